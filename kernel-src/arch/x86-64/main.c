@@ -79,6 +79,7 @@ void kernel_entry() {
 	acpi_init();
 
 	vmmcache_init();
+	pmm_reclaiminit();
 
 	vfs_init();
 	tmpfs_init();
@@ -111,6 +112,9 @@ void kernel_entry() {
 	console_init();
 	logging_sethook(console_putc);
 
+	// the disks are probed and scanned in the background, the root can be on any of them
+	block_waitasync();
+
 	char *root   = cmdline_get("root");
 	char *rootfs = cmdline_get("rootfs");
 
@@ -168,6 +168,7 @@ bool arch_mmu_iswritable(pagetableptr_t table, void *vaddr) {
 	return entry == NULL ? false : *entry & ARCH_MMU_FLAGS_WRITE;
 }
 
+#define ARCH_MMU_FLAGS_ACCESSED (1 << 5)
 #define ARCH_MMU_FLAGS_DIRTY (1 << 6)
 
 bool arch_mmu_isdirty(pagetableptr_t table, void *vaddr) {
@@ -175,6 +176,52 @@ bool arch_mmu_isdirty(pagetableptr_t table, void *vaddr) {
 	return entry == NULL ? false : *entry & ARCH_MMU_FLAGS_DIRTY;
 }
 
+bool arch_mmu_isaccessed(pagetableptr_t table, void *vaddr) {
+	uint64_t *entry = get_page(table, vaddr);
+	return entry == NULL ? false : *entry & ARCH_MMU_FLAGS_ACCESSED;
+}
+
+// skips to the start of the next area covered by an entry of a table level
+#define SKIP(addr, size) (((addr) & ~((uintptr_t)(size) - 1)) + (size))
+
+// clears the accessed bit of the pages mapped between vaddr and vaddr + size, calling accessed with the physical
+// address of those that had it set. missing tables are skipped whole, so a sparse range only costs what is mapped.
+// the tlb isn't flushed, so a cpu that still has the entry cached won't set the bit again until it walks the table.
+// good enough for the page replacement
+void arch_mmu_harvestaccessed(pagetableptr_t table, void *vaddr, size_t size, void (*accessed)(void *paddr)) {
+	uint64_t *pml4 = MAKE_HHDM(table);
+	uintptr_t addr = (uintptr_t)vaddr;
+	uintptr_t end = addr + size;
+
+	while (addr < end) {
+		uint64_t *pdpt = next(pml4[(addr & PML4MASK) >> 39]);
+		if (pdpt == NULL) {
+			addr = SKIP(addr, 1ul << 39);
+			continue;
+		}
+
+		uint64_t *pd = next(pdpt[(addr & PDPTMASK) >> 30]);
+		if (pd == NULL) {
+			addr = SKIP(addr, 1ul << 30);
+			continue;
+		}
+
+		uint64_t *pt = next(pd[(addr & PDMASK) >> 21]);
+		if (pt == NULL) {
+			addr = SKIP(addr, 1ul << 21);
+			continue;
+		}
+
+		uint64_t *entry = &pt[(addr & PTMASK) >> 12];
+		if (*entry & ARCH_MMU_FLAGS_ACCESSED) {
+			__atomic_and_fetch(entry, ~(uint64_t)ARCH_MMU_FLAGS_ACCESSED, __ATOMIC_SEQ_CST);
+			accessed((void *)(*entry & ADDRMASK));
+		}
+
+		addr += PAGE_SIZE;
+	}
+}
+
 #define FLAGS_MASK (ARCH_MMU_FLAGS_WRITE | ARCH_MMU_FLAGS_READ | ARCH_MMU_FLAGS_NOEXEC | ARCH_MMU_FLAGS_USER)
 
 bool arch_mmu_getflags(pagetableptr_t table, void *vaddr, mmuflags_t *mmuflagsp) {
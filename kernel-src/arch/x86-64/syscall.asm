@@ -91,6 +91,10 @@ extern syscall_sigsuspend
 extern syscall_sigtimedwait
 extern syscall_sigpending
 extern syscall_killthread
+extern syscall_sendfile
+extern syscall_copyfilerange
+extern syscall_splice
+extern syscall_fdatasync
 syscalltab:
 dq syscall_print
 dq syscall_mmap
@@ -184,7 +188,11 @@ dq syscall_sigsuspend
 dq syscall_sigtimedwait
 dq syscall_sigpending
 dq syscall_killthread
-syscallcount equ 92
+dq syscall_sendfile
+dq syscall_copyfilerange
+dq syscall_splice
+dq syscall_fdatasync
+syscallcount equ 96
 section .text
 global arch_syscall_entry
 ; on entry:
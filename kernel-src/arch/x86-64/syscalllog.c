@@ -5,7 +5,7 @@
 
 #ifdef SYSCALL_LOGGING
 
-#define SYSCALL_COUNT 92
+#define SYSCALL_COUNT 96
 #define LOGSTR(x) arch_e9_puts(x)
 
 static char *name[] = {
@@ -100,7 +100,11 @@ static char *name[] = {
 	"sigsuspend",
 	"sigtimedwait",
 	"sigpending",
-	"killthread"
+	"killthread",
+	"sendfile",
+	"copyfilerange",
+	"splice",
+	"fdatasync"
 };
 
 static char *args[] = {
@@ -195,7 +199,11 @@ static char *args[] = {
 	"sigset %p", // sigsuspend
 	"sigset %p info %p, timespec %p", // sigtimedwait
 	"sigset %p\n", // sigpending
-	"pid %d tid %d signal %d" // killthread
+	"pid %d tid %d signal %d", // killthread
+	"outfd %d infd %d offset %p count %lu", // sendfile
+	"infd %d inoffset %p outfd %d outoffset %p count %lu flags %lu", // copyfilerange
+	"infd %d inoffset %p outfd %d outoffset %p count %lu flags %lu", // splice
+	"fd %d" // fdatasync
 };
 
 #endif
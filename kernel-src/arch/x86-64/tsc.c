@@ -67,6 +67,10 @@ static timekeeper_source_info_t *tsc_init(void) {
 	return timekeeper_source_info;
 }
 
+uint64_t tsc_hz(void) {
+	return hz;
+}
+
 // ran in at least IPL_DPC
 static time_t tsc_ticks(timekeeper_source_info_t *timekeeper_source_info) {
 	__assert(timekeeper_source_info->private == current_cpu());
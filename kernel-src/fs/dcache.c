@@ -0,0 +1,352 @@
+#include <kernel/dcache.h>
+#include <kernel/alloc.h>
+#include <kernel/pmm.h>
+#include <kernel/vmm.h>
+#include <arch/cpu.h>
+#include <util.h>
+#include <string.h>
+#include <logging.h>
+#include <errno.h>
+
+// name lookup cache keyed by (parent vnode, name).
+// entries hold a reference to the parent and, if positive, the child. negative entries (child == NULL) remember
+// names that don't exist. the filesystem has to opt in with VFS_FLAGS_NAMECACHE and every change to a directory
+// entry has to go through vfs_create, vfs_link, vfs_unlink or vfs_rename, which invalidate the names they touch.
+// both lookups and invalidations happen with the parent locked, so an entry can't go stale while being added.
+//
+// path walks can also read the cache without taking any lock (see dcache_walkbegin). to make that safe, entries
+// come from a fixed pool and are never freed, and a removed entry keeps its vnode references on the zombie list
+// until no walk is in progress. removals bump seq, so a walk that raced one is thrown away and redone the slow way.
+
+#define TABLE_SIZE 1024
+#define MAX_ENTRIES 8192
+#define NAME_MAX 64
+
+typedef struct dentry_t {
+	struct dentry_t *hashnext;
+	struct dentry_t *lrunext;
+	struct dentry_t *lruprev;
+	vnode_t *parent;
+	vnode_t *child;
+	bool referenced;
+	size_t namelen;
+	char name[NAME_MAX];
+} dentry_t;
+
+static mutex_t mutex;
+static dentry_t **table;
+static dentry_t *pool;
+static dentry_t *freelist;
+static dentry_t *zombies;
+
+static uintmax_t seq;
+static int walkers;
+
+// most recently inserted first
+static dentry_t *lruhead;
+static dentry_t *lrutail;
+
+size_t dcache_entries;
+size_t dcache_hits;
+size_t dcache_negativehits;
+size_t dcache_misses;
+
+static uintmax_t getentry(vnode_t *parent, char *name, size_t namelen) {
+	return (fnv1ahash(&parent, sizeof(parent)) ^ fnv1ahash(name, namelen)) % TABLE_SIZE;
+}
+
+// can be called without the lock during a walk
+static dentry_t *find(vnode_t *parent, char *name, size_t namelen) {
+	dentry_t *dentry = __atomic_load_n(&table[getentry(parent, name, namelen)], __ATOMIC_ACQUIRE);
+	// bounded in case a walk sees a chain while it is being changed
+	for (int i = 0; dentry && i < MAX_ENTRIES; ++i) {
+		if (dentry->parent == parent && dentry->namelen == namelen && memcmp(dentry->name, name, namelen) == 0)
+			return dentry;
+
+		dentry = __atomic_load_n(&dentry->hashnext, __ATOMIC_ACQUIRE);
+	}
+
+	return NULL;
+}
+
+// assumes lock is held
+static void lruremove(dentry_t *dentry) {
+	if (dentry->lruprev)
+		dentry->lruprev->lrunext = dentry->lrunext;
+	else
+		lruhead = dentry->lrunext;
+
+	if (dentry->lrunext)
+		dentry->lrunext->lruprev = dentry->lruprev;
+	else
+		lrutail = dentry->lruprev;
+}
+
+// assumes lock is held
+static void lruinsert(dentry_t *dentry) {
+	dentry->lruprev = NULL;
+	dentry->lrunext = lruhead;
+	if (lruhead)
+		lruhead->lruprev = dentry;
+	else
+		lrutail = dentry;
+
+	lruhead = dentry;
+}
+
+// assumes lock is held. the entry is left with its references on the zombie list
+static void unhash(dentry_t *dentry) {
+	__atomic_add_fetch(&seq, 1, __ATOMIC_SEQ_CST);
+
+	dentry_t **link = &table[getentry(dentry->parent, dentry->name, dentry->namelen)];
+	while (*link != dentry)
+		link = &(*link)->hashnext;
+
+	__atomic_store_n(link, dentry->hashnext, __ATOMIC_RELEASE);
+
+	__atomic_add_fetch(&seq, 1, __ATOMIC_SEQ_CST);
+
+	lruremove(dentry);
+	--dcache_entries;
+	dentry->lrunext = zombies;
+	zombies = dentry;
+}
+
+// releasing the vnodes might call into the filesystem, so it is done without the lock
+static void reap() {
+	MUTEX_ACQUIRE(&mutex, false);
+	if (__atomic_load_n(&walkers, __ATOMIC_SEQ_CST)) {
+		// the last walk out will do it
+		MUTEX_RELEASE(&mutex);
+		return;
+	}
+
+	dentry_t *dead = zombies;
+	zombies = NULL;
+	MUTEX_RELEASE(&mutex);
+
+	dentry_t *dentry = dead;
+	while (dentry) {
+		if (dentry->child)
+			VOP_RELEASE(dentry->child);
+
+		VOP_RELEASE(dentry->parent);
+		dentry = dentry->lrunext;
+	}
+
+	if (dead == NULL)
+		return;
+
+	MUTEX_ACQUIRE(&mutex, false);
+	while (dead) {
+		dentry_t *next = dead->lrunext;
+		dead->lrunext = freelist;
+		freelist = dead;
+		dead = next;
+	}
+	MUTEX_RELEASE(&mutex);
+}
+
+// assumes lock is held. second chance: recently hit entries go back to the head
+static void evict() {
+	while (lrutail->referenced) {
+		dentry_t *dentry = lrutail;
+		dentry->referenced = false;
+		lruremove(dentry);
+		lruinsert(dentry);
+	}
+
+	unhash(lrutail);
+}
+
+static bool cacheable(vnode_t *parent, char *name) {
+	if (parent->vfs == NULL || (parent->vfs->flags & VFS_FLAGS_NAMECACHE) == 0)
+		return false;
+
+	return strcmp(name, ".") && strcmp(name, "..") && strlen(name) <= NAME_MAX;
+}
+
+static void insert(vnode_t *parent, char *name, vnode_t *child) {
+	size_t namelen = strlen(name);
+
+	MUTEX_ACQUIRE(&mutex, false);
+	if (find(parent, name, namelen))
+		goto leave;
+
+	// everything might be waiting on the zombie list
+	if (freelist == NULL && lrutail)
+		evict();
+
+	if (freelist == NULL)
+		goto leave;
+
+	dentry_t *dentry = freelist;
+	freelist = dentry->lrunext;
+
+	dentry->parent = parent;
+	dentry->child = child;
+	dentry->referenced = false;
+	dentry->namelen = namelen;
+	memcpy(dentry->name, name, namelen);
+	VOP_HOLD(parent);
+	if (child)
+		VOP_HOLD(child);
+
+	lruinsert(dentry);
+	++dcache_entries;
+
+	// publish it only once it's filled in
+	dentry_t **head = &table[getentry(parent, name, namelen)];
+	dentry->hashnext = *head;
+	__atomic_store_n(head, dentry, __ATOMIC_RELEASE);
+
+	leave:
+	MUTEX_RELEASE(&mutex);
+	if (zombies)
+		reap();
+}
+
+// same semantics as VOP_LOOKUP. parent is expected to be locked
+int dcache_lookup(vnode_t *parent, char *name, vnode_t **result, cred_t *cred) {
+	if (cacheable(parent, name) == false)
+		return VOP_LOOKUP(parent, name, result, cred);
+
+	MUTEX_ACQUIRE(&mutex, false);
+	dentry_t *dentry = find(parent, name, strlen(name));
+	if (dentry) {
+		dentry->referenced = true;
+		vnode_t *child = dentry->child;
+		if (child) {
+			__atomic_add_fetch(&dcache_hits, 1, __ATOMIC_SEQ_CST);
+			VOP_HOLD(child);
+		} else {
+			__atomic_add_fetch(&dcache_negativehits, 1, __ATOMIC_SEQ_CST);
+		}
+		MUTEX_RELEASE(&mutex);
+
+		if (child == NULL)
+			return ENOENT;
+
+		VOP_LOCK(child);
+		*result = child;
+		return 0;
+	}
+
+	__atomic_add_fetch(&dcache_misses, 1, __ATOMIC_SEQ_CST);
+	MUTEX_RELEASE(&mutex);
+
+	int error = VOP_LOOKUP(parent, name, result, cred);
+	if (error == 0)
+		insert(parent, name, *result);
+	else if (error == ENOENT)
+		insert(parent, name, NULL);
+
+	return error;
+}
+
+// drops the entry for a name, called whenever the directory entry changes. parent is expected to be locked
+void dcache_remove(vnode_t *parent, char *name) {
+	size_t namelen = strlen(name);
+	if (namelen > NAME_MAX)
+		return;
+
+	MUTEX_ACQUIRE(&mutex, false);
+	dentry_t *dentry = find(parent, name, namelen);
+	if (dentry)
+		unhash(dentry);
+	MUTEX_RELEASE(&mutex);
+
+	if (zombies)
+		reap();
+}
+
+// drops every entry in a directory, used when it is removed
+void dcache_purge(vnode_t *parent) {
+	MUTEX_ACQUIRE(&mutex, false);
+	dentry_t *dentry = lruhead;
+	while (dentry) {
+		dentry_t *next = dentry->lrunext;
+		if (dentry->parent == parent)
+			unhash(dentry);
+
+		dentry = next;
+	}
+	MUTEX_RELEASE(&mutex);
+
+	if (zombies)
+		reap();
+}
+
+// starts a lockless walk. entries found until dcache_walkend stay in memory along with their vnodes,
+// but are only known to be current if dcache_walkvalid returns true for the returned sequence afterwards
+uintmax_t dcache_walkbegin() {
+	__atomic_add_fetch(&walkers, 1, __ATOMIC_SEQ_CST);
+	uintmax_t s;
+	while ((s = __atomic_load_n(&seq, __ATOMIC_SEQ_CST)) & 1)
+		CPU_PAUSE();
+
+	return s;
+}
+
+// returns false on a miss. child is set to NULL for a negative entry
+bool dcache_walkfind(vnode_t *parent, char *name, size_t namelen, vnode_t **child) {
+	if (parent->vfs == NULL || (parent->vfs->flags & VFS_FLAGS_NAMECACHE) == 0 || namelen > NAME_MAX)
+		return false;
+
+	dentry_t *dentry = find(parent, name, namelen);
+	// counted atomically as walks run in parallel without the lock
+	if (dentry == NULL) {
+		__atomic_add_fetch(&dcache_misses, 1, __ATOMIC_SEQ_CST);
+		return false;
+	}
+
+	dentry->referenced = true;
+	*child = __atomic_load_n(&dentry->child, __ATOMIC_ACQUIRE);
+	if (*child)
+		__atomic_add_fetch(&dcache_hits, 1, __ATOMIC_SEQ_CST);
+	else
+		__atomic_add_fetch(&dcache_negativehits, 1, __ATOMIC_SEQ_CST);
+
+	return true;
+}
+
+bool dcache_walkvalid(uintmax_t s) {
+	return __atomic_load_n(&seq, __ATOMIC_SEQ_CST) == s;
+}
+
+void dcache_walkend() {
+	if (__atomic_sub_fetch(&walkers, 1, __ATOMIC_SEQ_CST) == 0 && __atomic_load_n(&zombies, __ATOMIC_SEQ_CST))
+		reap();
+}
+
+// positive entries hold their vnode, which keeps the filesystem from putting it in its own inactive list.
+// under memory pressure half of the entries go, so those vnodes can be freed by the shrinker of their filesystem
+static void shrink() {
+	MUTEX_ACQUIRE(&mutex, false);
+	for (size_t count = ROUND_UP(dcache_entries, 2) / 2; count && lrutail; --count)
+		evict();
+	MUTEX_RELEASE(&mutex);
+
+	if (zombies)
+		reap();
+}
+
+static pmmshrinker_t shrinker = {
+	.shrink = shrink
+};
+
+void dcache_init() {
+	MUTEX_INIT(&mutex);
+	table = alloc(TABLE_SIZE * sizeof(dentry_t *));
+	__assert(table);
+	// too big for alloc()
+	pool = vmm_map(NULL, MAX_ENTRIES * sizeof(dentry_t), VMM_FLAGS_ALLOCATE, ARCH_MMU_FLAGS_READ | ARCH_MMU_FLAGS_WRITE | ARCH_MMU_FLAGS_NOEXEC, NULL);
+	__assert(pool);
+
+	for (int i = 0; i < MAX_ENTRIES; ++i) {
+		pool[i].lrunext = freelist;
+		freelist = &pool[i];
+	}
+
+	pmm_registershrinker(&shrinker);
+}
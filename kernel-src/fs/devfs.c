@@ -9,6 +9,7 @@
 #include <kernel/pmm.h>
 #include <kernel/vmmcache.h>
 #include <kernel/auth.h>
+#include <kernel/block.h>
 
 static devnode_t *devfsroot;
 
@@ -367,7 +368,7 @@ static int devfs_getdents(vnode_t *node, dent_t *buffer, size_t count, uintmax_t
 		dent_t *ent = &buffer[*readcount];
 
 		ent->d_ino = currnode->attr.inode;
-		ent->d_off = offset;
+		ent->d_off = offset + *readcount + 1;
 		ent->d_reclen = sizeof(dent_t);
 		ent->d_type = vfs_getposixtype(currnode->vnode.type);
 		strcpy(ent->d_name, entry->key);
@@ -416,8 +417,14 @@ static int devfs_putpage(vnode_t *node, uintmax_t offset, struct page_t *page) {
 	return error;
 }
 
-static int devfs_sync(vnode_t *vnode) {
-	return vmmcache_sync(vnode);
+static int devfs_sync(vnode_t *vnode, int flags) {
+	int e = vmmcache_syncvnode(vnode, 0, UINT64_MAX);
+	if (e || vnode->type != V_TYPE_BLKDEV)
+		return e;
+
+	// and then out of the write cache of the disk
+	int result;
+	return devfs_ioctl(vnode, BLOCK_IOCTL_FLUSH, NULL, &result, NULL);
 }
 
 // most locking is handled by the devices.
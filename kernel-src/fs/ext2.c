@@ -7,11 +7,18 @@
 #include <kernel/pmm.h>
 #include <hashtable.h>
 #include <mutex.h>
+#include <spinlock.h>
 #include <logging.h>
 #include <util.h>
 #include <kernel/vmmcache.h>
 #include <kernel/pipefs.h>
 #include <kernel/auth.h>
+#include <kernel/jbd.h>
+#include <kernel/scheduler.h>
+#include <kernel/block.h>
+#include <kernel/cmdline.h>
+#include <kernel/usercopy.h>
+#include <kernel/ext2.h>
 
 #define INODE_ROOT 2
 
@@ -63,11 +70,31 @@ typedef struct {
 	uint8_t  fileblockpreallocation;
 	uint8_t  dirblockpreallocation;
 	uint16_t unused;
+	uint8_t  journalid[16];
 	uint32_t journalinode;
 	uint32_t journaldevice;
 	uint32_t orphanlist;
+	uint32_t hashseed[4];
+	uint8_t  defhashversion;
+	uint8_t  journalbackuptype;
+	uint16_t descsize;
+	uint32_t defaultmountoptions;
+	uint32_t firstmetabg;
+	uint32_t mkfstime;
+	uint32_t journalblocks[17];
+	uint32_t blockcounthigh;
+	uint32_t reservedblockshigh;
+	uint32_t unallocatedblockshigh;
+	uint16_t mininodeextrasize;
+	uint16_t wantinodeextrasize;
+	uint32_t flags;
 } __attribute__((packed)) ext2superblock_t;
 
+#define EXT2_FEATURE_COMPAT_HAS_JOURNAL 0x4
+#define EXT2_FEATURE_COMPAT_DIR_INDEX 0x20
+#define EXT2_FEATURE_INCOMPAT_RECOVER 0x4
+#define EXT2_FLAGS_UNSIGNED_HASH 2
+
 typedef struct {
 	uint32_t blockbitmap;
 	uint32_t inodebitmap;
@@ -110,6 +137,8 @@ typedef struct {
 	uint8_t  osvalue2[12];
 } __attribute__((packed)) inode_t;
 
+#define EXT2_INODE_FLAGS_INDEX 0x1000
+
 #define INODE_TYPE_FIFO 1
 #define INODE_TYPE_CHDEV 2
 #define INODE_TYPE_DIR 4
@@ -132,17 +161,66 @@ typedef struct {
 #define INODE_SECTSIZE 512
 #define EXT2NODE_INIT(vn, vop, f, t, v, i) \
 	VOP_INIT(&(vn)->vnode, vop, f, t, v); \
-	(vn)->id = i;
+	(vn)->id = i; \
+	SPINLOCK_INIT((vn)->mapcachelock); \
+	(vn)->mapcachegen = 0; \
+	(vn)->mapcachenext = 0; \
+	(vn)->reserved = 0; \
+	(vn)->inactive = false; \
+	(vn)->layoutdirty = false; \
+	memset((vn)->mapcache, 0, sizeof((vn)->mapcache));
+
+typedef uint32_t blockptr_t;
+
+#define MAPCACHE_SIZE 8
 
+// a run of contiguous blocks, starting at file block index and disk block block
 typedef struct {
+	uintmax_t index;
+	uintmax_t count;
+	blockptr_t block;
+} mapextent_t;
+
+typedef struct ext2node_t {
 	vnode_t vnode;
 	inode_t inode;
 	int id;
+	spinlock_t mapcachelock; // protects the mapcache fields
+	uintmax_t mapcachegen;
+	int mapcachenext;
+	mapextent_t mapcache[MAPCACHE_SIZE];
+	size_t reserved; // blocks reserved for delayed allocation, protected by the superblock lock
+	struct ext2node_t *lrunext; // in the inactive list, protected by the inode table lock
+	struct ext2node_t *lruprev;
+	bool inactive;
+	bool layoutdirty; // the size or the blocks changed since the last sync, so fdatasync needs the metadata too
 } ext2node_t;
 
+// a run of freed blocks waiting to be discarded
 typedef struct {
+	uintmax_t block;
+	size_t count;
+} discardextent_t;
+
+// in memory state of a block group. the descriptor and bitmaps point straight into pinned pages of the backing
+// device cache, which get marked dirty when changed and are written back by the page cache
+typedef struct {
+	mutex_t lock; // protects the descriptor and bitmaps of the group
+	blockgroupdesc_t *desc;
+	page_t *descpage;
+	uint8_t *blockbitmap; // loaded on first use
+	page_t *blockbitmappage;
+	uint8_t *inodebitmap;
+	page_t *inodebitmappage;
+	uintmax_t lastfree; // free generation of the last block freed in the group
+} ext2group_t;
+
+typedef struct ext2fs_t {
 	vfs_t vfs;
 	ext2superblock_t superblock;
+	void *superblockaddr; // where the superblock is in its pinned page
+	page_t *superblockpage;
+	ext2group_t *groups;
 	vnode_t *backing;
 	int backingmajor;
 	int backingminor;
@@ -150,17 +228,27 @@ typedef struct {
 	size_t bgcount;
 	ext2node_t *root;
 	hashtable_t inodetable; // hashtable of in memory inodes (indexed with inode id)
+	// nodes still linked on disk but with no references are kept in the inode table for a while, most recently
+	// used first. they get picked up again by lookups and freed when there are too many or memory runs low
+	ext2node_t *lruhead;
+	ext2node_t *lrutail;
+	size_t inactivecount;
+	struct ext2fs_t *mountnext;
 	uintmax_t lowestfreeinodebg;
 	uintmax_t lowestfreeblockbg;
+	size_t reservedblocks; // blocks reserved by all nodes for delayed allocation, protected by the superblock lock
+	jbd_t *journal; // NULL if the filesystem isn't journaled
+	bool discard; // freed blocks get discarded once the freeing is on disk
+	mutex_t discardlock; // protects the pending discards
+	discardextent_t *discardpending;
+	size_t discardcount;
+	uintmax_t freegeneration; // bumped for every block freed
 	mutex_t rootlock; // protects the root variable
-	mutex_t inodetablelock; // protects the inodetable hashtable
-	mutex_t superblocklock; // protects the superblock
-	mutex_t descriptorlock; // protects the block group descriptor table and related structures like the bitmaps. also protects the lowestfree*bg variables
+	mutex_t inodetablelock; // protects the inodetable hashtable and the inactive list
+	mutex_t superblocklock; // protects the superblock and the lowestfree*bg variables
 	mutex_t inodewritelock; // protects on disk inode tables
 } ext2fs_t;
 
-typedef uint32_t blockptr_t;
-
 #define GROUP_GETINODE(fs, x) ((x) * (fs)->superblock.inodespergroup + 1)
 #define GROUP_GETBLOCK(fs, x) ((x) * (fs)->superblock.blockspergroup + (fs)->superblock.superblockstart)
 #define BLOCK_GETDISKOFFSET(fs, x) ((fs)->blocksize * (x))
@@ -213,166 +301,523 @@ static const int vfstoext2typetable[] = {
 static vops_t vnops;
 static scache_t *nodecache;
 
+#define INACTIVE_MAX 1024
+
+// for the shrinker
+static mutex_t mountslock;
+static ext2fs_t *mounts;
+
+// every operation that changes metadata does so inside a journal handle, so that its changes get committed together
+#define JOURNAL_START(fs) { \
+	if ((fs)->journal) \
+		jbd_start((fs)->journal); \
+}
+
+#define JOURNAL_STOP(fs) { \
+	if ((fs)->journal) \
+		jbd_stop((fs)->journal); \
+}
+
+// metadata goes through the journal if there is one, file data never does
+static int metawrite_iovec(ext2fs_t *fs, iovec_iterator_t *iovec_iterator, size_t size, uintmax_t offset, size_t *writec) {
+	if (fs->journal)
+		return jbd_write(fs->journal, iovec_iterator, size, offset, writec);
+
+	return vfs_write_iovec(fs->backing, iovec_iterator, size, offset, writec, 0);
+}
+
+static int metawrite(ext2fs_t *fs, void *buffer, size_t size, uintmax_t offset, size_t *writec) {
+	iovec_t iovec = {
+		.addr = buffer,
+		.len = size
+	};
+
+	iovec_iterator_t iovec_iterator;
+	iovec_iterator_init(&iovec_iterator, &iovec, 1);
+	return metawrite_iovec(fs, &iovec_iterator, size, offset, writec);
+}
+
+// for metadata changed in place in a pinned page, offset being where in the backing device
+static int metadirty(ext2fs_t *fs, page_t *page, uintmax_t offset) {
+	if (fs->journal)
+		return jbd_dirty(fs->journal, offset);
+
+	return vmmcache_makedirty(page);
+}
+
+// the superblock is copied into its pinned page and written back later by the page cache
 static int syncsuperblock(ext2fs_t *fs) {
-	size_t tmp;
-	return vfs_write(fs->backing, &fs->superblock, sizeof(ext2superblock_t), SUPERBLOCK_OFFSET, &tmp, V_FFLAGS_NOCACHE);
+	memcpy(fs->superblockaddr, &fs->superblock, sizeof(ext2superblock_t));
+	return metadirty(fs, fs->superblockpage, SUPERBLOCK_OFFSET);
 }
 
-static int changedircount(ext2fs_t *fs, int bg, int change) {
-	MUTEX_ACQUIRE(&fs->descriptorlock, false);
-	blockgroupdesc_t desc;
-	size_t count;
-	int e = vfs_read(fs->backing, &desc, sizeof(blockgroupdesc_t), DESC_GETDISKOFFSET(fs, bg), &count, 0);
+// pins the page of the backing device cache holding offset and returns the address of offset in it
+static int pinpage(ext2fs_t *fs, uintmax_t offset, page_t **page, void **address) {
+	int e = vmmcache_getwritablepage(fs->backing, ROUND_DOWN(offset, PAGE_SIZE), page);
 	if (e)
-		goto cleanup;
+		return e;
+
+	(*page)->flags |= PAGE_FLAGS_PINNED;
+	*address = (void *)((uintptr_t)MAKE_HHDM(pmm_getpageaddress(*page)) + offset % PAGE_SIZE);
+	return 0;
+}
+
+static void unpinpage(page_t *page) {
+	page->flags &= ~PAGE_FLAGS_PINNED;
+	pmm_release(pmm_getpageaddress(page));
+}
 
-	desc.dircount += change;
+// pins the superblock and the group descriptor table
+static int loadgroups(ext2fs_t *fs) {
+	int e = pinpage(fs, SUPERBLOCK_OFFSET, &fs->superblockpage, &fs->superblockaddr);
+	if (e)
+		return e;
 
-	e = vfs_write(fs->backing, &desc, sizeof(blockgroupdesc_t), DESC_GETDISKOFFSET(fs, bg), &count, 0);
+	fs->groups = alloc(sizeof(ext2group_t) * fs->bgcount);
+	if (fs->groups == NULL) {
+		unpinpage(fs->superblockpage);
+		return ENOMEM;
+	}
+
+	uintmax_t i;
+	for (i = 0; i < fs->bgcount; ++i) {
+		ext2group_t *group = &fs->groups[i];
+		MUTEX_INIT(&group->lock);
+		uintmax_t offset = DESC_GETDISKOFFSET(fs, i);
+
+		// descriptors never cross pages, so every page only gets pinned once
+		if (i == 0 || (offset % PAGE_SIZE) == 0) {
+			e = pinpage(fs, offset, &group->descpage, (void **)&group->desc);
+			if (e)
+				break;
+		} else {
+			group->descpage = fs->groups[i - 1].descpage;
+			group->desc = fs->groups[i - 1].desc + 1;
+		}
+	}
+
+	if (e) {
+		for (uintmax_t j = 0; j < i; ++j) {
+			if (j == 0 || fs->groups[j].descpage != fs->groups[j - 1].descpage)
+				unpinpage(fs->groups[j].descpage);
+		}
+
+		unpinpage(fs->superblockpage);
+		free(fs->groups);
+	}
 
-	cleanup:
-	MUTEX_RELEASE(&fs->descriptorlock);
 	return e;
 }
 
-// allocates either a block or an inode
-static int allocatestructure(ext2fs_t *fs, uintmax_t *retid, bool inode) {
-	MUTEX_ACQUIRE(&fs->descriptorlock, false);
-	uint8_t *bm = NULL;
-	uintmax_t bg = inode ? fs->lowestfreeinodebg : fs->lowestfreeblockbg;
+// group lock expected to be held
+static int loadbitmaps(ext2fs_t *fs, ext2group_t *group) {
+	if (group->blockbitmap)
+		return 0;
 
-	int e = 0;
-	blockgroupdesc_t desc;
+	int e = pinpage(fs, BLOCK_GETDISKOFFSET(fs, group->desc->inodebitmap), &group->inodebitmappage, (void **)&group->inodebitmap);
+	if (e)
+		return e;
 
-	// safe to check outside of the superblock lock, as nothing that doesn't already
-	// hold the descriptorlock would change this variable
-	if (inode ? fs->superblock.unallocatedinodes == 0 : fs->superblock.unallocatedblocks == 0) {
-		e = ENOSPC;
-		goto cleanup;
+	e = pinpage(fs, BLOCK_GETDISKOFFSET(fs, group->desc->blockbitmap), &group->blockbitmappage, (void **)&group->blockbitmap);
+	if (e) {
+		unpinpage(group->inodebitmappage);
+		group->inodebitmap = NULL;
 	}
 
-	// iterate through block groups to find one with free structures
-	for (; bg < fs->bgcount; ++bg) {
-		size_t readc;
-		e = vfs_read(fs->backing, &desc, sizeof(blockgroupdesc_t), DESC_GETDISKOFFSET(fs, bg), &readc, 0);
-		if (e)
-			goto cleanup;
+	return e;
+}
+
+static int changedircount(ext2fs_t *fs, int bg, int change) {
+	ext2group_t *group = &fs->groups[bg];
+	MUTEX_ACQUIRE(&group->lock, false);
+	group->desc->dircount += change;
+	int e = metadirty(fs, group->descpage, DESC_GETDISKOFFSET(fs, bg));
+	MUTEX_RELEASE(&group->lock);
+	return e;
+}
+
+#define BITMAP_ISFREE(bm, x) (((bm)[(x) / 8] & (1 << ((x) % 8))) == 0)
+
+// allocates an inode. blocks go through allocateblocks, which knows about delayed allocation reservations
+static int allocatestructure(ext2fs_t *fs, uintmax_t *retid, bool inode) {
+	__assert(inode);
+
+	// take the inode out of the free count first so that parallel allocations can't go over it
+	MUTEX_ACQUIRE(&fs->superblocklock, false);
+	if (fs->superblock.unallocatedinodes == 0) {
+		MUTEX_RELEASE(&fs->superblocklock);
+		return ENOSPC;
+	}
+
+	fs->superblock.unallocatedinodes -= 1;
+	uintmax_t startbg = fs->lowestfreeinodebg;
+	MUTEX_RELEASE(&fs->superblocklock);
+
+	int e = ENOSPC;
+
+	// iterate through block groups to find one with free inodes
+	for (uintmax_t i = 0; i < fs->bgcount; ++i) {
+		uintmax_t bg = (startbg + i) % fs->bgcount;
+		ext2group_t *group = &fs->groups[bg];
+		MUTEX_ACQUIRE(&group->lock, false);
+		if (group->desc->freeinodes == 0) {
+			MUTEX_RELEASE(&group->lock);
+			continue;
+		}
 
-		if (inode ? desc.freeinodes : desc.freeblocks)
+		e = loadbitmaps(fs, group);
+		if (e) {
+			MUTEX_RELEASE(&group->lock);
 			break;
+		}
+
+		uintmax_t structurefound = 0;
+		// find free inode in it
+		for (int j = 0; j < fs->superblock.inodespergroup / 8; ++j) {
+			// in ext2, a 1 means an used entry and a 0 means a free entry.
+			// this is bad for iterating and finding free structures and getting a free structure using __builtin_ctz
+			// therefore we do a logical NOT in it. now 0 means an used entry and 1 means a free entry.
+			uint8_t v = ~group->inodebitmap[j];
+			if (v) {
+				int offset = __builtin_ctz(v);
+				group->inodebitmap[j] |= 1 << offset; //set as used
+				structurefound = GROUP_GETINODE(fs, bg) + j * 8 + offset;
+				break;
+			}
+		}
+
+		ASSERT_UNCLEAN(fs, structurefound);
+		if (structurefound == 0) {
+			MUTEX_RELEASE(&group->lock);
+			continue;
+		}
+
+		group->desc->freeinodes -= 1;
+		bool full = group->desc->freeinodes == 0;
+		metadirty(fs, group->inodebitmappage, BLOCK_GETDISKOFFSET(fs, group->desc->inodebitmap));
+		metadirty(fs, group->descpage, DESC_GETDISKOFFSET(fs, bg));
+		MUTEX_RELEASE(&group->lock);
+
+		*retid = structurefound;
+		e = 0;
+
+		// update lowest free group if there are no more free inodes in it
+		MUTEX_ACQUIRE(&fs->superblocklock, false);
+		if (full && bg == fs->lowestfreeinodebg)
+			fs->lowestfreeinodebg += 1;
+		MUTEX_RELEASE(&fs->superblocklock);
+		break;
 	}
 
-	if (inode)
-		fs->lowestfreeinodebg = bg;
-	else
-		fs->lowestfreeblockbg = bg;
+	MUTEX_ACQUIRE(&fs->superblocklock, false);
+	if (e)
+		fs->superblock.unallocatedinodes += 1;
+	int syncerr = syncsuperblock(fs);
+	MUTEX_RELEASE(&fs->superblocklock);
+	ASSERT_UNCLEAN(fs, syncerr == 0);
 
-	if (bg == fs->bgcount) {
-		e = ENOSPC;
-		goto cleanup;
+	return e;
+}
+
+// looks for the first run of free bits that is at least count long in [start, end), falling back to the longest one.
+// returns the length of the run found and its start in *found
+static size_t findfreerun(uint8_t *bm, size_t start, size_t end, size_t count, size_t *found) {
+	size_t best = 0;
+	size_t i = start;
+	while (i < end && best < count) {
+		// skip over fully used bytes
+		if ((i % 8) == 0 && bm[i / 8] == 0xff) {
+			i += 8;
+			continue;
+		}
+
+		if (BITMAP_ISFREE(bm, i) == false) {
+			++i;
+			continue;
+		}
+
+		size_t runstart = i;
+		while (i < end && i - runstart < count && BITMAP_ISFREE(bm, i))
+			++i;
+
+		if (i - runstart > best) {
+			best = i - runstart;
+			*found = runstart;
+		}
 	}
 
-	size_t bmsize = (inode ? fs->superblock.inodespergroup : fs->superblock.blockspergroup) / 8;
-	bm = alloc(bmsize);
-	if (bm == NULL) {
-		e = ENOMEM;
-		goto cleanup;
+	return best;
+}
+
+// reserves space for blocks that will only be allocated once their data is written back
+static int reserveblocks(ext2fs_t *fs, ext2node_t *node, size_t count) {
+	int e = 0;
+	MUTEX_ACQUIRE(&fs->superblocklock, false);
+	if (fs->superblock.unallocatedblocks < fs->reservedblocks + count) {
+		e = ENOSPC;
+	} else {
+		fs->reservedblocks += count;
+		node->reserved += count;
 	}
+	MUTEX_RELEASE(&fs->superblocklock);
+	return e;
+}
 
-	// read bitmap into buffer
-	size_t readc;
-	e = vfs_read(fs->backing, bm, bmsize, BLOCK_GETDISKOFFSET(fs, inode ? desc.inodebitmap : desc.blockbitmap), &readc, 0);
-	if (e)
-		goto cleanup;
+// gives back up to count reserved blocks
+static void unreserveblocks(ext2fs_t *fs, ext2node_t *node, size_t count) {
+	MUTEX_ACQUIRE(&fs->superblocklock, false);
+	count = min(count, node->reserved);
+	node->reserved -= count;
+	fs->reservedblocks -= count;
+	MUTEX_RELEASE(&fs->superblocklock);
+}
+
+// allocates up to *count contiguous blocks for a node, looking first at goal and then at the groups after it.
+// the node's reservation is used up first, the rest has to come from space nobody else has reserved.
+// *first and *count are set to the run that was actually allocated
+static int allocateblocks(ext2fs_t *fs, ext2node_t *node, uintmax_t goal, uintmax_t *first, size_t *count) {
+	// take the blocks out of the free count first so that parallel allocations can't go over it,
+	// what isn't found is given back at the end
+	MUTEX_ACQUIRE(&fs->superblocklock, false);
+	size_t othersreserved = fs->reservedblocks - (node ? node->reserved : 0);
+	size_t available = fs->superblock.unallocatedblocks > othersreserved ? fs->superblock.unallocatedblocks - othersreserved : 0;
+	size_t want = min(*count, available);
+	size_t usedreserve = node ? min(want, node->reserved) : 0;
+
+	fs->superblock.unallocatedblocks -= want;
+	fs->reservedblocks -= usedreserve;
+	if (node)
+		node->reserved -= usedreserve;
+
+	uintmax_t lowestbg = fs->lowestfreeblockbg;
+	MUTEX_RELEASE(&fs->superblocklock);
+
+	if (want == 0)
+		return ENOSPC;
+
+	bool hasgoal = goal >= fs->superblock.superblockstart && goal < fs->superblock.blockcount;
+	uintmax_t goalbg = hasgoal ? BLOCK_GETGROUP(fs, goal) : lowestbg;
+	size_t foundcount = 0;
+	int e = ENOSPC;
+
+	// iterate through the block groups starting at the goal to find one with free blocks
+	for (uintmax_t i = 0; i < fs->bgcount; ++i) {
+		uintmax_t bg = (goalbg + i) % fs->bgcount;
+		ext2group_t *group = &fs->groups[bg];
+		MUTEX_ACQUIRE(&group->lock, false);
+		if (group->desc->freeblocks == 0) {
+			MUTEX_RELEASE(&group->lock);
+			continue;
+		}
 
-	uintmax_t structurefound = 0;
-	int i;
-	// find free block in it
-	for (i = 0; i < bmsize; ++i) {
-		// in ext2, a 1 means an used entry and a 0 means a free entry.
-		// this is bad for iterating and finding free structures and getting a free structure using __builtin_ctz
-		// therefore we do a logical NOT in it. now 0 means an used entry and 1 means a free entry.
-		uint8_t v = ~bm[i];
-		if (v) {
-			int offset = __builtin_ctz(v);
-			bm[i] |= 1 << offset; //set as used
-			structurefound = (inode ? GROUP_GETINODE(fs, bg) : GROUP_GETBLOCK(fs, bg)) + i * 8 + offset;
+		e = loadbitmaps(fs, group);
+		if (e) {
+			MUTEX_RELEASE(&group->lock);
 			break;
 		}
-	}
 
-	__assert(structurefound);
+		size_t start = (hasgoal && bg == goalbg) ? BLOCK_GETINDEX(fs, goal) : 0;
+		size_t found = 0;
+		foundcount = findfreerun(group->blockbitmap, start, fs->superblock.blockspergroup, want, &found);
+
+		// wrap around in the goal group
+		if (foundcount < want && start) {
+			size_t wrapfound = 0;
+			size_t wrapcount = findfreerun(group->blockbitmap, 0, start, want, &wrapfound);
+			if (wrapcount > foundcount) {
+				foundcount = wrapcount;
+				found = wrapfound;
+			}
+		}
 
-	// sync bitmap back into disk
-	size_t writec;
-	e = vfs_write(fs->backing, bm, bmsize, BLOCK_GETDISKOFFSET(fs, inode ? desc.inodebitmap : desc.blockbitmap), &writec, 0);
-	if (e)
-		goto cleanup;
+		ASSERT_UNCLEAN(fs, foundcount);
+		if (foundcount == 0) {
+			MUTEX_RELEASE(&group->lock);
+			e = ENOSPC;
+			continue;
+		}
 
-	// update block group desc free structure count
-	if (inode)
-		desc.freeinodes -= 1;
-	else
-		desc.freeblocks -= 1;
+		for (size_t j = found; j < found + foundcount; ++j)
+			group->blockbitmap[j / 8] |= 1 << (j % 8);
 
-	e = vfs_write(fs->backing, &desc, sizeof(blockgroupdesc_t), DESC_GETDISKOFFSET(fs, bg), &writec, 0);
-	ASSERT_UNCLEAN(fs, e == 0);
-	if (e)
-		goto cleanup;
+		group->desc->freeblocks -= foundcount;
+		bool full = group->desc->freeblocks == 0;
+		metadirty(fs, group->blockbitmappage, BLOCK_GETDISKOFFSET(fs, group->desc->blockbitmap));
+		metadirty(fs, group->descpage, DESC_GETDISKOFFSET(fs, bg));
+		MUTEX_RELEASE(&group->lock);
 
-	// update lowest free block group if there are no more free structures in the current one
-	if ((inode ? desc.freeinodes : desc.freeblocks) == 0) {
-		if (inode)
-			fs->lowestfreeinodebg += 1;
-		else
+		*first = GROUP_GETBLOCK(fs, bg) + found;
+		*count = foundcount;
+		e = 0;
+
+		// update lowest free group if there are no more free blocks in it
+		MUTEX_ACQUIRE(&fs->superblocklock, false);
+		if (full && bg == fs->lowestfreeblockbg)
 			fs->lowestfreeblockbg += 1;
+		MUTEX_RELEASE(&fs->superblocklock);
+		break;
 	}
 
-	*retid = structurefound;
-
-	// update superblock unallocated structure count
+	// give back what wasn't allocated
 	MUTEX_ACQUIRE(&fs->superblocklock, false);
-	if (inode)
-		fs->superblock.unallocatedinodes -= 1;
-	else
-		fs->superblock.unallocatedblocks -= 1;
-	e = syncsuperblock(fs);
+	fs->superblock.unallocatedblocks += want - foundcount;
+	if (usedreserve > foundcount) {
+		fs->reservedblocks += usedreserve - foundcount;
+		node->reserved += usedreserve - foundcount;
+	}
+	int syncerr = syncsuperblock(fs);
 	MUTEX_RELEASE(&fs->superblocklock);
-	ASSERT_UNCLEAN(fs, e == 0);
+	ASSERT_UNCLEAN(fs, syncerr == 0);
 
-	cleanup:
-	if (bm)
-		free(bm);
+	return e;
+}
+
+static int allocateblock(ext2fs_t *fs, ext2node_t *node, uintmax_t goal, uintmax_t *block) {
+	size_t count = 1;
+	return allocateblocks(fs, node, goal, block, &count);
+}
+
+// more freed extents than this before a sync and the rest are left for FITRIM
+#define DISCARD_PENDING_MAX 512
+
+static int discardblocks(ext2fs_t *fs, uintmax_t block, size_t count) {
+	blockrange_t range = {
+		.offset = BLOCK_GETDISKOFFSET(fs, block),
+		.length = count * fs->blocksize
+	};
+
+	int result;
+	return VOP_IOCTL(fs->backing, BLOCK_IOCTL_DISCARD, &range, &result, NULL);
+}
+
+// discards the runs of at least minlen free blocks between the indexes start and end of a group.
+// the group stays locked so that nothing can be allocated from a run while it is discarded.
+// groups with blocks freed after the free generation synced might have a free that isn't on disk yet, for a block
+// still in use by a file after a crash, so they are left alone
+static int trimgroup(ext2fs_t *fs, uintmax_t bg, size_t start, size_t end, size_t minlen, size_t *trimmed, uintmax_t synced) {
+	ext2group_t *group = &fs->groups[bg];
+	uintmax_t groupblock = GROUP_GETBLOCK(fs, bg);
+
+	MUTEX_ACQUIRE(&group->lock, false);
+	int e = 0;
+	if (group->lastfree > synced)
+		goto leave;
+
+	e = loadbitmaps(fs, group);
+	if (e)
+		goto leave;
+
+	size_t run = 0;
+	for (size_t i = start; i <= end; ++i) {
+		// 0 means free
+		if (i < end && (group->blockbitmap[i / 8] & (1 << (i % 8))) == 0) {
+			++run;
+			continue;
+		}
+
+		if (run && run >= minlen) {
+			e = discardblocks(fs, groupblock + i - run, run);
+			if (e)
+				break;
+
+			*trimmed += run;
+		}
+
+		run = 0;
+	}
 
-	MUTEX_RELEASE(&fs->descriptorlock);
+	leave:
+	MUTEX_RELEASE(&group->lock);
 	return e;
 }
 
+static int trimrange(ext2fs_t *fs, uintmax_t block, uintmax_t count, size_t minlen, size_t *trimmed, uintmax_t synced) {
+	block = max(block, fs->superblock.superblockstart);
+	if (block >= fs->superblock.blockcount)
+		return 0;
+
+	uintmax_t end = count > fs->superblock.blockcount - block ? fs->superblock.blockcount : block + count;
+	while (block < end) {
+		uintmax_t bg = BLOCK_GETGROUP(fs, block);
+		uintmax_t groupend = min(GROUP_GETBLOCK(fs, bg + 1), end);
+		int e = trimgroup(fs, bg, BLOCK_GETINDEX(fs, block), groupend - GROUP_GETBLOCK(fs, bg), minlen, trimmed, synced);
+		if (e)
+			return e;
+
+		block = groupend;
+	}
+
+	return 0;
+}
+
+static void queuediscard(ext2fs_t *fs, uintmax_t block) {
+	MUTEX_ACQUIRE(&fs->discardlock, false);
+	discardextent_t *last = fs->discardcount ? &fs->discardpending[fs->discardcount - 1] : NULL;
+	if (last && last->block + last->count == block) {
+		++last->count;
+	} else if (last && block + 1 == last->block) {
+		--last->block;
+		++last->count;
+	} else if (fs->discardcount < DISCARD_PENDING_MAX) {
+		fs->discardpending[fs->discardcount].block = block;
+		fs->discardpending[fs->discardcount].count = 1;
+		++fs->discardcount;
+	}
+	MUTEX_RELEASE(&fs->discardlock);
+}
+
+// takes the pending discards before a sync, as only the blocks freed so far are sure to be free on disk after it.
+// returns NULL if there are none or there's no memory for the copy, in which case they stay queued
+static discardextent_t *takediscards(ext2fs_t *fs, size_t *count, uintmax_t *generation) {
+	MUTEX_ACQUIRE(&fs->discardlock, false);
+	*generation = __atomic_load_n(&fs->freegeneration, __ATOMIC_SEQ_CST);
+	*count = fs->discardcount;
+	discardextent_t *extents = *count ? alloc(sizeof(discardextent_t) * *count) : NULL;
+	if (extents) {
+		memcpy(extents, fs->discardpending, sizeof(discardextent_t) * *count);
+		fs->discardcount = 0;
+	}
+	MUTEX_RELEASE(&fs->discardlock);
+	return extents;
+}
+
+// puts back the discards of a failed sync, as much as fits. the rest is left for FITRIM
+static void requeuediscards(ext2fs_t *fs, discardextent_t *extents, size_t count) {
+	MUTEX_ACQUIRE(&fs->discardlock, false);
+	count = min(count, DISCARD_PENDING_MAX - fs->discardcount);
+	memcpy(&fs->discardpending[fs->discardcount], extents, sizeof(discardextent_t) * count);
+	fs->discardcount += count;
+	MUTEX_RELEASE(&fs->discardlock);
+}
+
+// called once the freeing of the taken blocks is on disk. the bitmaps are checked again
+// as the blocks might have been allocated again since they were freed
+static void flushdiscards(ext2fs_t *fs, discardextent_t *extents, size_t count, uintmax_t generation) {
+	for (size_t i = 0; i < count; ++i) {
+		size_t trimmed = 0;
+		if (trimrange(fs, extents[i].block, extents[i].count, 1, &trimmed, generation))
+			break;
+	}
+}
+
 // frees a block or an inode
 static int freestructure(ext2fs_t *fs, uintmax_t id, bool inode) {
-	int e = 0;
-	uint8_t *bm = NULL;
 	int bg = inode ? INODE_GETGROUP(fs, id) : BLOCK_GETGROUP(fs, id);
-	MUTEX_ACQUIRE(&fs->descriptorlock, false);
+	ext2group_t *group = &fs->groups[bg];
 
-	blockgroupdesc_t desc;
-	size_t readc;
-	e = vfs_read(fs->backing, &desc, sizeof(blockgroupdesc_t), DESC_GETDISKOFFSET(fs, bg), &readc, 0);
-	if (e)
-		goto cleanup;
+	// the journal can't be left with an old copy of the block once it gets reused
+	if (fs->journal && inode == false)
+		jbd_forget(fs->journal, id);
 
-	size_t bmsize = (inode ? fs->superblock.inodespergroup : fs->superblock.blockspergroup) / 8;
-	bm = alloc(bmsize);
-	if (bm == NULL) {
-		e = ENOMEM;
-		goto cleanup;
-	}
+	MUTEX_ACQUIRE(&group->lock, false);
 
-	// read bitmap into buffer
-	e = vfs_read(fs->backing, bm, bmsize, BLOCK_GETDISKOFFSET(fs, inode ? desc.inodebitmap : desc.blockbitmap), &readc, 0);
-	if (e)
-		goto cleanup;
+	int e = loadbitmaps(fs, group);
+	if (e) {
+		MUTEX_RELEASE(&group->lock);
+		return e;
+	}
 
+	uint8_t *bm = inode ? group->inodebitmap : group->blockbitmap;
 	int index = inode ? INODE_GETINDEX(fs, id) : BLOCK_GETINDEX(fs, id);
 	int bmoffset = index / 8;
 	int bmindex = index % 8;
@@ -380,25 +825,25 @@ static int freestructure(ext2fs_t *fs, uintmax_t id, bool inode) {
 	// 0 means free
 	__assert(bm[bmoffset] & (1 << bmindex));
 	bm[bmoffset] &= ~(1 << bmindex);
-
-	// sync bitmap back into disk
-	size_t writec;
-	e = vfs_write(fs->backing, bm, bmsize, BLOCK_GETDISKOFFSET(fs, inode ? desc.inodebitmap : desc.blockbitmap), &writec, 0);
-	if (e)
-		goto cleanup;
+	if (inode == false)
+		group->lastfree = __atomic_add_fetch(&fs->freegeneration, 1, __ATOMIC_SEQ_CST);
 
 	// update block group desc free structure count
-	ASSERT_UNCLEAN(fs, e == 0);
 	if (inode)
-		desc.freeinodes += 1;
+		group->desc->freeinodes += 1;
 	else
-		desc.freeblocks += 1;
+		group->desc->freeblocks += 1;
 
-	e = vfs_write(fs->backing, &desc, sizeof(blockgroupdesc_t), DESC_GETDISKOFFSET(fs, bg), &writec, 0);
-	if (e)
-		goto cleanup;
+	if (inode)
+		metadirty(fs, group->inodebitmappage, BLOCK_GETDISKOFFSET(fs, group->desc->inodebitmap));
+	else
+		metadirty(fs, group->blockbitmappage, BLOCK_GETDISKOFFSET(fs, group->desc->blockbitmap));
 
-	// update lowest free block group if block group is lower
+	metadirty(fs, group->descpage, DESC_GETDISKOFFSET(fs, bg));
+	MUTEX_RELEASE(&group->lock);
+
+	// update lowest free block group if block group is lower and the superblock unallocated structure count
+	MUTEX_ACQUIRE(&fs->superblocklock, false);
 	if (bg < (inode ? fs->lowestfreeinodebg : fs->lowestfreeblockbg)) {
 		if (inode)
 			fs->lowestfreeinodebg = bg;
@@ -406,8 +851,6 @@ static int freestructure(ext2fs_t *fs, uintmax_t id, bool inode) {
 			fs->lowestfreeblockbg = bg;
 	}
 
-	// update superblock unallocated structure count
-	MUTEX_ACQUIRE(&fs->superblocklock, false);
 	if (inode)
 		fs->superblock.unallocatedinodes += 1;
 	else
@@ -415,49 +858,136 @@ static int freestructure(ext2fs_t *fs, uintmax_t id, bool inode) {
 	e = syncsuperblock(fs);
 	MUTEX_RELEASE(&fs->superblocklock);
 
-	cleanup:
-	if (bm)
-		free(bm);
-	MUTEX_RELEASE(&fs->descriptorlock);
+	if (fs->discard && inode == false)
+		queuediscard(fs, id);
+
 	return e;
 }
 
-static int readinode(ext2fs_t *fs, inode_t *buffer, int inode) {
-	// get inode table offset. descriptor lock not held because the position of the table is fixed
-	blockgroupdesc_t desc;
-	size_t readc;
-	int e = vfs_read(fs->backing, &desc, sizeof(blockgroupdesc_t), DESC_GETDISKOFFSET(fs, INODE_GETGROUP(fs, inode)), &readc, 0);
-	if (e)
-		return e;
+// inode table lock expected to be held
+static void lruremove(ext2fs_t *fs, ext2node_t *node) {
+	if (node->lruprev)
+		node->lruprev->lrunext = node->lrunext;
+	else
+		fs->lruhead = node->lrunext;
 
-	if (readc != sizeof(blockgroupdesc_t))
-		return EIO;
+	if (node->lrunext)
+		node->lrunext->lruprev = node->lruprev;
+	else
+		fs->lrutail = node->lruprev;
 
-	// read inode into buffer. inode table lock not held because not a writing operation and the inode lock is already held
-	e = vfs_read(fs->backing, buffer, sizeof(inode_t), INODE_GETDISKOFFSET(fs, BLOCK_GETDISKOFFSET(fs, desc.inodetable), inode), &readc, 0);
-	if (e)
-		return e;
+	node->inactive = false;
+	--fs->inactivecount;
+}
 
-	if (readc != sizeof(inode_t))
-		return EIO;
+// inode table lock expected to be held
+static void lruinsert(ext2fs_t *fs, ext2node_t *node) {
+	node->lruprev = NULL;
+	node->lrunext = fs->lruhead;
+	if (fs->lruhead)
+		fs->lruhead->lruprev = node;
+	else
+		fs->lrutail = node;
 
-	return e;
+	fs->lruhead = node;
+	node->inactive = true;
+	++fs->inactivecount;
 }
 
-static int writeinode(ext2fs_t *fs, inode_t *buffer, int inode) {
-	// get inode table offset. descriptor lock not held because the position of the table is fixed
-	blockgroupdesc_t desc;
-	size_t count;
-	int e = vfs_read(fs->backing, &desc, sizeof(blockgroupdesc_t), DESC_GETDISKOFFSET(fs, INODE_GETGROUP(fs, inode)), &count, 0);
+// takes the least recently used inactive nodes out of the inode table. inode table lock expected to be held
+static ext2node_t *lrutake(ext2fs_t *fs, size_t count) {
+	ext2node_t *list = NULL;
+	while (count-- && fs->lrutail) {
+		ext2node_t *node = fs->lrutail;
+		lruremove(fs, node);
+		__assert(hashtable_remove(&fs->inodetable, &node->id, sizeof(node->id)) == 0);
+		node->lrunext = list;
+		list = node;
+	}
+
+	return list;
+}
+
+// frees the nodes taken by lrutake. the inode table lock doesn't need to be held
+static void lrufree(ext2fs_t *fs, ext2node_t *list) {
+	while (list) {
+		ext2node_t *next = list->lrunext;
+		// any dirty page would have held a reference to the vnode, so these are all clean
+		vmmcache_truncate(&list->vnode, 0);
+		unreserveblocks(fs, list, SIZE_MAX);
+		slab_free(nodecache, list);
+		list = next;
+	}
+}
+
+// gets the in memory node of an inode with a new reference, or NULL if it isn't in memory.
+// inode table lock expected to be held, but it gets dropped for a bit if the node is on its way to ext2_inactive
+static ext2node_t *tableget(ext2fs_t *fs, int id) {
+	for (;;) {
+		void *v;
+		if (hashtable_get(&fs->inodetable, &v, &id, sizeof(id)))
+			return NULL;
+
+		ext2node_t *node = v;
+		if (node->inactive) {
+			lruremove(fs, node);
+			VOP_HOLD(&node->vnode);
+			return node;
+		}
+
+		// only take a reference if it is still referenced
+		int refcount = __atomic_load_n(&node->vnode.refcount, __ATOMIC_SEQ_CST);
+		while (refcount) {
+			if (__atomic_compare_exchange_n(&node->vnode.refcount, &refcount, refcount + 1, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+				return node;
+		}
+
+		// the last reference just went away, wait for ext2_inactive to put it in the inactive list
+		MUTEX_RELEASE(&fs->inodetablelock);
+		sched_yield();
+		MUTEX_ACQUIRE(&fs->inodetablelock, false);
+	}
+}
+
+static void shrink() {
+	MUTEX_ACQUIRE(&mountslock, false);
+	for (ext2fs_t *fs = mounts; fs; fs = fs->mountnext) {
+		MUTEX_ACQUIRE(&fs->inodetablelock, false);
+		ext2node_t *list = lrutake(fs, ROUND_UP(fs->inactivecount, 2) / 2);
+		MUTEX_RELEASE(&fs->inodetablelock);
+		lrufree(fs, list);
+	}
+	MUTEX_RELEASE(&mountslock);
+}
+
+static pmmshrinker_t shrinker = {
+	.shrink = shrink
+};
+
+static int readinode(ext2fs_t *fs, inode_t *buffer, int inode) {
+	// get inode table offset. group lock not held because the position of the table is fixed
+	uintmax_t table = BLOCK_GETDISKOFFSET(fs, fs->groups[INODE_GETGROUP(fs, inode)].desc->inodetable);
+
+	// read inode into buffer. inode table lock not held because not a writing operation and the inode lock is already held
+	size_t readc;
+	int e = vfs_read(fs->backing, buffer, sizeof(inode_t), INODE_GETDISKOFFSET(fs, table, inode), &readc, 0);
 	if (e)
 		return e;
 
-	if (count != sizeof(blockgroupdesc_t))
+	if (readc != sizeof(inode_t))
 		return EIO;
 
+	return e;
+}
+
+static int writeinode(ext2fs_t *fs, inode_t *buffer, int inode) {
+	// get inode table offset. group lock not held because the position of the table is fixed
+	uintmax_t table = BLOCK_GETDISKOFFSET(fs, fs->groups[INODE_GETGROUP(fs, inode)].desc->inodetable);
+
 	MUTEX_ACQUIRE(&fs->inodewritelock, false);
 	// write inode from buffer
-	e = vfs_write(fs->backing, buffer, sizeof(inode_t), INODE_GETDISKOFFSET(fs, BLOCK_GETDISKOFFSET(fs, desc.inodetable), inode), &count, 0);
+	size_t count;
+	int e = metawrite(fs, buffer, sizeof(inode_t), INODE_GETDISKOFFSET(fs, table, inode), &count);
 	MUTEX_RELEASE(&fs->inodewritelock);
 	if (e)
 		return e;
@@ -468,68 +998,143 @@ static int writeinode(ext2fs_t *fs, inode_t *buffer, int inode) {
 	return e;
 }
 
-static int getinodeblock(ext2fs_t *fs, ext2node_t *node, uintmax_t index, blockptr_t *block) {
+#define MAP_READAHEAD 64
+
+// reads the pointer at offset in an indirect block, a 0 indirect block means a hole
+static int readindirect(ext2fs_t *fs, blockptr_t indirect, uintmax_t offset, blockptr_t *ptr) {
+	if (indirect == 0) {
+		*ptr = 0;
+		return 0;
+	}
+
+	size_t readc;
+	return vfs_read(fs->backing, ptr, sizeof(blockptr_t), BLOCK_GETDISKOFFSET(fs, indirect) + offset, &readc, 0);
+}
+
+// resolves a file block to a disk block without the cache, along with how many blocks after it follow contiguously
+// on disk (or are also holes). only the indirect block the pointer is in is looked at, so the run is cut at its end
+static int mapblocks(ext2fs_t *fs, ext2node_t *node, uintmax_t index, blockptr_t *block, size_t *count) {
 	// no indirection needed
 	if (index < 12) {
 		*block = node->inode.directpointer[index];
+		*count = 1;
+		while (index + *count < 12 && node->inode.directpointer[index + *count] == (*block ? *block + *count : 0))
+			*count += 1;
+
 		return 0;
 	}
 
 	index -= 12;
 
 	size_t blocksinindirect = BLOCKS_IN_INDIRECT(fs);
-	int singlyidx = index % blocksinindirect;
-	uintmax_t singlyoffset = singlyidx * sizeof(blockptr_t);
-	int singly = index / blocksinindirect;
+	uintmax_t singlyidx = index % blocksinindirect;
+	uintmax_t singly = index / blocksinindirect;
+	blockptr_t singlyptr = 0;
+	int e = 0;
 
-	// first singly indirect block
 	if (singly == 0) {
-		size_t readc;
-		return vfs_read(fs->backing, block, sizeof(blockptr_t), BLOCK_GETDISKOFFSET(fs, node->inode.singlypointer) + singlyoffset, &readc, 0);
-	}
+		// first singly indirect block
+		singlyptr = node->inode.singlypointer;
+	} else {
+		singly -= 1;
+		uintmax_t doublyoffset = (singly % blocksinindirect) * sizeof(blockptr_t);
+		uintmax_t doubly = singly / blocksinindirect;
 
-	singly -= 1;
-	int doublyidx = singly % blocksinindirect;
-	uintmax_t doublyoffset = doublyidx * sizeof(blockptr_t);
-	int doubly = singly / blocksinindirect;
+		if (doubly == 0) {
+			// first doubly indirect block
+			e = readindirect(fs, node->inode.doublypointer, doublyoffset, &singlyptr);
+		} else {
+			// triply indirect block
+			doubly -= 1;
+			uintmax_t triplyoffset = (doubly % blocksinindirect) * sizeof(blockptr_t);
+			blockptr_t doublyptr;
+			e = readindirect(fs, node->inode.triplypointer, triplyoffset, &doublyptr);
+			if (e == 0)
+				e = readindirect(fs, doublyptr, doublyoffset, &singlyptr);
+		}
 
-	// first doubly indirect block
-	if (doubly == 0) {
-		size_t readc;
-		blockptr_t singlyptr;
-		int e = vfs_read(fs->backing, &singlyptr, sizeof(blockptr_t), BLOCK_GETDISKOFFSET(fs, node->inode.doublypointer) + doublyoffset, &readc, 0);
 		if (e)
 			return e;
-		return vfs_read(fs->backing, block, sizeof(blockptr_t), BLOCK_GETDISKOFFSET(fs, singlyptr) + singlyoffset, &readc, 0);
 	}
 
-	doubly -= 1;
-	int triplyidx = doubly % blocksinindirect;
-	uintmax_t triplyoffset = triplyidx * sizeof(blockptr_t);
+	// read the pointers for the run in one go instead of one by one
+	size_t readcount = min(MAP_READAHEAD, blocksinindirect - singlyidx);
+	if (singlyptr == 0) {
+		*block = 0;
+		*count = readcount;
+		return 0;
+	}
 
-	// triply indirect block
+	blockptr_t pointers[MAP_READAHEAD];
 	size_t readc;
-	blockptr_t doublyptr;
-	blockptr_t singlyptr;
-	int e = vfs_read(fs->backing, &doublyptr, sizeof(blockptr_t), BLOCK_GETDISKOFFSET(fs, node->inode.triplypointer) + triplyoffset, &readc, 0);
+	e = vfs_read(fs->backing, pointers, readcount * sizeof(blockptr_t), BLOCK_GETDISKOFFSET(fs, singlyptr) + singlyidx * sizeof(blockptr_t), &readc, 0);
 	if (e)
 		return e;
 
-	e = vfs_read(fs->backing, &singlyptr, sizeof(blockptr_t), BLOCK_GETDISKOFFSET(fs, doublyptr) + doublyoffset, &readc, 0);
-	if (e)
+	*block = pointers[0];
+	*count = 1;
+	while (*count < readcount && pointers[*count] == (*block ? *block + *count : 0))
+		*count += 1;
+
+	return 0;
+}
+
+// drops every cached run, has to be called after a block pointer of the inode changes
+static void mapcacheinvalidate(ext2node_t *node) {
+	spinlock_acquire(&node->mapcachelock);
+	node->mapcachegen += 1;
+	memset(node->mapcache, 0, sizeof(node->mapcache));
+	spinlock_release(&node->mapcachelock);
+}
+
+// resolves a file block to a disk block, along with the number of blocks from index on that are contiguous on disk
+static int getinodeblocks(ext2fs_t *fs, ext2node_t *node, uintmax_t index, blockptr_t *block, size_t *count) {
+	spinlock_acquire(&node->mapcachelock);
+	for (int i = 0; i < MAPCACHE_SIZE; ++i) {
+		mapextent_t *extent = &node->mapcache[i];
+		if (extent->count && index >= extent->index && index < extent->index + extent->count) {
+			*block = extent->block + (index - extent->index);
+			*count = extent->count - (index - extent->index);
+			spinlock_release(&node->mapcachelock);
+			return 0;
+		}
+	}
+
+	uintmax_t gen = node->mapcachegen;
+	spinlock_release(&node->mapcachelock);
+
+	int e = mapblocks(fs, node, index, block, count);
+	if (e || *block == 0)
 		return e;
 
-	return vfs_read(fs->backing, block, sizeof(blockptr_t), BLOCK_GETDISKOFFSET(fs, singlyptr) + singlyoffset, &readc, 0);
+	// don't remember it if the mapping changed while it was being read
+	spinlock_acquire(&node->mapcachelock);
+	if (gen == node->mapcachegen) {
+		node->mapcache[node->mapcachenext] = (mapextent_t){
+			.index = index,
+			.count = *count,
+			.block = *block
+		};
+		node->mapcachenext = (node->mapcachenext + 1) % MAPCACHE_SIZE;
+	}
+	spinlock_release(&node->mapcachelock);
+
+	return 0;
+}
+
+static int getinodeblock(ext2fs_t *fs, ext2node_t *node, uintmax_t index, blockptr_t *block) {
+	size_t count;
+	return getinodeblocks(fs, node, index, block, &count);
 }
 
 static int allocandset(ext2fs_t *fs, ext2node_t *node, uintmax_t setoffset, blockptr_t *newvalue) {
 	uintmax_t block = 0;
-	int e = allocatestructure(fs, &block, false);
+	int e = allocateblock(fs, node, GROUP_GETBLOCK(fs, INODE_GETGROUP(fs, node->id)), &block);
 	if (e)
 		return e;
 	blockptr_t blockptr = block;
 	size_t writec;
-	e = vfs_write(fs->backing, &blockptr, sizeof(blockptr_t), setoffset, &writec, 0);
+	e = metawrite(fs, &blockptr, sizeof(blockptr_t), setoffset, &writec);
 	if (e) {
 		ASSERT_UNCLEAN(fs, freestructure(fs, block, false) == 0);
 		return e;
@@ -543,13 +1148,13 @@ static int allocandset(ext2fs_t *fs, ext2node_t *node, uintmax_t setoffset, bloc
 
 static int inodeallocateindirect(ext2fs_t *fs, ext2node_t *node, int indirect) {
 	uintmax_t v;
-	int e = allocatestructure(fs, &v, false);
+	int e = allocateblock(fs, node, GROUP_GETBLOCK(fs, INODE_GETGROUP(fs, node->id)), &v);
 	if (e)
 		return e;
 
 	__assert(fs->blocksize <= UTIL_ZEROBUFFERSIZE);
 	size_t writec;
-	e = vfs_write(fs->backing, util_zerobuffer, fs->blocksize, BLOCK_GETDISKOFFSET(fs, v), &writec, 0);
+	e = metawrite(fs, util_zerobuffer, fs->blocksize, BLOCK_GETDISKOFFSET(fs, v), &writec);
 	if (e) {
 		ASSERT_UNCLEAN(fs, freestructure(fs, v, false) == 0);
 		return e;
@@ -636,7 +1241,7 @@ static int setinodeblock(ext2fs_t *fs, ext2node_t *node, uintmax_t index, blockp
 			if (e)
 				return e;
 
-			e = vfs_write(fs->backing, util_zerobuffer, fs->blocksize, BLOCK_GETDISKOFFSET(fs, doublyptr), &writec, 0);
+			e = metawrite(fs, util_zerobuffer, fs->blocksize, BLOCK_GETDISKOFFSET(fs, doublyptr), &writec);
 			if (e)
 				return e;
 		} else if (usetriply) {
@@ -652,7 +1257,7 @@ static int setinodeblock(ext2fs_t *fs, ext2node_t *node, uintmax_t index, blockp
 				if (e)
 					return e;
 
-				e = vfs_write(fs->backing, util_zerobuffer, fs->blocksize, BLOCK_GETDISKOFFSET(fs, doublyptr), &writec, 0);
+				e = metawrite(fs, util_zerobuffer, fs->blocksize, BLOCK_GETDISKOFFSET(fs, doublyptr), &writec);
 				if (e)
 					return e;
 			}
@@ -680,7 +1285,7 @@ static int setinodeblock(ext2fs_t *fs, ext2node_t *node, uintmax_t index, blockp
 				if (e)
 					return e;
 
-				e = vfs_write(fs->backing, util_zerobuffer, fs->blocksize, BLOCK_GETDISKOFFSET(fs, singlyptr), &writec, 0);
+				e = metawrite(fs, util_zerobuffer, fs->blocksize, BLOCK_GETDISKOFFSET(fs, singlyptr), &writec);
 				if (e)
 					return e;
 			}
@@ -700,11 +1305,13 @@ static int setinodeblock(ext2fs_t *fs, ext2node_t *node, uintmax_t index, blockp
 		e = vfs_read(fs->backing, &oldblock, sizeof(blockptr_t), offset, &count, 0);
 		if (e)
 			return e;
-		e = vfs_write(fs->backing, &block, sizeof(blockptr_t), offset, &count, 0);
+		e = metawrite(fs, &block, sizeof(blockptr_t), offset, &count);
 		if (e)
 			return e;
 	}
 
+	mapcacheinvalidate(node);
+
 	if (oldblock) {
 		node->inode.sectcount -= INODE_SECTSPERBLOCK(fs);
 		ASSERT_UNCLEAN(fs, freestructure(fs, oldblock, false) == 0);
@@ -718,75 +1325,142 @@ static int setinodeblock(ext2fs_t *fs, ext2node_t *node, uintmax_t index, blockp
 	return e;
 }
 
+// where to look for free blocks for a file block: right after the block before it, so files stay contiguous,
+// or otherwise in the group of the inode
+static uintmax_t blockgoal(ext2fs_t *fs, ext2node_t *node, uintmax_t index) {
+	blockptr_t previous = 0;
+	if (index && getinodeblock(fs, node, index - 1, &previous) == 0 && previous)
+		return previous + 1;
+
+	return GROUP_GETBLOCK(fs, INODE_GETGROUP(fs, node->id));
+}
+
+// allocates disk blocks for up to *count hole blocks starting at file block index, as one contiguous run if possible.
+// *count is set to how many were filled and *block to the first disk block of the run
+static int fillhole(ext2fs_t *fs, ext2node_t *node, uintmax_t index, size_t *count, blockptr_t *block) {
+	uintmax_t first;
+	int e = allocateblocks(fs, node, blockgoal(fs, node, index), &first, count);
+	if (e)
+		return e;
+
+	for (size_t i = 0; i < *count; ++i) {
+		e = setinodeblock(fs, node, index + i, first + i);
+		if (e) {
+			for (size_t j = i; j < *count; ++j)
+				ASSERT_UNCLEAN(fs, freestructure(fs, first + j, false) == 0);
+
+			*count = i;
+			return e;
+		}
+	}
+
+	*block = first;
+	__atomic_store_n(&node->layoutdirty, true, __ATOMIC_SEQ_CST);
+	return 0;
+}
+
 static int resizeinode(ext2fs_t *fs, ext2node_t *node, size_t newsize) {
 	size_t newblockcount = ROUND_UP(newsize, fs->blocksize) / fs->blocksize;
 	size_t currentblockcount = ROUND_UP(INODE_SIZE(&node->inode), fs->blocksize) / fs->blocksize;
 
-	if (newblockcount > currentblockcount) {
-		// grow
-		for (int i = currentblockcount; i < newblockcount; ++i) {
-			uintmax_t newblock;
-			int e = allocatestructure(fs, &newblock, false);
-			if (e)
-				return e;
-			e = setinodeblock(fs, node, i, newblock);
+	if (newblockcount > currentblockcount && node->vnode.type == V_TYPE_REGULAR) {
+		// delayed allocation: the space is only reserved here (along with an estimate for the indirect blocks)
+		// and the blocks are allocated when the data is written back, in runs as large as the writes
+		size_t count = newblockcount - currentblockcount;
+		int e = reserveblocks(fs, node, count + ROUND_UP(count, BLOCKS_IN_INDIRECT(fs)) / BLOCKS_IN_INDIRECT(fs) + 2);
+		if (e)
+			return e;
+	} else if (newblockcount > currentblockcount) {
+		// directories and symlinks get their blocks right away
+		for (uintmax_t i = currentblockcount; i < newblockcount;) {
+			size_t count = newblockcount - i;
+			blockptr_t block;
+			int e = fillhole(fs, node, i, &count, &block);
 			ASSERT_UNCLEAN(fs, e == 0);
 			if (e)
 				return e;
+
+			i += count;
 		}
 	} else if (newblockcount < currentblockcount) {
 		// shrink
-		for (int i = newblockcount; i < currentblockcount; ++i) {
-			int e = setinodeblock(fs, node, i, 0);
+		for (uintmax_t i = newblockcount; i < currentblockcount;) {
+			blockptr_t block;
+			size_t count;
+			int e = getinodeblocks(fs, node, i, &block, &count);
 			if (e)
 				return e;
+
+			count = min(count, currentblockcount - i);
+
+			// never written back, only the reservation has to go
+			if (block == 0) {
+				unreserveblocks(fs, node, count);
+				i += count;
+				continue;
+			}
+
+			for (size_t j = 0; j < count; ++j) {
+				e = setinodeblock(fs, node, i + j, 0);
+				if (e)
+					return e;
+			}
+
+			i += count;
 		}
+
+		// the leftover estimate for indirect blocks
+		if (newblockcount == 0)
+			unreserveblocks(fs, node, SIZE_MAX);
 	}
 
 	INODE_SETSIZE(&node->inode, newsize);
+	__atomic_store_n(&node->layoutdirty, true, __ATOMIC_SEQ_CST);
 
 	ASSERT_UNCLEAN(fs, writeinode(fs, &node->inode, node->id) == 0);
 	return 0;
 }
 
 static int rwblocks_iovec(ext2fs_t *fs, ext2node_t *node, iovec_iterator_t *iovec_iterator, size_t count, uintmax_t index, bool write, bool cache) {
-	for (uintmax_t i = 0; i < count; ++i) {
+	for (uintmax_t i = 0; i < count;) {
 		size_t inodesize = INODE_SIZE(&node->inode);
 		__assert(index + i < ROUND_UP(inodesize, fs->blocksize) / fs->blocksize);
 
 		blockptr_t block;
-		int e = getinodeblock(fs, node, index + i, &block);
+		size_t runcount;
+		int e = getinodeblocks(fs, node, index + i, &block, &runcount);
 		if (e)
 			return e;
 
-		// for sparse files
+		runcount = min(runcount, count - i);
+
+		// for sparse files and delayed allocation
 		if (block == 0 && write) {
-			uintmax_t newblock;
-			e = allocatestructure(fs, &newblock, false);
+			e = fillhole(fs, node, index + i, &runcount, &block);
 			if (e)
 				return e;
-
-			e = setinodeblock(fs, node, index + i, newblock);
-			if (e) {
-				freestructure(fs, newblock, false);
-				return e;
-			}
-
-			block = newblock;
 		} else if (block == 0 && write == false) {
-			iovec_iterator_memset(iovec_iterator, 0, fs->blocksize);
+			iovec_iterator_memset(iovec_iterator, 0, runcount * fs->blocksize);
+			i += runcount;
 			continue;
 		}
 
+		// the whole run is contiguous on disk, so it can go down as a single request
+		size_t runsize = runcount * fs->blocksize;
 		size_t donecount;
-		e = write ?
-			vfs_write_iovec(fs->backing, iovec_iterator, fs->blocksize, BLOCK_GETDISKOFFSET(fs, block), &donecount, cache ? 0 : V_FFLAGS_NOCACHE) :
-			vfs_read_iovec(fs->backing, iovec_iterator, fs->blocksize, BLOCK_GETDISKOFFSET(fs, block), &donecount, cache ? 0 : V_FFLAGS_NOCACHE);
+		// cached blocks belong to directories and symlinks, so they are metadata
+		if (write && cache)
+			e = metawrite_iovec(fs, iovec_iterator, runsize, BLOCK_GETDISKOFFSET(fs, block), &donecount);
+		else if (write)
+			e = vfs_write_iovec(fs->backing, iovec_iterator, runsize, BLOCK_GETDISKOFFSET(fs, block), &donecount, V_FFLAGS_NOCACHE);
+		else
+			e = vfs_read_iovec(fs->backing, iovec_iterator, runsize, BLOCK_GETDISKOFFSET(fs, block), &donecount, cache ? 0 : V_FFLAGS_NOCACHE);
 
 		if (e)
 			return e;
 
-		__assert(donecount == fs->blocksize);
+		__assert(donecount == runsize);
+		i += runcount;
 	}
 	return 0;
 }
@@ -802,29 +1476,35 @@ static int rwblock_iovec(ext2fs_t *fs, ext2node_t *node, iovec_iterator_t *iovec
 		return e;
 
 
-	// for sparse files
+	// for sparse files and delayed allocation
 	if (block == 0 && write) {
-		uintmax_t newblock;
-		e = allocatestructure(fs, &newblock, false);
+		size_t one = 1;
+		e = fillhole(fs, node, index, &one, &block);
 		if (e)
 			return e;
 
-		e = setinodeblock(fs, node, index, newblock);
-		if (e) {
-			freestructure(fs, newblock, false);
-			return e;
+		// the rest of the block has to read back as zeroes
+		if (count < fs->blocksize) {
+			__assert(fs->blocksize <= UTIL_ZEROBUFFERSIZE);
+			size_t writec;
+			e = cache ?
+				metawrite(fs, util_zerobuffer, fs->blocksize, BLOCK_GETDISKOFFSET(fs, block), &writec) :
+				vfs_write(fs->backing, util_zerobuffer, fs->blocksize, BLOCK_GETDISKOFFSET(fs, block), &writec, V_FFLAGS_NOCACHE);
+			if (e)
+				return e;
 		}
-
-		block = newblock;
 	} else if (block == 0 && write == false) {
 		iovec_iterator_memset(iovec_iterator, 0, count);
 		return 0;
 	}
 
 	size_t donecount;
-	e = write ?
-		vfs_write_iovec(fs->backing, iovec_iterator, count, BLOCK_GETDISKOFFSET(fs, block) + offset, &donecount, cache ? 0 : V_FFLAGS_NOCACHE) :
-		vfs_read_iovec(fs->backing, iovec_iterator, count, BLOCK_GETDISKOFFSET(fs, block) + offset, &donecount, cache ? 0 : V_FFLAGS_NOCACHE);
+	if (write && cache)
+		e = metawrite_iovec(fs, iovec_iterator, count, BLOCK_GETDISKOFFSET(fs, block) + offset, &donecount);
+	else if (write)
+		e = vfs_write_iovec(fs->backing, iovec_iterator, count, BLOCK_GETDISKOFFSET(fs, block) + offset, &donecount, V_FFLAGS_NOCACHE);
+	else
+		e = vfs_read_iovec(fs->backing, iovec_iterator, count, BLOCK_GETDISKOFFSET(fs, block) + offset, &donecount, cache ? 0 : V_FFLAGS_NOCACHE);
 
 	if (e)
 		return e;
@@ -876,49 +1556,775 @@ static int rwbytes(ext2fs_t *fs, ext2node_t *node, void *buffer, size_t count, u
 	return rwbytes_iovec(fs, node, &iovec_iterator, count, offset, write, cache);
 }
 
-#define BUFFER_MAP_FLAGS (ARCH_MMU_FLAGS_READ | ARCH_MMU_FLAGS_WRITE | ARCH_MMU_FLAGS_NOEXEC)
+// hashed b-tree directories (dir_index), on disk compatible with ext3/4.
+// block 0 of an indexed directory holds "." and "..", with ".." spanning the rest of the block so that the index
+// looks like free space to code that doesn't know about it. the index itself maps hash ranges to leaf blocks,
+// which are normal directory blocks. interior index blocks look like a single empty dirent spanning the block.
+
+#define DX_HASH_LEGACY 0
+#define DX_HASH_HALF_MD4 1
+#define DX_HASH_TEA 2
+#define DX_HASH_UNSIGNED_DELTA 3
+#define DX_MAXLEVELS 2
+#define DX_ROOT_ENTRIES_OFFSET(info) (24 + (info)->infolength)
+#define DX_NODE_ENTRIES_OFFSET 8
+
+typedef struct {
+	uint32_t reservedzero;
+	uint8_t hashversion;
+	uint8_t infolength;
+	uint8_t indirectlevels;
+	uint8_t unusedflags;
+} __attribute__((packed)) dxrootinfo_t;
+
+typedef struct {
+	uint32_t hash;
+	uint32_t block;
+} __attribute__((packed)) dxentry_t;
+
+// overlaps the hash of the first entry, which is implicitly the lowest hash covered by the block
+typedef struct {
+	uint16_t limit;
+	uint16_t count;
+} __attribute__((packed)) dxcountlimit_t;
+
+#define DX_COUNTLIMIT(entries) ((dxcountlimit_t *)(entries))
+
+typedef struct {
+	void *buffer;
+	uintmax_t block;
+	dxentry_t *entries;
+	int at;
+} dxframe_t;
+
+typedef struct {
+	int levels;
+	int hashversion;
+	dxframe_t frames[DX_MAXLEVELS];
+} dxpath_t;
+
+#define DX_DELTA 0x9e3779b9
+#define DX_F(x, y, z) ((z) ^ ((x) & ((y) ^ (z))))
+#define DX_G(x, y, z) (((x) & (y)) + (((x) ^ (y)) & (z)))
+#define DX_H(x, y, z) ((x) ^ (y) ^ (z))
+#define DX_ROUND(f, a, b, c, d, x, s) (a += f(b, c, d) + x, a = (a << s) | (a >> (32 - s)))
+#define DX_K1 0
+#define DX_K2 013240474631u
+#define DX_K3 015666365641u
+
+static void teatransform(uint32_t buf[4], uint32_t in[4]) {
+	uint32_t sum = 0;
+	uint32_t b0 = buf[0], b1 = buf[1];
+	uint32_t a = in[0], b = in[1], c = in[2], d = in[3];
+
+	for (int n = 0; n < 16; ++n) {
+		sum += DX_DELTA;
+		b0 += ((b1 << 4) + a) ^ (b1 + sum) ^ ((b1 >> 5) + b);
+		b1 += ((b0 << 4) + c) ^ (b0 + sum) ^ ((b0 >> 5) + d);
+	}
+
+	buf[0] += b0;
+	buf[1] += b1;
+}
+
+static void halfmd4transform(uint32_t buf[4], uint32_t in[8]) {
+	uint32_t a = buf[0], b = buf[1], c = buf[2], d = buf[3];
+
+	DX_ROUND(DX_F, a, b, c, d, in[0] + DX_K1, 3);
+	DX_ROUND(DX_F, d, a, b, c, in[1] + DX_K1, 7);
+	DX_ROUND(DX_F, c, d, a, b, in[2] + DX_K1, 11);
+	DX_ROUND(DX_F, b, c, d, a, in[3] + DX_K1, 19);
+	DX_ROUND(DX_F, a, b, c, d, in[4] + DX_K1, 3);
+	DX_ROUND(DX_F, d, a, b, c, in[5] + DX_K1, 7);
+	DX_ROUND(DX_F, c, d, a, b, in[6] + DX_K1, 11);
+	DX_ROUND(DX_F, b, c, d, a, in[7] + DX_K1, 19);
+
+	DX_ROUND(DX_G, a, b, c, d, in[1] + DX_K2, 3);
+	DX_ROUND(DX_G, d, a, b, c, in[3] + DX_K2, 5);
+	DX_ROUND(DX_G, c, d, a, b, in[5] + DX_K2, 9);
+	DX_ROUND(DX_G, b, c, d, a, in[7] + DX_K2, 13);
+	DX_ROUND(DX_G, a, b, c, d, in[0] + DX_K2, 3);
+	DX_ROUND(DX_G, d, a, b, c, in[2] + DX_K2, 5);
+	DX_ROUND(DX_G, c, d, a, b, in[4] + DX_K2, 9);
+	DX_ROUND(DX_G, b, c, d, a, in[6] + DX_K2, 13);
+
+	DX_ROUND(DX_H, a, b, c, d, in[3] + DX_K3, 3);
+	DX_ROUND(DX_H, d, a, b, c, in[7] + DX_K3, 9);
+	DX_ROUND(DX_H, c, d, a, b, in[2] + DX_K3, 11);
+	DX_ROUND(DX_H, b, c, d, a, in[6] + DX_K3, 15);
+	DX_ROUND(DX_H, a, b, c, d, in[1] + DX_K3, 3);
+	DX_ROUND(DX_H, d, a, b, c, in[5] + DX_K3, 9);
+	DX_ROUND(DX_H, c, d, a, b, in[0] + DX_K3, 11);
+	DX_ROUND(DX_H, b, c, d, a, in[4] + DX_K3, 15);
+
+	buf[0] += a;
+	buf[1] += b;
+	buf[2] += c;
+	buf[3] += d;
+}
+
+static uint32_t legacyhash(char *name, size_t len, bool issigned) {
+	uint32_t hash, hash0 = 0x12a3fe2d, hash1 = 0x37abe8f9;
+
+	for (size_t i = 0; i < len; ++i) {
+		int c = issigned ? (int)(signed char)name[i] : (int)(unsigned char)name[i];
+		hash = hash1 + (hash0 ^ (c * 7152373));
+		if (hash & 0x80000000)
+			hash -= 0x7fffffff;
+
+		hash1 = hash0;
+		hash0 = hash;
+	}
+
+	return hash0 << 1;
+}
+
+static void strtohashbuf(char *msg, size_t len, uint32_t *buf, int num, bool issigned) {
+	uint32_t pad = (uint32_t)len | ((uint32_t)len << 8);
+	pad |= pad << 16;
+
+	uint32_t val = pad;
+	if (len > num * 4)
+		len = num * 4;
+
+	for (size_t i = 0; i < len; ++i) {
+		int c = issigned ? (int)(signed char)msg[i] : (int)(unsigned char)msg[i];
+		val = c + (val << 8);
+		if ((i % 4) == 3) {
+			*buf++ = val;
+			val = pad;
+			num--;
+		}
+	}
+
+	if (--num >= 0)
+		*buf++ = val;
+
+	while (--num >= 0)
+		*buf++ = pad;
+}
+
+// returns false if the hash version isn't known
+static bool dxhash(ext2fs_t *fs, int version, char *name, size_t len, uint32_t *hashp, uint32_t *minorp) {
+	uint32_t buf[4] = {0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476};
+	uint32_t in[8];
+	uint32_t hash, minor = 0;
+
+	for (int i = 0; i < 4; ++i) {
+		if (fs->superblock.hashseed[i]) {
+			memcpy(buf, fs->superblock.hashseed, sizeof(buf));
+			break;
+		}
+	}
+
+	bool issigned = version < DX_HASH_UNSIGNED_DELTA;
+	switch (version % DX_HASH_UNSIGNED_DELTA) {
+		case DX_HASH_LEGACY:
+			hash = legacyhash(name, len, issigned);
+			break;
+		case DX_HASH_HALF_MD4:
+			for (intmax_t remaining = len; remaining > 0; remaining -= 32, name += 32) {
+				strtohashbuf(name, remaining, in, 8, issigned);
+				halfmd4transform(buf, in);
+			}
+			hash = buf[1];
+			minor = buf[2];
+			break;
+		case DX_HASH_TEA:
+			for (intmax_t remaining = len; remaining > 0; remaining -= 16, name += 16) {
+				strtohashbuf(name, remaining, in, 4, issigned);
+				teatransform(buf, in);
+			}
+			hash = buf[0];
+			minor = buf[1];
+			break;
+		default:
+			return false;
+	}
+
+	if (version > DX_HASH_UNSIGNED_DELTA + DX_HASH_TEA)
+		return false;
+
+	hash &= ~1;
+	if (hash == (0x7fffffffu << 1))
+		hash = (0x7fffffffu - 1) << 1;
+
+	*hashp = hash;
+	if (minorp)
+		*minorp = minor;
+
+	return true;
+}
+
+static inline int rwdirblock(ext2fs_t *fs, ext2node_t *node, void *buffer, uintmax_t block, bool write) {
+	return rwbytes(fs, node, buffer, fs->blocksize, block * fs->blocksize, write, true);
+}
+
+static inline bool isdotname(char *name, size_t namelen) {
+	return (namelen == 1 && name[0] == '.') || (namelen == 2 && name[0] == '.' && name[1] == '.');
+}
+
+static inline bool isindexed(ext2fs_t *fs, ext2node_t *node) {
+	return (fs->superblock.optionalfeatures & EXT2_FEATURE_COMPAT_DIR_INDEX) && (node->inode.flags & EXT2_INODE_FLAGS_INDEX);
+}
+
+// adds a new block to the end of the directory
+static int growdir(ext2fs_t *fs, ext2node_t *node, uintmax_t *block) {
+	size_t size = INODE_SIZE(&node->inode);
+	*block = size / fs->blocksize;
+	return resizeinode(fs, node, size + fs->blocksize);
+}
+
+static void dxrelease(dxpath_t *path) {
+	for (int i = 0; i < path->levels; ++i)
+		free(path->frames[i].buffer);
+
+	path->levels = 0;
+}
+
+// hashes name and walks the index down to the leaf that covers it.
+// returns EOPNOTSUPP if the index is in a format that isn't understood
+static int dxprobe(ext2fs_t *fs, ext2node_t *node, char *name, size_t namelen, uint32_t *hashp, dxpath_t *path) {
+	path->levels = 0;
+	int err = 0;
+	uintmax_t dirblocks = INODE_SIZE(&node->inode) / fs->blocksize;
+	uintmax_t block = 0;
+	int levels = 1;
+	uint32_t hash = 0;
+
+	for (int level = 0; level < levels; ++level) {
+		dxframe_t *frame = &path->frames[level];
+		frame->buffer = alloc(fs->blocksize);
+		if (frame->buffer == NULL) {
+			err = ENOMEM;
+			goto error;
+		}
+
+		++path->levels;
+		frame->block = block;
+		err = rwdirblock(fs, node, frame->buffer, block, false);
+		if (err)
+			goto error;
+
+		if (level == 0) {
+			dxrootinfo_t *info = (dxrootinfo_t *)((uintptr_t)frame->buffer + 24);
+			if (info->reservedzero || info->hashversion > DX_HASH_TEA || info->infolength != sizeof(dxrootinfo_t) || info->indirectlevels >= DX_MAXLEVELS) {
+				err = EOPNOTSUPP;
+				goto error;
+			}
+
+			levels = info->indirectlevels + 1;
+			path->hashversion = info->hashversion;
+			if (path->hashversion <= DX_HASH_TEA && (fs->superblock.flags & EXT2_FLAGS_UNSIGNED_HASH))
+				path->hashversion += DX_HASH_UNSIGNED_DELTA;
+
+			if (dxhash(fs, path->hashversion, name, namelen, &hash, NULL) == false) {
+				err = EOPNOTSUPP;
+				goto error;
+			}
+
+			frame->entries = (dxentry_t *)((uintptr_t)frame->buffer + DX_ROOT_ENTRIES_OFFSET(info));
+		} else {
+			frame->entries = (dxentry_t *)((uintptr_t)frame->buffer + DX_NODE_ENTRIES_OFFSET);
+		}
+
+		dxcountlimit_t *countlimit = DX_COUNTLIMIT(frame->entries);
+		size_t maxlimit = (fs->blocksize - ((uintptr_t)frame->entries - (uintptr_t)frame->buffer)) / sizeof(dxentry_t);
+		if (countlimit->count == 0 || countlimit->count > countlimit->limit || countlimit->limit > maxlimit) {
+			err = EOPNOTSUPP;
+			goto error;
+		}
+
+		// last entry with a hash <= the one being looked for, the first entry covers everything below the second
+		int low = 1;
+		int high = countlimit->count - 1;
+		while (low <= high) {
+			int middle = (low + high) / 2;
+			if (frame->entries[middle].hash > hash)
+				high = middle - 1;
+			else
+				low = middle + 1;
+		}
+
+		frame->at = low - 1;
+		block = frame->entries[frame->at].block;
+		if (block >= dirblocks || block == 0) {
+			err = EOPNOTSUPP;
+			goto error;
+		}
+	}
+
+	*hashp = hash;
+	return 0;
+
+	error:
+	dxrelease(path);
+	return err;
+}
+
+static inline uintmax_t dxleaf(dxpath_t *path) {
+	dxframe_t *frame = &path->frames[path->levels - 1];
+	return frame->entries[frame->at].block;
+}
+
+// moves the path to the next leaf if it continues the range of hash (hash collisions spanning multiple blocks)
+static int dxnext(ext2fs_t *fs, ext2node_t *node, dxpath_t *path, uint32_t hash, bool *more) {
+	*more = false;
+	int level = path->levels - 1;
+	while (level >= 0 && path->frames[level].at + 1 >= DX_COUNTLIMIT(path->frames[level].entries)->count)
+		--level;
+
+	if (level < 0)
+		return 0;
+
+	dxframe_t *frame = &path->frames[level];
+	frame->at += 1;
+	if ((frame->entries[frame->at].hash & ~1) != hash)
+		return 0;
+
+	for (++level; level < path->levels; ++level) {
+		dxframe_t *upper = &path->frames[level - 1];
+		frame = &path->frames[level];
+		frame->block = upper->entries[upper->at].block;
+		int err = rwdirblock(fs, node, frame->buffer, frame->block, false);
+		if (err)
+			return err;
+
+		frame->entries = (dxentry_t *)((uintptr_t)frame->buffer + DX_NODE_ENTRIES_OFFSET);
+		frame->at = 0;
+	}
+
+	*more = true;
+	return 0;
+}
+
+// looks for a name in a single directory block.
+// returns the offset of its dirent in the block or -1, and the offset of the one before it in prevp (-1 if first)
+static intmax_t searchblock(ext2fs_t *fs, void *buffer, char *name, size_t namelen, intmax_t *prevp) {
+	uintmax_t offset = 0;
+	intmax_t prev = -1;
+
+	while (offset < fs->blocksize) {
+		ext2dent_t *dent = (ext2dent_t *)((uintptr_t)buffer + offset);
+		__assert(dent->size);
+
+		if (namelen == dent->namelen && dent->inode && strncmp(name, dent->name, dent->namelen) == 0) {
+			if (prevp)
+				*prevp = prev;
+			return offset;
+		}
+
+		prev = offset;
+		offset += dent->size;
+	}
+
+	return -1;
+}
+
+// finds the dirent of a name and leaves the block it is in in buffer
+static int finddent(ext2fs_t *fs, ext2node_t *node, char *name, void *buffer, uintmax_t *blockp, uintmax_t *offsetp, intmax_t *prevp) {
+	size_t namelen = strlen(name);
+	int err;
+
+	if (isindexed(fs, node) && isdotname(name, namelen) == false) {
+		dxpath_t path;
+		uint32_t hash;
+		err = dxprobe(fs, node, name, namelen, &hash, &path);
+		if (err == 0) {
+			bool more = true;
+			while (more) {
+				uintmax_t block = dxleaf(&path);
+				err = rwdirblock(fs, node, buffer, block, false);
+				if (err)
+					break;
+
+				intmax_t offset = searchblock(fs, buffer, name, namelen, prevp);
+				if (offset >= 0) {
+					*blockp = block;
+					*offsetp = offset;
+					dxrelease(&path);
+					return 0;
+				}
+
+				err = dxnext(fs, node, &path, hash, &more);
+				if (err)
+					break;
+			}
+
+			dxrelease(&path);
+			return err ? err : ENOENT;
+		}
+
+		if (err != EOPNOTSUPP)
+			return err;
+
+		// unknown index format, fall back to a linear search
+	}
+
+	uintmax_t blockcount = INODE_SIZE(&node->inode) / fs->blocksize;
+	for (uintmax_t block = 0; block < blockcount; ++block) {
+		err = rwdirblock(fs, node, buffer, block, false);
+		if (err)
+			return err;
+
+		intmax_t offset = searchblock(fs, buffer, name, namelen, prevp);
+		if (offset >= 0) {
+			*blockp = block;
+			*offsetp = offset;
+			return 0;
+		}
+	}
+
+	return ENOENT;
+}
 
 static int findindir(ext2fs_t *fs, ext2node_t *node, char *name, int *inode, ext2node_t *switchnode) {
-	// XXX loading the whole dir into memory at once isn't the best idea but works for now
-	void *dirbuffer = vmm_map(NULL, INODE_SIZE(&node->inode) + 1, VMM_FLAGS_ALLOCATE, BUFFER_MAP_FLAGS, NULL); // + 1 to make sure there is at least one page mapped
-	if (dirbuffer == NULL)
+	void *buffer = alloc(fs->blocksize);
+	if (buffer == NULL)
 		return ENOMEM;
 
-	int err = rwbytes(fs, node, dirbuffer, INODE_SIZE(&node->inode), 0, false, true);
+	uintmax_t block, offset;
+	int err = finddent(fs, node, name, buffer, &block, &offset, NULL);
 	if (err)
 		goto cleanup;
 
+	ext2dent_t *dent = (ext2dent_t *)((uintptr_t)buffer + offset);
+	*inode = dent->inode;
+	if (switchnode) {
+		dent->inode = switchnode->id;
+		dent->type = vfstoext2denttypetable[switchnode->vnode.type];
+		err = rwbytes(fs, node, dent, dent->size, block * fs->blocksize + offset, true, true);
+	}
+
+	cleanup:
+	free(buffer);
+	return err;
+}
+
+// puts a dirent in the free space of a block, returns false if there was no space for it
+static bool addtoblock(ext2fs_t *fs, void *buffer, ext2dent_t *newdent, size_t entlen) {
 	uintmax_t offset = 0;
-	int inodefound = 0;
+	while (offset < fs->blocksize) {
+		ext2dent_t *dent = (ext2dent_t *)((uintptr_t)buffer + offset);
+		size_t truesize = dent->inode == 0 ? 0 : ROUND_UP(sizeof(ext2dent_t) + dent->namelen, 4);
+		size_t freesize = dent->size - truesize;
+
+		if (entlen <= freesize) {
+			dent->size = truesize;
+			newdent->size = freesize;
+			memcpy((void *)((uintptr_t)dent + truesize), newdent, entlen);
+			return true;
+		}
+
+		__assert(dent->size);
+		offset += dent->size;
+	}
+
+	return false;
+}
+
+typedef struct {
+	uint32_t hash;
+	uint32_t minor;
+	uint16_t offset;
+	uint16_t size;
+} dxmap_t;
+
+// packs the dirents in map into buffer, the last one taking up the rest of the block
+static void packdents(ext2fs_t *fs, void *from, dxmap_t *map, size_t count, void *buffer) {
+	uintmax_t offset = 0;
+	ext2dent_t *last = NULL;
+
+	for (size_t i = 0; i < count; ++i) {
+		last = (ext2dent_t *)((uintptr_t)buffer + offset);
+		memcpy(last, (void *)((uintptr_t)from + map[i].offset), map[i].size);
+		last->size = map[i].size;
+		offset += map[i].size;
+	}
+
+	if (last) {
+		last->size += fs->blocksize - offset;
+	} else {
+		last = buffer;
+		last->inode = 0;
+		last->size = fs->blocksize;
+		last->namelen = 0;
+		last->type = 0;
+	}
+}
+
+// inserts an entry at position at, the caller makes sure there is room for it
+static void dxaddentry(dxentry_t *entries, int at, uint32_t hash, uint32_t block) {
+	dxcountlimit_t *countlimit = DX_COUNTLIMIT(entries);
+	for (int i = countlimit->count; i > at; --i)
+		entries[i] = entries[i - 1];
+
+	countlimit->count += 1;
+	entries[at].hash = hash;
+	entries[at].block = block;
+}
+
+// makes sure the bottom index block of the path has room for one more entry, growing or splitting the index if needed
+static int dxmakeroom(ext2fs_t *fs, ext2node_t *node, dxpath_t *path) {
+	dxframe_t *frame = &path->frames[path->levels - 1];
+	dxcountlimit_t *countlimit = DX_COUNTLIMIT(frame->entries);
+	if (countlimit->count < countlimit->limit)
+		return 0;
+
+	dxframe_t *root = &path->frames[0];
+	dxcountlimit_t *rootcountlimit = DX_COUNTLIMIT(root->entries);
+	if (path->levels == DX_MAXLEVELS && rootcountlimit->count == rootcountlimit->limit)
+		return ENOSPC;
+
+	void *newbuffer = alloc(fs->blocksize);
+	if (newbuffer == NULL)
+		return ENOMEM;
+
+	uintmax_t newblock;
+	int err = growdir(fs, node, &newblock);
+	if (err) {
+		free(newbuffer);
+		return err;
+	}
+
+	ext2dent_t *fakedent = newbuffer;
+	fakedent->inode = 0;
+	fakedent->size = fs->blocksize;
+	dxentry_t *newentries = (dxentry_t *)((uintptr_t)newbuffer + DX_NODE_ENTRIES_OFFSET);
+	uint16_t newlimit = (fs->blocksize - DX_NODE_ENTRIES_OFFSET) / sizeof(dxentry_t);
+
+	if (path->levels == 1) {
+		// the root is full, move all of its entries to a new index block below it
+		memcpy(newentries, root->entries, countlimit->count * sizeof(dxentry_t));
+		DX_COUNTLIMIT(newentries)->limit = newlimit;
+		DX_COUNTLIMIT(newentries)->count = countlimit->count;
+
+		countlimit->count = 1;
+		root->entries[0].block = newblock;
+		((dxrootinfo_t *)((uintptr_t)root->buffer + 24))->indirectlevels = 1;
+
+		err = rwdirblock(fs, node, newbuffer, newblock, true);
+		if (err == 0)
+			err = rwdirblock(fs, node, root->buffer, root->block, true);
+
+		path->frames[1] = (dxframe_t){
+			.buffer = newbuffer,
+			.block = newblock,
+			.entries = newentries,
+			.at = root->at
+		};
+		root->at = 0;
+		path->levels = 2;
+		return err;
+	}
+
+	// split the full index block in half and add the new half to the root
+	int half = countlimit->count / 2;
+	int moved = countlimit->count - half;
+	uint32_t splithash = frame->entries[half].hash;
+	memcpy(newentries, &frame->entries[half], moved * sizeof(dxentry_t));
+	DX_COUNTLIMIT(newentries)->limit = newlimit;
+	DX_COUNTLIMIT(newentries)->count = moved;
+	countlimit->count = half;
+
+	dxaddentry(root->entries, root->at + 1, splithash, newblock);
+
+	err = rwdirblock(fs, node, newbuffer, newblock, true);
+	if (err == 0)
+		err = rwdirblock(fs, node, frame->buffer, frame->block, true);
+	if (err == 0)
+		err = rwdirblock(fs, node, root->buffer, root->block, true);
+
+	if (frame->at >= half) {
+		free(frame->buffer);
+		frame->buffer = newbuffer;
+		frame->block = newblock;
+		frame->entries = newentries;
+		frame->at -= half;
+		root->at += 1;
+	} else {
+		free(newbuffer);
+	}
+
+	return err;
+}
+
+// inserts a dirent into an indexed directory, splitting the leaf it goes into if it is full
+static int dxinsert(ext2fs_t *fs, ext2node_t *node, char *name, ext2dent_t *newdent, size_t entlen) {
 	size_t namelen = strlen(name);
+	dxpath_t path;
+	uint32_t hash;
 
-	// iterate through directory to find the inode number
-	while (offset < INODE_SIZE(&node->inode)) {
-		ext2dent_t *dent = (ext2dent_t *)((uintptr_t)dirbuffer + offset);
+	int err = dxprobe(fs, node, name, namelen, &hash, &path);
+	if (err)
+		return err;
 
-		if (namelen == dent->namelen && dent->inode && strncmp(name, dent->name, dent->namelen) == 0) {
-			inodefound = dent->inode;
-			if (switchnode) {
-				dent->inode = switchnode->id;
-				dent->type = vfstoext2denttypetable[switchnode->vnode.type];
-				err = rwbytes(fs, node, dent, dent->size, offset, true, true);
-			}
-			break;
-		}
+	void *leafbuffer = alloc(fs->blocksize);
+	void *oldbuffer = alloc(fs->blocksize);
+	void *newbuffer = alloc(fs->blocksize);
+	dxmap_t *map = alloc(sizeof(dxmap_t) * (fs->blocksize / (sizeof(ext2dent_t) + 4)));
+	if (leafbuffer == NULL || oldbuffer == NULL || newbuffer == NULL || map == NULL) {
+		err = ENOMEM;
+		goto cleanup;
+	}
 
+	uintmax_t leafblock = dxleaf(&path);
+	err = rwdirblock(fs, node, leafbuffer, leafblock, false);
+	if (err)
+		goto cleanup;
+
+	if (addtoblock(fs, leafbuffer, newdent, entlen)) {
+		err = rwdirblock(fs, node, leafbuffer, leafblock, true);
+		goto cleanup;
+	}
+
+	// the leaf is full and has to be split, first make sure the index can take the new block
+	err = dxmakeroom(fs, node, &path);
+	if (err)
+		goto cleanup;
+
+	size_t count = 0;
+	size_t totalsize = 0;
+	for (uintmax_t offset = 0; offset < fs->blocksize;) {
+		ext2dent_t *dent = (ext2dent_t *)((uintptr_t)leafbuffer + offset);
 		__assert(dent->size);
+		if (dent->inode) {
+			map[count].offset = offset;
+			map[count].size = ROUND_UP(sizeof(ext2dent_t) + dent->namelen, 4);
+			dxhash(fs, path.hashversion, dent->name, dent->namelen, &map[count].hash, &map[count].minor);
+			totalsize += map[count].size;
+			++count;
+		}
 		offset += dent->size;
 	}
 
-	if (inodefound == 0)
-		err = ENOENT;
-	else
-		*inode = inodefound;
+	if (count < 2) {
+		err = ENOSPC;
+		goto cleanup;
+	}
+
+	// sort by hash
+	for (size_t i = 1; i < count; ++i) {
+		dxmap_t tmp = map[i];
+		size_t j = i;
+		for (; j > 0 && (map[j - 1].hash > tmp.hash || (map[j - 1].hash == tmp.hash && map[j - 1].minor > tmp.minor)); --j)
+			map[j] = map[j - 1];
+		map[j] = tmp;
+	}
+
+	// move the upper half (by size) to the new block
+	size_t split = count;
+	size_t movedsize = 0;
+	while (split > 1 && movedsize < totalsize / 2) {
+		--split;
+		movedsize += map[split].size;
+	}
+
+	uint32_t splithash = map[split].hash;
+	// if the hashes at the split are equal, the lookup for it has to go on to the new block
+	if (splithash == map[split - 1].hash)
+		splithash |= 1;
+
+	uintmax_t newblock;
+	err = growdir(fs, node, &newblock);
+	if (err)
+		goto cleanup;
+
+	packdents(fs, leafbuffer, map, split, oldbuffer);
+	packdents(fs, leafbuffer, &map[split], count - split, newbuffer);
+
+	dxframe_t *frame = &path.frames[path.levels - 1];
+	dxaddentry(frame->entries, frame->at + 1, splithash, newblock);
+
+	void *target = hash >= splithash ? newbuffer : oldbuffer;
+	if (addtoblock(fs, target, newdent, entlen) == false) {
+		ASSERT_UNCLEAN(fs, !"no space for dirent after leaf split");
+		err = ENOSPC;
+	}
+
+	int e = rwdirblock(fs, node, newbuffer, newblock, true);
+	if (e == 0)
+		e = rwdirblock(fs, node, oldbuffer, leafblock, true);
+	if (e == 0)
+		e = rwdirblock(fs, node, frame->buffer, frame->block, true);
+
+	if (e)
+		err = e;
 
 	cleanup:
-	if (dirbuffer)
-		vmm_unmap(dirbuffer, INODE_SIZE(&node->inode) + 1, 0);
+	dxrelease(&path);
+	free(leafbuffer);
+	free(oldbuffer);
+	free(newbuffer);
+	free(map);
+	return err;
+}
+
+// turns a full single block directory into an indexed one.
+// everything but "." and ".." is moved to a new leaf block and the first block becomes the index root
+static int makeindexed(ext2fs_t *fs, ext2node_t *node, void *buffer) {
+	ext2dent_t *dot = buffer;
+	if (dot->size != 12 || dot->namelen != 1 || dot->name[0] != '.')
+		return EOPNOTSUPP;
+
+	ext2dent_t *dotdot = (ext2dent_t *)((uintptr_t)buffer + 12);
+	if (dotdot->namelen != 2 || dotdot->name[0] != '.' || dotdot->name[1] != '.' || 12 + dotdot->size > fs->blocksize)
+		return EOPNOTSUPP;
+
+	int version = fs->superblock.defhashversion;
+	if (version > DX_HASH_TEA)
+		version = DX_HASH_HALF_MD4;
+
+	void *leafbuffer = alloc(fs->blocksize);
+	dxmap_t *map = alloc(sizeof(dxmap_t) * (fs->blocksize / (sizeof(ext2dent_t) + 4)));
+	int err = 0;
+	if (leafbuffer == NULL || map == NULL) {
+		err = ENOMEM;
+		goto cleanup;
+	}
+
+	size_t count = 0;
+	for (uintmax_t offset = 12 + dotdot->size; offset < fs->blocksize;) {
+		ext2dent_t *dent = (ext2dent_t *)((uintptr_t)buffer + offset);
+		__assert(dent->size);
+		if (dent->inode) {
+			map[count].offset = offset;
+			map[count].size = ROUND_UP(sizeof(ext2dent_t) + dent->namelen, 4);
+			++count;
+		}
+		offset += dent->size;
+	}
+
+	uintmax_t leafblock;
+	err = growdir(fs, node, &leafblock);
+	if (err)
+		goto cleanup;
 
+	packdents(fs, buffer, map, count, leafbuffer);
+	err = rwdirblock(fs, node, leafbuffer, leafblock, true);
+	if (err)
+		goto cleanup;
+
+	dotdot->size = fs->blocksize - 12;
+	memset((void *)((uintptr_t)buffer + 24), 0, fs->blocksize - 24);
+	dxrootinfo_t *info = (dxrootinfo_t *)((uintptr_t)buffer + 24);
+	info->hashversion = version;
+	info->infolength = sizeof(dxrootinfo_t);
+	dxentry_t *entries = (dxentry_t *)((uintptr_t)buffer + DX_ROOT_ENTRIES_OFFSET(info));
+	DX_COUNTLIMIT(entries)->limit = (fs->blocksize - DX_ROOT_ENTRIES_OFFSET(info)) / sizeof(dxentry_t);
+	DX_COUNTLIMIT(entries)->count = 1;
+	entries[0].block = leafblock;
+
+	err = rwdirblock(fs, node, buffer, 0, true);
+	if (err)
+		goto cleanup;
+
+	node->inode.flags |= EXT2_INODE_FLAGS_INDEX;
+	err = writeinode(fs, &node->inode, node->id);
+
+	cleanup:
+	free(leafbuffer);
+	free(map);
 	return err;
 }
 
@@ -926,115 +2332,96 @@ static int insertdent(ext2fs_t *fs, ext2node_t *node, char *name, int inode, int
 	size_t namelen = strlen(name);
 	size_t entlen = ROUND_UP(sizeof(ext2dent_t) + namelen, 4);
 	ext2dent_t *dentbuffer = alloc(entlen);
-	if (dentbuffer == NULL)
-		return ENOMEM;
+	void *buffer = alloc(fs->blocksize);
+	int err = 0;
+	if (dentbuffer == NULL || buffer == NULL) {
+		err = ENOMEM;
+		goto cleanup;
+	}
 
 	dentbuffer->inode = inode;
 	dentbuffer->namelen = namelen;
 	dentbuffer->type = type;
 	memcpy(dentbuffer->name, name, namelen);
 
-	size_t inodesize = INODE_SIZE(&node->inode);
-	// XXX loading the whole dir into memory isn't the best idea
-	void *dirbuffer = vmm_map(NULL, inodesize + 1, VMM_FLAGS_ALLOCATE, BUFFER_MAP_FLAGS, NULL); // + 1 to make sure there is at least one page mapped
-	int err = dirbuffer ? 0 : ENOMEM;
-	if (err)
-		goto cleanup;
-
-	err = rwbytes(fs, node, dirbuffer, inodesize, 0, false, true);
-	if (err)
-		goto cleanup;
+	if (isindexed(fs, node)) {
+		err = dxinsert(fs, node, name, dentbuffer, entlen);
+		if (err != EOPNOTSUPP)
+			goto cleanup;
 
-	ext2dent_t *splitdent = NULL;
-	uintmax_t offset = 0;
-	size_t truesize, freesize;
-	while (offset < inodesize) {
-		splitdent = (ext2dent_t *)((uintptr_t)dirbuffer + offset);
-		truesize = splitdent->inode == 0 ? 0 : ROUND_UP(sizeof(ext2dent_t) + splitdent->namelen, 4);
-		freesize = splitdent->size - truesize;
+		// the index can't be maintained, so stop using it. e2fsck can rebuild it
+		node->inode.flags &= ~EXT2_INODE_FLAGS_INDEX;
+		err = writeinode(fs, &node->inode, node->id);
+		if (err)
+			goto cleanup;
+	}
 
-		if (entlen <= freesize)
-			break;
+	uintmax_t blockcount = INODE_SIZE(&node->inode) / fs->blocksize;
+	for (uintmax_t block = 0; block < blockcount; ++block) {
+		err = rwdirblock(fs, node, buffer, block, false);
+		if (err)
+			goto cleanup;
 
-		__assert(splitdent->size);
-		offset += splitdent->size;
+		if (addtoblock(fs, buffer, dentbuffer, entlen)) {
+			err = rwdirblock(fs, node, buffer, block, true);
+			goto cleanup;
+		}
 	}
 
-	// need to grow dir?
-	if (offset >= inodesize) {
-		err = resizeinode(fs, node, inodesize + fs->blocksize); // directory size has to be block aligned
-		if (err)
+	// a single full block, index the directory instead of growing it linearly
+	if (blockcount == 1 && (fs->superblock.optionalfeatures & EXT2_FEATURE_COMPAT_DIR_INDEX) && isdotname(name, namelen) == false) {
+		err = makeindexed(fs, node, buffer);
+		if (err == 0) {
+			err = dxinsert(fs, node, name, dentbuffer, entlen);
 			goto cleanup;
+		}
 
-		dentbuffer->size = fs->blocksize;
-		err = rwbytes(fs, node, dentbuffer, entlen, inodesize, true, true);
-		ASSERT_UNCLEAN(fs, err == 0);
-	} else {
-		size_t writesize = splitdent->size;
-		splitdent->size = truesize;
-		dentbuffer->size = freesize;
-		memcpy((void *)((uintptr_t)splitdent + truesize), dentbuffer, entlen);
-		err = rwbytes(fs, node, splitdent, writesize, offset, true, true);
+		if (err != EOPNOTSUPP)
+			goto cleanup;
 	}
 
+	// need to grow dir
+	uintmax_t newblock;
+	err = growdir(fs, node, &newblock);
+	if (err)
+		goto cleanup;
+
+	dentbuffer->size = fs->blocksize;
+	err = rwbytes(fs, node, dentbuffer, entlen, newblock * fs->blocksize, true, true);
+	ASSERT_UNCLEAN(fs, err == 0);
+
 	cleanup:
-	if (dirbuffer)
-		vmm_unmap(dirbuffer, inodesize + 1, 0);
+	free(buffer);
 	free(dentbuffer);
 	return err;
 }
 
 static int removedent(ext2fs_t *fs, ext2node_t *node, char *name, int *inode) {
-	// XXX loading the whole dir into memory at once isn't the best idea but works for now
-	void *dirbuffer = vmm_map(NULL, INODE_SIZE(&node->inode) + 1, VMM_FLAGS_ALLOCATE, BUFFER_MAP_FLAGS, NULL); // + 1 to make sure there is at least one page mapped
-	if (dirbuffer == NULL)
+	void *buffer = alloc(fs->blocksize);
+	if (buffer == NULL)
 		return ENOMEM;
 
-	int err = rwbytes(fs, node, dirbuffer, INODE_SIZE(&node->inode), 0, false, true);
+	uintmax_t block, offset;
+	intmax_t prev;
+	int err = finddent(fs, node, name, buffer, &block, &offset, &prev);
 	if (err)
 		goto cleanup;
 
-	uintmax_t offset = 0;
-	int inodefound = 0;
-	size_t namelen = strlen(name);
-	uintmax_t lastsize = 0;
-	ext2dent_t *dent = NULL;
-
-	// iterate through directory to find the inode number and dent offset
-	while (offset < INODE_SIZE(&node->inode)) {
-		dent = (ext2dent_t *)((uintptr_t)dirbuffer + offset);
-
-		if (namelen == dent->namelen && dent->inode && strncmp(name, dent->name, dent->namelen) == 0) {
-			inodefound = dent->inode;
-			break;
-		}
-
-		__assert(dent->size);
-		lastsize = dent->size;
-		offset += dent->size;
-	}
-
-	if (inodefound == 0) {
-		err = ENOENT;
-		goto cleanup;
-	}
-
-	*inode = inodefound;
-	ext2dent_t *lastdent = (ext2dent_t *)((uintptr_t)dent - lastsize);
+	ext2dent_t *dent = (ext2dent_t *)((uintptr_t)buffer + offset);
+	*inode = dent->inode;
 
-	if (offset % fs->blocksize) { // can expand last dent size?
+	if (prev >= 0) { // can expand last dent size?
+		ext2dent_t *lastdent = (ext2dent_t *)((uintptr_t)buffer + prev);
 		lastdent->size += dent->size;
-		err = rwbytes(fs, node, lastdent, lastdent->size, offset - lastsize, true, true);
+		err = rwbytes(fs, node, lastdent, lastdent->size, block * fs->blocksize + prev, true, true);
 	} else { // nope, set current as unused
 		dent->inode = 0;
 		dent->name[0] = '\0';
-		err = rwbytes(fs, node, dent, dent->size, offset, true, true);
+		err = rwbytes(fs, node, dent, dent->size, block * fs->blocksize + offset, true, true);
 	}
 
 	cleanup:
-	if (dirbuffer)
-		vmm_unmap(dirbuffer, INODE_SIZE(&node->inode) + 1, 0);
-
+	free(buffer);
 	return err;
 }
 
@@ -1176,7 +2563,11 @@ static int ext2_setattr(vnode_t *vnode, vattr_t *attr, int which, cred_t *cred)
 		node->inode.ctime = attr->ctime.s;
 	if (which & V_ATTR_ATIME)
 		node->inode.atime = attr->atime.s;
-	int e = writeinode((ext2fs_t *)vnode->vfs, &node->inode, node->id);
+
+	ext2fs_t *fs = (ext2fs_t *)vnode->vfs;
+	JOURNAL_START(fs);
+	int e = writeinode(fs, &node->inode, node->id);
+	JOURNAL_STOP(fs);
 	return e;
 }
 
@@ -1190,41 +2581,30 @@ static int ext2_lookup(vnode_t *vnode, char *name, vnode_t **result, cred_t *cre
 		goto cleanup;
 
 	MUTEX_ACQUIRE(&fs->inodetablelock, false);
-
-	void *tablev;
-	// check if it isn't already in the inode table
-	err = hashtable_get(&fs->inodetable, &tablev, &inode, sizeof(inode));
-	if (err == ENOENT) {
-		// it isn't, allocate new and read inode information
+	newnode = tableget(fs, inode);
+	if (newnode == NULL) {
+		// not in memory, allocate new and read inode information
 		newnode = slab_allocate(nodecache);
-		if (newnode == NULL) {
+		if (newnode == NULL)
 			err = ENOMEM;
-			MUTEX_RELEASE(&fs->inodetablelock);
-			goto cleanup;
-		}
-	
-		err = readinode(fs, &newnode->inode, inode);
-		if (err)
-			goto cleanup;
 
-		EXT2NODE_INIT(newnode, &vnops, 0, ext2tovfstypetable[INODE_TYPEPERM_TYPE(newnode->inode.typeperm)], vnode->vfs, inode);
+		if (err == 0)
+			err = readinode(fs, &newnode->inode, inode);
 
-		// finally add it to the inode table
-		err = hashtable_set(&fs->inodetable, newnode, &inode, sizeof(inode), true);
-		if (err)
-			goto cleanup;
+		if (err == 0) {
+			EXT2NODE_INIT(newnode, &vnops, 0, ext2tovfstypetable[INODE_TYPEPERM_TYPE(newnode->inode.typeperm)], vnode->vfs, inode);
+			// finally add it to the inode table
+			err = hashtable_set(&fs->inodetable, newnode, &inode, sizeof(inode), true);
+		}
 
-		VOP_HOLD(&newnode->vnode);
-	} else if (err) {
-		MUTEX_RELEASE(&fs->inodetablelock);
-		goto cleanup;
-	} else {
-		// it is, use the vnode from the table
-		newnode = tablev;
-		VOP_HOLD(&newnode->vnode);
+		if (err && newnode) {
+			slab_free(nodecache, newnode);
+			newnode = NULL;
+		}
 	}
-
 	MUTEX_RELEASE(&fs->inodetablelock);
+	if (err)
+		goto cleanup;
 
 	// VOP_LOOKUP is required to unlock the parent vnode
 	// if the name is ".."
@@ -1237,14 +2617,11 @@ static int ext2_lookup(vnode_t *vnode, char *name, vnode_t **result, cred_t *cre
 		VOP_LOCK(*result);
 
 	cleanup:
-	if (err && newnode) {
-		vnode_t *tmp = (vnode_t *)newnode;
-		VOP_RELEASE(tmp);
-		MUTEX_RELEASE(&fs->inodetablelock);
-	}
 	return err;
 }
 
+// offset is the byte offset of a dirent in the directory, and the d_off of every returned entry is the offset
+// of the one after it, so listing can be resumed from any of them without reading the blocks before it
 static int ext2_getdents(vnode_t *vnode, dent_t *buffer, size_t count, uintmax_t diroffset, size_t *readcount) {
 	ext2node_t *node = (ext2node_t *)vnode;
 	ext2fs_t *fs = (ext2fs_t *)node->vnode.vfs;
@@ -1252,45 +2629,46 @@ static int ext2_getdents(vnode_t *vnode, dent_t *buffer, size_t count, uintmax_t
 	if (vnode->type != V_TYPE_DIR)
 		return ENOTDIR;
 
-	int err = 0;
-	// XXX loading the whole dir into memory at once isn't the best idea but works for now
-	void *dirbuffer = vmm_map(NULL, INODE_SIZE(&node->inode) + 1, VMM_FLAGS_ALLOCATE, BUFFER_MAP_FLAGS, NULL); // + 1 to make sure there is at least one page mapped
-	if (dirbuffer == NULL) {
-		err = ENOMEM;
-		goto cleanup;
-	}
+	*readcount = 0;
+	size_t dirsize = INODE_SIZE(&node->inode);
+	if (diroffset >= dirsize)
+		return 0;
 
-	err = rwbytes(fs, node, dirbuffer, INODE_SIZE(&node->inode), 0, false, true);
-	if (err)
-		goto cleanup;
+	void *blockbuffer = alloc(fs->blocksize);
+	if (blockbuffer == NULL)
+		return ENOMEM;
 
-	uintmax_t currdiroffset = 0;
-	uintmax_t offset = 0;
+	int err = 0;
 	int i = 0;
+	for (uintmax_t block = diroffset / fs->blocksize; block < dirsize / fs->blocksize && i < count; ++block) {
+		err = rwdirblock(fs, node, blockbuffer, block, false);
+		if (err)
+			break;
 
-	// iterate through directory and build dent entries
-	while (offset < INODE_SIZE(&node->inode) && i < count) {
-		ext2dent_t *dent = (ext2dent_t *)((uintptr_t)dirbuffer + offset);
+		// the offset might not be at the start of a dirent if the directory changed since it was returned,
+		// so the block is walked from the start and everything before it is skipped
+		uintmax_t offset = 0;
+		while (offset < fs->blocksize && i < count) {
+			ext2dent_t *dent = (ext2dent_t *)((uintptr_t)blockbuffer + offset);
+			__assert(dent->size);
+
+			uintmax_t position = block * fs->blocksize + offset;
+			offset += dent->size;
+			if (dent->inode == 0 || position < diroffset)
+				continue;
 
-		if (dent->inode && currdiroffset++ >= diroffset) {
 			buffer[i].d_ino = dent->inode;
-			buffer[i].d_off = offset;
+			buffer[i].d_off = block * fs->blocksize + offset;
 			buffer[i].d_reclen = sizeof(dent_t);
 			buffer[i].d_type = vfs_getposixtype(ext2denttovfstypetable[dent->type]);
 			memcpy(buffer[i].d_name, dent->name, dent->namelen);
 			buffer[i].d_name[dent->namelen] = '\0';
 			i += 1;
 		}
-
-		offset += dent->size;
 	}
 
 	*readcount = i;
-
-	cleanup:
-	if (dirbuffer)
-		vmm_unmap(dirbuffer, INODE_SIZE(&node->inode) + 1, 0);
-
+	free(blockbuffer);
 	return err;
 }
 
@@ -1393,7 +2771,10 @@ int ext2_write(vnode_t *vnode, iovec_iterator_t *iovec_iterator, size_t size, ui
 		size = min(endoffset, inodesize) - offset;
 	}
 
+	// the data goes out before the handle is stopped, so it is on disk before the blocks it got are committed
+	JOURNAL_START(fs);
 	err = rwbytes_iovec(fs, node, iovec_iterator, size, offset, true, false);
+	JOURNAL_STOP(fs);
 	*writec = err ? -1 : size;
 	if (err)
 		goto cleanup;
@@ -1418,7 +2799,9 @@ int ext2_resize(vnode_t *vnode, size_t newsize, cred_t *cred) {
 	size_t size = INODE_SIZE(&node->inode);
 	int e = 0;
 	if (size != newsize) {
+		JOURNAL_START(fs);
 		e = resizeinode(fs, node, newsize);
+		JOURNAL_STOP(fs);
 		if (size > newsize)
 			vmmcache_truncate(vnode, newsize);
 	}
@@ -1438,11 +2821,6 @@ static int linkinternal(ext2fs_t *fs, ext2node_t *dirnode, ext2node_t *node, cha
 	if (err)
 		return err;
 
-	// if the node is in memory without any filesystem links,
-	// undo the release done by ext2_unlink
-	if (node->inode.links == 0)
-		VOP_HOLD(&node->vnode);
-
 	node->inode.links += 1;
 
 	ASSERT_UNCLEAN(fs, writeinode(fs, &node->inode, node->id) == 0);
@@ -1456,7 +2834,9 @@ static int ext2_link(vnode_t *vnode, vnode_t *dirvnode, char *name, cred_t *cred
 	ext2node_t *node = (ext2node_t *)vnode;
 	ext2node_t *dirnode = (ext2node_t *)dirvnode;
 	ext2fs_t *fs = (ext2fs_t *)dirvnode->vfs;
+	JOURNAL_START(fs);
 	int err = linkinternal(fs, dirnode, node, name);
+	JOURNAL_STOP(fs);
 	return err;
 }
 
@@ -1508,7 +2888,6 @@ static int internalcreate(vnode_t *parent, char *name, vattr_t *attr, int type,
 	if (err)
 		goto cleanup;
 
-	VOP_HOLD(&newnode->vnode);
 	*result = &newnode->vnode;
 
 	// create . and .. entries and increase block group dir count if dir
@@ -1534,11 +2913,14 @@ static int internalcreate(vnode_t *parent, char *name, vattr_t *attr, int type,
 }
 
 static int ext2_create(vnode_t *parent, char *name, vattr_t *attr, int type, vnode_t **result, cred_t *cred) {
+	ext2fs_t *fs = (ext2fs_t *)parent->vfs;
+	JOURNAL_START(fs);
 	int err = internalcreate(parent, name, attr, type, result, cred);
+	JOURNAL_STOP(fs);
 	return err;
 }
 
-static int ext2_symlink(vnode_t *vnode, char *name, vattr_t *attr, char *path, cred_t *cred) {
+static int internalsymlink(vnode_t *vnode, char *name, vattr_t *attr, char *path, cred_t *cred) {
 	ext2fs_t *fs = (ext2fs_t *)vnode->vfs;
 	size_t linklen = strlen(path);
 
@@ -1566,15 +2948,20 @@ static int ext2_symlink(vnode_t *vnode, char *name, vattr_t *attr, char *path, c
 	INODE_SETSIZE(&newnode->inode, linklen);
 	err = writeinode(fs, &newnode->inode, newnode->id);
 
-	VOP_RELEASE(newvnode);
-
 	cleanup:
-	if (err) {
+	if (err)
 		ASSERT_UNCLEAN(fs, VOP_UNLINK(vnode, newvnode, name, cred) == 0);
-	} else {
-		VOP_UNLOCK(newvnode); // locked by internalcreate
-	}
 
+	VOP_UNLOCK(newvnode); // locked by internalcreate
+	VOP_RELEASE(newvnode);
+	return err;
+}
+
+static int ext2_symlink(vnode_t *vnode, char *name, vattr_t *attr, char *path, cred_t *cred) {
+	ext2fs_t *fs = (ext2fs_t *)vnode->vfs;
+	JOURNAL_START(fs);
+	int err = internalsymlink(vnode, name, attr, path, cred);
+	JOURNAL_STOP(fs);
 	return err;
 }
 
@@ -1590,10 +2977,10 @@ static int ext2_munmap(vnode_t *node, void *addr, uintmax_t offset, int flags, c
 
 static int handleinodeunlink(ext2fs_t *fs, ext2node_t *node, int inode, ext2node_t *known) {
 	bool isdir = false;
-	void *v;
+	int err = 0;
 	MUTEX_ACQUIRE(&fs->inodetablelock, false);
-	int err = hashtable_get(&fs->inodetable, &v, &inode, sizeof(inode));
-	if (err == ENOENT) {
+	ext2node_t *unlinknode = tableget(fs, inode);
+	if (unlinknode == NULL) {
 		__assert(known == NULL);
 		inode_t buff;
 		err = readinode(fs, &buff, inode);
@@ -1612,12 +2999,7 @@ static int handleinodeunlink(ext2fs_t *fs, ext2node_t *node, int inode, ext2node
 			ASSERT_UNCLEAN(fs, err == 0);
 		}
 		MUTEX_RELEASE(&fs->inodetablelock);
-	} else if (err) {
-		ASSERT_UNCLEAN(fs, !"Failed to get from inode table");
-		MUTEX_RELEASE(&fs->inodetablelock);
-		return err;
 	} else {
-		ext2node_t *unlinknode = v;
 		MUTEX_RELEASE(&fs->inodetablelock);
 
 		if (known) {
@@ -1632,18 +3014,15 @@ static int handleinodeunlink(ext2fs_t *fs, ext2node_t *node, int inode, ext2node
 			unlinknode->inode.links -= 1;
 		}
 
-		int nlinks = --unlinknode->inode.links;
+		--unlinknode->inode.links;
 		err = writeinode(fs, &unlinknode->inode, unlinknode->id);
 		ASSERT_UNCLEAN(fs, err == 0);
 		if (known == NULL)
 			VOP_UNLOCK(&unlinknode->vnode);
 
-		if (nlinks == 0) {
-			vnode_t *unlinkvnode = v;
-			// do an operation to remove from memory and inode table if theres no more refcounts nor links.
-			// this will also unallocate the inode and blocks
-			VOP_RELEASE(unlinkvnode);
-		}
+		// if this was the last link and reference, ext2_inactive will free the inode and its blocks
+		vnode_t *unlinkvnode = &unlinknode->vnode;
+		VOP_RELEASE(unlinkvnode);
 	}
 
 	if (isdir) { // account for .. entry in unlinked dir
@@ -1687,12 +3066,12 @@ static int ext2_unlink(vnode_t *vnode, vnode_t *child, char *name, cred_t *cred)
 		free(dents);
 	}
 
+	JOURNAL_START(fs);
 	int inode = 0;
 	int err = removedent(fs, node, name, &inode);
-	if (err)
-		return err;
-
-	err = handleinodeunlink(fs, node, inode, (ext2node_t *)child);
+	if (err == 0)
+		err = handleinodeunlink(fs, node, inode, (ext2node_t *)child);
+	JOURNAL_STOP(fs);
 
 	return err;
 }
@@ -1747,7 +3126,88 @@ static int ext2_putpage(vnode_t *node, uintmax_t offset, struct page_t *page) {
 	return error;
 }
 
-static int ext2_rename(vnode_t *sourcedir, vnode_t *source, char *oldname, vnode_t *targetdir, vnode_t *new, char *newname, int flags) {
+static int bmap(vnode_t *vnode, uintmax_t offset, size_t size, bool allocate, vnode_t **device, uintmax_t *deviceoffset, size_t *contiguous) {
+	ext2node_t *node = (ext2node_t *)vnode;
+	ext2fs_t *fs = (ext2fs_t *)vnode->vfs;
+	uintmax_t index = offset / fs->blocksize;
+	uintmax_t blockoffset = offset % fs->blocksize;
+	size_t blockcount = ROUND_UP(INODE_SIZE(&node->inode), fs->blocksize) / fs->blocksize;
+
+	if (index >= blockcount)
+		return ENXIO;
+
+	blockptr_t block;
+	size_t runcount;
+	int e = getinodeblocks(fs, node, index, &block, &runcount);
+	if (e)
+		return e;
+
+	// for sparse files and delayed allocation
+	if (block == 0 && allocate) {
+		runcount = min(runcount, min(blockcount - index, ROUND_UP(blockoffset + size, fs->blocksize) / fs->blocksize));
+		e = fillhole(fs, node, index, &runcount, &block);
+		if (e)
+			return e;
+
+		// blocks that won't be overwritten completely have to read back as zeroes
+		__assert(fs->blocksize <= UTIL_ZEROBUFFERSIZE);
+		for (size_t i = 0; i < runcount; ++i) {
+			uintmax_t start = i * fs->blocksize;
+			if (start >= blockoffset && start + fs->blocksize <= blockoffset + size)
+				continue;
+
+			size_t writec;
+			e = vfs_write(fs->backing, util_zerobuffer, fs->blocksize, BLOCK_GETDISKOFFSET(fs, block + i), &writec, V_FFLAGS_NOCACHE);
+			if (e)
+				return e;
+		}
+	}
+
+	*device = fs->backing;
+	*deviceoffset = block ? BLOCK_GETDISKOFFSET(fs, block) + blockoffset : 0;
+	*contiguous = min(runcount, blockcount - index) * fs->blocksize - blockoffset;
+
+	// extend the run while the next blocks follow on disk (or are also holes)
+	for (uintmax_t next = index + runcount; *contiguous < size && next < blockcount;) {
+		blockptr_t nextblock;
+		size_t nextcount;
+		e = getinodeblocks(fs, node, next, &nextblock, &nextcount);
+		if (e)
+			return e;
+
+		if (block ? nextblock != block + (next - index) : nextblock != 0)
+			break;
+
+		nextcount = min(nextcount, blockcount - next);
+		*contiguous += nextcount * fs->blocksize;
+		next += nextcount;
+	}
+
+	return 0;
+}
+
+// maps a file offset to a run of contiguous bytes on the backing device. a deviceoffset of 0 means a hole.
+// when allocating, the operation is left open until ext2_bmapend so the new block pointers can't be committed
+// before the caller has written the data to the blocks (ordered mode)
+static int ext2_bmap(vnode_t *vnode, uintmax_t offset, size_t size, bool allocate, vnode_t **device, uintmax_t *deviceoffset, size_t *contiguous) {
+	if (allocate == false)
+		return bmap(vnode, offset, size, allocate, device, deviceoffset, contiguous);
+
+	ext2fs_t *fs = (ext2fs_t *)vnode->vfs;
+	JOURNAL_START(fs);
+	int e = bmap(vnode, offset, size, allocate, device, deviceoffset, contiguous);
+	if (e)
+		JOURNAL_STOP(fs);
+
+	return e;
+}
+
+static void ext2_bmapend(vnode_t *vnode) {
+	ext2fs_t *fs = (ext2fs_t *)vnode->vfs;
+	JOURNAL_STOP(fs);
+}
+
+static int internalrename(vnode_t *sourcedir, vnode_t *source, char *oldname, vnode_t *targetdir, vnode_t *new, char *newname, int flags) {
 	if (sourcedir->vfs != targetdir->vfs)
 		return EXDEV;
 
@@ -1793,15 +3253,103 @@ static int ext2_rename(vnode_t *sourcedir, vnode_t *source, char *oldname, vnode
 	return err;
 }
 
-static int ext2_sync(vnode_t *vnode) {
-	int e = vmmcache_syncvnode(vnode, 0, UINT64_MAX);
-	ext2fs_t *fs = (ext2fs_t *)vnode->vfs;
+static int ext2_rename(vnode_t *sourcedir, vnode_t *source, char *oldname, vnode_t *targetdir, vnode_t *new, char *newname, int flags) {
+	ext2fs_t *fs = (ext2fs_t *)targetdir->vfs;
+	JOURNAL_START(fs);
+	int err = internalrename(sourcedir, source, oldname, targetdir, new, newname, flags);
+	JOURNAL_STOP(fs);
+	return err;
+}
+
+static int syncmetadata(ext2fs_t *fs) {
+	// a commit puts every metadata change on disk
+	if (fs->journal)
+		return jbd_commit(fs->journal);
+
 	// TODO don't sync the entire disk but rather only the inodes and blocks
 	VOP_LOCK(fs->backing);
-	int e2 = vmmcache_syncvnode(fs->backing, 0, UINT64_MAX);
+	int e = vmmcache_syncvnode(fs->backing, 0, UINT64_MAX);
 	VOP_UNLOCK(fs->backing);
+	return e;
+}
+
+static int ext2_sync(vnode_t *vnode, int flags) {
+	ext2node_t *node = (ext2node_t *)vnode;
+	ext2fs_t *fs = (ext2fs_t *)vnode->vfs;
+	int e = vmmcache_syncvnode(vnode, 0, UINT64_MAX);
+
+	// the data is out, now the metadata pointing to it. fdatasync only needs it if the data can't be found without it
+	bool layoutdirty = __atomic_exchange_n(&node->layoutdirty, false, __ATOMIC_SEQ_CST);
+	bool metadata = (flags & V_SYNC_DATA) == 0 || layoutdirty;
+
+	// frees made from now on might miss the commit, so they wait for the next sync
+	discardextent_t *discards = NULL;
+	size_t discardcount;
+	uintmax_t generation;
+	if (fs->discard && metadata)
+		discards = takediscards(fs, &discardcount, &generation);
+
+	int e2 = 0;
+	if (metadata) {
+		e2 = syncmetadata(fs);
+		if (e2 && layoutdirty)
+			__atomic_store_n(&node->layoutdirty, true, __ATOMIC_SEQ_CST);
+	}
+
+	// a single flush gets everything above out of the write cache of the disk
+	int result;
+	int e3 = VOP_IOCTL(fs->backing, BLOCK_IOCTL_FLUSH, NULL, &result, NULL);
+
+	// discards are only hints, so their errors aren't reported. the blocks have to be free on disk first
+	if (discards) {
+		if (e == 0 && e2 == 0 && e3 == 0)
+			flushdiscards(fs, discards, discardcount, generation);
+		else
+			requeuediscards(fs, discards, discardcount);
+
+		free(discards);
+	}
+
 	// only the first errors are reported
-	return e ? e : e2;
+	return e ? e : (e2 ? e2 : e3);
+}
+
+static int ext2_ioctl(vnode_t *vnode, unsigned long request, void *arg, int *result, cred_t *cred) {
+	ext2fs_t *fs = (ext2fs_t *)vnode->vfs;
+	switch (request) {
+		case EXT2_IOCTL_FITRIM:
+			if (cred && CRED_IS_ESU(cred) == false)
+				return EPERM;
+
+			ext2trimrange_t range;
+			int e = USERCOPY_POSSIBLY_FROM_USER(&range, arg, sizeof(ext2trimrange_t));
+			if (e)
+				return e;
+
+			// the bitmaps in memory have the frees of the running transaction, which aren't on disk yet.
+			// get them out first, groups with frees made after that are skipped
+			uintmax_t generation = __atomic_load_n(&fs->freegeneration, __ATOMIC_SEQ_CST);
+			e = syncmetadata(fs);
+			if (e)
+				return e;
+
+			e = VOP_IOCTL(fs->backing, BLOCK_IOCTL_FLUSH, NULL, result, NULL);
+			if (e)
+				return e;
+
+			size_t minlen = max(1, ROUND_UP(range.minlen, fs->blocksize) / fs->blocksize);
+			size_t trimmed = 0;
+			e = trimrange(fs, range.start / fs->blocksize, range.length / fs->blocksize, minlen, &trimmed, generation);
+			if (e)
+				return e;
+
+			// like linux, the length is updated to how much was trimmed
+			range.length = trimmed * fs->blocksize;
+			*result = 0;
+			return USERCOPY_POSSIBLY_TO_USER(arg, &range, sizeof(ext2trimrange_t));
+		default:
+			return ENOTTY;
+	}
 }
 
 static int ext2_lock(vnode_t *vnode) {
@@ -1818,22 +3366,25 @@ static int ext2_inactive(vnode_t *vnode) {
 	ext2node_t *node = (ext2node_t *)vnode;
 	ext2fs_t *fs = (ext2fs_t *)vnode->vfs;
 
+	MUTEX_ACQUIRE(&fs->inodetablelock, false);
+	__assert(node->inactive == false);
 	if (node->inode.links) {
-		// TODO there is still no *normal* situation where this would happen, so it has 
-		// not been implemented yet. the node still has links on the filesystem but is being 
-		// released from memory due to only being referenced by the inode table. 
-		// this was done likely to free up memory (and the structures and data will still remain on disk)
-		// the inode table lock is nescessarily being held here by the function that called VOP_RELEASE
-		__assert(!"ext2 VOP_INACTIVE() with hardlink count >0 is currently unimplemented");
+		// still on disk, keep it around in case it gets looked up again
+		lruinsert(fs, node);
+		ext2node_t *list = fs->inactivecount > INACTIVE_MAX ? lrutake(fs, fs->inactivecount - INACTIVE_MAX) : NULL;
+		MUTEX_RELEASE(&fs->inodetablelock);
+		lrufree(fs, list);
 	} else {
 		// the node does not have any more links on the file system nor references and
 		// we should free it completely from the filesystem.
-		MUTEX_ACQUIRE(&fs->inodetablelock, false);
 		__assert(hashtable_remove(&fs->inodetable, &node->id, sizeof(node->id)) == 0);
 		MUTEX_RELEASE(&fs->inodetablelock);
 
 		vmmcache_truncate(vnode, 0);
+		unreserveblocks(fs, node, SIZE_MAX);
+		JOURNAL_START(fs);
 		freeinode(fs, &node->inode, node->id);
+		JOURNAL_STOP(fs);
 
 		slab_free(nodecache, node);
 	}
@@ -1880,6 +3431,59 @@ static int ext2_root(vfs_t *vfs, vnode_t **vnodep) {
 	return err;
 }
 
+// opens the journal, replaying whatever was left in it. this happens before the groups are loaded,
+// so the journal inode is found by hand
+static int openjournal(ext2fs_t *fs, jbd_t **journal, bool *recovered) {
+	int id = fs->superblock.journalinode;
+	blockgroupdesc_t desc;
+	size_t readc;
+	int e = vfs_read(fs->backing, &desc, sizeof(blockgroupdesc_t), DESC_GETDISKOFFSET(fs, INODE_GETGROUP(fs, id)), &readc, 0);
+	if (e)
+		return e;
+
+	ext2node_t *node = slab_allocate(nodecache);
+	if (node == NULL)
+		return ENOMEM;
+
+	uintmax_t *map = NULL;
+	e = vfs_read(fs->backing, &node->inode, sizeof(inode_t), INODE_GETDISKOFFSET(fs, BLOCK_GETDISKOFFSET(fs, desc.inodetable), id), &readc, 0);
+	if (e)
+		goto cleanup;
+
+	size_t maxlen = INODE_SIZE(&node->inode) / fs->blocksize;
+	map = alloc(sizeof(uintmax_t) * maxlen);
+	if (map == NULL) {
+		e = ENOMEM;
+		goto cleanup;
+	}
+
+	for (uintmax_t i = 0; i < maxlen;) {
+		blockptr_t block;
+		size_t count;
+		e = mapblocks(fs, node, i, &block, &count);
+		if (e)
+			goto cleanup;
+
+		if (block == 0) {
+			printf("ext2: journal has holes\n");
+			e = EINVAL;
+			goto cleanup;
+		}
+
+		for (size_t j = 0; j < count && i < maxlen; ++j, ++i)
+			map[i] = block + j;
+	}
+
+	e = jbd_open(fs->backing, fs->blocksize, map, maxlen, journal, recovered);
+
+	cleanup:
+	if (e && map)
+		free(map);
+
+	slab_free(nodecache, node);
+	return e;
+}
+
 static vfsops_t vfsops;
 static int ext2_mount(vfs_t **vfs, vnode_t *mountpoint, vnode_t *backing, void *data) {
 	if (backing == NULL)
@@ -1889,11 +3493,12 @@ static int ext2_mount(vfs_t **vfs, vnode_t *mountpoint, vnode_t *backing, void *
 	if (fs == NULL)
 		return ENOMEM;
 
+	jbd_t *journal = NULL;
 	MUTEX_INIT(&fs->superblocklock);
 	MUTEX_INIT(&fs->inodetablelock);
 	MUTEX_INIT(&fs->rootlock);
 	MUTEX_INIT(&fs->inodewritelock);
-	MUTEX_INIT(&fs->descriptorlock);
+	MUTEX_INIT(&fs->discardlock);
 
 	vattr_t vattr;
 	VOP_LOCK(backing);
@@ -1948,24 +3553,90 @@ static int ext2_mount(vfs_t **vfs, vnode_t *mountpoint, vnode_t *backing, void *
 
 	// TODO path last mounted to
 
+	fs->backing = backing;
+	fs->bgcount = inobgcount;
+	fs->blocksize = 1024 << fs->superblock.blocksize;
+
+	// the bitmaps are used in place in the backing device cache, so a block can't span more than a page
+	if (fs->blocksize > PAGE_SIZE) {
+		printf("ext2: no support for blocks larger than a page\n");
+		goto cleanup;
+	}
+
 	err = hashtable_init(&fs->inodetable, 4096);
 	if (err)
 		goto cleanup;
 
-	VFS_INIT(&fs->vfs, &vfsops, 0);
+	// the journal gets replayed before anything else is read
+	if ((fs->superblock.optionalfeatures & EXT2_FEATURE_COMPAT_HAS_JOURNAL) && fs->superblock.journalinode) {
+		bool recovered;
+		err = openjournal(fs, &journal, &recovered);
+		if (err) {
+			printf("ext2: could not open the journal\n");
+			goto cleanup;
+		}
+
+		// the replay went straight to the disk
+		if (recovered) {
+			vmmcache_invalidate(backing, 0, SIZE_MAX);
+			err = vfs_read(backing, &fs->superblock, sizeof(ext2superblock_t), SUPERBLOCK_OFFSET, &readcount, 0);
+			if (err)
+				goto cleanup;
+		}
+	}
+
+	err = loadgroups(fs);
+	if (err)
+		goto cleanup;
+
+	// online discard is opt in and needs a device that can do it
+	blockdesc_t blockdesc;
+	int result;
+	if (cmdline_get("ext2discard") && VOP_IOCTL(backing, BLOCK_IOCTL_GETDESC, &blockdesc, &result, NULL) == 0 && blockdesc.maxdiscard) {
+		fs->discardpending = alloc(sizeof(discardextent_t) * DISCARD_PENDING_MAX);
+		fs->discard = fs->discardpending != NULL;
+	}
+
+	VFS_INIT(&fs->vfs, &vfsops, VFS_FLAGS_NAMECACHE);
 	fs->superblock.mountsaftercheck += 1;
 	fs->superblock.timeoflastmount = timekeeper_time().s;
-	fs->backing = backing;
+	if (journal) {
+		// the flag has to be on disk before anything goes into the log
+		fs->superblock.requiredfeatures |= EXT2_FEATURE_INCOMPAT_RECOVER;
+		syncsuperblock(fs);
+		VOP_LOCK(backing);
+		err = vmmcache_syncvnode(backing, 0, PAGE_SIZE);
+		VOP_UNLOCK(backing);
+
+		// jbd_run fails for blocks smaller than a page, in which case the filesystem is used like ext2
+		if (err == 0)
+			err = jbd_run(journal);
+
+		if (err) {
+			printf("ext2: not using the journal (error %d)\n", err);
+			fs->superblock.requiredfeatures &= ~EXT2_FEATURE_INCOMPAT_RECOVER;
+			jbd_close(journal);
+		} else {
+			fs->journal = journal;
+		}
+	}
+
 	err = syncsuperblock(fs);
 
 	VOP_HOLD(backing);
 
-	fs->bgcount = inobgcount;
-	fs->blocksize = 1024 << fs->superblock.blocksize;
+	MUTEX_ACQUIRE(&mountslock, false);
+	fs->mountnext = mounts;
+	mounts = fs;
+	MUTEX_RELEASE(&mountslock);
+
 	*vfs = &fs->vfs;
 	err = 0;
 
 	cleanup:
+	if (err && journal)
+		jbd_close(journal);
+
 	if (err)
 		free(fs);
 
@@ -2001,6 +3672,9 @@ static vops_t vnops = {
 	.getpage = ext2_getpage,
 	.putpage = ext2_putpage,
 	.sync = ext2_sync,
+	.ioctl = ext2_ioctl,
+	.bmap = ext2_bmap,
+	.bmapend = ext2_bmapend,
 	.lock = ext2_lock,
 	.unlock = ext2_unlock
 };
@@ -2009,4 +3683,6 @@ void ext2_init() {
 	__assert(vfs_register(&vfsops, "ext2") == 0);
 	nodecache = slab_newcache(sizeof(ext2node_t), 0, NULL, NULL);
 	__assert(nodecache);
+	MUTEX_INIT(&mountslock);
+	pmm_registershrinker(&shrinker);
 }
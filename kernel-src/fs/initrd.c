@@ -8,6 +8,13 @@
 #include <kernel/abi.h>
 #include <time.h>
 #include <kernel/vfs.h>
+#include <kernel/vmmcache.h>
+#include <kernel/alloc.h>
+#include <kernel/cmdline.h>
+#include <kernel/scheduler.h>
+#include <arch/smp.h>
+#include <mutex.h>
+#include <semaphore.h>
 
 #define TAR_BLOCKSIZE 512
 #define TAR_FILE 0
@@ -106,6 +113,151 @@ static volatile struct limine_module_request modreq = {
 	.revision = 0
 };
 
+// file contents that couldn't be adopted straight into the page cache are copied by worker threads
+typedef struct unpackjob_t {
+	struct unpackjob_t *next;
+	vnode_t *node;
+	void *data;
+	size_t size;
+	uintmax_t offset;
+	char name[];
+} unpackjob_t;
+
+#define WORKER_MAX 8
+
+static mutex_t joblock;
+static semaphore_t jobsem;
+static semaphore_t donesem;
+static unpackjob_t *jobs;
+static unpackjob_t *jobstail;
+
+__attribute__((noreturn)) static void unpackworker() {
+	for (;;) {
+		semaphore_wait(&jobsem, false);
+
+		MUTEX_ACQUIRE(&joblock, false);
+		unpackjob_t *job = jobs;
+		if (job) {
+			jobs = job->next;
+			if (jobs == NULL)
+				jobstail = NULL;
+		}
+		MUTEX_RELEASE(&joblock);
+
+		// an empty queue after a wakeup means everything was unpacked
+		if (job == NULL)
+			break;
+
+		size_t writecount;
+		int err = vfs_write(job->node, job->data, job->size, job->offset, &writecount, 0);
+		if (err)
+			printf("initrd: failed to unpack %s: %lu\n", job->name, err);
+
+		VOP_RELEASE(job->node);
+		free(job);
+	}
+
+	semaphore_signal(&donesem);
+	sched_threadexit();
+}
+
+static void queuejob(vnode_t *node, char *name, void *data, size_t size, uintmax_t offset) {
+	unpackjob_t *job = alloc(sizeof(unpackjob_t) + strlen(name) + 1);
+	if (job == NULL) {
+		// do it here instead
+		size_t writecount;
+		int err = vfs_write(node, data, size, offset, &writecount, 0);
+		if (err)
+			printf("initrd: failed to unpack %s: %lu\n", name, err);
+		return;
+	}
+
+	VOP_HOLD(node);
+	job->node = node;
+	job->data = data;
+	job->size = size;
+	job->offset = offset;
+	strcpy(job->name, name);
+
+	MUTEX_ACQUIRE(&joblock, false);
+	if (jobstail)
+		jobstail->next = job;
+	else
+		jobs = job;
+	jobstail = job;
+	MUTEX_RELEASE(&joblock);
+
+	semaphore_signal(&jobsem);
+}
+
+// hands the whole pages of file data that start on a page boundary in the module to the page cache
+// as the file contents, the same way tmpfs_getpage would have left them. returns how many bytes were adopted
+static size_t adoptpages(vnode_t *node, void *data, size_t size) {
+	if (((uintptr_t)data % PAGE_SIZE) != 0)
+		return 0;
+
+	size_t adopted = 0;
+	while (size - adopted >= PAGE_SIZE) {
+		void *phy = FROM_HHDM((void *)((uintptr_t)data + adopted));
+		page_t *page = pmm_getpage(phy);
+		pmm_adoptpage(phy);
+
+		// tmpfs keeps its pages pinned with an extra reference
+		pmm_hold(phy);
+		page->flags |= PAGE_FLAGS_PINNED;
+
+		// the node was just created, so nothing can be cached at this offset yet
+		__assert(vmmcache_pushpage(node, adopted, page) == 0);
+		pmm_release(phy);
+		adopted += PAGE_SIZE;
+	}
+
+	return adopted;
+}
+
+static int unpackfile(vnode_t *node, tarentry_t *entry, void *datastart, bool fast) {
+	if (fast == false) {
+		size_t writecount;
+		return vfs_write(node, datastart, entry->size, 0, &writecount, 0);
+	}
+
+	// set the size first so the adopted pages are within the file
+	// and the copies can happen in any order without having to extend it
+	VOP_LOCK(node);
+	int err = VOP_RESIZE(node, entry->size, NULL);
+	VOP_UNLOCK(node);
+	if (err)
+		return err;
+
+	size_t adopted = adoptpages(node, datastart, entry->size);
+	if (adopted < entry->size)
+		queuejob(node, entry->name, (void *)((uintptr_t)datastart + adopted), entry->size - adopted, adopted);
+
+	return 0;
+}
+
+// frees the module pages that weren't adopted by the page cache
+static void freemodule(void *address, size_t pagecount) {
+	uintptr_t runstart = (uintptr_t)FROM_HHDM(address);
+	size_t runcount = 0;
+	for (size_t i = 0; i < pagecount; ++i) {
+		uintptr_t phy = (uintptr_t)FROM_HHDM(address) + i * PAGE_SIZE;
+		if (pmm_getpage((void *)phy)->backing) {
+			if (runcount)
+				pmm_makefree((void *)runstart, runcount);
+
+			runstart = phy + PAGE_SIZE;
+			runcount = 0;
+			continue;
+		}
+
+		++runcount;
+	}
+
+	if (runcount)
+		pmm_makefree((void *)runstart, runcount);
+}
+
 void initrd_unpack() {
 	__assert(modreq.response);
 	
@@ -121,12 +273,38 @@ void initrd_unpack() {
 	printf("initrd at %p with size %lu (%lu pages)\n", initrd->address, initrd->size, ROUND_UP(initrd->size, PAGE_SIZE) / PAGE_SIZE);
 	__assert(((uintptr_t)initrd->address % PAGE_SIZE) == 0);
 
+	// the fast mode adopts page aligned file data as cache pages and copies the rest on several cpus.
+	// as the workers read from the module while the tar is walked, it can only be freed at the end
+	bool fast = cmdline_get("initrdserial") == NULL;
+	size_t workercount = 0;
+	if (fast) {
+		MUTEX_INIT(&joblock);
+		SEMAPHORE_INIT(&jobsem, 0);
+		SEMAPHORE_INIT(&donesem, 0);
+		jobs = NULL;
+		jobstail = NULL;
+
+		size_t cpus = arch_smp_cpusawake > WORKER_MAX ? WORKER_MAX : arch_smp_cpusawake;
+		for (int i = 0; i < cpus; ++i) {
+			thread_t *thread = sched_newthread(unpackworker, PAGE_SIZE * 4, 0, NULL, NULL);
+			if (thread == NULL)
+				break;
+
+			sched_queue(thread);
+			++workercount;
+		}
+
+		// without workers every file gets copied by unpackfile like in the serial mode
+		if (workercount == 0)
+			printf("initrd: no unpack workers, copying serially\n");
+	}
+
 	void *ptr = initrd->address;
 	tarentry_t entry;
 	void *cleanupptr = initrd->address;
 	size_t cleanupbytespassed = 0;
 	for (;;) {
-		if (cleanupbytespassed >= PAGE_SIZE) {
+		if (fast == false && cleanupbytespassed >= PAGE_SIZE) {
 			size_t pagec = cleanupbytespassed / PAGE_SIZE;
 			pmm_makefree(FROM_HHDM(cleanupptr), pagec);
 			cleanupptr = (void *)((uintptr_t)cleanupptr + ROUND_DOWN(cleanupbytespassed, PAGE_SIZE));
@@ -149,7 +327,6 @@ void initrd_unpack() {
 
 		int err = 0;
 		vnode_t *node;
-		size_t writecount;
 		switch (entry.type) {
 			case TAR_FILE:
 				cleanupbytespassed += ROUND_UP(entry.size, TAR_BLOCKSIZE);
@@ -158,7 +335,7 @@ void initrd_unpack() {
 					break;
 
 				VOP_UNLOCK(node);
-				err = vfs_write(node, datastart, entry.size, 0, &writecount, 0);
+				err = unpackfile(node, &entry, datastart, fast && workercount);
 				VOP_RELEASE(node);
 				break;
 			case TAR_DIR:
@@ -176,6 +353,18 @@ void initrd_unpack() {
 			printf("initrd: failed to unpack %s: %lu\n", entry.name, err);
 	}
 
+	if (fast) {
+		// wake every worker up with an empty queue to tell them to exit, and wait until the copies are done
+		for (int i = 0; i < workercount; ++i)
+			semaphore_signal(&jobsem);
+
+		for (int i = 0; i < workercount; ++i)
+			semaphore_wait(&donesem, false);
+
+		freemodule(initrd->address, ROUND_UP(cleanupbytespassed, PAGE_SIZE) / PAGE_SIZE);
+		return;
+	}
+
 	// free remaining pages to be freed
 	pmm_makefree(FROM_HHDM(cleanupptr), ROUND_UP(cleanupbytespassed, PAGE_SIZE) / PAGE_SIZE);
 }
@@ -0,0 +1,891 @@
+#include <kernel/jbd.h>
+#include <kernel/vmmcache.h>
+#include <kernel/alloc.h>
+#include <kernel/scheduler.h>
+#include <kernel/interrupt.h>
+#include <kernel/timer.h>
+#include <kernel/event.h>
+#include <kernel/block.h>
+#include <arch/cpu.h>
+#include <hashtable.h>
+#include <logging.h>
+#include <string.h>
+#include <util.h>
+
+// ext3 compatible journal for filesystem metadata, in ordered mode.
+// metadata changes are made in the pages of the device cache without marking them dirty, and the pages are held by
+// the running transaction so they can't be dropped. a commit waits for every operation in progress to finish,
+// copies the blocks of the transaction and writes the copies to the log, then the commit block, and then to their
+// place on disk. file data is written by the filesystem before the metadata pointing to it gets committed.
+//
+// the log is checkpointed right after every commit, so every transaction is written at the start of the log and the
+// log superblock always points there. the sequence number tells the newest transaction apart from older ones.
+// log and checkpoint i/o goes straight to the device so the cache pages keep any newer changes.
+// with a volatile write cache on the disk, the log is flushed before the commit block is written with fua, and the
+// checkpoint is flushed before the log superblock lets the next transaction reuse the log.
+
+#define JBD_MAGIC 0xc03b3998
+#define JBD_BLOCKTYPE_DESCRIPTOR 1
+#define JBD_BLOCKTYPE_COMMIT 2
+#define JBD_BLOCKTYPE_SUPERBLOCKV1 3
+#define JBD_BLOCKTYPE_SUPERBLOCKV2 4
+#define JBD_BLOCKTYPE_REVOKE 5
+
+#define JBD_TAG_ESCAPE 1
+#define JBD_TAG_SAMEUUID 2
+#define JBD_TAG_LAST 8
+
+#define JBD_COMPAT_CHECKSUM 1
+#define JBD_INCOMPAT_REVOKE 1
+#define JBD_INCOMPAT_ASYNCCOMMIT 4
+#define JBD_INCOMPAT_SUPPORTED (JBD_INCOMPAT_REVOKE | JBD_INCOMPAT_ASYNCCOMMIT)
+
+#define JBD_UUID_SIZE 16
+#define JBD_COMMIT_INTERVAL_SECONDS 5
+#define JBD_CHECKPOINT_RUN 64
+#define JBD_GATE_TIMEOUT_US 10000
+
+typedef struct {
+	uint32_t magic;
+	uint32_t blocktype;
+	uint32_t sequence;
+} __attribute__((packed)) jbdheader_t;
+
+// all fields are big endian
+typedef struct {
+	jbdheader_t header;
+	uint32_t blocksize;
+	uint32_t maxlen;
+	uint32_t first;
+	uint32_t sequence;
+	uint32_t start;
+	uint32_t error;
+	// version 2
+	uint32_t compat;
+	uint32_t incompat;
+	uint32_t rocompat;
+	uint8_t  uuid[JBD_UUID_SIZE];
+} __attribute__((packed)) jbdsuperblock_t;
+
+typedef struct {
+	uint32_t block;
+	uint32_t flags;
+} __attribute__((packed)) jbdtag_t;
+
+typedef struct {
+	jbdheader_t header;
+	uint32_t count;
+} __attribute__((packed)) jbdrevoke_t;
+
+typedef struct jbdbuffer_t {
+	struct jbdbuffer_t *next;
+	uintmax_t block;
+	page_t *page; // cache page of the block, held until it is checkpointed
+	void *copy; // taken at commit time, this is what gets written
+	bool escaped;
+} jbdbuffer_t;
+
+struct jbd_t {
+	vnode_t *device;
+	size_t blocksize;
+	uintmax_t *map;
+	size_t maxlen;
+	jbdsuperblock_t *superblock; // a whole block
+	uint32_t sequence; // of the running transaction
+	size_t capacity; // biggest transaction that fits in the log
+	mutex_t commitlock; // only one commit at a time
+	mutex_t lock; // protects everything below
+	int handles;
+	bool locked; // a commit is waiting for the handles to finish
+	eventheader_t gateevent;
+	eventheader_t drainevent;
+	eventheader_t checkpointevent;
+	semaphore_t wake;
+	hashtable_t table; // block number -> buffer in the running transaction
+	jbdbuffer_t *buffers;
+	jbdbuffer_t *committing; // transaction being written out
+	size_t count;
+};
+
+// sequence numbers wrap around
+#define SEQUENCE_AFTER(a, b) ((int32_t)((a) - (b)) > 0)
+
+// reads or writes blocks straight from or into the device, bypassing its cache
+static int devio(jbd_t *jbd, uintmax_t block, void **buffers, size_t count, bool write, int flags) {
+	iovec_t *iovec = alloc(sizeof(iovec_t) * count);
+	if (iovec == NULL)
+		return ENOMEM;
+
+	for (size_t i = 0; i < count; ++i) {
+		iovec[i].addr = buffers[i];
+		iovec[i].len = jbd->blocksize;
+	}
+
+	iovec_iterator_t iovec_iterator;
+	iovec_iterator_init(&iovec_iterator, iovec, count);
+
+	// the block layer doesn't need the device vnode to be locked
+	size_t done;
+	size_t size = count * jbd->blocksize;
+	int e = write ?
+		VOP_WRITE(jbd->device, &iovec_iterator, size, block * jbd->blocksize, flags, &done, NULL) :
+		VOP_READ(jbd->device, &iovec_iterator, size, block * jbd->blocksize, 0, &done, NULL);
+
+	if (e == 0 && done != size)
+		e = EIO;
+
+	free(iovec);
+	return e;
+}
+
+// waits for everything written so far to leave the write cache of the disk
+static int flush(jbd_t *jbd) {
+	int result;
+	return VOP_IOCTL(jbd->device, BLOCK_IOCTL_FLUSH, NULL, &result, NULL);
+}
+
+static int logread(jbd_t *jbd, uintmax_t position, void *buffer) {
+	return devio(jbd, jbd->map[position], &buffer, 1, false, 0);
+}
+
+// writes blocks to consecutive log positions, in as few requests as the journal file layout allows
+static int logwrite(jbd_t *jbd, uintmax_t position, void **buffers, size_t count, int flags) {
+	while (count) {
+		size_t run = 1;
+		while (run < count && jbd->map[position + run] == jbd->map[position] + run)
+			++run;
+
+		int e = devio(jbd, jbd->map[position], buffers, run, true, flags);
+		if (e)
+			return e;
+
+		position += run;
+		buffers += run;
+		count -= run;
+	}
+
+	return 0;
+}
+
+static int writesuperblock(jbd_t *jbd) {
+	void *buffer = jbd->superblock;
+	return devio(jbd, jbd->map[0], &buffer, 1, true, 0);
+}
+
+static uintmax_t nextposition(jbd_t *jbd, uintmax_t position) {
+	return position + 1 == jbd->maxlen ? be_to_cpu_d(jbd->superblock->first) : position + 1;
+}
+
+#define PASS_SCAN 0
+#define PASS_REVOKE 1
+#define PASS_REPLAY 2
+
+// goes through the transactions left in the log in the same three passes as e2fsprogs: finding the last one with
+// a commit block, collecting the revoked blocks and then writing the logged blocks to their place on disk
+static int recoverypass(jbd_t *jbd, int pass, hashtable_t *revoked, uint32_t *endsequence, void *buffer, void *data) {
+	uintmax_t position = be_to_cpu_d(jbd->superblock->start);
+	uint32_t sequence = be_to_cpu_d(jbd->superblock->sequence);
+	int e = 0;
+
+	for (;;) {
+		if (pass != PASS_SCAN && sequence == *endsequence)
+			break;
+
+		e = logread(jbd, position, buffer);
+		if (e)
+			break;
+
+		jbdheader_t *header = buffer;
+		if (be_to_cpu_d(header->magic) != JBD_MAGIC || be_to_cpu_d(header->sequence) != sequence)
+			break;
+
+		uint32_t type = be_to_cpu_d(header->blocktype);
+		position = nextposition(jbd, position);
+
+		if (type == JBD_BLOCKTYPE_DESCRIPTOR) {
+			uintmax_t offset = sizeof(jbdheader_t);
+			while (offset + sizeof(jbdtag_t) <= jbd->blocksize) {
+				jbdtag_t *tag = (jbdtag_t *)((uintptr_t)buffer + offset);
+				// jbd2 keeps a 16 bit checksum in the upper half of the flags
+				uint32_t flags = be_to_cpu_d(tag->flags) & 0xffff;
+				uint32_t block = be_to_cpu_d(tag->block);
+
+				offset += sizeof(jbdtag_t);
+				if ((flags & JBD_TAG_SAMEUUID) == 0)
+					offset += JBD_UUID_SIZE;
+
+				void *revokedsequence;
+				if (pass == PASS_REPLAY && (hashtable_get(revoked, &revokedsequence, &block, sizeof(block)) || SEQUENCE_AFTER(sequence, (uint32_t)(uintptr_t)revokedsequence))) {
+					e = logread(jbd, position, data);
+					if (e)
+						return e;
+
+					if (flags & JBD_TAG_ESCAPE)
+						*(uint32_t *)data = cpu_to_be_d(JBD_MAGIC);
+
+					e = devio(jbd, block, &data, 1, true, 0);
+					if (e)
+						return e;
+				}
+
+				position = nextposition(jbd, position);
+				if (flags & JBD_TAG_LAST)
+					break;
+			}
+		} else if (type == JBD_BLOCKTYPE_COMMIT) {
+			sequence += 1;
+			if (pass == PASS_SCAN)
+				*endsequence = sequence;
+		} else if (type == JBD_BLOCKTYPE_REVOKE) {
+			if (pass != PASS_REVOKE)
+				continue;
+
+			jbdrevoke_t *revoke = buffer;
+			size_t count = min(be_to_cpu_d(revoke->count), jbd->blocksize);
+			for (uintmax_t offset = sizeof(jbdrevoke_t); offset + sizeof(uint32_t) <= count; offset += sizeof(uint32_t)) {
+				uint32_t block = be_to_cpu_d(*(uint32_t *)((uintptr_t)buffer + offset));
+
+				// only the newest revoke of a block matters
+				void *old;
+				if (hashtable_get(revoked, &old, &block, sizeof(block)) == 0 && SEQUENCE_AFTER((uint32_t)(uintptr_t)old, sequence))
+					continue;
+
+				e = hashtable_set(revoked, (void *)(uintptr_t)sequence, &block, sizeof(block), true);
+				if (e)
+					return e;
+			}
+		} else {
+			break;
+		}
+	}
+
+	return e;
+}
+
+static int recover(jbd_t *jbd, bool *recovered) {
+	jbdsuperblock_t *superblock = jbd->superblock;
+	uint32_t startsequence = be_to_cpu_d(superblock->sequence);
+	uint32_t endsequence = startsequence;
+	*recovered = false;
+	jbd->sequence = startsequence;
+
+	// a start of 0 means the log is empty
+	if (superblock->start == 0)
+		return 0;
+
+	hashtable_t revoked;
+	void *buffer = alloc(jbd->blocksize);
+	void *data = alloc(jbd->blocksize);
+	int e = hashtable_init(&revoked, 64);
+	if (buffer == NULL || data == NULL || e) {
+		e = e ? e : ENOMEM;
+		goto cleanup;
+	}
+
+	e = recoverypass(jbd, PASS_SCAN, &revoked, &endsequence, buffer, data);
+	if (e == 0 && endsequence != startsequence)
+		e = recoverypass(jbd, PASS_REVOKE, &revoked, &endsequence, buffer, data);
+	if (e == 0 && endsequence != startsequence)
+		e = recoverypass(jbd, PASS_REPLAY, &revoked, &endsequence, buffer, data);
+
+	hashtable_destroy(&revoked);
+	if (e)
+		goto cleanup;
+
+	if (endsequence != startsequence) {
+		printf("jbd: replayed transactions %u to %u\n", startsequence, endsequence - 1);
+		*recovered = true;
+		e = flush(jbd);
+		if (e)
+			goto cleanup;
+	}
+
+	// everything is in place now, mark the log as empty
+	jbd->sequence = endsequence;
+	superblock->sequence = cpu_to_be_d(endsequence);
+	superblock->start = 0;
+	e = writesuperblock(jbd);
+
+	cleanup:
+	if (buffer)
+		free(buffer);
+	if (data)
+		free(data);
+
+	return e;
+}
+
+// opens the journal and replays whatever committed transactions were left in it. the journal takes over map
+int jbd_open(vnode_t *device, size_t blocksize, uintmax_t *map, size_t maxlen, jbd_t **jbdp, bool *recovered) {
+	jbd_t *jbd = alloc(sizeof(jbd_t));
+	if (jbd == NULL)
+		return ENOMEM;
+
+	jbd->device = device;
+	jbd->blocksize = blocksize;
+	jbd->map = map;
+	jbd->maxlen = maxlen;
+	MUTEX_INIT(&jbd->commitlock);
+	MUTEX_INIT(&jbd->lock);
+	SEMAPHORE_INIT(&jbd->wake, 0);
+	EVENT_INITHEADER(&jbd->gateevent);
+	EVENT_INITHEADER(&jbd->drainevent);
+	EVENT_INITHEADER(&jbd->checkpointevent);
+
+	int e = ENOMEM;
+	jbd->superblock = alloc(blocksize);
+	if (jbd->superblock == NULL)
+		goto error;
+
+	e = logread(jbd, 0, jbd->superblock);
+	if (e)
+		goto error;
+
+	e = EINVAL;
+	jbdsuperblock_t *superblock = jbd->superblock;
+	uint32_t type = be_to_cpu_d(superblock->header.blocktype);
+	if (be_to_cpu_d(superblock->header.magic) != JBD_MAGIC || (type != JBD_BLOCKTYPE_SUPERBLOCKV1 && type != JBD_BLOCKTYPE_SUPERBLOCKV2)) {
+		printf("jbd: bad superblock\n");
+		goto error;
+	}
+
+	if (be_to_cpu_d(superblock->blocksize) != blocksize || be_to_cpu_d(superblock->maxlen) > maxlen || be_to_cpu_d(superblock->first) == 0 || be_to_cpu_d(superblock->first) + 2 >= be_to_cpu_d(superblock->maxlen)) {
+		printf("jbd: bad geometry\n");
+		goto error;
+	}
+
+	if (type == JBD_BLOCKTYPE_SUPERBLOCKV2 && (be_to_cpu_d(superblock->incompat) & ~JBD_INCOMPAT_SUPPORTED)) {
+		printf("jbd: unsupported features %x\n", be_to_cpu_d(superblock->incompat) & ~JBD_INCOMPAT_SUPPORTED);
+		goto error;
+	}
+
+	jbd->maxlen = be_to_cpu_d(superblock->maxlen);
+
+	e = recover(jbd, recovered);
+	if (e)
+		goto error;
+
+	*jbdp = jbd;
+	return 0;
+
+	error:
+	if (jbd->superblock)
+		free(jbd->superblock);
+	free(jbd);
+	return e;
+}
+
+// for journals that were opened only to be recovered
+void jbd_close(jbd_t *jbd) {
+	free(jbd->map);
+	free(jbd->superblock);
+	free(jbd);
+}
+
+// wait for everyone in the middle of an operation to finish, and keep new ones out. lock expected to be held
+static void drain(jbd_t *jbd) {
+	jbd->locked = true;
+	while (jbd->handles) {
+		eventlistener_t listener;
+		EVENT_INITLISTENER(&listener);
+		EVENT_ATTACH(&listener, &jbd->drainevent);
+		MUTEX_RELEASE(&jbd->lock);
+		EVENT_WAIT(&listener, 0);
+		EVENT_DETACHALL(&listener);
+		MUTEX_ACQUIRE(&jbd->lock, false);
+	}
+}
+
+// starts an operation. everything it changes goes in the same transaction. operations can nest
+void jbd_start(jbd_t *jbd) {
+	thread_t *thread = current_thread();
+	if (thread->journal == jbd) {
+		++thread->journaldepth;
+		return;
+	}
+
+	MUTEX_ACQUIRE(&jbd->lock, false);
+	// give the commit a chance to take the running transaction. the wait is bounded because this thread might hold a
+	// vnode lock that someone with a handle open is waiting for. getting in anyway is fine, the commit just waits for it
+	if (jbd->locked) {
+		eventlistener_t listener;
+		EVENT_INITLISTENER(&listener);
+		EVENT_ATTACH(&listener, &jbd->gateevent);
+		MUTEX_RELEASE(&jbd->lock);
+		EVENT_WAIT(&listener, JBD_GATE_TIMEOUT_US);
+		EVENT_DETACHALL(&listener);
+		MUTEX_ACQUIRE(&jbd->lock, false);
+	}
+
+	++jbd->handles;
+	bool full = jbd->count >= jbd->capacity / 2;
+	MUTEX_RELEASE(&jbd->lock);
+
+	if (thread->journal == NULL) {
+		thread->journal = jbd;
+		thread->journaldepth = 1;
+	}
+
+	// get big transactions out early
+	if (full)
+		semaphore_signal(&jbd->wake);
+}
+
+void jbd_stop(jbd_t *jbd) {
+	thread_t *thread = current_thread();
+	if (thread->journal == jbd) {
+		if (--thread->journaldepth)
+			return;
+
+		thread->journal = NULL;
+	}
+
+	MUTEX_ACQUIRE(&jbd->lock, false);
+	if (--jbd->handles == 0 && jbd->locked)
+		EVENT_SIGNAL(&jbd->drainevent);
+	MUTEX_RELEASE(&jbd->lock);
+}
+
+// adds a block to the running transaction, taking over the reference to its page. lock expected to be held
+static int addblock(jbd_t *jbd, uintmax_t block, page_t *page) {
+	jbdbuffer_t *buffer;
+	if (hashtable_get(&jbd->table, (void **)&buffer, &block, sizeof(block)) == 0) {
+		// it might have been freed and reused since it got in
+		if (buffer->page)
+			pmm_release(pmm_getpageaddress(page));
+		else
+			buffer->page = page;
+
+		return 0;
+	}
+
+	int e = ENOMEM;
+	buffer = alloc(sizeof(jbdbuffer_t));
+	if (buffer == NULL)
+		goto error;
+
+	buffer->block = block;
+	buffer->page = page;
+	buffer->copy = NULL;
+
+	e = hashtable_set(&jbd->table, buffer, &buffer->block, sizeof(buffer->block), true);
+	if (e) {
+		free(buffer);
+		goto error;
+	}
+
+	buffer->next = jbd->buffers;
+	jbd->buffers = buffer;
+	++jbd->count;
+	return 0;
+
+	error:
+	// not journaled, but at least it doesn't get lost
+	vmmcache_makedirty(page);
+	pmm_release(pmm_getpageaddress(page));
+	return e;
+}
+
+// writes metadata into the device cache as part of the running transaction
+int jbd_write(jbd_t *jbd, iovec_iterator_t *iovec_iterator, size_t size, uintmax_t offset, size_t *writec) {
+	*writec = 0;
+	while (*writec < size) {
+		uintmax_t pageoffset = ROUND_DOWN(offset + *writec, PAGE_SIZE);
+		uintmax_t startoffset = (offset + *writec) % PAGE_SIZE;
+		size_t count = min(PAGE_SIZE - startoffset, size - *writec);
+
+		page_t *page;
+		int e = vmmcache_getwritablepage(jbd->device, pageoffset, &page);
+		if (e)
+			return e;
+
+		void *address = (void *)((uintptr_t)MAKE_HHDM(pmm_getpageaddress(page)) + startoffset);
+		e = iovec_iterator_copy_to_buffer(iovec_iterator, address, count);
+		if (e) {
+			pmm_release(pmm_getpageaddress(page));
+			return e;
+		}
+
+		MUTEX_ACQUIRE(&jbd->lock, false);
+		e = addblock(jbd, pageoffset / jbd->blocksize, page);
+		MUTEX_RELEASE(&jbd->lock);
+		if (e)
+			return e;
+
+		*writec += count;
+	}
+
+	return 0;
+}
+
+// adds metadata that was changed in place in a cache page to the running transaction
+int jbd_dirty(jbd_t *jbd, uintmax_t offset) {
+	page_t *page;
+	uintmax_t pageoffset = ROUND_DOWN(offset, PAGE_SIZE);
+	int e = vmmcache_getpage(jbd->device, pageoffset, &page);
+	if (e)
+		return e;
+
+	MUTEX_ACQUIRE(&jbd->lock, false);
+	e = addblock(jbd, pageoffset / jbd->blocksize, page);
+	MUTEX_RELEASE(&jbd->lock);
+	return e;
+}
+
+static jbdbuffer_t *sortbuffers(jbdbuffer_t *list) {
+	if (list == NULL || list->next == NULL)
+		return list;
+
+	// split in half
+	jbdbuffer_t *slow = list;
+	jbdbuffer_t *fast = list->next;
+	while (fast && fast->next) {
+		slow = slow->next;
+		fast = fast->next->next;
+	}
+
+	jbdbuffer_t *second = slow->next;
+	slow->next = NULL;
+
+	jbdbuffer_t *a = sortbuffers(list);
+	jbdbuffer_t *b = sortbuffers(second);
+	jbdbuffer_t *head = NULL;
+	jbdbuffer_t **tail = &head;
+	while (a && b) {
+		jbdbuffer_t **smallest = a->block < b->block ? &a : &b;
+		*tail = *smallest;
+		tail = &(*smallest)->next;
+		*smallest = (*smallest)->next;
+	}
+
+	*tail = a ? a : b;
+	return head;
+}
+
+// writes the copies of the blocks to their place on disk, neighbouring blocks together
+static int checkpoint(jbd_t *jbd, jbdbuffer_t *buffers) {
+	void *run[JBD_CHECKPOINT_RUN];
+	int e = 0;
+
+	jbdbuffer_t *buffer = buffers;
+	while (buffer) {
+		uintmax_t start = buffer->block;
+		size_t count = 0;
+		while (buffer && buffer->block == start + count && count < JBD_CHECKPOINT_RUN) {
+			run[count++] = buffer->copy;
+			buffer = buffer->next;
+		}
+
+		int error = devio(jbd, start, run, count, true, 0);
+		if (error) {
+			printf("jbd: error %d writing back block %lu\n", error, start);
+			e = e ? e : error;
+		}
+	}
+
+	return e;
+}
+
+
+static void *newblock(uint32_t type, uint32_t sequence) {
+	void *address = pmm_allocpage(PMM_SECTION_DEFAULT);
+	if (address == NULL)
+		return NULL;
+
+	jbdheader_t *header = MAKE_HHDM(address);
+	memset(header, 0, PAGE_SIZE);
+	header->magic = cpu_to_be_d(JBD_MAGIC);
+	header->blocktype = cpu_to_be_d(type);
+	header->sequence = cpu_to_be_d(sequence);
+	return header;
+}
+
+// writes the descriptor and data blocks to the start of the log, followed by the commit block
+static int writelog(jbd_t *jbd, jbdbuffer_t *buffers, size_t count, uint32_t sequence) {
+	size_t tagsperdesc = (jbd->blocksize - sizeof(jbdheader_t) - JBD_UUID_SIZE) / sizeof(jbdtag_t);
+	size_t desccount = ROUND_UP(count, tagsperdesc) / tagsperdesc;
+	size_t blockcount = 0;
+	size_t descriptorcount = 0;
+	void *commit = NULL;
+	int e = ENOMEM;
+
+	void **blocks = alloc(sizeof(void *) * (desccount + count));
+	void **descriptors = alloc(sizeof(void *) * desccount);
+	if (blocks == NULL || descriptors == NULL)
+		goto cleanup;
+
+	// descriptors followed by the blocks they describe
+	jbdbuffer_t *buffer = buffers;
+	for (size_t i = 0; i < desccount; ++i) {
+		descriptors[i] = newblock(JBD_BLOCKTYPE_DESCRIPTOR, sequence);
+		if (descriptors[i] == NULL)
+			goto cleanup;
+
+		++descriptorcount;
+		blocks[blockcount++] = descriptors[i];
+		uintmax_t offset = sizeof(jbdheader_t);
+		for (size_t j = 0; j < tagsperdesc && buffer; ++j) {
+			jbdtag_t *tag = (jbdtag_t *)((uintptr_t)descriptors[i] + offset);
+			uint32_t flags = j ? JBD_TAG_SAMEUUID : 0;
+			offset += sizeof(jbdtag_t);
+			if (j == 0) {
+				memcpy((void *)((uintptr_t)descriptors[i] + offset), jbd->superblock->uuid, JBD_UUID_SIZE);
+				offset += JBD_UUID_SIZE;
+			}
+
+			// blocks that look like a journal block have the magic taken out while in the log
+			if (*(uint32_t *)buffer->copy == cpu_to_be_d(JBD_MAGIC)) {
+				flags |= JBD_TAG_ESCAPE;
+				buffer->escaped = true;
+				*(uint32_t *)buffer->copy = 0;
+			}
+
+			if (j == tagsperdesc - 1 || buffer->next == NULL)
+				flags |= JBD_TAG_LAST;
+
+			tag->block = cpu_to_be_d(buffer->block);
+			tag->flags = cpu_to_be_d(flags);
+			blocks[blockcount++] = buffer->copy;
+			buffer = buffer->next;
+		}
+	}
+
+	commit = newblock(JBD_BLOCKTYPE_COMMIT, sequence);
+	if (commit == NULL)
+		goto cleanup;
+
+	uintmax_t first = be_to_cpu_d(jbd->superblock->first);
+	e = logwrite(jbd, first, blocks, blockcount, 0);
+	if (e == 0)
+		e = flush(jbd);
+
+	// the transaction only counts once the commit block is there, so it goes after everything else
+	if (e == 0)
+		e = logwrite(jbd, first + blockcount, &commit, 1, V_FFLAGS_FUA);
+
+	cleanup:
+	for (buffer = buffers; buffer; buffer = buffer->next) {
+		if (buffer->escaped)
+			*(uint32_t *)buffer->copy = cpu_to_be_d(JBD_MAGIC);
+	}
+
+	if (commit)
+		pmm_release(FROM_HHDM(commit));
+
+	for (size_t i = 0; i < descriptorcount; ++i)
+		pmm_release(FROM_HHDM(descriptors[i]));
+
+	if (blocks)
+		free(blocks);
+	if (descriptors)
+		free(descriptors);
+
+	return e;
+}
+
+// logs the transaction and writes it home right away, so the next one can use the log from the start again
+static int writetransaction(jbd_t *jbd, jbdbuffer_t *buffers, size_t count, uint32_t sequence) {
+	int e = 0;
+	if (count > jbd->capacity) {
+		printf("jbd: transaction %u with %lu blocks is too big for the log, writing it unjournaled\n", sequence, count);
+	} else {
+		e = writelog(jbd, buffers, count, sequence);
+		if (e)
+			printf("jbd: error %d writing transaction %u to the log\n", e, sequence);
+	}
+
+	// even if it couldn't be logged, the changes are better off on disk than lost
+	int error = checkpoint(jbd, buffers);
+	e = e ? e : error;
+
+	// the log can't be let go of before the blocks are on disk
+	error = flush(jbd);
+	e = e ? e : error;
+
+	// the transaction is in place, recovery should start looking from the next one
+	jbd->superblock->sequence = cpu_to_be_d(sequence + 1);
+	error = writesuperblock(jbd);
+	return e ? e : error;
+}
+
+static void freetransaction(jbdbuffer_t *buffers) {
+	while (buffers) {
+		jbdbuffer_t *next = buffers->next;
+		free(buffers);
+		buffers = next;
+	}
+}
+
+static bool incommit(jbd_t *jbd, uintmax_t block) {
+	for (jbdbuffer_t *buffer = jbd->committing; buffer; buffer = buffer->next) {
+		if (buffer->block == block)
+			return true;
+	}
+
+	return false;
+}
+
+// called before a block is freed, so that an old copy of it doesn't get written over whatever it is reused for
+void jbd_forget(jbd_t *jbd, uintmax_t block) {
+	MUTEX_ACQUIRE(&jbd->lock, false);
+	// the buffer stays in the running transaction without a page, and gets dropped at commit time
+	jbdbuffer_t *buffer;
+	if (hashtable_get(&jbd->table, (void **)&buffer, &block, sizeof(block)) == 0 && buffer->page) {
+		pmm_release(pmm_getpageaddress(buffer->page));
+		buffer->page = NULL;
+	}
+
+	// a commit being written out might still have it
+	while (incommit(jbd, block)) {
+		eventlistener_t listener;
+		EVENT_INITLISTENER(&listener);
+		EVENT_ATTACH(&listener, &jbd->checkpointevent);
+		MUTEX_RELEASE(&jbd->lock);
+		EVENT_WAIT(&listener, 0);
+		EVENT_DETACHALL(&listener);
+		MUTEX_ACQUIRE(&jbd->lock, false);
+	}
+	MUTEX_RELEASE(&jbd->lock);
+}
+
+// commits the running transaction and waits for it to be on disk. commits that come in while another one is being
+// written get grouped into the next one
+int jbd_commit(jbd_t *jbd) {
+	// it can't be committed while this thread is in the middle of changing it
+	if (current_thread()->journal == jbd)
+		return 0;
+
+	MUTEX_ACQUIRE(&jbd->commitlock, false);
+	MUTEX_ACQUIRE(&jbd->lock, false);
+	if (jbd->count == 0) {
+		MUTEX_RELEASE(&jbd->lock);
+		MUTEX_RELEASE(&jbd->commitlock);
+		return 0;
+	}
+
+	drain(jbd);
+
+	// blocks freed since they got in don't need to be written
+	for (jbdbuffer_t **link = &jbd->buffers; *link;) {
+		jbdbuffer_t *buffer = *link;
+		if (buffer->page) {
+			link = &buffer->next;
+			continue;
+		}
+
+		*link = buffer->next;
+		hashtable_remove(&jbd->table, &buffer->block, sizeof(buffer->block));
+		free(buffer);
+		--jbd->count;
+	}
+
+	// take copies so new changes can be made to the pages while the transaction is written out
+	int e = 0;
+	for (jbdbuffer_t *buffer = jbd->buffers; buffer; buffer = buffer->next) {
+		void *address = pmm_allocpage(PMM_SECTION_DEFAULT);
+		if (address == NULL) {
+			e = ENOMEM;
+			break;
+		}
+
+		buffer->copy = MAKE_HHDM(address);
+		buffer->escaped = false;
+		memcpy(buffer->copy, MAKE_HHDM(pmm_getpageaddress(buffer->page)), PAGE_SIZE);
+	}
+
+	jbdbuffer_t *buffers = NULL;
+	size_t count = jbd->count;
+	uint32_t sequence = jbd->sequence;
+	if (e) {
+		// leave it running and try again later
+		for (jbdbuffer_t *buffer = jbd->buffers; buffer && buffer->copy; buffer = buffer->next) {
+			pmm_release(FROM_HHDM(buffer->copy));
+			buffer->copy = NULL;
+		}
+	} else if (count) {
+		// in disk order, for the checkpoint
+		buffers = sortbuffers(jbd->buffers);
+		for (jbdbuffer_t *buffer = buffers; buffer; buffer = buffer->next)
+			hashtable_remove(&jbd->table, &buffer->block, sizeof(buffer->block));
+
+		jbd->committing = buffers;
+		jbd->buffers = NULL;
+		jbd->count = 0;
+		++jbd->sequence;
+	}
+
+	jbd->locked = false;
+	EVENT_SIGNAL(&jbd->gateevent);
+	MUTEX_RELEASE(&jbd->lock);
+
+	if (buffers) {
+		e = writetransaction(jbd, buffers, count, sequence);
+		for (jbdbuffer_t *buffer = buffers; buffer; buffer = buffer->next) {
+			pmm_release(FROM_HHDM(buffer->copy));
+			pmm_release(pmm_getpageaddress(buffer->page));
+		}
+
+		MUTEX_ACQUIRE(&jbd->lock, false);
+		jbd->committing = NULL;
+		EVENT_SIGNAL(&jbd->checkpointevent);
+		MUTEX_RELEASE(&jbd->lock);
+		freetransaction(buffers);
+	}
+
+	MUTEX_RELEASE(&jbd->commitlock);
+	return e;
+}
+
+static void tick(context_t *, dpcarg_t arg) {
+	jbd_t *jbd = arg;
+	semaphore_signal(&jbd->wake);
+}
+
+static void committer() {
+	jbd_t *jbd = current_thread()->kernelarg;
+	timerentry_t timerentry;
+	interrupt_set(false);
+	timer_insert(current_cpu()->timer, &timerentry, tick, jbd, (uintmax_t)JBD_COMMIT_INTERVAL_SECONDS * 1000000, true);
+	interrupt_set(true);
+	for (;;) {
+		semaphore_wait(&jbd->wake, false);
+		int e = jbd_commit(jbd);
+		if (e)
+			printf("jbd: commit failed with error %d\n", e);
+	}
+}
+
+// starts journaling changes, once whatever was in the log has been recovered
+int jbd_run(jbd_t *jbd) {
+	// transactions hold device cache pages, so a block has to be a whole page
+	if (jbd->blocksize != PAGE_SIZE)
+		return ENOTSUP;
+
+	jbdsuperblock_t *superblock = jbd->superblock;
+	size_t first = be_to_cpu_d(superblock->first);
+	size_t tagsperdesc = (jbd->blocksize - sizeof(jbdheader_t) - JBD_UUID_SIZE) / sizeof(jbdtag_t);
+	// leaving space for the descriptors and the commit block
+	jbd->capacity = (jbd->maxlen - first - 2) * tagsperdesc / (tagsperdesc + 1);
+
+	int e = hashtable_init(&jbd->table, 1024);
+	if (e)
+		return e;
+
+	superblock->start = cpu_to_be_d(first);
+	superblock->sequence = cpu_to_be_d(jbd->sequence);
+	// commit blocks don't carry a checksum
+	if (be_to_cpu_d(superblock->header.blocktype) == JBD_BLOCKTYPE_SUPERBLOCKV2)
+		superblock->compat &= ~cpu_to_be_d(JBD_COMPAT_CHECKSUM);
+
+	e = writesuperblock(jbd);
+	if (e) {
+		hashtable_destroy(&jbd->table);
+		return e;
+	}
+
+	thread_t *thread = sched_newthread(committer, PAGE_SIZE * 4, 1, NULL, NULL);
+	__assert(thread);
+	thread->kernelarg = jbd;
+	sched_queue(thread);
+	return 0;
+}
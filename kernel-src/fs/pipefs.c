@@ -4,6 +4,7 @@
 #include <kernel/alloc.h>
 #include <kernel/timekeeper.h>
 #include <kernel/vmm.h>
+#include <kernel/pmm.h>
 #include <logging.h>
 #include <errno.h>
 #include <kernel/abi.h>
@@ -20,6 +21,70 @@ static vops_t vnops;
 #define INTERNAL_LOCK(v) MUTEX_ACQUIRE(&(v)->lock, false)
 #define INTERNAL_UNLOCK(v) MUTEX_RELEASE(&(v)->lock)
 
+// spliced pages count towards the size of the pipe like the bytes in the ring buffer. the ring buffer alone
+// would take more than that. pages put back by a splice out can go over the size for a while
+#define DATACOUNT(p) (RINGBUFFER_DATACOUNT(&(p)->data) + (p)->pagebytes)
+#define FREESPACE(p) (DATACOUNT(p) >= BUFFER_SIZE ? 0 : BUFFER_SIZE - DATACOUNT(p))
+
+static void appendbuffer(pipenode_t *pipenode, pipebuffer_t *buffer) {
+	buffer->next = NULL;
+	if (pipenode->bufferstail)
+		pipenode->bufferstail->next = buffer;
+	else
+		pipenode->buffers = buffer;
+
+	pipenode->bufferstail = buffer;
+}
+
+// removes count bytes from the first buffer of the queue, the bytes themselves have to be taken out of the ring
+// buffer by the caller if it isn't a page
+static void consumebuffer(pipenode_t *pipenode, size_t count) {
+	pipebuffer_t *buffer = pipenode->buffers;
+	buffer->offset += count;
+	buffer->length -= count;
+	if (buffer->page)
+		pipenode->pagebytes -= count;
+
+	if (buffer->length)
+		return;
+
+	pipenode->buffers = buffer->next;
+	if (pipenode->buffers == NULL)
+		pipenode->bufferstail = NULL;
+
+	if (buffer->page)
+		pmm_release(buffer->page);
+
+	free(buffer);
+}
+
+static size_t readfrompipe(pipenode_t *pipenode, iovec_iterator_t *iovec_iterator, size_t size) {
+	if (pipenode->buffers == NULL)
+		return iovec_iterator_read_from_ringbuffer(iovec_iterator, &pipenode->data, size);
+
+	size_t done = 0;
+	while (done < size && pipenode->buffers) {
+		pipebuffer_t *buffer = pipenode->buffers;
+		size_t count = min(size - done, buffer->length);
+
+		if (buffer->page) {
+			if (iovec_iterator_copy_from_buffer(iovec_iterator, (void *)((uintptr_t)MAKE_HHDM(buffer->page) + buffer->offset), count))
+				return done ? done : RINGBUFFER_USER_COPY_FAILED;
+		} else {
+			size_t readc = iovec_iterator_read_from_ringbuffer(iovec_iterator, &pipenode->data, count);
+			if (readc == RINGBUFFER_USER_COPY_FAILED)
+				return done ? done : RINGBUFFER_USER_COPY_FAILED;
+
+			__assert(readc == count);
+		}
+
+		consumebuffer(pipenode, count);
+		done += count;
+	}
+
+	return done;
+}
+
 int pipefs_close(vnode_t *node, int flags, cred_t *cred) {
 	INTERNAL_LOCK(node);
 	pipenode_t *pipenode = (pipenode_t *)node;
@@ -110,7 +175,7 @@ static int internalpoll(vnode_t *node, polldata_t *data, int events) {
 		events |= POLLHUP;
 		if (pipenode->writers == 0)
 			revents |= POLLHUP;
-		else if (RINGBUFFER_DATACOUNT(&pipenode->data) > 0)
+		else if (DATACOUNT(pipenode) > 0)
 			revents |= POLLIN;
 	}
 
@@ -120,7 +185,7 @@ static int internalpoll(vnode_t *node, polldata_t *data, int events) {
 			revents |= POLLERR;
 		// poll will only return POLLOUT if an atomic write can be done without blocking
 		// this is undocumented in POSIX but many unices implement it like this
-		else if (RINGBUFFER_DATACOUNT(&pipenode->data) < BUFFER_SIZE - PIPE_ATOMIC_SIZE)
+		else if (DATACOUNT(pipenode) < BUFFER_SIZE - PIPE_ATOMIC_SIZE)
 			revents |= POLLOUT;
 	}
 
@@ -130,6 +195,32 @@ static int internalpoll(vnode_t *node, polldata_t *data, int events) {
 	return revents;
 }
 
+// waits for one of events to be possible on the pipe. called with the lock held and returns with it held,
+// except if there was an error
+static int waitpipe(vnode_t *node, int events) {
+	polldesc_t desc = {0};
+	int error = poll_initdesc(&desc, 1);
+	if (error) {
+		INTERNAL_UNLOCK(node);
+		return error;
+	}
+
+	internalpoll(node, &desc.data[0], events);
+
+	INTERNAL_UNLOCK(node);
+
+	error = poll_dowait(&desc, 0);
+
+	poll_leave(&desc);
+	poll_destroydesc(&desc);
+
+	if (error)
+		return error;
+
+	INTERNAL_LOCK(node);
+	return 0;
+}
+
 int pipefs_read(vnode_t *node, iovec_iterator_t *iovec_iterator, size_t size, uintmax_t offset, int flags, size_t *readc, cred_t *cred) {
 	pipenode_t *pipenode = (pipenode_t *)node;
 	INTERNAL_LOCK(node);
@@ -170,12 +261,12 @@ int pipefs_read(vnode_t *node, iovec_iterator_t *iovec_iterator, size_t size, ui
 		INTERNAL_LOCK(node);
 	}
 
-	*readc = iovec_iterator_read_from_ringbuffer(iovec_iterator, &pipenode->data, size);
+	*readc = readfrompipe(pipenode, iovec_iterator, size);
 	if (*readc == RINGBUFFER_USER_COPY_FAILED)
 		error = EFAULT;
 
 	// signal that there is space to write for any threads blocked on this pipe
-	if (RINGBUFFER_DATACOUNT(&pipenode->data) < BUFFER_SIZE - PIPE_ATOMIC_SIZE)
+	if (DATACOUNT(pipenode) < BUFFER_SIZE - PIPE_ATOMIC_SIZE)
 		poll_event(&pipenode->pollheader, POLLOUT);
 
 	leave:
@@ -191,11 +282,32 @@ static int writetopipe(pipenode_t *pipenode, iovec_iterator_t *iovec_iterator, s
 		return EPIPE;
 	}
 
+	// the ring buffer has room for the bytes held as pages too
+	size = min(size, FREESPACE(pipenode));
+
+	// bytes written after a spliced page have to come out after it
+	pipebuffer_t *buffer = NULL;
+	if (pipenode->bufferstail && pipenode->bufferstail->page) {
+		buffer = alloc(sizeof(pipebuffer_t));
+		if (buffer == NULL)
+			return ENOMEM;
+	}
+
 	*writec = iovec_iterator_write_to_ringbuffer(iovec_iterator, &pipenode->data, size);
-	if (*writec == RINGBUFFER_USER_COPY_FAILED)
+	if (*writec == RINGBUFFER_USER_COPY_FAILED) {
+		if (buffer)
+			free(buffer);
 		return EFAULT;
+	}
 
 	__assert(*writec);
+	if (buffer) {
+		buffer->length = *writec;
+		appendbuffer(pipenode, buffer);
+	} else if (pipenode->bufferstail) {
+		pipenode->bufferstail->length += *writec;
+	}
+
 	poll_event(&pipenode->pollheader, POLLIN);
 	return 0;
 }
@@ -227,7 +339,7 @@ int pipefs_write(vnode_t *node, iovec_iterator_t *iovec_iterator, size_t size, u
 		if (revents & POLLHUP)
 			break;
 
-		size_t freebytes = RINGBUFFER_FREESPACE(&pipenode->data);
+		size_t freebytes = FREESPACE(pipenode);
 		// case 1
 		if (nonblock == false && atomic && freebytes >= size)
 			break;
@@ -296,6 +408,219 @@ int pipefs_write(vnode_t *node, iovec_iterator_t *iovec_iterator, size_t size, u
 	return error;
 }
 
+// queues length bytes of a page by reference, taking over the reference held by the caller.
+// the page must not change while it is in the pipe, so cache pages have to be lent out first
+int pipefs_splicepage(vnode_t *node, void *page, size_t offset, size_t length, int flags) {
+	pipenode_t *pipenode = (pipenode_t *)node;
+	if (node->ops != &vnops)
+		return EOPNOTSUPP;
+
+	pipebuffer_t *buffer = alloc(sizeof(pipebuffer_t));
+	if (buffer == NULL)
+		return ENOMEM;
+
+	INTERNAL_LOCK(node);
+	int error = 0;
+
+	// a page is never bigger than PIPE_ATOMIC_SIZE, so this works like an atomic write
+	while (FREESPACE(pipenode) < length && pipenode->readers) {
+		if (flags & V_FFLAGS_NONBLOCKING) {
+			error = EAGAIN;
+			goto leave;
+		}
+
+		error = waitpipe(node, POLLOUT);
+		if (error) {
+			free(buffer);
+			return error;
+		}
+	}
+
+	if (pipenode->readers == 0) {
+		if (current_thread()->proc)
+			signal_signalproc(current_thread()->proc, SIGPIPE);
+
+		error = EPIPE;
+		goto leave;
+	}
+
+	// whatever is already in the ring buffer comes out first
+	size_t ringbytes = RINGBUFFER_DATACOUNT(&pipenode->data);
+	if (pipenode->buffers == NULL && ringbytes) {
+		pipebuffer_t *ringbuffer = alloc(sizeof(pipebuffer_t));
+		if (ringbuffer == NULL) {
+			error = ENOMEM;
+			goto leave;
+		}
+
+		ringbuffer->length = ringbytes;
+		appendbuffer(pipenode, ringbuffer);
+	}
+
+	buffer->page = page;
+	buffer->offset = offset;
+	buffer->length = length;
+	appendbuffer(pipenode, buffer);
+	pipenode->pagebytes += length;
+	buffer = NULL;
+
+	poll_event(&pipenode->pollheader, POLLIN);
+
+	leave:
+	INTERNAL_UNLOCK(node);
+	if (buffer)
+		free(buffer);
+
+	return error;
+}
+
+// takes up to size bytes from the front of the pipe as a list of page buffers, so they can be written out without
+// the lock. bytes in the ring buffer get copied to a new page. lock expected to be held
+static pipebuffer_t *takebuffers(pipenode_t *pipenode, size_t size) {
+	pipebuffer_t *list = NULL;
+	pipebuffer_t **link = &list;
+	size_t taken = 0;
+
+	while (taken < size && DATACOUNT(pipenode)) {
+		pipebuffer_t *buffer = pipenode->buffers;
+		pipebuffer_t *newbuffer = alloc(sizeof(pipebuffer_t));
+		if (newbuffer == NULL)
+			break;
+
+		size_t count;
+		if (buffer && buffer->page) {
+			count = min(buffer->length, size - taken);
+			pmm_hold(buffer->page);
+			newbuffer->page = buffer->page;
+			newbuffer->offset = buffer->offset;
+		} else {
+			count = min(min(RINGBUFFER_DATACOUNT(&pipenode->data), PAGE_SIZE), size - taken);
+			if (buffer)
+				count = min(count, buffer->length);
+
+			newbuffer->page = pmm_allocpage(PMM_SECTION_DEFAULT);
+			if (newbuffer->page == NULL) {
+				free(newbuffer);
+				break;
+			}
+
+			__assert(ringbuffer_read(&pipenode->data, MAKE_HHDM(newbuffer->page), count) == count);
+		}
+
+		newbuffer->length = count;
+		if (buffer)
+			consumebuffer(pipenode, count);
+
+		*link = newbuffer;
+		link = &newbuffer->next;
+		taken += count;
+	}
+
+	return list;
+}
+
+// puts what a splice out couldn't write back at the front of the pipe. ringentry is used if the bytes in the ring
+// buffer need an entry of their own to come out after the pages, and is set to NULL then. lock expected to be held
+static void requeuebuffers(pipenode_t *pipenode, pipebuffer_t *list, pipebuffer_t **ringentry) {
+	size_t ringbytes = RINGBUFFER_DATACOUNT(&pipenode->data);
+	if (pipenode->buffers == NULL && ringbytes) {
+		(*ringentry)->length = ringbytes;
+		appendbuffer(pipenode, *ringentry);
+		*ringentry = NULL;
+	}
+
+	pipebuffer_t *last = list;
+	for (pipebuffer_t *buffer = list; buffer; buffer = buffer->next) {
+		pipenode->pagebytes += buffer->length;
+		last = buffer;
+	}
+
+	last->next = pipenode->buffers;
+	if (pipenode->bufferstail == NULL)
+		pipenode->bufferstail = last;
+
+	pipenode->buffers = list;
+	poll_event(&pipenode->pollheader, POLLIN);
+}
+
+// writes up to size bytes from the pipe into out straight from the spliced pages, so they are only copied by out.
+// like a read, it waits for data unless nonblocking. the data is taken out of the pipe before the writes so that
+// the lock isn't held while out blocks, and whatever couldn't be written is put back at the front
+int pipefs_spliceout(vnode_t *node, int flags, vnode_t *out, uintmax_t outoffset, int outflags, size_t size, size_t *done) {
+	pipenode_t *pipenode = (pipenode_t *)node;
+	if (node->ops != &vnops)
+		return EOPNOTSUPP;
+
+	// it could end up waiting for space only it can make
+	if (out == node)
+		return EINVAL;
+
+	// allocated now as putting data back can't fail
+	pipebuffer_t *ringentry = alloc(sizeof(pipebuffer_t));
+	if (ringentry == NULL)
+		return ENOMEM;
+
+	INTERNAL_LOCK(node);
+	int error = 0;
+	*done = 0;
+
+	while (internalpoll(node, NULL, POLLIN) == 0) {
+		if (flags & V_FFLAGS_NONBLOCKING) {
+			error = EAGAIN;
+			INTERNAL_UNLOCK(node);
+			goto leave;
+		}
+
+		error = waitpipe(node, POLLIN);
+		if (error)
+			goto leave;
+	}
+
+	pipebuffer_t *list = takebuffers(pipenode, size);
+	if (list == NULL && DATACOUNT(pipenode))
+		error = ENOMEM;
+
+	if (DATACOUNT(pipenode) < BUFFER_SIZE - PIPE_ATOMIC_SIZE)
+		poll_event(&pipenode->pollheader, POLLOUT);
+
+	INTERNAL_UNLOCK(node);
+
+	while (list) {
+		size_t written = 0;
+		size_t count = list->length;
+		error = vfs_write(out, (void *)((uintptr_t)MAKE_HHDM(list->page) + list->offset), count, outoffset + *done, &written, outflags);
+		*done += written;
+		list->offset += written;
+		list->length -= written;
+
+		if (list->length == 0) {
+			pipebuffer_t *next = list->next;
+			pmm_release(list->page);
+			free(list);
+			list = next;
+		}
+
+		if (error || written < count)
+			break;
+	}
+
+	if (list) {
+		INTERNAL_LOCK(node);
+		requeuebuffers(pipenode, list, &ringentry);
+		INTERNAL_UNLOCK(node);
+	}
+
+	// report what was moved, the error will show up again on the next call
+	if (*done)
+		error = 0;
+
+	leave:
+	if (ringentry)
+		free(ringentry);
+
+	return error;
+}
+
 int pipefs_poll(vnode_t *node, polldata_t *data, int events) {
 	int revents = 0;
 	INTERNAL_LOCK(node);
@@ -340,6 +665,9 @@ int pipefs_setattr(vnode_t *node, vattr_t *attr, int which, cred_t *cred) {
 int pipefs_inactive(vnode_t *node) {
 	pipenode_t *pipenode = (pipenode_t *)node;
 	INTERNAL_LOCK(node);
+	while (pipenode->buffers)
+		consumebuffer(pipenode, pipenode->buffers->length);
+
 	ringbuffer_destroy(&pipenode->data);
 	slab_free(nodecache, node);
 	return 0;
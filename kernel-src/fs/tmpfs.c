@@ -441,7 +441,7 @@ static int tmpfs_getdents(vnode_t *node, dent_t *buffer, size_t count, uintmax_t
 		tmpfsnode_t *itmpnode = entry->value;
 
 		ent->d_ino = itmpnode->attr.inode;
-		ent->d_off = offset;
+		ent->d_off = offset + *readcount + 1;
 		ent->d_reclen = sizeof(dent_t);
 		ent->d_type = vfs_getposixtype(itmpnode->vnode.type);
 		memcpy(ent->d_name, entry->key, entry->keysize);
@@ -497,7 +497,7 @@ static int tmpfs_putpage(vnode_t *node, uintmax_t offset, struct page_t *page) {
 	return 0;
 }
 
-static int tmpfs_sync(vnode_t *node) {
+static int tmpfs_sync(vnode_t *node, int flags) {
 	// sync is a no-op on tmpfs
 	return 0;
 }
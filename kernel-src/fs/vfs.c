@@ -11,12 +11,19 @@
 #include <kernel/block.h>
 #include <kernel/pipefs.h>
 #include <kernel/auth.h>
+#include <kernel/cmdline.h>
+#include <kernel/timekeeper.h>
+#include <kernel/dcache.h>
 
 #define PATHNAME_MAX 512
 #define MAXLINKDEPTH 64
 
+// reads of at least this size map whole cache pages into page aligned user buffers instead of copying
+#define ZEROCOPY_MINSIZE (PAGE_SIZE * 16)
+
 static hashtable_t fstable;
 vnode_t *vfsroot;
+static bool zerocopyreads;
 
 static spinlock_t listlock;
 static vfs_t *vfslist;
@@ -57,6 +64,8 @@ void vfs_init() {
 	vfsroot->type = V_TYPE_DIR;
 	vfsroot->refcount = 1;
 	vfsroot->ops = &vnops;
+	zerocopyreads = cmdline_get("nozerocopy") == NULL;
+	dcache_init();
 }
 
 int vfs_register(vfsops_t *ops, char *name) {
@@ -182,6 +191,7 @@ int vfs_create(vnode_t *ref, char *path, vattr_t *attr, int type, vnode_t **node
 
 	vnode_t *ret;
 	err = VOP_CREATE(parent, component, attr, type, &ret, getcred());
+	dcache_remove(parent, component);
 	VOP_RELEASE(parent);
 	if (err) {
 		VOP_UNLOCK(parent);
@@ -218,7 +228,7 @@ static int writenocache(vnode_t *node, page_t *page, uintmax_t pageoffset) {
 	VOP_LOCK(node);
 	int e;
 	if (node->type == V_TYPE_REGULAR)
-		e = VOP_SYNC(node);
+		e = VOP_SYNC(node, 0);
 	else
 		e = vmmcache_syncvnode(node, pageoffset, PAGE_SIZE);
 	VOP_UNLOCK(node);
@@ -229,6 +239,154 @@ static int writenocache(vnode_t *node, page_t *page, uintmax_t pageoffset) {
 	return e;
 }
 
+// reads or writes a regular file straight from or into the device under it by going through the filesystem block map.
+// returns EOPNOTSUPP without doing anything if the filesystem or the request alignment doesn't allow it
+static int rwdirect(vnode_t *node, iovec_iterator_t *iovec_iterator, size_t size, uintmax_t offset, bool write, size_t *done) {
+	if (node->ops->bmap == NULL)
+		return EOPNOTSUPP;
+
+	vnode_t *device;
+	uintmax_t deviceoffset;
+	size_t contiguous;
+
+	// only to find the device, nothing gets allocated until the request is known to be doable
+	VOP_LOCK(node);
+	int err = VOP_BMAP(node, offset, size, false, &device, &deviceoffset, &contiguous);
+	VOP_UNLOCK(node);
+	if (err)
+		return err;
+
+	blockdesc_t blockdesc;
+	int r;
+	VOP_LOCK(device);
+	err = VOP_IOCTL(device, BLOCK_IOCTL_GETDESC, &blockdesc, &r, NULL);
+	VOP_UNLOCK(device);
+	if (err)
+		return err;
+
+	if ((offset % blockdesc.blocksize) || (size % blockdesc.blocksize) || iovec_iterator_aligned(iovec_iterator, blockdesc.blocksize, true) == false)
+		return EOPNOTSUPP;
+
+	// the device will access the user pages directly, so make sure they are there and writable if needed
+	for (iovec_t *iovec = iovec_iterator->current; iovec < iovec_iterator->iovec + iovec_iterator->count; ++iovec) {
+		err = vmm_faultin(iovec->addr, iovec->len, write == false);
+		if (err)
+			return err;
+	}
+
+	// the disk has to have the latest data before anything is read or overwritten
+	VOP_LOCK(node);
+	err = vmmcache_syncvnode(node, offset, size);
+	VOP_UNLOCK(node);
+	if (err)
+		return err;
+
+	*done = 0;
+	while (*done < size) {
+		// a write keeps the filesystem operation open until its data is on the disk, so the blocks given to the file
+		// aren't published before that
+		VOP_LOCK(node);
+		err = VOP_BMAP(node, offset + *done, size - *done, write, &device, &deviceoffset, &contiguous);
+		VOP_UNLOCK(node);
+		if (err)
+			break;
+
+		size_t docount = min(contiguous, size - *done);
+		size_t devicedone = docount;
+
+		if (deviceoffset == 0) {
+			// hole in the file
+			__assert(write == false);
+			err = iovec_iterator_memset(iovec_iterator, 0, docount);
+		} else {
+			// the cache of the device can have pages for these blocks, from zeroing a newly allocated block
+			// or from a past life as metadata. they go to the disk first and are dropped after a write,
+			// or a later writeback would put the old contents over the new data
+			VOP_LOCK(device);
+			err = vmmcache_syncvnode(device, deviceoffset, docount);
+			VOP_UNLOCK(device);
+
+			// the block layer doesn't need the device vnode to be locked
+			if (err)
+				devicedone = 0;
+			else if (write)
+				err = VOP_WRITE(device, iovec_iterator, docount, deviceoffset, 0, &devicedone, NULL);
+			else
+				err = VOP_READ(device, iovec_iterator, docount, deviceoffset, 0, &devicedone, NULL);
+
+			if (write && devicedone)
+				vmmcache_invalidate(device, deviceoffset, devicedone);
+		}
+
+		if (write)
+			VOP_BMAPEND(node);
+
+		if (err)
+			break;
+
+		*done += devicedone;
+		if (devicedone != docount)
+			break;
+	}
+
+	if (write && *done) {
+		// whatever was left in the cache for this range is now stale
+		vmmcache_invalidate(node, offset, *done);
+
+		vattr_t attr;
+		attr.mtime = timekeeper_time();
+		VOP_LOCK(node);
+		VOP_SETATTR(node, &attr, V_ATTR_MTIME, getcred());
+		VOP_UNLOCK(node);
+	}
+
+	return err;
+}
+
+// raw mode for block devices: reads or writes go to the driver as a single transfer instead of a page at a time
+// through the cache. user buffers aligned to the block size are used by the device directly, others are bounced by
+// the block layer. returns EOPNOTSUPP without doing anything if the request isn't made of whole blocks
+static int rwraw(vnode_t *node, iovec_iterator_t *iovec_iterator, size_t size, uintmax_t offset, bool write, size_t *done) {
+	blockdesc_t blockdesc;
+	int r;
+	VOP_LOCK(node);
+	int err = VOP_IOCTL(node, BLOCK_IOCTL_GETDESC, &blockdesc, &r, NULL);
+	VOP_UNLOCK(node);
+	if (err)
+		return err;
+
+	if ((offset % blockdesc.blocksize) || (size % blockdesc.blocksize))
+		return EOPNOTSUPP;
+
+	if (iovec_iterator_aligned(iovec_iterator, blockdesc.blocksize, true)) {
+		for (iovec_t *iovec = iovec_iterator->current; iovec < iovec_iterator->iovec + iovec_iterator->count; ++iovec) {
+			err = vmm_faultin(iovec->addr, iovec->len, write == false);
+			if (err)
+				return err;
+		}
+	}
+
+	// the disk has to have the latest data before anything is read or overwritten
+	VOP_LOCK(node);
+	err = vmmcache_syncvnode(node, offset, size);
+	VOP_UNLOCK(node);
+	if (err)
+		return err;
+
+	// the block layer doesn't need the device vnode to be locked
+	*done = 0;
+	if (write)
+		err = VOP_WRITE(node, iovec_iterator, size, offset, 0, done, NULL);
+	else
+		err = VOP_READ(node, iovec_iterator, size, offset, 0, done, NULL);
+
+	// whatever was left in the cache for this range is now stale
+	if (write && *done)
+		vmmcache_invalidate(node, offset, *done);
+
+	return err;
+}
+
 int vfs_write_iovec(vnode_t *node, iovec_iterator_t *iovec_iterator, size_t size, uintmax_t offset, size_t *written, int flags) {
 	int err = 0;
 	if (vfs_iscacheable(node)) {
@@ -243,24 +401,35 @@ int vfs_write_iovec(vnode_t *node, iovec_iterator_t *iovec_iterator, size_t size
 			goto leave;
 		}
 
-		MUTEX_ACQUIRE(&node->size_lock, false);
-
+		// writes within the file share the lock with readers, only an extension needs it exclusively
+		bool exclusive = false;
 		vattr_t attr;
+		rwlock_acquireread(&node->size_lock);
+
+		relock:
 		VOP_LOCK(node);
 		err = VOP_GETATTR(node, &attr, getcred());
 		VOP_UNLOCK(node);
 		if (err)
-			goto leave;
+			goto unlock;
 
 		size_t newsize = size + offset > attr.size ? size + offset : 0;
 
 		if (node->type == V_TYPE_REGULAR && newsize) {
+			if (exclusive == false) {
+				// the size could have changed while the lock wasn't held, so check it again
+				rwlock_releaseread(&node->size_lock);
+				rwlock_acquirewrite(&node->size_lock);
+				exclusive = true;
+				goto relock;
+			}
+
 			// do resize stuff if regular and applicable
 			VOP_LOCK(node);
 			err = VOP_RESIZE(node, newsize, &current_thread()->proc->cred);
 			VOP_UNLOCK(node);
 			if (err)
-				goto leave;
+				goto unlock;
 		} else if (node->type == V_TYPE_BLKDEV) {
 			// else just get the disk size and limit the read size
 			blockdesc_t blockdesc;
@@ -273,20 +442,34 @@ int vfs_write_iovec(vnode_t *node, iovec_iterator_t *iovec_iterator, size_t size
 			size_t bytesize = blockdesc.blockcapacity * blockdesc.blocksize;
 
 			if (offset >= bytesize)
-				goto leave;
+				goto unlock;
 
 			size = min(size + offset, bytesize) - offset;
 		}
 
+		if (flags & V_FFLAGS_DIRECT) {
+			if (node->type == V_TYPE_REGULAR)
+				err = rwdirect(node, iovec_iterator, size, offset, true, written);
+			else
+				err = rwraw(node, iovec_iterator, size, offset, true, written);
+
+			if (err != EOPNOTSUPP)
+				goto unlock;
+
+			// can't be done directly, but still don't keep anything in the cache
+			err = 0;
+			flags |= V_FFLAGS_NOCACHE;
+		}
+
 		uintmax_t pageoffset, pagecount, startoffset;
 		bytestopages(offset, size, &pageoffset, &pagecount, &startoffset);
 		page_t *page = NULL;
 
 		if (startoffset) {
 			// unaligned first page
-			err = vmmcache_getpage(node, pageoffset * PAGE_SIZE, &page);
+			err = vmmcache_getwritablepage(node, pageoffset * PAGE_SIZE, &page);
 			if (err)
-				goto leave;
+				goto unlock;
 
 			size_t writesize = min(PAGE_SIZE - startoffset, size);
 			void *address = MAKE_HHDM(pmm_getpageaddress(page));
@@ -294,7 +477,7 @@ int vfs_write_iovec(vnode_t *node, iovec_iterator_t *iovec_iterator, size_t size
 			err = iovec_iterator_copy_to_buffer(iovec_iterator, (void *)((uintptr_t)address + startoffset), writesize);
 			if (err) {
 				pmm_release(FROM_HHDM(address));
-				goto leave;
+				goto unlock;
 			}
 
 			vmmcache_makedirty(page);
@@ -307,14 +490,14 @@ int vfs_write_iovec(vnode_t *node, iovec_iterator_t *iovec_iterator, size_t size
 
 			pmm_release(FROM_HHDM(address));
 			if (err)
-				goto leave;
+				goto unlock;
 		}
 
 		for (uintmax_t offset = 0; offset < pagecount * PAGE_SIZE; offset += PAGE_SIZE) {
 			// the other pages
-			err = vmmcache_getpage(node, pageoffset * PAGE_SIZE + offset, &page);
+			err = vmmcache_getwritablepage(node, pageoffset * PAGE_SIZE + offset, &page);
 			if (err)
-				goto leave;
+				goto unlock;
 
 			size_t writesize = min(PAGE_SIZE, size - *written);
 			void *address = MAKE_HHDM(pmm_getpageaddress(page));
@@ -322,7 +505,7 @@ int vfs_write_iovec(vnode_t *node, iovec_iterator_t *iovec_iterator, size_t size
 			err = iovec_iterator_copy_to_buffer(iovec_iterator, address, writesize);
 			if (err) {
 				pmm_release(FROM_HHDM(address));
-				goto leave;
+				goto unlock;
 			}
 
 			vmmcache_makedirty(page);
@@ -334,11 +517,14 @@ int vfs_write_iovec(vnode_t *node, iovec_iterator_t *iovec_iterator, size_t size
 			pmm_release(FROM_HHDM(address));
 
 			if (err)
-				goto leave;
+				goto unlock;
 		}
 
-		leave:
-		MUTEX_RELEASE(&node->size_lock);
+		unlock:
+		if (exclusive)
+			rwlock_releasewrite(&node->size_lock);
+		else
+			rwlock_releaseread(&node->size_lock);
 	} else {
 		// special file, just write as its not being cached
 		VOP_LOCK(node);
@@ -346,9 +532,50 @@ int vfs_write_iovec(vnode_t *node, iovec_iterator_t *iovec_iterator, size_t size
 		VOP_UNLOCK(node);
 	}
 
+	leave:
 	return err;
 }
 
+// maps a whole cache page copy on write into a page aligned user buffer instead of copying it
+static bool trycowmap(iovec_iterator_t *iovec_iterator, page_t *page) {
+	size_t contiguous;
+	void *address = iovec_iterator_current_address(iovec_iterator, &contiguous);
+
+	if (IS_USER_ADDRESS(address) == false || ((uintptr_t)address % PAGE_SIZE) || contiguous < PAGE_SIZE)
+		return false;
+
+	if (vmmcache_lendpage(page) || vmm_cowmap(address, pmm_getpageaddress(page)))
+		return false;
+
+	iovec_iterator_skip(iovec_iterator, PAGE_SIZE);
+	return true;
+}
+
+// size of a cacheable node (regular file or block device)
+static int getnodesize(vnode_t *node, size_t *size) {
+	if (node->type == V_TYPE_REGULAR) {
+		vattr_t attr;
+		VOP_LOCK(node);
+		int err = VOP_GETATTR(node, &attr, getcred());
+		VOP_UNLOCK(node);
+		if (err)
+			return err;
+
+		*size = attr.size;
+	} else {
+		blockdesc_t blockdesc;
+		int r;
+		VOP_LOCK(node);
+		int err = VOP_IOCTL(node, BLOCK_IOCTL_GETDESC, &blockdesc, &r, NULL);
+		VOP_UNLOCK(node);
+		__assert(err == 0);
+
+		*size = blockdesc.blockcapacity * blockdesc.blocksize;
+	}
+
+	return 0;
+}
+
 int vfs_read_iovec(vnode_t *node, iovec_iterator_t *iovec_iterator, size_t size, uintmax_t offset, size_t *bytesread, int flags) {
 	int err = 0;
 	if (vfs_iscacheable(node)) {
@@ -365,33 +592,34 @@ int vfs_read_iovec(vnode_t *node, iovec_iterator_t *iovec_iterator, size_t size,
 
 		size_t nodesize = 0;
 
-		MUTEX_ACQUIRE(&node->size_lock, false);
-		if (node->type == V_TYPE_REGULAR) {
-			vattr_t attr;
-			VOP_LOCK(node);
-			err = VOP_GETATTR(node, &attr, getcred());
-			VOP_UNLOCK(node);
-			if (err)
-				goto leave;
-
-			nodesize = attr.size;
-		} else {
-			blockdesc_t blockdesc;
-			int r;
-			VOP_LOCK(node);
-			err = VOP_IOCTL(node, BLOCK_IOCTL_GETDESC, &blockdesc, &r, NULL);
-			VOP_UNLOCK(node);
-			__assert(err == 0);
-
-			nodesize = blockdesc.blockcapacity * blockdesc.blocksize;
-		}
+		// readers only need the size to stay stable against truncation, so any number of them can run at once
+		rwlock_acquireread(&node->size_lock);
+		err = getnodesize(node, &nodesize);
+		if (err)
+			goto unlock;
 
 		// read past end of file?
 		if (offset >= nodesize)
-			goto leave;
+			goto unlock;
 
 		size = min(size + offset, nodesize) - offset;
 
+		if (flags & V_FFLAGS_DIRECT) {
+			if (node->type == V_TYPE_REGULAR)
+				err = rwdirect(node, iovec_iterator, size, offset, false, bytesread);
+			else
+				err = rwraw(node, iovec_iterator, size, offset, false, bytesread);
+
+			if (err != EOPNOTSUPP)
+				goto unlock;
+
+			// can't be done directly, but still don't keep anything in the cache
+			err = 0;
+			flags |= V_FFLAGS_NOCACHE;
+		}
+
+		bool zerocopy = zerocopyreads && size >= ZEROCOPY_MINSIZE && (flags & V_FFLAGS_NOCACHE) == 0;
+
 		uintmax_t pageoffset, pagecount, startoffset;
 		bytestopages(offset, size, &pageoffset, &pagecount, &startoffset);
 		page_t *page = NULL;
@@ -400,7 +628,7 @@ int vfs_read_iovec(vnode_t *node, iovec_iterator_t *iovec_iterator, size_t size,
 			// unaligned first page
 			err = vmmcache_getpage(node, pageoffset * PAGE_SIZE, &page);
 			if (err)
-				goto leave;
+				goto unlock;
 
 			size_t readsize = min(PAGE_SIZE - startoffset, size);
 			void *address = MAKE_HHDM(pmm_getpageaddress(page));
@@ -408,7 +636,7 @@ int vfs_read_iovec(vnode_t *node, iovec_iterator_t *iovec_iterator, size_t size,
 			err = iovec_iterator_copy_from_buffer(iovec_iterator, (void *)((uintptr_t)address + startoffset), readsize);
 			if (err) {
 				pmm_release(FROM_HHDM(address));
-				goto leave;
+				goto unlock;
 			}
 
 			*bytesread += readsize;
@@ -427,15 +655,21 @@ int vfs_read_iovec(vnode_t *node, iovec_iterator_t *iovec_iterator, size_t size,
 			// the other pages
 			err = vmmcache_getpage(node, pageoffset * PAGE_SIZE + offset, &page);
 			if (err)
-				goto leave;
+				goto unlock;
 
 			size_t readsize = min(PAGE_SIZE, size - *bytesread);
 			void *address = MAKE_HHDM(pmm_getpageaddress(page));
 
+			if (zerocopy && readsize == PAGE_SIZE && trycowmap(iovec_iterator, page)) {
+				*bytesread += readsize;
+				pmm_release(FROM_HHDM(address));
+				continue;
+			}
+
 			err = iovec_iterator_copy_from_buffer(iovec_iterator, address, readsize);
 			if (err) {
 				pmm_release(FROM_HHDM(address));
-				goto leave;
+				goto unlock;
 			}
 
 			*bytesread += readsize;
@@ -445,14 +679,126 @@ int vfs_read_iovec(vnode_t *node, iovec_iterator_t *iovec_iterator, size_t size,
 			}
 			pmm_release(FROM_HHDM(address));
 		}
-		leave:
-		MUTEX_RELEASE(&node->size_lock);
+		unlock:
+		rwlock_releaseread(&node->size_lock);
 	} else {
 		// special file, just read as size doesn't matter
 		VOP_LOCK(node);
 		err = VOP_READ(node, iovec_iterator, size, offset, flags, bytesread, getcred());
 		VOP_UNLOCK(node);
 	}
+
+	leave:
+	return err;
+}
+
+// moves data from one node to another without going through userspace.
+// cache pages going into a pipe are lent to it by reference and a pipe is written out straight from what it holds.
+// other cacheable sources are written out straight from their cache pages, anything else goes through a bounce page.
+// a partial transfer is not an error, the amount moved is returned in done
+int vfs_splice(vnode_t *in, uintmax_t inoffset, int inflags, vnode_t *out, uintmax_t outoffset, int outflags, size_t size, size_t *done) {
+	int err = 0;
+	*done = 0;
+
+	if (size == 0)
+		return 0;
+
+	if (vfs_iscacheable(in)) {
+		// the size lock is not held across the writes as out might be the same node,
+		// a truncation in the middle will just make vmmcache_getpage return ENXIO
+		size_t nodesize;
+		rwlock_acquireread(&in->size_lock);
+		err = getnodesize(in, &nodesize);
+		rwlock_releaseread(&in->size_lock);
+		if (err || inoffset >= nodesize)
+			return err;
+
+		size = min(size, nodesize - inoffset);
+
+		while (*done < size) {
+			uintmax_t offset = inoffset + *done;
+			uintmax_t pageoffset = ROUND_DOWN(offset, PAGE_SIZE);
+			size_t startoffset = offset - pageoffset;
+			size_t count = min(PAGE_SIZE - startoffset, size - *done);
+
+			page_t *page;
+			err = vmmcache_getpage(in, pageoffset, &page);
+			if (err == ENXIO) {
+				err = 0;
+				break;
+			}
+
+			if (err)
+				break;
+
+			// the pipe takes over our reference. a page that is dirty or used by someone else gets copied instead
+			if (out->type == V_TYPE_FIFO && vmmcache_lendpage(page) == 0) {
+				err = pipefs_splicepage(out, pmm_getpageaddress(page), startoffset, count, outflags);
+				if (err == 0) {
+					*done += count;
+					continue;
+				}
+
+				if (err != EOPNOTSUPP) {
+					pmm_release(pmm_getpageaddress(page));
+					break;
+				}
+			}
+
+			void *address = MAKE_HHDM(pmm_getpageaddress(page));
+			size_t written;
+			err = vfs_write(out, (void *)((uintptr_t)address + startoffset), count, outoffset + *done, &written, outflags);
+
+			if (inflags & V_FFLAGS_NOCACHE)
+				vmmcache_evict(page);
+
+			pmm_release(FROM_HHDM(address));
+
+			if (err)
+				break;
+
+			*done += written;
+			if (written < count)
+				break;
+		}
+	} else {
+		if (in->type == V_TYPE_FIFO) {
+			err = pipefs_spliceout(in, inflags, out, outoffset, outflags, size, done);
+			if (err != EOPNOTSUPP)
+				return err;
+
+			err = 0;
+		}
+
+		void *buffer = alloc(PAGE_SIZE);
+		if (buffer == NULL)
+			return ENOMEM;
+
+		while (*done < size) {
+			size_t count = min(PAGE_SIZE, size - *done);
+			size_t bytesread;
+			err = vfs_read(in, buffer, count, inoffset + *done, &bytesread, inflags);
+			if (err || bytesread == 0)
+				break;
+
+			size_t written;
+			err = vfs_write(out, buffer, bytesread, outoffset + *done, &written, outflags);
+			if (err)
+				break;
+
+			*done += written;
+			// don't block waiting for more data once something was moved
+			if (written < bytesread || bytesread < count)
+				break;
+		}
+
+		free(buffer);
+	}
+
+	// report what was moved, the error will show up again on the next call
+	if (*done)
+		err = 0;
+
 	return err;
 }
 
@@ -518,6 +864,8 @@ int vfs_link(vnode_t *destref, char *destpath, vnode_t *linkref, char *linkpath,
 		err = VOP_SYMLINK(parent, component, attr, destpath, getcred());
 	}
 
+	dcache_remove(parent, component);
+
 	cleanup_parent:
 	VOP_UNLOCK(parent);
 	VOP_RELEASE(parent);
@@ -547,7 +895,7 @@ int vfs_unlink(vnode_t *ref, char *path) {
 	bool isdotdot = strcmp(path, "..") == 0;
 
 	vnode_t *child = NULL;
-	err = VOP_LOOKUP(parent, component, &child, getcred());
+	err = dcache_lookup(parent, component, &child, getcred());
 	if (err) {
 		VOP_UNLOCK(parent);
 		VOP_RELEASE(parent);
@@ -559,6 +907,10 @@ int vfs_unlink(vnode_t *ref, char *path) {
 		goto cleanup_release;
 
 	err = VOP_UNLINK(parent, child, component, getcred());
+	dcache_remove(parent, component);
+	if (err == 0 && child->type == V_TYPE_DIR)
+		dcache_purge(child);
+
 	cleanup_release:
 	// locked by VOP_LOOKUP
 	VOP_UNLOCK(child);
@@ -607,7 +959,7 @@ int vfs_rename(vnode_t *srcref, char *srcpath, vnode_t *dstref, char *dstpath, i
 	vnode_t *src = NULL;
 	vnode_t *dst = NULL;
 
-	err = VOP_LOOKUP(srcdir, srccomp, &src, getcred());
+	err = dcache_lookup(srcdir, srccomp, &src, getcred());
 	if (err)
 		goto cleanup_locks;
 
@@ -617,7 +969,7 @@ int vfs_rename(vnode_t *srcref, char *srcpath, vnode_t *dstref, char *dstpath, i
 
 	VOP_UNLOCK(src); // locked by VOP_LOOKUP, unlocked here to allow the other VOP_LOOKUP to not deadlock
 
-	err = VOP_LOOKUP(dstdir, dstcomp, &dst, getcred());
+	err = dcache_lookup(dstdir, dstcomp, &dst, getcred());
 	if (err != 0 && err != ENOENT) {
 		VOP_RELEASE(src);
 		goto cleanup_locks;
@@ -648,6 +1000,10 @@ int vfs_rename(vnode_t *srcref, char *srcpath, vnode_t *dstref, char *dstpath, i
 		goto cleanup_child;
 
 	err = VOP_RENAME(srcdir, src, srccomp, dstdir, dst, dstcomp, flags);
+	dcache_remove(srcdir, srccomp);
+	dcache_remove(dstdir, dstcomp);
+	if (err == 0 && dst && dst->type == V_TYPE_DIR)
+		dcache_purge(dst);
 
 	cleanup_child:
 
@@ -695,6 +1051,102 @@ static vnode_t *lowestnodeinmp(vnode_t *node) {
 	return node;
 }
 
+// walks the path through the name cache alone, without locking or holding anything until the end.
+// returns EAGAIN if anything it can't deal with comes up (a miss, "..", a mount point, a symlink to follow
+// or a race with a change in the cache), in which case the full walk has to be done.
+// start is expected to already be the highest node in its mount point
+static int fastlookup(vnode_t **result, vnode_t *start, char *path, char *lastcomp, int flags) {
+	if (flags & VFS_LOOKUP_INTERNAL)
+		return EAGAIN;
+
+	vnode_t *current = start;
+	int error = 0;
+	uintmax_t seq = dcache_walkbegin();
+
+	while (*path) {
+		if (*path == '/') {
+			++path;
+			continue;
+		}
+
+		char *component = path;
+		size_t complen = 0;
+		while (component[complen] && component[complen] != '/')
+			++complen;
+
+		path += complen;
+		char *next = path;
+		while (*next == '/')
+			++next;
+
+		bool islast = *next == '\0';
+
+		if (current->type != V_TYPE_DIR) {
+			error = EAGAIN;
+			break;
+		}
+
+		if (islast && (flags & VFS_LOOKUP_PARENT)) {
+			memcpy(lastcomp, component, complen);
+			lastcomp[complen] = '\0';
+			break;
+		}
+
+		if (complen == 2 && component[0] == '.' && component[1] == '.') {
+			error = EAGAIN;
+			break;
+		}
+
+		// the vnode isn't locked, but the attributes are only read.
+		// done before skipping "." as the full walk checks it for every component
+		if (VOP_ACCESS(current, V_ACCESS_SEARCH, getcred())) {
+			error = EAGAIN;
+			break;
+		}
+
+		if (complen == 1 && component[0] == '.')
+			continue;
+
+		vnode_t *child;
+		if (dcache_walkfind(current, component, complen, &child) == false) {
+			error = EAGAIN;
+			break;
+		}
+
+		if (child == NULL) {
+			error = ENOENT;
+			break;
+		}
+
+		if (child->vfsmounted || (child->type == V_TYPE_LINK && (islast == false || (flags & VFS_LOOKUP_NOLINK) == 0))) {
+			error = EAGAIN;
+			break;
+		}
+
+		current = child;
+	}
+
+	if (error == 0)
+		VOP_HOLD(current);
+
+	if (dcache_walkvalid(seq) == false) {
+		// the cached entries still hold a reference to current, so this can't be the last one
+		if (error == 0)
+			VOP_RELEASE(current);
+
+		error = EAGAIN;
+	}
+
+	dcache_walkend();
+
+	if (error == 0) {
+		VOP_LOCK(current);
+		*result = current;
+	}
+
+	return error;
+}
+
 // looks up a pathname
 // result will always be returned locked.
 // if flags & VFS_LOOKUP_PARENT, the parent of the resulting node will be put in
@@ -731,6 +1183,10 @@ int vfs_lookup(vnode_t **result, vnode_t *start, char *path, char *lastcomp, int
 	if (error)
 		return error;
 
+	error = fastlookup(result, current, path, lastcomp, flags);
+	if (error != EAGAIN)
+		return error;
+
 	char *compbuffer = alloc(pathlen + 1);
 	if (compbuffer == NULL)
 		return ENOMEM;
@@ -801,7 +1257,7 @@ int vfs_lookup(vnode_t **result, vnode_t *start, char *path, char *lastcomp, int
 		if (error)
 			break;
 
-		error = VOP_LOOKUP(current, component, &next, getcred());
+		error = dcache_lookup(current, component, &next, getcred());
 		if (error)
 			break;
 
@@ -3,24 +3,174 @@
 
 #include <stddef.h>
 #include <stdint.h>
+#include <stdbool.h>
 #include <kernel/iovec.h>
+#include <spinlock.h>
 
 #define BLOCK_TYPE_DISK 0
 #define BLOCK_TYPE_PART 1
 
 #define BLOCK_IOCTL_GETDESC 0xb10ccd35c
+#define BLOCK_IOCTL_GETLATENCY 0xb10c1a7e
+#define BLOCK_IOCTL_DISCARD 0xb10cd15c
+#define BLOCK_IOCTL_WRITEZEROES 0xb10c2e05
+#define BLOCK_IOCTL_FLUSH 0xb10cf1a5
 
+#define BLOCK_SCHED_NOOP 0
+#define BLOCK_SCHED_DEADLINE 1
+
+// how much of the disk a process gets compared to others when the scheduler has to choose
+#define BLOCK_WEIGHT_DEFAULT 100
+#define BLOCK_WEIGHT_BACKGROUND 25
+#define BLOCK_WEIGHT_MAX 1000
+
+#define BIO_OP_READ 0
+#define BIO_OP_WRITE 1
+// these have no segments
+#define BIO_OP_DISCARD 2 // the device may forget what the blocks have
+#define BIO_OP_WRITEZEROES 3 // the blocks read back as zeroes
+#define BIO_OP_FLUSH 4 // everything completed before it is on stable media once it completes. no lba or count
+
+// the submitter spins on the driver for the completion instead of sleeping, for small latency sensitive reads
+#define BIO_FLAGS_POLL 1
+// the write is on stable media when it completes, not only in the cache of the device
+#define BIO_FLAGS_FUA 2
+
+// a physically contiguous piece of a bio's buffer, never crossing a page boundary.
+// the page is a physical address and whoever made the bio keeps it referenced until completion
 typedef struct {
+	void *page;
+	size_t offset;
+	size_t length;
+} biosegment_t;
+
+struct blockdesc_t;
+struct blockqueue_t;
+struct bio_t;
+
+// called from the block completion thread, so it may take mutexes but must not wait for other I/O
+typedef void (*biodone_t)(struct bio_t *bio);
+
+typedef struct bio_t {
+	struct bio_t *next;
+	struct blockdesc_t *desc;
+	int op;
+	int flags;
+	int error;
+	uintmax_t lba; // relative to the desc
+	size_t count;
+	biodone_t done;
+	void *private;
+	uint64_t submittsc;
+	size_t segmentcount;
+	biosegment_t segments[];
+} bio_t;
+
+// one or more bios that are contiguous on the disk, merged to be handed to the driver as a single request.
+// the driver calls block_complete once it is done with it, from any context
+typedef struct blockrequest_t {
+	struct blockrequest_t *next;
+	int op;
+	int flags;
+	int error;
+	uintmax_t lba; // absolute
+	size_t count;
+	size_t segmentcount;
+	bio_t *bios;
+	bio_t *biostail;
+	size_t remaining; // for the driver to count the commands it has outstanding
+	void *driverdata;
+	bool polled; // set instead of queueing the completion when BIO_FLAGS_POLL is set
+	bool scheduled; // went through the scheduler and counts as in flight there
+	int weight;
+	uintmax_t submittime; // in us
+	uintmax_t dispatchtime;
+	uintmax_t deadline;
+	// for the scheduler, which keeps the requests sorted by lba and in submission order
+	struct blockrequest_t *sortprev;
+	struct blockrequest_t *sortnext;
+	struct blockrequest_t *fifoprev;
+	struct blockrequest_t *fifonext;
+} blockrequest_t;
+
+#define BLOCK_HISTOGRAM_BUCKETS 48
+
+// byte range for BLOCK_IOCTL_DISCARD and BLOCK_IOCTL_WRITEZEROES, aligned to the block size
+typedef struct {
+	uintmax_t offset;
+	uintmax_t length;
+} blockrange_t;
+
+// kept for every desc, partitions included, and readable from /dev/blockstats. times are in tsc cycles.
+// i/o to a partition is also counted in the stats of its disk
+typedef struct blockstats_t {
+	spinlock_t lock;
+	struct blockstats_t *parent; // of the whole disk for partitions, NULL otherwise
+	char *name;
+	size_t ios[2]; // per op, with write zeroes counted as writes
+	size_t merges[2];
+	size_t sectors[2]; // of 512 bytes
+	uint64_t cycles[2];
+	size_t discards;
+	size_t discardsectors;
+	size_t flushes;
+	size_t histogram[2][BLOCK_HISTOGRAM_BUCKETS]; // log2 of the latency
+	size_t inflight;
+	uint64_t busycycles; // time with anything in flight
+	uint64_t busysince;
+} blockstats_t;
+
+typedef struct blockdesc_t {
 	void *private;
 	int type;
 	uintmax_t lbaoffset;
 	size_t blockcapacity;
 	size_t blocksize;
-	int (*write)(void *private, iovec_iterator_t *buffer, uintmax_t lba, size_t count);
-	int (*read)(void *private, iovec_iterator_t *buffer, uintmax_t lba, size_t count);
+	size_t maxcount; // biggest request the driver wants in blocks, or 0 for no limit
+	size_t maxsegments; // same but in segments
+	size_t maxdiscard; // biggest discard the driver takes in blocks, 0 if it can't do them
+	size_t maxwritezeroes; // same for write zeroes
+	bool writecache; // the device has a volatile write cache, emptied by BIO_OP_FLUSH
+	bool fua; // the driver does BIO_FLAGS_FUA itself, otherwise the block layer follows those writes with a flush
+	int (*submit)(void *private, blockrequest_t *request);
+	int (*ioctl)(void *private, unsigned long request, void *arg, int *result); // optional
+	void (*poll)(void *private, blockrequest_t *request); // optional, reaps completions without waiting for an interrupt
+	size_t polllatency; // moving average of polled requests in us
+	int scheduler; // BLOCK_SCHED_*
+	size_t queuedepth; // requests the scheduler lets the driver have at once, or 0 for no limit
+	struct blockqueue_t *queue; // set up by block_register and shared with the partitions
+	blockstats_t *stats; // set up by block_register, one for each desc
 } blockdesc_t;
 
+// moving averages in us, from the submission of a request to its completion and from its dispatch to the driver to its completion
+typedef struct {
+	size_t readavg;
+	size_t writeavg;
+	size_t readmax;
+	size_t writemax;
+	size_t readdeviceavg;
+	size_t writedeviceavg;
+	size_t queued;
+	size_t inflight;
+} blocklatency_t;
+
+// bios submitted while a plug is held by the thread are kept back and merged with each other until the unplug
+typedef struct {
+	bio_t *head;
+} blockplug_t;
+
+bio_t *block_newbio(size_t segmentcount);
+void block_freebio(bio_t *bio);
+void block_submit(bio_t *bio);
+void block_plug(blockplug_t *plug);
+void block_unplug(blockplug_t *plug);
+void block_complete(blockrequest_t *request);
+
+// partitions are scanned in the background, block_waitasync waits for every disk registered so far to show up
 void block_register(blockdesc_t *desc, char *name);
+// runs fn on its own thread, for drivers to probe their controllers in parallel
+void block_async(void (*fn)(void *arg), void *arg);
+void block_waitasync();
 void block_init();
 
 #endif
@@ -0,0 +1,20 @@
+#ifndef _DCACHE_H
+#define _DCACHE_H
+
+#include <kernel/vfs.h>
+
+extern size_t dcache_entries;
+extern size_t dcache_hits;
+extern size_t dcache_negativehits;
+extern size_t dcache_misses;
+
+void dcache_init();
+int dcache_lookup(vnode_t *parent, char *name, vnode_t **result, cred_t *cred);
+void dcache_remove(vnode_t *parent, char *name);
+void dcache_purge(vnode_t *parent);
+uintmax_t dcache_walkbegin();
+bool dcache_walkfind(vnode_t *parent, char *name, size_t namelen, vnode_t **child);
+bool dcache_walkvalid(uintmax_t seq);
+void dcache_walkend();
+
+#endif
@@ -20,6 +20,8 @@
 #define DEV_MAJOR_MOUSE 11
 #define DEV_MAJOR_PTY 12
 #define DEV_MAJOR_ACPI 13
+#define DEV_MAJOR_BLOCKSTATS 14
+#define DEV_MAJOR_CACHESTATS 15
 
 typedef struct {
 	int (*open)(int minor, vnode_t **vnode, int flags);
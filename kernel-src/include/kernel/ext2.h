@@ -1,6 +1,17 @@
 #ifndef _EXT2_H
 #define _EXT2_H
 
+#include <stdint.h>
+
+// same number and layout as the linux FITRIM, in bytes
+#define EXT2_IOCTL_FITRIM 0xc0185879
+
+typedef struct {
+	uint64_t start;
+	uint64_t length;
+	uint64_t minlen;
+} ext2trimrange_t;
+
 void ext2_init();
 
 #endif
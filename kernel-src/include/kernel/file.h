@@ -70,8 +70,10 @@ static inline int fileflagstovnodeflags(int flags) {
 		vnflags |= V_FFLAGS_NONBLOCKING;
 	if (flags & O_NOCTTY)
 		vnflags |= V_FFLAGS_NOCTTY;
-	if (flags & (O_DIRECT | O_SYNC | O_DSYNC))
+	if (flags & (O_SYNC | O_DSYNC))
 		vnflags |= V_FFLAGS_NOCACHE;
+	if (flags & O_DIRECT)
+		vnflags |= V_FFLAGS_DIRECT;
 
 	return vnflags;
 }
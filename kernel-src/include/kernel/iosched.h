@@ -0,0 +1,40 @@
+#ifndef _IOSCHED_H
+#define _IOSCHED_H
+
+#include <kernel/block.h>
+#include <mutex.h>
+#include <spinlock.h>
+
+struct iosched_t;
+
+// sits between the block layer and the driver of a disk, shared by all of its partitions
+typedef struct blockqueue_t {
+	mutex_t mutex;
+	struct iosched_t *sched;
+	void *schedprivate;
+	size_t inflight;
+	size_t maxinflight; // 0 for no limit
+	spinlock_t statslock;
+	blocklatency_t latency;
+} blockqueue_t;
+
+// everything except init is called with the queue mutex held
+typedef struct iosched_t {
+	char *name;
+	bool passthrough; // requests skip the queue and go straight to the driver
+	int (*init)(blockqueue_t *queue);
+	void (*insert)(blockqueue_t *queue, blockrequest_t *request);
+	blockrequest_t *(*next)(blockqueue_t *queue); // NULL if nothing should be dispatched right now
+	void (*completed)(blockqueue_t *queue, blockrequest_t *request);
+	size_t (*queued)(blockqueue_t *queue);
+} iosched_t;
+
+extern iosched_t iosched_noop;
+extern iosched_t iosched_deadline;
+
+iosched_t *iosched_get(int scheduler);
+// from block.c, for the schedulers to account their merges
+void block_countmerge(bio_t *bio);
+int iosched_currentweight();
+
+#endif
@@ -72,4 +72,12 @@ size_t iovec_iterator_peek_from_ringbuffer(iovec_iterator_t *iovec_iterator, rin
 // fails with EFAULT if the page is not mapped
 int iovec_iterator_next_page(iovec_iterator_t *iovec_iterator, size_t *page_offset, size_t *page_remaining, void **page);
 
+// checks that every byte left in the iovec_iterator is in iovecs that start and end on a multiple of alignment
+// if user is true, the iovecs also have to be in user memory
+bool iovec_iterator_aligned(iovec_iterator_t *iovec_iterator, size_t alignment, bool user);
+
+// returns the address the iovec_iterator is on and sets contiguous to the number of bytes left in the current iovec
+// returns NULL with contiguous set to 0 if there are no more bytes in the iovec_iterator
+void *iovec_iterator_current_address(iovec_iterator_t *iovec_iterator, size_t *contiguous);
+
 #endif
@@ -0,0 +1,21 @@
+#ifndef _JBD_H
+#define _JBD_H
+
+#include <kernel/vfs.h>
+#include <kernel/iovec.h>
+
+// ext3 compatible journal (jbd) kept in a file of a filesystem on device.
+// the filesystem gives it a map from journal block to disk block
+typedef struct jbd_t jbd_t;
+
+int jbd_open(vnode_t *device, size_t blocksize, uintmax_t *map, size_t maxlen, jbd_t **jbdp, bool *recovered);
+void jbd_close(jbd_t *jbd);
+int jbd_run(jbd_t *jbd);
+void jbd_start(jbd_t *jbd);
+void jbd_stop(jbd_t *jbd);
+int jbd_write(jbd_t *jbd, iovec_iterator_t *iovec_iterator, size_t size, uintmax_t offset, size_t *writec);
+int jbd_dirty(jbd_t *jbd, uintmax_t offset);
+void jbd_forget(jbd_t *jbd, uintmax_t block);
+int jbd_commit(jbd_t *jbd);
+
+#endif
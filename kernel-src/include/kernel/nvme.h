@@ -1,6 +1,20 @@
 #ifndef _NVME_H
 #define _NVME_H
 
+#include <stdint.h>
+#include <time.h>
+
+#define NVME_IOCTL_GETSTATS 0x17e5a7
+
+// totals since the namespace was found, sampling them twice gives the iops and bandwidth in between
+typedef struct {
+	uint64_t readcommands;
+	uint64_t writecommands;
+	uint64_t readbytes;
+	uint64_t writebytes;
+	timespec_t timestamp;
+} nvmestats_t;
+
 void nvme_init();
 
 #endif
@@ -7,10 +7,23 @@
 #include <kernel/poll.h>
 #include <kernel/event.h>
 
+// data spliced in from the page cache is kept as a reference to the page instead of being copied into the ring buffer.
+// once a page is queued, everything in the pipe is described by the queue in order, with a NULL page for bytes that
+// are in the ring buffer
+typedef struct pipebuffer_t {
+	struct pipebuffer_t *next;
+	void *page; // physical and referenced by the pipe
+	size_t offset;
+	size_t length;
+} pipebuffer_t;
+
 typedef struct pipenode_t {
 	vnode_t vnode;
 	vattr_t attr;
 	ringbuffer_t data;
+	pipebuffer_t *buffers;
+	pipebuffer_t *bufferstail;
+	size_t pagebytes;
 	size_t readers, writers;
 	pollheader_t pollheader;
 	eventheader_t readopenevent;
@@ -21,5 +34,7 @@ void pipefs_init();
 int pipefs_newpipe(vnode_t **nodep);
 int pipefs_getbinding(vnode_t *node, vnode_t **pipep);
 void pipefs_leavebinding(vnode_t *pipenode);
+int pipefs_splicepage(vnode_t *node, void *page, size_t offset, size_t length, int flags);
+int pipefs_spliceout(vnode_t *node, int flags, vnode_t *out, uintmax_t outoffset, int outflags, size_t size, size_t *done);
 
 #endif
@@ -15,6 +15,9 @@
 #define PAGE_FLAGS_DIRTY 8
 #define PAGE_FLAGS_READY 16
 #define PAGE_FLAGS_ERROR 32
+#define PAGE_FLAGS_REFERENCED 64
+#define PAGE_FLAGS_ACTIVE 128
+#define PAGE_FLAGS_LOANED 256
 
 typedef struct page_t {
 	struct vnode_t *backing;
@@ -37,15 +40,28 @@ typedef struct page_t {
 	int flags;
 } page_t;
 
+// caches of things other than pages can register to be shrunk by the reclaim thread once the page cache runs dry
+typedef struct pmmshrinker_t {
+	struct pmmshrinker_t *next;
+	void (*shrink)();
+} pmmshrinker_t;
+
 void *pmm_allocpage(int section);
 page_t *pmm_getpage(void *addr);
 void *pmm_getpageaddress(page_t *);
 void pmm_hold(void *addr);
 void pmm_release(void *addr);
 void pmm_makefree(void *address, size_t count);
+void pmm_adoptpage(void *address);
 void *pmm_alloc(size_t size, int section);
 void pmm_free(void *addr, size_t size);
 void pmm_init();
+void pmm_reclaiminit();
+void pmm_registershrinker(pmmshrinker_t *shrinker);
+
+extern size_t pmm_reclaimedpages;
+extern size_t pmm_activatedpages;
+extern size_t pmm_deactivatedpages;
 
 extern uintptr_t hhdmbase;
 
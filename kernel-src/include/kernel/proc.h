@@ -35,6 +35,7 @@ typedef struct proc_t {
 	mutex_t fdmutex;
 	struct fd_t *fd;
 	mode_t umask;
+	int ioweight; // BLOCK_WEIGHT_*
 	int flags;
 	vnode_t *cwd;
 	vnode_t *root;
@@ -40,6 +40,10 @@ typedef struct thread_t {
 	bool shouldexit;
 	void *kernelarg;
 	context_t *usercopyctx;
+	void *journal; // journal this thread has an operation started on
+	int journaldepth;
+	void *blockplug; // block_plug in effect, if any
+	int ioweight; // overrides the weight of the process for the block scheduler if not 0
 	struct {
 		spinlock_t lock;
 		eventheader_t waitpendingevent;
@@ -17,6 +17,8 @@ extern topology_node_t topology_root;
 
 topology_node_t *topology_create_node(void);
 void topology_insert(topology_node_t *node, topology_node_t *parent, int id, cpu_t *cpu);
+// fills cpus with up to max cpus ordered by topology and returns how many were written
+size_t topology_cpus(cpu_t **cpus, size_t max);
 
 static inline topology_node_t *topology_get_root(void) {
 	return &topology_root;
@@ -2,6 +2,7 @@
 #define _VFS_H
 
 #include <mutex.h>
+#include <rwlock.h>
 #include <spinlock.h>
 #include <stddef.h>
 #include <stdint.h>
@@ -73,6 +74,9 @@ typedef struct vfs_t {
 
 #define V_FLAGS_ROOT 1
 
+// directory entries only change through the vfs_* functions, so names can be cached
+#define VFS_FLAGS_NAMECACHE 1
+
 #define V_TYPE_REGULAR	0
 #define V_TYPE_DIR	1
 #define V_TYPE_CHDEV	2
@@ -88,11 +92,17 @@ typedef struct vfs_t {
 #define V_FFLAGS_EXEC 16
 #define V_FFLAGS_NOCTTY 32
 #define V_FFLAGS_NOCACHE 64
+#define V_FFLAGS_DIRECT 128
+#define V_FFLAGS_FUA 256 // for writes straight to a block device, they are on stable media once done
+
+// only what is needed to read the data back, like fdatasync
+#define V_SYNC_DATA 1
 
 typedef struct vnode_t {
 	struct vops_t *ops;
 	mutex_t lock;
-	mutex_t size_lock;
+	// held shared by readers and writers within the file, exclusively when the size changes
+	rwlock_t size_lock;
 	int refcount;
 	int flags;
 	int type;
@@ -141,7 +151,9 @@ typedef struct vops_t {
 	int (*rename)(vnode_t *sourcedir, vnode_t *source, char *oldname, vnode_t *targetdir, vnode_t *target, char *newname, int flags);
 	int (*getpage)(vnode_t *node, uintmax_t offset, struct page_t *page);
 	int (*putpage)(vnode_t *node, uintmax_t offset, struct page_t *page);
-	int (*sync)(vnode_t *node);
+	int (*sync)(vnode_t *node, int flags);
+	int (*bmap)(vnode_t *node, uintmax_t offset, size_t size, bool allocate, vnode_t **device, uintmax_t *deviceoffset, size_t *contiguous);
+	void (*bmapend)(vnode_t *node);
 	int (*lock)(vnode_t *node);
 	int (*unlock)(vnode_t *node);
 } vops_t;
@@ -161,7 +173,7 @@ typedef struct vops_t {
 #define VOP_INIT(vn, o, f, t, v) \
 	(vn)->ops = o; \
 	MUTEX_INIT(&(vn)->lock); \
-	MUTEX_INIT(&(vn)->size_lock); \
+	RWLOCK_INIT(&(vn)->size_lock); \
 	(vn)->refcount = 1; \
 	(vn)->flags = f; \
 	(vn)->type = t; \
@@ -197,7 +209,12 @@ typedef struct vops_t {
 #define VOP_RENAME(sd, s, o, td, t, n, f) (s)->ops->rename(sd, s, o, td, t, n, f)
 #define VOP_GETPAGE(v, o, p) (v)->ops->getpage(v, o, p)
 #define VOP_PUTPAGE(v, o, p) (v)->ops->putpage(v, o, p)
-#define VOP_SYNC(v) (v)->ops->sync(v)
+#define VOP_SYNC(v, f) (v)->ops->sync(v, f)
+#define VOP_BMAP(v, o, s, a, d, dof, c) (v)->ops->bmap(v, o, s, a, d, dof, c)
+#define VOP_BMAPEND(v) { \
+		if ((v)->ops->bmapend) \
+			(v)->ops->bmapend(v); \
+	}
 #define VOP_HOLD(v) __atomic_add_fetch(&(v)->refcount, 1, __ATOMIC_SEQ_CST)
 #define VOP_RELEASE(v) {\
 		if (__atomic_sub_fetch(&(v)->refcount, 1, __ATOMIC_SEQ_CST) == 0) {\
@@ -218,6 +235,7 @@ int vfs_write_iovec(vnode_t *node, iovec_iterator_t *iovec_iterator, size_t size
 int vfs_read_iovec(vnode_t *node, iovec_iterator_t *iovec_iterator, size_t size, uintmax_t offset, size_t *bytesread, int flags);
 int vfs_write(vnode_t *node, void *buffer, size_t size, uintmax_t offset, size_t *written, int flags);
 int vfs_read(vnode_t *node, void *buffer, size_t size, uintmax_t offset, size_t *bytesread, int flags);
+int vfs_splice(vnode_t *in, uintmax_t inoffset, int inflags, vnode_t *out, uintmax_t outoffset, int outflags, size_t size, size_t *done);
 int vfs_create(vnode_t *ref, char *path, vattr_t *attr, int type, vnode_t **node);
 int vfs_link(vnode_t *destref, char *destpath, vnode_t *linkref, char *linkpath, int type, vattr_t *attr);
 int vfs_rename(vnode_t *srcref, char *srcpath, vnode_t *dstref, char *dstpath, int flags);
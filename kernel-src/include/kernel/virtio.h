@@ -50,6 +50,7 @@ uint64_t virtio_negotiatefeatures(viodevice_t *viodevice, uint64_t features);
 void *virtio_createqueue(viodevice_t *viodevice, vioqueue_t *vioqueue, int queue, size_t size, int msix);
 void virtio_enabledevice(viodevice_t *viodevice);
 
+#define VIO_FEATURE_INDIRECT_DESC (1l << 28)
 #define VIO_FEATURE_VERSION_1 (1l << 32)
 
 #define VIO_CONFIG_STATUS_SET(x, v) (x)->config->status |= v
@@ -62,6 +63,7 @@ void virtio_enabledevice(viodevice_t *viodevice);
 
 #define VIO_QUEUE_BUFFER_NEXT 1
 #define VIO_QUEUE_BUFFER_DEVICE 2
+#define VIO_QUEUE_BUFFER_INDIRECT 4
 
 typedef struct {
 	uint64_t address;
@@ -62,9 +62,11 @@ typedef struct {
 	void *end;
 } vmmspace_t;
 
-typedef struct {
+typedef struct vmmcontext_t {
 	vmmspace_t space;
 	pagetableptr_t pagetable;
+	struct vmmcontext_t *next;
+	struct vmmcontext_t *prev;
 } vmmcontext_t;
 
 extern vmmcontext_t vmm_kernelctx;
@@ -102,6 +104,9 @@ bool vmm_pagefault(void *addr, bool user, int actions);
 vmmcontext_t *vmm_newcontext();
 void vmm_switchcontext(vmmcontext_t *ctx);
 void *vmm_getphysical(void *addr, bool hold);
+int vmm_cowmap(void *addr, void *physical);
+int vmm_faultin(void *addr, size_t size, bool write);
+void vmm_harvestaccessed();
 void vmm_apinit();
 void vmm_init();
 
@@ -5,12 +5,18 @@
 #include <kernel/vfs.h>
 
 extern size_t vmmcache_cachedpages;
+extern size_t vmmcache_hits;
+extern size_t vmmcache_misses;
+extern size_t vmmcache_refaults;
 
 void vmmcache_init();
 int vmmcache_getpage(vnode_t *vnode, uintmax_t offset, page_t **res);
+int vmmcache_getwritablepage(vnode_t *vnode, uintmax_t offset, page_t **res);
+int vmmcache_lendpage(page_t *page);
 int vmmcache_takepage(page_t *page);
 int vmmcache_makedirty(page_t *page);
 int vmmcache_truncate(vnode_t *vnode, uintmax_t offset);
+int vmmcache_invalidate(vnode_t *vnode, uintmax_t offset, size_t size);
 int vmmcache_syncvnode(vnode_t *vnode, uintmax_t startoffset, size_t size);
 int vmmcache_pushpage(vnode_t *vnode, uintmax_t offset, page_t *page);
 int vmmcache_sync();
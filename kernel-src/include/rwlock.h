@@ -0,0 +1,49 @@
+#ifndef _RWLOCK_H
+#define _RWLOCK_H
+
+#include <mutex.h>
+
+// the first reader in takes the write mutex on behalf of every reader and the last one out releases it.
+// writers hold the turnstile while waiting so new readers queue up behind them instead of starving them.
+typedef struct {
+	mutex_t turnstile;
+	mutex_t writemutex;
+	mutex_t readersmutex;
+	int readers;
+} rwlock_t;
+
+#define RWLOCK_INIT(l) { \
+		MUTEX_INIT(&(l)->turnstile); \
+		MUTEX_INIT(&(l)->writemutex); \
+		MUTEX_INIT(&(l)->readersmutex); \
+		(l)->readers = 0; \
+	}
+
+static inline void rwlock_acquireread(rwlock_t *lock) {
+	MUTEX_ACQUIRE(&lock->turnstile, false);
+	MUTEX_RELEASE(&lock->turnstile);
+
+	MUTEX_ACQUIRE(&lock->readersmutex, false);
+	if (++lock->readers == 1)
+		MUTEX_ACQUIRE(&lock->writemutex, false);
+	MUTEX_RELEASE(&lock->readersmutex);
+}
+
+static inline void rwlock_releaseread(rwlock_t *lock) {
+	MUTEX_ACQUIRE(&lock->readersmutex, false);
+	if (--lock->readers == 0)
+		MUTEX_RELEASE(&lock->writemutex);
+	MUTEX_RELEASE(&lock->readersmutex);
+}
+
+static inline void rwlock_acquirewrite(rwlock_t *lock) {
+	MUTEX_ACQUIRE(&lock->turnstile, false);
+	MUTEX_ACQUIRE(&lock->writemutex, false);
+	MUTEX_RELEASE(&lock->turnstile);
+}
+
+static inline void rwlock_releasewrite(rwlock_t *lock) {
+	MUTEX_RELEASE(&lock->writemutex);
+}
+
+#endif
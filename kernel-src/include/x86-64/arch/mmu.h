@@ -34,6 +34,8 @@ void *arch_mmu_getphysical(pagetableptr_t table, void *vaddr);
 bool arch_mmu_ispresent(pagetableptr_t table, void *vaddr);
 bool arch_mmu_iswritable(pagetableptr_t table, void *vaddr);
 bool arch_mmu_isdirty(pagetableptr_t table, void *vaddr);
+bool arch_mmu_isaccessed(pagetableptr_t table, void *vaddr);
+void arch_mmu_harvestaccessed(pagetableptr_t table, void *vaddr, size_t size, void (*accessed)(void *paddr));
 pagetableptr_t arch_mmu_newtable();
 void arch_mmu_init();
 void arch_mmu_apswitch();
@@ -9,6 +9,8 @@
 #include <kernel/pmm.h>
 #include <kernel/alloc.h>
 #include <arch/cpu.h>
+#include <kernel/interrupt.h>
+#include <spinlock.h>
 
 #include <uacpi/acpi.h>
 #include <uacpi/tables.h>
@@ -21,16 +23,28 @@ static void (*pci_archwrite32)(int bus, int device, int function, uint32_t offse
 #define CONFADD 0xcf8
 #define CONFDATA 0xcfc
 
+// the address and data ports are shared, and drivers probe their devices from several threads at once
+static spinlock_t legacylock;
+
 static uint32_t legacy_read32(int bus, int device, int function, uint32_t offset) {
 	uint32_t confadd = 0x80000000 | (offset & ~0x3) | (function << 8) | (device << 11) | (bus << 16);
+	bool intstatus = interrupt_set(false);
+	spinlock_acquire(&legacylock);
 	outd(CONFADD, confadd);
-	return ind(CONFDATA);
+	uint32_t value = ind(CONFDATA);
+	spinlock_release(&legacylock);
+	interrupt_set(intstatus);
+	return value;
 }
 
 static void legacy_write32(int bus, int device, int function, uint32_t offset, uint32_t value) {
 	uint32_t confadd = 0x80000000 | (offset & ~0x3) | (function << 8) | (device << 11) | (bus << 16);
+	bool intstatus = interrupt_set(false);
+	spinlock_acquire(&legacylock);
 	outd(CONFADD, confadd);
 	outd(CONFDATA, value);
+	spinlock_release(&legacylock);
+	interrupt_set(intstatus);
 }
 
 static inline struct acpi_mcfg_allocation *getmcfgentry(int bus) {
@@ -104,6 +118,7 @@ static void pci_archinit() {
 		uacpi_table_unref(&tbl);
 	} else {
 		printf("pci: MCFG table not found. Falling back to legacy access mechanism\n");
+		SPINLOCK_INIT(legacylock);
 		pci_archread32 = legacy_read32;
 		pci_archwrite32 = legacy_write32;
 	}
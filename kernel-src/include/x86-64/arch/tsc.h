@@ -8,4 +8,15 @@ static inline uint64_t rdtsc_serialized(void) {
 	return ((uint64_t)high << 32) | low;
 }
 
+// cheaper, for when it doesn't matter if it gets reordered a bit
+static inline uint64_t rdtsc(void) {
+	uint32_t high;
+	uint32_t low;
+	asm volatile("rdtsc" : "=a"(low), "=d"(high));
+	return ((uint64_t)high << 32) | low;
+}
+
+// 0 if the tsc isn't used as a timekeeper source
+uint64_t tsc_hz(void);
+
 #endif
@@ -1,15 +1,21 @@
 #include <kernel/block.h>
+#include <kernel/iosched.h>
 #include <hashtable.h>
 #include <mutex.h>
+#include <semaphore.h>
+#include <spinlock.h>
 #include <logging.h>
 #include <kernel/alloc.h>
 #include <kernel/devfs.h>
+#include <kernel/scheduler.h>
 #include <string.h>
 #include <kernel/vmm.h>
+#include <kernel/pmm.h>
 #include <kernel/usercopy.h>
-
-#define DISK_READ(desc, it, lba, size) (desc)->read(desc->private, it, lba, size)
-#define DISK_WRITE(desc, it, lba, size) (desc)->write(desc->private, it, lba, size)
+#include <kernel/timekeeper.h>
+#include <kernel/cred.h>
+#include <arch/cpu.h>
+#include <arch/tsc.h>
 
 typedef struct {
 	char signature[8];
@@ -72,19 +78,645 @@ static void bytestolba(blockdesc_t *desc, uintmax_t offset, size_t size, uintmax
 	*lbacount = toplba - *lbaoffset;
 }
 
-static inline int disk_read_direct(blockdesc_t *desc, void *buffer, size_t lba_offset, size_t block_count) {
-	iovec_t iovec = {
-		.addr = buffer,
-		.len = block_count * desc->blocksize
-	};
+// biggest bio the synchronous paths build, bigger transfers are split into several bios submitted together
+#define BIO_MAXSEGMENTS 256
 
-	iovec_iterator_t iovec_iterator;
-	iovec_iterator_init(&iovec_iterator, &iovec, 1);
+// synchronous reads up to this size are polled when the driver supports it
+#define POLL_MAXBYTES (64 * 1024)
+// sleeping for less than this before polling isn't worth the trip through the scheduler
+#define POLL_MINSLEEPUS 50
+
+static spinlock_t donelock;
+static semaphore_t donesem;
+static blockrequest_t *donelist;
+
+bio_t *block_newbio(size_t segmentcount) {
+	bio_t *bio = alloc(sizeof(bio_t) + sizeof(biosegment_t) * segmentcount);
+	if (bio == NULL)
+		return NULL;
+
+	memset(bio, 0, sizeof(bio_t));
+	return bio;
+}
+
+void block_freebio(bio_t *bio) {
+	free(bio);
+}
+
+static blockstats_t *newstats(char *name) {
+	blockstats_t *stats = alloc(sizeof(blockstats_t));
+	__assert(stats);
+	stats->name = alloc(strlen(name) + 1);
+	__assert(stats->name);
+	strcpy(stats->name, name);
+	SPINLOCK_INIT(stats->lock);
+	return stats;
+}
+
+// write zeroes and flushes are counted with the writes
+#define STATSOP(op) ((op) == BIO_OP_READ ? BIO_OP_READ : BIO_OP_WRITE)
+
+static void countsubmit(bio_t *bio) {
+	uint64_t now = rdtsc();
+	bio->submittsc = now;
+
+	bool intstatus = interrupt_set(false);
+	for (blockstats_t *stats = bio->desc->stats; stats; stats = stats->parent) {
+		spinlock_acquire(&stats->lock);
+		if (stats->inflight++ == 0)
+			stats->busysince = now;
+		spinlock_release(&stats->lock);
+	}
+	interrupt_set(intstatus);
+}
+
+static void countcompletion(bio_t *bio) {
+	uint64_t now = rdtsc();
+	// the tsc of the cpu it completed on might be a bit behind
+	uint64_t latency = now > bio->submittsc ? now - bio->submittsc : 0;
+	size_t bucket = latency ? min(63 - __builtin_clzl(latency), BLOCK_HISTOGRAM_BUCKETS - 1) : 0;
+	size_t sectors = bio->count * bio->desc->blocksize / 512;
+	int op = STATSOP(bio->op);
+
+	bool intstatus = interrupt_set(false);
+	for (blockstats_t *stats = bio->desc->stats; stats; stats = stats->parent) {
+		spinlock_acquire(&stats->lock);
+		if (bio->op == BIO_OP_DISCARD) {
+			++stats->discards;
+			stats->discardsectors += sectors;
+		} else if (bio->op == BIO_OP_FLUSH) {
+			++stats->flushes;
+		} else {
+			++stats->ios[op];
+			stats->sectors[op] += sectors;
+			stats->cycles[op] += latency;
+			++stats->histogram[op][bucket];
+		}
+
+		if (--stats->inflight == 0 && now > stats->busysince)
+			stats->busycycles += now - stats->busysince;
+		spinlock_release(&stats->lock);
+	}
+	interrupt_set(intstatus);
+}
+
+void block_countmerge(bio_t *bio) {
+	for (blockstats_t *stats = bio->desc->stats; stats; stats = stats->parent)
+		__atomic_add_fetch(&stats->merges[STATSOP(bio->op)], 1, __ATOMIC_RELAXED);
+}
+
+// called by the drivers once they're done with a request, possibly from a dpc.
+// the bios are completed from the completion thread so that their callbacks can take mutexes
+void block_complete(blockrequest_t *request) {
+	// the submitter is spinning on it
+	if (request->flags & BIO_FLAGS_POLL) {
+		__atomic_store_n(&request->polled, true, __ATOMIC_SEQ_CST);
+		return;
+	}
+
+	bool intstatus = interrupt_set(false);
+	spinlock_acquire(&donelock);
+	request->next = donelist;
+	donelist = request;
+	spinlock_release(&donelock);
+	interrupt_set(intstatus);
+
+	semaphore_signal(&donesem);
+}
+
+static void accountlatency(blockqueue_t *queue, blockrequest_t *request) {
+	uintmax_t now = timespec_us(timekeeper_timefromboot());
+	size_t total = now - request->submittime;
+	size_t device = now - request->dispatchtime;
+	bool write = request->op != BIO_OP_READ;
+	size_t *avg = write ? &queue->latency.writeavg : &queue->latency.readavg;
+	size_t *deviceavg = write ? &queue->latency.writedeviceavg : &queue->latency.readdeviceavg;
+	size_t *maxlatency = write ? &queue->latency.writemax : &queue->latency.readmax;
+
+	bool intstatus = interrupt_set(false);
+	spinlock_acquire(&queue->statslock);
+	*avg = (*avg * 7 + total) / 8;
+	*deviceavg = (*deviceavg * 7 + device) / 8;
+	*maxlatency = max(*maxlatency, total);
+	spinlock_release(&queue->statslock);
+	interrupt_set(intstatus);
+}
+
+static void runqueue(blockqueue_t *queue);
+static void dispatch(blockrequest_t *request);
+
+static void completerequest(blockrequest_t *request) {
+	blockdesc_t *desc = request->bios->desc;
+	blockqueue_t *queue = desc->queue;
+	bool scheduled = request->scheduled;
+
+	if (scheduled) {
+		MUTEX_ACQUIRE(&queue->mutex, false);
+		--queue->inflight;
+		if (queue->sched->completed)
+			queue->sched->completed(queue, request);
+		MUTEX_RELEASE(&queue->mutex);
+	}
+
+	// the driver can't do fua, so the write is only in the device cache. the same request goes again as a flush
+	if (request->op == BIO_OP_WRITE && (request->flags & BIO_FLAGS_FUA) && request->error == 0 && desc->fua == false) {
+		request->op = BIO_OP_FLUSH;
+		request->flags &= ~BIO_FLAGS_FUA;
+		request->scheduled = false;
+		dispatch(request);
+		if (scheduled)
+			runqueue(queue);
+		return;
+	}
+
+	accountlatency(queue, request);
+
+	bio_t *bio = request->bios;
+	while (bio) {
+		bio_t *next = bio->next;
+		bio->next = NULL;
+		bio->error = request->error;
+		countcompletion(bio);
+		bio->done(bio);
+		bio = next;
+	}
+
+	free(request);
+
+	// there might be something waiting for a free spot in the driver
+	if (scheduled)
+		runqueue(queue);
+}
+
+__attribute__((noreturn)) static void completionthread() {
+	for (;;) {
+		semaphore_wait(&donesem, false);
+
+		bool intstatus = interrupt_set(false);
+		spinlock_acquire(&donelock);
+		blockrequest_t *request = donelist;
+		donelist = request->next;
+		spinlock_release(&donelock);
+		interrupt_set(intstatus);
+
+		completerequest(request);
+	}
+}
+
+// sorts bios by the disk they go to and then by their position in it
+static bool biobefore(bio_t *a, bio_t *b) {
+	if (a->desc->private != b->desc->private)
+		return (uintptr_t)a->desc->private < (uintptr_t)b->desc->private;
+
+	return a->lba + a->desc->lbaoffset < b->lba + b->desc->lbaoffset;
+}
+
+static bool canmerge(blockrequest_t *request, bio_t *bio) {
+	blockdesc_t *desc = bio->desc;
+	blockdesc_t *requestdesc = request->bios->desc;
+	if (requestdesc->private != desc->private || requestdesc->submit != desc->submit || request->op != bio->op || request->flags != bio->flags)
+		return false;
+
+	if (request->lba + request->count != bio->lba + desc->lbaoffset)
+		return false;
+
+	// discards and write zeroes have their own limit
+	size_t maxcount = desc->maxcount;
+	if (bio->op == BIO_OP_DISCARD)
+		maxcount = desc->maxdiscard;
+	else if (bio->op == BIO_OP_WRITEZEROES)
+		maxcount = desc->maxwritezeroes;
+
+	if (maxcount && request->count + bio->count > maxcount)
+		return false;
+
+	if (desc->maxsegments && request->segmentcount + bio->segmentcount > desc->maxsegments)
+		return false;
+
+	return true;
+}
+
+// hybrid polling: sleep through about half of the usual latency of the device and spin on it for the rest
+static void pollrequest(blockdesc_t *desc, blockrequest_t *request, time_t start) {
+	size_t sleepus = desc->polllatency / 2;
+	if (sleepus >= POLL_MINSLEEPUS)
+		sched_sleep_us(sleepus);
+
+	while (__atomic_load_n(&request->polled, __ATOMIC_SEQ_CST) == false) {
+		desc->poll(desc->private, request);
+		CPU_PAUSE();
+	}
+
+	time_t latency = timespec_us(timekeeper_timefromboot()) - start;
+	desc->polllatency = (desc->polllatency * 7 + latency) / 8;
+	completerequest(request);
+}
+
+static void dispatch(blockrequest_t *request) {
+	blockdesc_t *desc = request->bios->desc;
+	bool poll = request->flags & BIO_FLAGS_POLL;
+	time_t start = timespec_us(timekeeper_timefromboot());
+	request->dispatchtime = start;
+
+	// everything is already on stable media
+	if (request->op == BIO_OP_FLUSH && desc->writecache == false) {
+		block_complete(request);
+		return;
+	}
+
+	int error = desc->submit(desc->private, request);
+	if (error) {
+		request->error = error;
+		if (poll)
+			completerequest(request);
+		else
+			block_complete(request);
+	} else if (poll) {
+		pollrequest(desc, request, start);
+	}
+}
+
+// hands the driver whatever the scheduler wants to send next until it says to stop or the driver queue is full
+static void runqueue(blockqueue_t *queue) {
+	for (;;) {
+		blockrequest_t *request = NULL;
+		MUTEX_ACQUIRE(&queue->mutex, false);
+		if (queue->maxinflight == 0 || queue->inflight < queue->maxinflight)
+			request = queue->sched->next(queue);
+
+		if (request)
+			++queue->inflight;
+		MUTEX_RELEASE(&queue->mutex);
+
+		if (request == NULL)
+			break;
+
+		dispatch(request);
+	}
+}
+
+// polled requests have their submitter waiting on the cpu, so they never wait in the scheduler.
+// the schedulers only know about reads and writes, the rest goes straight through too
+static void queuerequest(blockrequest_t *request) {
+	blockqueue_t *queue = request->bios->desc->queue;
+	request->submittime = timespec_us(timekeeper_timefromboot());
+	request->weight = iosched_currentweight();
+
+	bool data = request->op == BIO_OP_READ || request->op == BIO_OP_WRITE;
+	if (queue->sched->passthrough || (request->flags & BIO_FLAGS_POLL) || data == false) {
+		dispatch(request);
+		return;
+	}
+
+	request->scheduled = true;
+	MUTEX_ACQUIRE(&queue->mutex, false);
+	queue->sched->insert(queue, request);
+	MUTEX_RELEASE(&queue->mutex);
+
+	runqueue(queue);
+}
+
+// turns a sorted list of bios into requests, merging the ones that are next to each other on the disk
+static void dispatchlist(bio_t *list) {
+	blockrequest_t *request = NULL;
+	while (list) {
+		bio_t *bio = list;
+		list = list->next;
+		bio->next = NULL;
+
+		if (request && canmerge(request, bio)) {
+			request->biostail->next = bio;
+			request->biostail = bio;
+			request->count += bio->count;
+			request->segmentcount += bio->segmentcount;
+			block_countmerge(bio);
+			continue;
+		}
+
+		if (request)
+			queuerequest(request);
+
+		request = alloc(sizeof(blockrequest_t));
+		if (request == NULL) {
+			bio->error = ENOMEM;
+			countcompletion(bio);
+			bio->done(bio);
+			continue;
+		}
+
+		request->op = bio->op;
+		request->flags = bio->flags;
+		request->lba = bio->lba + bio->desc->lbaoffset;
+		request->count = bio->count;
+		request->segmentcount = bio->segmentcount;
+		request->bios = bio;
+		request->biostail = bio;
+	}
+
+	if (request)
+		queuerequest(request);
+}
+
+void block_submit(bio_t *bio) {
+	__assert(bio->lba + bio->count <= bio->desc->blockcapacity);
+	bio->next = NULL;
+	bio->error = 0;
+
+	// without a volatile cache every write is already fua
+	if (bio->desc->writecache == false)
+		bio->flags &= ~BIO_FLAGS_FUA;
+	countsubmit(bio);
+
+	blockplug_t *plug = current_thread()->blockplug;
+	if (plug == NULL) {
+		dispatchlist(bio);
+		return;
+	}
+
+	// keep the plugged bios sorted so that the unplug only has to merge neighbours
+	bio_t **iterator = &plug->head;
+	while (*iterator && biobefore(*iterator, bio) == true)
+		iterator = &(*iterator)->next;
+
+	bio->next = *iterator;
+	*iterator = bio;
+}
+
+// only the outermost plug of a thread does anything, so functions can plug without caring about their callers
+void block_plug(blockplug_t *plug) {
+	plug->head = NULL;
+	if (current_thread()->blockplug == NULL)
+		current_thread()->blockplug = plug;
+}
+
+void block_unplug(blockplug_t *plug) {
+	if (current_thread()->blockplug != plug)
+		return;
+
+	current_thread()->blockplug = NULL;
+	bio_t *list = plug->head;
+	plug->head = NULL;
+	dispatchlist(list);
+}
+
+typedef struct {
+	semaphore_t semaphore;
+	int error;
+} syncwait_t;
+
+static void syncdone(bio_t *bio) {
+	syncwait_t *wait = bio->private;
+	if (bio->error)
+		wait->error = bio->error;
+
+	for (size_t i = 0; i < bio->segmentcount; ++i)
+		pmm_release(bio->segments[i].page);
+
+	block_freebio(bio);
+	semaphore_signal(&wait->semaphore);
+}
+
+// builds bios out of an iovec iterator and submits them all at once. *biocount is set to how many will signal wait
+static int rwsubmit(blockdesc_t *desc, iovec_iterator_t *iovec_iterator, uintmax_t lba, size_t count, bool write, bool fua, syncwait_t *wait, size_t *biocount) {
+	blockplug_t plug;
+	block_plug(&plug);
+
+	int error = 0;
+	size_t done = 0;
+	*biocount = 0;
+	while (done < count) {
+		size_t segmentcount = min(BIO_MAXSEGMENTS, ROUND_UP((count - done) * desc->blocksize, PAGE_SIZE) / PAGE_SIZE + 1);
+		bio_t *bio = block_newbio(segmentcount);
+		if (bio == NULL) {
+			error = ENOMEM;
+			break;
+		}
+
+		bio->desc = desc;
+		bio->op = write ? BIO_OP_WRITE : BIO_OP_READ;
+		bio->lba = lba + done;
+		bio->flags = (write == false && desc->poll && count * desc->blocksize <= POLL_MAXBYTES) ? BIO_FLAGS_POLL : 0;
+		if (fua)
+			bio->flags |= BIO_FLAGS_FUA;
+		bio->done = syncdone;
+		bio->private = wait;
+
+		while (done + bio->count < count && bio->segmentcount < segmentcount) {
+			void *page;
+			size_t page_offset, page_remaining;
+			error = iovec_iterator_next_page(iovec_iterator, &page_offset, &page_remaining, &page);
+			if (error)
+				break;
+
+			// check that there is enough space to complete the transfer of this page
+			__assert(page);
+			__assert(page_remaining >= min((count - done - bio->count) * desc->blocksize, PAGE_SIZE - page_offset));
+
+			// and that the space is aligned to the block size
+			__assert((page_remaining % desc->blocksize) == 0);
+
+			size_t docount = min(page_remaining / desc->blocksize, count - done - bio->count);
+			biosegment_t *segment = &bio->segments[bio->segmentcount++];
+			segment->page = page;
+			segment->offset = page_offset;
+			segment->length = docount * desc->blocksize;
+			bio->count += docount;
 
-	return DISK_READ(desc, &iovec_iterator, lba_offset, block_count);
+			// if we didnt use the whole space in the page, set the iterator back a bit
+			size_t diff_between_available_and_used = page_remaining - docount * desc->blocksize;
+			if (diff_between_available_and_used) {
+				size_t iterator_offset = iovec_iterator_total_offset(iovec_iterator);
+				iovec_iterator_set(iovec_iterator, iterator_offset - diff_between_available_and_used);
+			}
+		}
+
+		if (error) {
+			for (size_t i = 0; i < bio->segmentcount; ++i)
+				pmm_release(bio->segments[i].page);
+
+			block_freebio(bio);
+			break;
+		}
+
+		done += bio->count;
+		++*biocount;
+		block_submit(bio);
+	}
+
+	block_unplug(&plug);
+	return error;
+}
+
+static int rwwait(syncwait_t *wait, size_t biocount) {
+	for (size_t i = 0; i < biocount; ++i)
+		semaphore_wait(&wait->semaphore, false);
+
+	return wait->error;
+}
+
+// submits the bios for the whole transfer and waits for them to complete
+static int rwsync(blockdesc_t *desc, iovec_iterator_t *iovec_iterator, uintmax_t lba, size_t count, bool write, bool fua) {
+	syncwait_t wait;
+	SEMAPHORE_INIT(&wait.semaphore, 0);
+	wait.error = 0;
+
+	size_t biocount;
+	int error = rwsubmit(desc, iovec_iterator, lba, count, write, fua, &wait, &biocount);
+	int waiterror = rwwait(&wait, biocount);
+	return error ? error : waiterror;
+}
+
+#define MAP_FLAGS (ARCH_MMU_FLAGS_READ | ARCH_MMU_FLAGS_WRITE | ARCH_MMU_FLAGS_NOEXEC)
+
+// buffers that aren't aligned to the block size can't be handed to the driver, so they are copied through two bounce
+// buffers instead: the driver works on one while the other is being copied
+#define BOUNCE_SIZE (512 * 1024)
+
+static int rwbounce(blockdesc_t *desc, iovec_iterator_t *iovec_iterator, uintmax_t lba, size_t count, bool write, bool fua) {
+	void *buffer = vmm_map(NULL, BOUNCE_SIZE * 2, VMM_FLAGS_ALLOCATE, MAP_FLAGS, NULL);
+	if (buffer == NULL)
+		return ENOMEM;
+
+	syncwait_t wait[2];
+	size_t biocount[2] = {0, 0};
+	size_t pending[2] = {0, 0}; // blocks in flight in each buffer
+	for (int i = 0; i < 2; ++i) {
+		SEMAPHORE_INIT(&wait[i].semaphore, 0);
+		wait[i].error = 0;
+	}
+
+	size_t chunkcount = BOUNCE_SIZE / desc->blocksize;
+	size_t submitted = 0;
+	int error = 0;
+
+	// the chunks alternate between the buffers, so they also complete in order
+	for (int b = 0; error == 0 && (submitted < count || pending[0] || pending[1]); b ^= 1) {
+		void *chunk = (void *)((uintptr_t)buffer + b * BOUNCE_SIZE);
+		if (pending[b]) {
+			error = rwwait(&wait[b], biocount[b]);
+			if (error == 0 && write == false)
+				error = iovec_iterator_copy_from_buffer(iovec_iterator, chunk, pending[b] * desc->blocksize);
+
+			biocount[b] = 0;
+			pending[b] = 0;
+			if (error)
+				break;
+		}
+
+		if (submitted == count)
+			continue;
+
+		size_t chunksize = min(chunkcount, count - submitted);
+		if (write) {
+			error = iovec_iterator_copy_to_buffer(iovec_iterator, chunk, chunksize * desc->blocksize);
+			if (error)
+				break;
+		}
+
+		iovec_t iovec = {
+			.addr = chunk,
+			.len = chunksize * desc->blocksize
+		};
+
+		iovec_iterator_t chunkiterator;
+		iovec_iterator_init(&chunkiterator, &iovec, 1);
+		error = rwsubmit(desc, &chunkiterator, lba + submitted, chunksize, write, fua, &wait[b], &biocount[b]);
+		pending[b] = chunksize;
+		submitted += chunksize;
+	}
+
+	// whatever is still in flight has to finish before the buffers go away
+	for (int b = 0; b < 2; ++b)
+		rwwait(&wait[b], biocount[b]);
+
+	vmm_unmap(buffer, BOUNCE_SIZE * 2, 0);
+	return error;
+}
+
+// discards and write zeroes carry no data, they're only split up to the limits of the driver
+static int nodatasync(blockdesc_t *desc, int op, uintmax_t lba, size_t count) {
+	size_t maxcount = op == BIO_OP_DISCARD ? desc->maxdiscard : desc->maxwritezeroes;
+	if (maxcount == 0)
+		return EOPNOTSUPP;
+
+	syncwait_t wait;
+	SEMAPHORE_INIT(&wait.semaphore, 0);
+	wait.error = 0;
+
+	blockplug_t plug;
+	block_plug(&plug);
+
+	int error = 0;
+	size_t done = 0;
+	size_t biocount = 0;
+	while (done < count) {
+		bio_t *bio = block_newbio(0);
+		if (bio == NULL) {
+			error = ENOMEM;
+			break;
+		}
+
+		bio->desc = desc;
+		bio->op = op;
+		bio->lba = lba + done;
+		bio->count = min(maxcount, count - done);
+		bio->done = syncdone;
+		bio->private = &wait;
+
+		done += bio->count;
+		++biocount;
+		block_submit(bio);
+	}
+
+	block_unplug(&plug);
+
+	for (size_t i = 0; i < biocount; ++i)
+		semaphore_wait(&wait.semaphore, false);
+
+	return error ? error : wait.error;
 }
 
-static inline int disk_write_direct(blockdesc_t *desc, void *buffer, size_t lba_offset, size_t block_count) {
+static int rangeop(blockdesc_t *desc, int op, void *arg) {
+	blockrange_t range;
+	int error = USERCOPY_POSSIBLY_FROM_USER(&range, arg, sizeof(blockrange_t));
+	if (error)
+		return error;
+
+	if ((range.offset % desc->blocksize) || (range.length % desc->blocksize) || range.offset + range.length < range.offset)
+		return EINVAL;
+
+	uintmax_t lba = range.offset / desc->blocksize;
+	size_t count = range.length / desc->blocksize;
+	if (lba + count < lba || lba + count > desc->blockcapacity)
+		return EINVAL;
+
+	return count ? nodatasync(desc, op, lba, count) : 0;
+}
+
+// empties the write cache of the disk, partitions included, and waits for it
+static int flushsync(blockdesc_t *desc) {
+	if (desc->writecache == false)
+		return 0;
+
+	syncwait_t wait;
+	SEMAPHORE_INIT(&wait.semaphore, 0);
+	wait.error = 0;
+
+	bio_t *bio = block_newbio(0);
+	if (bio == NULL)
+		return ENOMEM;
+
+	bio->desc = desc;
+	bio->op = BIO_OP_FLUSH;
+	bio->done = syncdone;
+	bio->private = &wait;
+	block_submit(bio);
+
+	semaphore_wait(&wait.semaphore, false);
+	return wait.error;
+}
+
+static inline int disk_read_direct(blockdesc_t *desc, void *buffer, size_t lba_offset, size_t block_count) {
 	iovec_t iovec = {
 		.addr = buffer,
 		.len = block_count * desc->blocksize
@@ -93,19 +725,18 @@ static inline int disk_write_direct(blockdesc_t *desc, void *buffer, size_t lba_
 	iovec_iterator_t iovec_iterator;
 	iovec_iterator_init(&iovec_iterator, &iovec, 1);
 
-	return DISK_WRITE(desc, &iovec_iterator, lba_offset, block_count);
+	return rwsync(desc, &iovec_iterator, lba_offset, block_count, false, false);
 }
 
-#define MAP_FLAGS (ARCH_MMU_FLAGS_READ | ARCH_MMU_FLAGS_WRITE | ARCH_MMU_FLAGS_NOEXEC)
-
-// this is only really called by the page cache VOP_GETPAGE and VOP_PUTPAGE functions, so we can make a few assumptions
+// this is only really called by the page cache VOP_GETPAGE and VOP_PUTPAGE functions and direct file and raw device I/O,
+// so we can assume the request is made of whole blocks. the buffer itself only has to be aligned to go straight to the driver
 static int rwblock(int minor, iovec_iterator_t *iovec_iterator, size_t size, uintmax_t offset, int flags, bool write, size_t *done) {
 	blockdesc_t *desc = getdesc(minor);
 	if (desc == NULL)
 		return ENODEV;
 
 	__assert((size % desc->blocksize) == 0);
-	__assert((size % PAGE_SIZE) == 0);
+	__assert((offset % desc->blocksize) == 0);
 	uintmax_t bytetop = desc->blockcapacity * desc->blocksize;
 
 	// offset past end
@@ -126,16 +757,12 @@ static int rwblock(int minor, iovec_iterator_t *iovec_iterator, size_t size, uin
 	size_t lbaoffset, lbacount, startoffset;
 	bytestolba(desc, offset, size, &lbaoffset, &lbacount, &startoffset);
 
-	int error = 0;
-	if (write) {
-		error = DISK_WRITE(desc, iovec_iterator, lbaoffset + desc->lbaoffset, lbacount);
-		if (error)
-			goto cleanup;
-	} else {
-		error = DISK_READ(desc, iovec_iterator, lbaoffset + desc->lbaoffset, lbacount);
-		if (error)
-			goto cleanup;
-	}
+	bool fua = write && (flags & V_FFLAGS_FUA);
+	int error = iovec_iterator_aligned(iovec_iterator, desc->blocksize, false) ?
+		rwsync(desc, iovec_iterator, lbaoffset, lbacount, write, fua) :
+		rwbounce(desc, iovec_iterator, lbaoffset, lbacount, write, fua);
+	if (error)
+		goto cleanup;
 
 	*done = size;
 
@@ -161,13 +788,49 @@ static int ioctl(int minor, unsigned long request, void *arg, int *result, cred_
 	switch (request) {
 		case BLOCK_IOCTL_GETDESC:
 			blockdesc_t copy = *desc;
-			copy.write = NULL;
-			copy.read = NULL;
+			copy.submit = NULL;
+			copy.ioctl = NULL;
+			copy.poll = NULL;
 			copy.private = NULL;
+			copy.queue = NULL;
+			copy.stats = NULL;
 			ret = USERCOPY_POSSIBLY_TO_USER(arg, &copy, sizeof(blockdesc_t));
 			break;
+		// these destroy data, so they are kept to the superuser. calls from inside the kernel have no cred
+		case BLOCK_IOCTL_DISCARD:
+			if (cred && CRED_IS_ESU(cred) == false)
+				return EPERM;
+
+			ret = rangeop(desc, BIO_OP_DISCARD, arg);
+			break;
+		case BLOCK_IOCTL_WRITEZEROES:
+			if (cred && CRED_IS_ESU(cred) == false)
+				return EPERM;
+
+			ret = rangeop(desc, BIO_OP_WRITEZEROES, arg);
+			break;
+		case BLOCK_IOCTL_FLUSH:
+			ret = flushsync(desc);
+			break;
+		case BLOCK_IOCTL_GETLATENCY:
+			blockqueue_t *queue = desc->queue;
+			blocklatency_t latency;
+			bool intstatus = interrupt_set(false);
+			spinlock_acquire(&queue->statslock);
+			latency = queue->latency;
+			spinlock_release(&queue->statslock);
+			interrupt_set(intstatus);
+
+			MUTEX_ACQUIRE(&queue->mutex, false);
+			latency.queued = queue->sched->queued ? queue->sched->queued(queue) : 0;
+			latency.inflight = queue->inflight;
+			MUTEX_RELEASE(&queue->mutex);
+
+			ret = USERCOPY_POSSIBLY_TO_USER(arg, &latency, sizeof(blocklatency_t));
+			break;
 		default:
-			ret = ENOTTY;
+			// let the driver handle its own requests
+			ret = desc->ioctl ? desc->ioctl(desc->private, request, arg, result) : ENOTTY;
 			break;
 	}
 
@@ -180,6 +843,74 @@ static devops_t devops = {
 	.ioctl = ioctl
 };
 
+// one line with the counters of each desc followed by one with the read latency histogram and one with the write one
+#define STATS_LINES 3
+#define STATS_LINE_MAX (32 + 22 * (BLOCK_HISTOGRAM_BUCKETS + 2))
+
+static size_t printstats(blockstats_t *stats, char *buffer, size_t size) {
+	blockstats_t copy;
+	bool intstatus = interrupt_set(false);
+	spinlock_acquire(&stats->lock);
+	copy = *stats;
+	spinlock_release(&stats->lock);
+	interrupt_set(intstatus);
+
+	uint64_t busy = copy.busycycles;
+	uint64_t now = rdtsc();
+	if (copy.inflight && now > copy.busysince)
+		busy += now - copy.busysince;
+
+	size_t length = snprintf(buffer, size, "%s %lu %lu %lu %lu %lu %lu %lu %lu %lu %lu %lu %lu %lu\n", copy.name,
+		copy.ios[BIO_OP_READ], copy.merges[BIO_OP_READ], copy.sectors[BIO_OP_READ], copy.cycles[BIO_OP_READ],
+		copy.ios[BIO_OP_WRITE], copy.merges[BIO_OP_WRITE], copy.sectors[BIO_OP_WRITE], copy.cycles[BIO_OP_WRITE],
+		copy.inflight, busy, copy.discards, copy.discardsectors, copy.flushes);
+
+	for (int op = BIO_OP_READ; op <= BIO_OP_WRITE; ++op) {
+		length += snprintf(buffer + length, size - length, "%s %s", copy.name, op == BIO_OP_READ ? "read" : "write");
+		for (int i = 0; i < BLOCK_HISTOGRAM_BUCKETS; ++i)
+			length += snprintf(buffer + length, size - length, " %lu", copy.histogram[op][i]);
+
+		length += snprintf(buffer + length, size - length, "\n");
+	}
+
+	return length;
+}
+
+// the whole file is generated again for every read, readers are expected to read it in one go
+static int statsread(int minor, iovec_iterator_t *iovec_iterator, size_t size, uintmax_t offset, int flags, size_t *readc) {
+	MUTEX_ACQUIRE(&tablemutex, false);
+	int count = currentid - 1;
+	MUTEX_RELEASE(&tablemutex);
+
+	size_t buffersize = ROUND_UP((count * STATS_LINES + 1) * STATS_LINE_MAX, PAGE_SIZE);
+	char *buffer = vmm_map(NULL, buffersize, VMM_FLAGS_ALLOCATE, MAP_FLAGS, NULL);
+	if (buffer == NULL)
+		return ENOMEM;
+
+	size_t length = snprintf(buffer, buffersize, "tschz %lu\n", tsc_hz());
+	for (int id = 1; id <= count; ++id) {
+		blockdesc_t *desc = getdesc(id);
+		if (desc)
+			length += printstats(desc->stats, buffer + length, buffersize - length);
+	}
+
+	int error = 0;
+	*readc = 0;
+	if (offset < length) {
+		*readc = min(size, length - offset);
+		error = iovec_iterator_copy_from_buffer(iovec_iterator, buffer + offset, *readc);
+		if (error)
+			*readc = 0;
+	}
+
+	vmm_unmap(buffer, buffersize, 0);
+	return error;
+}
+
+static devops_t statsops = {
+	.read = statsread
+};
+
 static int registerdesc(blockdesc_t *desc, char *name) {
 	MUTEX_ACQUIRE(&tablemutex, false);
 	int id = currentid++;
@@ -252,6 +983,8 @@ static void dogpt(blockdesc_t *desc, char *name) {
 		partdesc->lbaoffset = entry->startlba;
 		partdesc->blockcapacity = entry->endlba - entry->startlba + 1;
 		partdesc->type = BLOCK_TYPE_PART;
+		partdesc->stats = newstats(partname);
+		partdesc->stats->parent = desc->stats;
 
 		__assert(registerdesc(partdesc, partname) == 0);
 	}
@@ -285,6 +1018,8 @@ static void dombr(blockdesc_t *desc, char *name) {
 		partdesc->lbaoffset = mbrents[i].lbastart;
 		partdesc->blockcapacity = mbrents[i].lbasize;
 		partdesc->type = BLOCK_TYPE_PART;
+		partdesc->stats = newstats(partname);
+		partdesc->stats->parent = desc->stats;
 
 		__assert(registerdesc(partdesc, partname) == 0);
 	}
@@ -292,23 +1027,107 @@ static void dombr(blockdesc_t *desc, char *name) {
 	vmm_unmap(lba0, desc->blocksize, 0);
 }
 
+// the slow parts of bringing up disks run on their own threads, all of them in parallel
+typedef struct {
+	void (*fn)(void *arg);
+	void *arg;
+} asyncjob_t;
+
+static semaphore_t asyncdone;
+static size_t asyncstarted;
+
+__attribute__((noreturn)) static void asyncthread() {
+	asyncjob_t *job = current_thread()->kernelarg;
+	job->fn(job->arg);
+	free(job);
+
+	semaphore_signal(&asyncdone);
+	sched_threadexit();
+}
+
+void block_async(void (*fn)(void *arg), void *arg) {
+	asyncjob_t *job = alloc(sizeof(asyncjob_t));
+	thread_t *thread = job ? sched_newthread(asyncthread, PAGE_SIZE * 4, 1, NULL, NULL) : NULL;
+	if (thread == NULL) {
+		// run it right away instead
+		if (job)
+			free(job);
+		fn(arg);
+		return;
+	}
+
+	job->fn = fn;
+	job->arg = arg;
+	thread->kernelarg = job;
+	__atomic_add_fetch(&asyncstarted, 1, __ATOMIC_SEQ_CST);
+	sched_queue(thread);
+}
+
+// jobs only start others before they finish, so once every job started so far is done, nothing is left running
+void block_waitasync() {
+	static size_t finished;
+	while (finished < __atomic_load_n(&asyncstarted, __ATOMIC_SEQ_CST)) {
+		semaphore_wait(&asyncdone, false);
+		++finished;
+	}
+}
+
+typedef struct {
+	blockdesc_t *desc;
+	char name[];
+} scanjob_t;
+
+// a disk only shows up in devfs once its partitions have been found
+static void scan(void *arg) {
+	scanjob_t *job = arg;
+	int part = detectpart(job->desc);
+
+	if (part == PART_GPT)
+		dogpt(job->desc, job->name);
+
+	if (part == PART_MBR)
+		dombr(job->desc, job->name);
+
+	__assert(registerdesc(job->desc, job->name) == 0);
+	free(job);
+}
+
 void block_register(blockdesc_t *desc, char *name) {
 	blockdesc_t *permdesc = alloc(sizeof(blockdesc_t));
 	__assert(permdesc);
 	*permdesc = *desc;
 
-	int part = detectpart(permdesc);
+	// the partitions get a copy of the desc, so they end up going through the same queue
+	blockqueue_t *queue = alloc(sizeof(blockqueue_t));
+	__assert(queue);
+	MUTEX_INIT(&queue->mutex);
+	SPINLOCK_INIT(queue->statslock);
+	queue->sched = iosched_get(desc->scheduler);
+	queue->maxinflight = desc->queuedepth;
+	if (queue->sched->init)
+		__assert(queue->sched->init(queue) == 0);
 
-	if (part == PART_GPT)
-		dogpt(permdesc, name);
+	permdesc->queue = queue;
+	permdesc->stats = newstats(name);
+	printf("block: %s using the %s scheduler\n", name, queue->sched->name);
 
-	if (part == PART_MBR)
-		dombr(permdesc, name);
-
-	__assert(registerdesc(permdesc, name) == 0);
+	scanjob_t *job = alloc(sizeof(scanjob_t) + strlen(name) + 1);
+	__assert(job);
+	job->desc = permdesc;
+	strcpy(job->name, name);
+	block_async(scan, job);
 }
 
 void block_init() {
 	hashtable_init(&blocktable, 100);
 	MUTEX_INIT(&tablemutex);
+	SPINLOCK_INIT(donelock);
+	SEMAPHORE_INIT(&donesem, 0);
+	SEMAPHORE_INIT(&asyncdone, 0);
+
+	__assert(devfs_register(&statsops, "blockstats", V_TYPE_CHDEV, DEV_MAJOR_BLOCKSTATS, 0, 0644, NULL) == 0);
+
+	thread_t *thread = sched_newthread(completionthread, PAGE_SIZE * 4, 0, NULL, NULL);
+	__assert(thread);
+	sched_queue(thread);
 }
@@ -0,0 +1,283 @@
+#include <kernel/iosched.h>
+#include <kernel/alloc.h>
+#include <kernel/scheduler.h>
+#include <kernel/timekeeper.h>
+#include <kernel/cmdline.h>
+#include <kernel/proc.h>
+#include <logging.h>
+#include <errno.h>
+#include <string.h>
+
+int iosched_currentweight() {
+	thread_t *thread = current_thread();
+	if (thread->ioweight)
+		return thread->ioweight;
+
+	return thread->proc ? thread->proc->ioweight : BLOCK_WEIGHT_DEFAULT;
+}
+
+// the driver is fast enough and has enough queues that reordering would only add overhead
+iosched_t iosched_noop = {
+	.name = "noop",
+	.passthrough = true
+};
+
+// reads are waited on, writes mostly come from writeback that nobody waits on
+#define READ_EXPIRE_US 500000
+#define WRITE_EXPIRE_US 5000000
+// requests dispatched in lba order before the deadlines are checked again
+#define FIFO_BATCH 16
+// read batches that may be dispatched while writes are waiting
+#define WRITES_STARVED 2
+
+typedef struct {
+	blockrequest_t *sorted[2]; // per op
+	blockrequest_t *fifo[2];
+	blockrequest_t *fifotail[2];
+	size_t queued;
+	blockrequest_t *batchnext;
+	int batchop;
+	size_t batchcount;
+	int starved;
+	uintmax_t lastend;
+	size_t inflightlight; // requests of processes below the default weight in flight
+} deadline_t;
+
+static void sortinsert(deadline_t *deadline, blockrequest_t *request) {
+	blockrequest_t *prev = NULL;
+	blockrequest_t *iterator = deadline->sorted[request->op];
+	while (iterator && iterator->lba < request->lba) {
+		prev = iterator;
+		iterator = iterator->sortnext;
+	}
+
+	request->sortprev = prev;
+	request->sortnext = iterator;
+	if (iterator)
+		iterator->sortprev = request;
+
+	if (prev)
+		prev->sortnext = request;
+	else
+		deadline->sorted[request->op] = request;
+}
+
+static void fifoappend(deadline_t *deadline, blockrequest_t *request) {
+	request->fifonext = NULL;
+	request->fifoprev = deadline->fifotail[request->op];
+	if (request->fifoprev)
+		request->fifoprev->fifonext = request;
+	else
+		deadline->fifo[request->op] = request;
+
+	deadline->fifotail[request->op] = request;
+}
+
+static void removerequest(deadline_t *deadline, blockrequest_t *request) {
+	int op = request->op;
+	if (deadline->batchnext == request)
+		deadline->batchnext = request->sortnext;
+
+	if (request->sortprev)
+		request->sortprev->sortnext = request->sortnext;
+	else
+		deadline->sorted[op] = request->sortnext;
+
+	if (request->sortnext)
+		request->sortnext->sortprev = request->sortprev;
+
+	if (request->fifoprev)
+		request->fifoprev->fifonext = request->fifonext;
+	else
+		deadline->fifo[op] = request->fifonext;
+
+	if (request->fifonext)
+		request->fifonext->fifoprev = request->fifoprev;
+	else
+		deadline->fifotail[op] = request->fifoprev;
+
+	request->sortprev = request->sortnext = request->fifoprev = request->fifonext = NULL;
+	--deadline->queued;
+}
+
+// whether the bios of b can go right after the ones of a in a single request
+static bool canmerge(blockrequest_t *a, blockrequest_t *b) {
+	blockdesc_t *desc = a->bios->desc;
+	if (a->flags != b->flags || a->lba + a->count != b->lba)
+		return false;
+
+	if (desc->maxcount && a->count + b->count > desc->maxcount)
+		return false;
+
+	if (desc->maxsegments && a->segmentcount + b->segmentcount > desc->maxsegments)
+		return false;
+
+	return true;
+}
+
+// merges the new request into one already queued if it continues it or is continued by it
+static bool trymerge(deadline_t *deadline, blockrequest_t *request) {
+	uintmax_t end = request->lba + request->count;
+	for (blockrequest_t *iterator = deadline->sorted[request->op]; iterator && iterator->lba <= end; iterator = iterator->sortnext) {
+		if (canmerge(iterator, request)) {
+			iterator->biostail->next = request->bios;
+			iterator->biostail = request->biostail;
+		} else if (canmerge(request, iterator)) {
+			request->biostail->next = iterator->bios;
+			iterator->bios = request->bios;
+			iterator->lba = request->lba;
+		} else {
+			continue;
+		}
+
+		block_countmerge(request->bios);
+		iterator->count += request->count;
+		iterator->segmentcount += request->segmentcount;
+		iterator->deadline = min(iterator->deadline, request->deadline);
+		iterator->weight = max(iterator->weight, request->weight);
+		free(request);
+		return true;
+	}
+
+	return false;
+}
+
+static int deadline_init(blockqueue_t *queue) {
+	deadline_t *deadline = alloc(sizeof(deadline_t));
+	if (deadline == NULL)
+		return ENOMEM;
+
+	queue->schedprivate = deadline;
+	return 0;
+}
+
+static void deadline_insert(blockqueue_t *queue, blockrequest_t *request) {
+	deadline_t *deadline = queue->schedprivate;
+
+	// a lighter process has its requests expire later, so a heavy writeback can't push back everyone else's reads
+	uintmax_t expire = request->op == BIO_OP_READ ? READ_EXPIRE_US : WRITE_EXPIRE_US;
+	request->deadline = request->submittime + expire * BLOCK_WEIGHT_DEFAULT / request->weight;
+
+	if (trymerge(deadline, request))
+		return;
+
+	sortinsert(deadline, request);
+	fifoappend(deadline, request);
+	++deadline->queued;
+}
+
+static bool expired(deadline_t *deadline, int op, uintmax_t now) {
+	return deadline->fifo[op] && deadline->fifo[op]->deadline <= now;
+}
+
+static blockrequest_t *pickrequest(deadline_t *deadline) {
+	uintmax_t now = timespec_us(timekeeper_timefromboot());
+
+	// keep going through the current batch unless the other op has something that expired
+	if (deadline->batchnext && deadline->batchcount < FIFO_BATCH && expired(deadline, !deadline->batchop, now) == false)
+		return deadline->batchnext;
+
+	bool reads = deadline->fifo[BIO_OP_READ];
+	bool writes = deadline->fifo[BIO_OP_WRITE];
+	int op;
+
+	if (reads && (writes == false || deadline->starved < WRITES_STARVED)) {
+		op = BIO_OP_READ;
+		if (writes)
+			++deadline->starved;
+	} else {
+		op = BIO_OP_WRITE;
+		deadline->starved = 0;
+	}
+
+	deadline->batchop = op;
+	deadline->batchcount = 0;
+
+	if (expired(deadline, op, now))
+		return deadline->fifo[op];
+
+	// carry on the sweep from where the last request ended, or from the oldest request once past the end
+	blockrequest_t *request = deadline->sorted[op];
+	while (request && request->lba < deadline->lastend)
+		request = request->sortnext;
+
+	return request ? request : deadline->fifo[op];
+}
+
+static blockrequest_t *heavyrequest(deadline_t *deadline) {
+	for (int op = BIO_OP_READ; op <= BIO_OP_WRITE; ++op) {
+		for (blockrequest_t *request = deadline->fifo[op]; request; request = request->fifonext) {
+			if (request->weight >= BLOCK_WEIGHT_DEFAULT)
+				return request;
+		}
+	}
+
+	return NULL;
+}
+
+static blockrequest_t *deadline_next(blockqueue_t *queue) {
+	deadline_t *deadline = queue->schedprivate;
+	if (deadline->queued == 0)
+		return NULL;
+
+	blockrequest_t *request = pickrequest(deadline);
+	__assert(request);
+
+	// lighter processes only get a share of the driver queue proportional to their weight
+	if (request->weight < BLOCK_WEIGHT_DEFAULT && queue->maxinflight) {
+		size_t share = max(queue->maxinflight * request->weight / BLOCK_WEIGHT_DEFAULT, 1);
+		if (deadline->inflightlight >= share) {
+			// a completion will run the queue again
+			request = heavyrequest(deadline);
+			if (request == NULL)
+				return NULL;
+		}
+	}
+
+	if (request->op != deadline->batchop) {
+		deadline->batchop = request->op;
+		deadline->batchcount = 0;
+	}
+
+	deadline->batchnext = request->sortnext;
+	removerequest(deadline, request);
+	++deadline->batchcount;
+	deadline->lastend = request->lba + request->count;
+
+	if (request->weight < BLOCK_WEIGHT_DEFAULT)
+		++deadline->inflightlight;
+
+	return request;
+}
+
+static void deadline_completed(blockqueue_t *queue, blockrequest_t *request) {
+	deadline_t *deadline = queue->schedprivate;
+	if (request->weight < BLOCK_WEIGHT_DEFAULT)
+		--deadline->inflightlight;
+}
+
+static size_t deadline_queued(blockqueue_t *queue) {
+	deadline_t *deadline = queue->schedprivate;
+	return deadline->queued;
+}
+
+iosched_t iosched_deadline = {
+	.name = "deadline",
+	.init = deadline_init,
+	.insert = deadline_insert,
+	.next = deadline_next,
+	.completed = deadline_completed,
+	.queued = deadline_queued
+};
+
+// the driver suggests a scheduler, which can be overridden for all disks with iosched=noop or iosched=deadline
+iosched_t *iosched_get(int scheduler) {
+	char *override = cmdline_get("iosched");
+	if (override && strcmp(override, iosched_noop.name) == 0)
+		return &iosched_noop;
+
+	if (override && strcmp(override, iosched_deadline.name) == 0)
+		return &iosched_deadline;
+
+	return scheduler == BLOCK_SCHED_DEADLINE ? &iosched_deadline : &iosched_noop;
+}
@@ -10,6 +10,13 @@
 #include <arch/cpu.h>
 #include <errno.h>
 #include <kernel/block.h>
+#include <kernel/nvme.h>
+#include <kernel/timekeeper.h>
+#include <kernel/usercopy.h>
+#include <kernel/topology.h>
+#include <kernel/cmdline.h>
+#include <arch/smp.h>
+#include <kernel/scheduler.h>
 
 #define CC_ENABLE(cc) cc = (cc) | 1
 #define CC_DISABLE(cc) cc = (cc) & ~1
@@ -51,12 +58,15 @@
 #define PAIR_INIT(pair, opcode, fused, memaccess, nsid) \
 	SUB_INIT(&(pair)->sub, opcode, fused, memaccess, nsid);
 
+#define SUB_DW0_OPCODE_FLUSH 0x0
 #define SUB_DW0_OPCODE_WRITE 0x1
 #define SUB_DW0_OPCODE_CREATEIOSUBQUEUE 0x1
 #define SUB_DW0_OPCODE_READ 0x2
 #define SUB_DW0_OPCODE_CREATEIOCOMPQUEUE 0x5
 #define SUB_DW0_OPCODE_IDENTIFY 0x6
 #define SUB_DW0_OPCODE_SETFEATURES 0x9
+#define SUB_DW0_OPCODE_WRITEZEROES 0x8
+#define SUB_DW0_OPCODE_DATASETMANAGEMENT 0x9
 #define SUB_DW0_UNFUSED 0
 #define SUB_DW0_PRP 0
 
@@ -69,6 +79,23 @@
 #define CTLRID_QSIZE_MIN(x) ((x) & 0xf)
 #define CTLRID_QSIZE_MAX(x) (((x) >> 4) & 0xf)
 
+#define CTLRID_ONCS_DATASETMANAGEMENT 4
+#define CTLRID_ONCS_WRITEZEROES 8
+
+#define CTLRID_VWC_PRESENT 1
+
+// in the third command dword of reads and writes
+#define RW_FORCEUNITACCESS (1 << 30)
+
+// a single range of a dataset management command, the lba count isn't 0 based here
+typedef struct {
+	uint32_t attributes;
+	uint32_t count;
+	uint64_t lba;
+} __attribute__((packed)) dsmrange_t;
+
+#define DSM_DEALLOCATE 4
+
 typedef struct {
 	uint16_t metadatasize;
 	uint8_t lbadatasize; // power of two
@@ -221,6 +248,10 @@ typedef struct {
 	compentry_t comp;
 	subentry_t sub;
 	thread_t *thread;
+	blockrequest_t *request; // for commands that nobody waits on
+	struct nvmenamespace_t *namespace;
+	size_t bytes;
+	uint64_t *prplist; // physical, allocated the first time the entry needs one
 } entrypair_t;
 
 typedef struct {
@@ -241,6 +272,7 @@ typedef struct {
 	spinlock_t lock;
 	semaphore_t entrysem;
 	entrypair_t *entries[QUEUEPAIR_ENTRY_COUNT];
+	entrypair_t *asyncentries; // QUEUEPAIR_ENTRY_COUNT of them for i/o queues, allocated apart to keep the pairs small
 } queuepair_t;
 
 typedef struct nvmecontroller_t {
@@ -252,30 +284,59 @@ typedef struct nvmecontroller_t {
 	size_t paircount;
 	uintmax_t queueindex;
 	queuepair_t *ioqueues;
+	queuepair_t **cpuqueues; // indexed by cpu id
+	size_t cpuqueuecount;
+	size_t maxpages; // most pages a single command can transfer
+	uint16_t oncs; // optional nvm commands supported
+	bool writecache; // the namespaces have a volatile write cache
 } nvmecontroller_t;
 
-typedef struct {
+typedef struct nvmenamespace_t {
 	nvmecontroller_t *controller;
 	int id;
 	size_t blocksize;
 	size_t capacity;
+	nvmestats_t stats;
 } nvmenamespace_t;
 
-#define CAP_COMMANDSET_NVM 1
+// a single prp list page is used, so a command can have the first prp entry plus a full list
+#define PRPLIST_ENTRIES (PAGE_SIZE / sizeof(uint64_t))
+#define MAX_COMMAND_PAGES (PRPLIST_ENTRIES + 1)
 
-static void nvme_dpc(context_t *, dpcarg_t arg) {
-	queuepair_t *pair = arg;
-	spinlock_acquire(&pair->lock);
+#define CAP_COMMANDSET_NVM 1
 
+// expects the queue lock to be held
+static void processcompletions(queuepair_t *pair) {
 	compentry_t *queue = (compentry_t *)pair->completion.address;
 
 	int count = 0;
 
 	while (COMP_CMDINFO_PHASE(queue[pair->completion.index].cmdinfo) == pair->completion.phase) {
 		int subid = COMP_CMDINFO_CMDID(queue[pair->completion.index].cmdinfo);
-		pair->entries[subid]->comp = queue[pair->completion.index];
-
-		sched_wakeup(pair->entries[subid]->thread, SCHED_WAKEUP_REASON_NORMAL);
+		entrypair_t *entries = pair->entries[subid];
+		entries->comp = queue[pair->completion.index];
+
+		if (entries->request) {
+			// the request is done once the last of its commands completes
+			blockrequest_t *request = entries->request;
+			entries->request = NULL;
+			if (COMP_CMDINFO_STATUS(entries->comp.cmdinfo)) {
+				request->error = EIO;
+			} else if (request->op != BIO_OP_READ && request->op != BIO_OP_WRITE) {
+				// no data moved
+			} else if (request->op == BIO_OP_WRITE) {
+				__atomic_add_fetch(&entries->namespace->stats.writecommands, 1, __ATOMIC_RELAXED);
+				__atomic_add_fetch(&entries->namespace->stats.writebytes, entries->bytes, __ATOMIC_RELAXED);
+			} else {
+				__atomic_add_fetch(&entries->namespace->stats.readcommands, 1, __ATOMIC_RELAXED);
+				__atomic_add_fetch(&entries->namespace->stats.readbytes, entries->bytes, __ATOMIC_RELAXED);
+			}
+
+			if (__atomic_sub_fetch(&request->remaining, 1, __ATOMIC_SEQ_CST) == 0)
+				block_complete(request);
+		} else {
+			sched_wakeup(entries->thread, SCHED_WAKEUP_REASON_NORMAL);
+		}
 
 		pair->entries[subid] = NULL;
 		semaphore_signal(&pair->entrysem);
@@ -290,7 +351,12 @@ static void nvme_dpc(context_t *, dpcarg_t arg) {
 
 	if (count)
 		*pair->completion.doorbell = pair->completion.index;
+}
 
+static void nvme_dpc(context_t *, dpcarg_t arg) {
+	queuepair_t *pair = arg;
+	spinlock_acquire(&pair->lock);
+	processcompletions(pair);
 	spinlock_release(&pair->lock);
 }
 
@@ -306,15 +372,16 @@ static isr_t *msixnewisrforqueue(queuepair_t *queuepair) {
 	return isr;
 }
 
-static void enqueueandwait(queuepair_t *queuepair, entrypair_t *entries) {
-	bool intstatus = interrupt_set(false);
-	semaphore_wait(&queuepair->entrysem, false);
-
-	subentry_t *subqueue = queuepair->submission.address;
-	spinlock_acquire(&queuepair->lock);
-
+// expects the queue lock to be held and a free entry to have been reserved with entrysem
+static int getfreeentry(queuepair_t *queuepair) {
 	int pair = 0;
 	while (queuepair->entries[pair]) ++pair;
+	return pair;
+}
+
+// expects the queue lock to be held
+static void ringsubmission(queuepair_t *queuepair, int pair, entrypair_t *entries) {
+	subentry_t *subqueue = queuepair->submission.address;
 
 	SUB_SETDW0ID(entries->sub.dword0, pair);
 	queuepair->entries[pair] = entries;
@@ -323,6 +390,18 @@ static void enqueueandwait(queuepair_t *queuepair, entrypair_t *entries) {
 	queuepair->submission.index %= queuepair->submission.entrycount;
 
 	*queuepair->submission.doorbell = queuepair->submission.index;
+}
+
+static void enqueueandwait(queuepair_t *queuepair, entrypair_t *entries) {
+	bool intstatus = interrupt_set(false);
+	semaphore_wait(&queuepair->entrysem, false);
+
+	spinlock_acquire(&queuepair->lock);
+
+	int pair = getfreeentry(queuepair);
+	entries->request = NULL;
+	ringsubmission(queuepair, pair, entries);
+
 	sched_prepare_sleep(false);
 	entries->thread = current_thread();
 	spinlock_release(&queuepair->lock);
@@ -330,6 +409,29 @@ static void enqueueandwait(queuepair_t *queuepair, entrypair_t *entries) {
 	interrupt_set(intstatus);
 }
 
+// takes an entry for a command of a block request, which is then filled in by the caller and submitted by enqueueasync
+static int reserveentry(queuepair_t *queuepair) {
+	bool intstatus = interrupt_set(false);
+	semaphore_wait(&queuepair->entrysem, false);
+
+	spinlock_acquire(&queuepair->lock);
+	int pair = getfreeentry(queuepair);
+	queuepair->entries[pair] = &queuepair->asyncentries[pair];
+	spinlock_release(&queuepair->lock);
+
+	interrupt_set(intstatus);
+	return pair;
+}
+
+// submits a command of a block request without waiting for it, the dpc completes the request
+static void enqueueasync(queuepair_t *queuepair, int pair) {
+	bool intstatus = interrupt_set(false);
+	spinlock_acquire(&queuepair->lock);
+	ringsubmission(queuepair, pair, &queuepair->asyncentries[pair]);
+	spinlock_release(&queuepair->lock);
+	interrupt_set(intstatus);
+}
+
 #define IDENTIFY_SIZE 4096
 #define IDENTIFY_WHAT_NAMESPACE 0
 #define IDENTIFY_WHAT_CONTROLLER 1
@@ -458,104 +560,196 @@ static void newioqueuepair(nvmecontroller_t *controller, queuepair_t *pair, int
 	__assert(createiosubqueue(controller, &pair->submission, QUEUEPAIR_ENTRY_COUNT, id, id, 0) == 0);
 	pair->controller = controller;
 	SPINLOCK_INIT(pair->lock);
-	SEMAPHORE_INIT(&pair->entrysem, QUEUEPAIR_ENTRY_COUNT);
+	// a full submission queue would look empty to the controller, so one entry is always left unused
+	SEMAPHORE_INIT(&pair->entrysem, QUEUEPAIR_ENTRY_COUNT - 1);
+	pair->asyncentries = alloc(sizeof(entrypair_t) * QUEUEPAIR_ENTRY_COUNT);
+	__assert(pair->asyncentries);
 }
 
+// every cpu submits to the queue whose interrupt is routed to it or to a cpu next to it
 static queuepair_t *pickioqueue(nvmecontroller_t *controller) {
+	long id = current_cpu_id();
+	if (id < controller->cpuqueuecount && controller->cpuqueues[id])
+		return controller->cpuqueues[id];
+
 	uintmax_t index = __atomic_fetch_add(&controller->queueindex, 1, __ATOMIC_SEQ_CST);
 	index %= controller->paircount;
 	return &controller->ioqueues[index];
 }
 
-static int ioread(nvmenamespace_t *namespace, uint64_t prp[2], uint64_t lba, uint64_t count) {
-	entrypair_t pair = {0};
-	PAIR_INIT(&pair, SUB_DW0_OPCODE_READ, SUB_DW0_UNFUSED, SUB_DW0_PRP, namespace->id);
-
-	queuepair_t *queue = pickioqueue(namespace->controller);
-
-	pair.sub.datapointer[0] = prp[0];
-	pair.sub.datapointer[1] = prp[1];
-	pair.sub.command[0] = lba & 0xffffffff;
-	pair.sub.command[1] = (lba >> 32) & 0xffffffff;
-	pair.sub.command[2] = (count - 1) & 0xffff;
-
-	enqueueandwait(queue, &pair);
-
-	return COMP_CMDINFO_STATUS(pair.comp.cmdinfo) ? EIO : 0;
+static int ioctl(void *private, unsigned long request, void *arg, int *result) {
+	nvmenamespace_t *namespace = private;
+	switch (request) {
+		case NVME_IOCTL_GETSTATS:
+			nvmestats_t stats = {
+				.readcommands = __atomic_load_n(&namespace->stats.readcommands, __ATOMIC_RELAXED),
+				.writecommands = __atomic_load_n(&namespace->stats.writecommands, __ATOMIC_RELAXED),
+				.readbytes = __atomic_load_n(&namespace->stats.readbytes, __ATOMIC_RELAXED),
+				.writebytes = __atomic_load_n(&namespace->stats.writebytes, __ATOMIC_RELAXED),
+				.timestamp = timekeeper_timefromboot()
+			};
+			*result = 0;
+			return USERCOPY_POSSIBLY_TO_USER(arg, &stats, sizeof(nvmestats_t));
+		default:
+			return ENOTTY;
+	}
 }
 
-static int iowrite(nvmenamespace_t *namespace, uint64_t prp[2], uint64_t lba, uint64_t count) {
-	entrypair_t pair = {0};
-	PAIR_INIT(&pair, SUB_DW0_OPCODE_WRITE, SUB_DW0_UNFUSED, SUB_DW0_PRP, namespace->id);
-
-	queuepair_t *queue = pickioqueue(namespace->controller);
-
-	pair.sub.datapointer[0] = prp[0];
-	pair.sub.datapointer[1] = prp[1];
-	pair.sub.command[0] = lba & 0xffffffff;
-	pair.sub.command[1] = (lba >> 32) & 0xffffffff;
-	pair.sub.command[2] = (count - 1) & 0xffff;
-
-	enqueueandwait(queue, &pair);
-
-	return COMP_CMDINFO_STATUS(pair.comp.cmdinfo) ? EIO : 0;
+// reaps the completions of the queue the request was submitted to, for polled requests
+static void poll(void *private, blockrequest_t *request) {
+	queuepair_t *queue = request->driverdata;
+	bool intstatus = interrupt_set(false);
+	spinlock_acquire(&queue->lock);
+	processcompletions(queue);
+	spinlock_release(&queue->lock);
+	interrupt_set(intstatus);
 }
 
-#define PAGES_FLAGS (ARCH_MMU_FLAGS_READ | ARCH_MMU_FLAGS_WRITE | ARCH_MMU_FLAGS_NOEXEC)
+static void issuecommand(queuepair_t *queue, int pair, uintmax_t lba, size_t pagecount, blockrequest_t *request) {
+	entrypair_t *entries = &queue->asyncentries[pair];
+	size_t count = entries->bytes / entries->namespace->blocksize;
 
-static int rwblocks(nvmenamespace_t *namespace, iovec_iterator_t *iovec_iterator, uintmax_t lba, size_t count, bool write) {
-	__assert(namespace->blocksize <= PAGE_SIZE);
+	// the second prp entry is either the second page or a list of every page after the first
+	if (pagecount == 2 && entries->prplist)
+		entries->sub.datapointer[1] = ((uint64_t *)MAKE_HHDM(entries->prplist))[0];
+	else if (pagecount > 2)
+		entries->sub.datapointer[1] = (uint64_t)entries->prplist;
 
-	int err = 0;
-
-	uint64_t prp[2] = {0, 0};
-
-	int done = 0;
-	while (done < count) {
-		void *page;
-		size_t page_offset, page_remaining;
-		err = iovec_iterator_next_page(iovec_iterator, &page_offset, &page_remaining, &page);
-		if (err)
-			break;
+	entries->sub.command[0] = lba & 0xffffffff;
+	entries->sub.command[1] = (lba >> 32) & 0xffffffff;
+	entries->sub.command[2] = (count - 1) & 0xffff;
+	if (request->flags & BIO_FLAGS_FUA)
+		entries->sub.command[2] |= RW_FORCEUNITACCESS;
 
-		// check that there is enough space to complete the write of this page
-		__assert(page);
-		__assert(page_remaining >= min((count - done) * namespace->blocksize, PAGE_SIZE));
-
-		// and that the space is aligned to the block size
-		__assert((page_remaining % namespace->blocksize) == 0);
+	__atomic_add_fetch(&request->remaining, 1, __ATOMIC_SEQ_CST);
+	enqueueasync(queue, pair);
+}
 
-		size_t docount = page_remaining / namespace->blocksize;
-		docount = min(docount, count - done);
+// flushes, discards and write zeroes are merged by the block layer up to the limits given to it, so they are always a single command
+static int submitnodata(nvmenamespace_t *namespace, queuepair_t *queue, blockrequest_t *request) {
+	int pair = reserveentry(queue);
+	entrypair_t *entries = &queue->asyncentries[pair];
+
+	memset(&entries->sub, 0, sizeof(subentry_t));
+	entries->thread = NULL;
+	entries->request = request;
+	entries->namespace = namespace;
+	entries->bytes = 0;
+
+	if (request->op == BIO_OP_DISCARD) {
+		// the range goes in the page otherwise used for the prp list
+		if (entries->prplist == NULL)
+			entries->prplist = pmm_allocpage(PMM_SECTION_DEFAULT);
+
+		if (entries->prplist == NULL) {
+			bool intstatus = interrupt_set(false);
+			spinlock_acquire(&queue->lock);
+			queue->entries[pair] = NULL;
+			spinlock_release(&queue->lock);
+			interrupt_set(intstatus);
+			semaphore_signal(&queue->entrysem);
+			return ENOMEM;
+		}
 
-		prp[0] = (uint64_t)page + page_offset;
+		dsmrange_t *range = MAKE_HHDM(entries->prplist);
+		range->attributes = 0;
+		range->count = request->count;
+		range->lba = request->lba;
+
+		SUB_INIT(&entries->sub, SUB_DW0_OPCODE_DATASETMANAGEMENT, SUB_DW0_UNFUSED, SUB_DW0_PRP, namespace->id);
+		entries->sub.datapointer[0] = (uint64_t)entries->prplist;
+		entries->sub.command[0] = 0; // a single range
+		entries->sub.command[1] = DSM_DEALLOCATE;
+	} else if (request->op == BIO_OP_FLUSH) {
+		SUB_INIT(&entries->sub, SUB_DW0_OPCODE_FLUSH, SUB_DW0_UNFUSED, SUB_DW0_PRP, namespace->id);
+	} else {
+		SUB_INIT(&entries->sub, SUB_DW0_OPCODE_WRITEZEROES, SUB_DW0_UNFUSED, SUB_DW0_PRP, namespace->id);
+		entries->sub.command[0] = request->lba & 0xffffffff;
+		entries->sub.command[1] = (request->lba >> 32) & 0xffffffff;
+		entries->sub.command[2] = (request->count - 1) & 0xffff;
+	}
 
-		err = write ? iowrite(namespace, prp, lba + done, docount) : ioread(namespace, prp, lba + done, docount);
+	request->driverdata = queue;
+	request->remaining = 1;
+	enqueueasync(queue, pair);
+	return 0;
+}
 
-		pmm_release((void *)prp[0]);
+// segments are packed into as few commands as the prp rules and the controller transfer size allow:
+// every page but the first has to start at offset 0 and every page but the last has to end on a page boundary
+static int submit(void *private, blockrequest_t *request) {
+	nvmenamespace_t *namespace = private;
+	__assert(namespace->blocksize <= PAGE_SIZE);
 
-		// if we didnt use the whole space in the page, set the iterator back a bit
-		size_t diff_between_available_and_used = page_remaining - docount * namespace->blocksize;
-		if (diff_between_available_and_used) {
-			size_t iterator_offset = iovec_iterator_total_offset(iovec_iterator);
-			iovec_iterator_set(iovec_iterator, iterator_offset - diff_between_available_and_used);
+	queuepair_t *queue = pickioqueue(namespace->controller);
+	if (request->op != BIO_OP_READ && request->op != BIO_OP_WRITE)
+		return submitnodata(namespace, queue, request);
+
+	int opcode = request->op == BIO_OP_WRITE ? SUB_DW0_OPCODE_WRITE : SUB_DW0_OPCODE_READ;
+	uintmax_t lba = request->lba;
+
+	int pair = -1;
+	entrypair_t *entries = NULL;
+	uintmax_t commandlba = 0;
+	size_t pagecount = 0;
+	size_t maxpages = 0;
+	bool endsonpage = false;
+
+	request->driverdata = queue;
+
+	// keep an extra count so the request can't complete while its commands are still being submitted
+	request->remaining = 1;
+
+	for (bio_t *bio = request->bios; bio; bio = bio->next) {
+		for (size_t i = 0; i < bio->segmentcount; ++i) {
+			biosegment_t *segment = &bio->segments[i];
+			uint64_t address = (uint64_t)segment->page + segment->offset;
+
+			if (pair != -1 && endsonpage && segment->offset == 0 && pagecount < maxpages) {
+				// continue the current command
+				if (pagecount == 1 && entries->prplist == NULL) {
+					// only room for a second page in the command itself
+					entries->sub.datapointer[1] = address;
+				} else {
+					((uint64_t *)MAKE_HHDM(entries->prplist))[pagecount - 1] = address;
+				}
+				++pagecount;
+			} else {
+				if (pair != -1)
+					issuecommand(queue, pair, commandlba, pagecount, request);
+
+				pair = reserveentry(queue);
+				entries = &queue->asyncentries[pair];
+				if (entries->prplist == NULL)
+					entries->prplist = pmm_allocpage(PMM_SECTION_DEFAULT);
+
+				// without a list page a command can still have two pages
+				maxpages = entries->prplist ? namespace->controller->maxpages : min(2, namespace->controller->maxpages);
+
+				memset(&entries->sub, 0, sizeof(subentry_t));
+				SUB_INIT(&entries->sub, opcode, SUB_DW0_UNFUSED, SUB_DW0_PRP, namespace->id);
+				entries->sub.datapointer[0] = address;
+				entries->thread = NULL;
+				entries->request = request;
+				entries->namespace = namespace;
+				entries->bytes = 0;
+				commandlba = lba;
+				pagecount = 1;
+			}
+
+			entries->bytes += segment->length;
+			lba += segment->length / namespace->blocksize;
+			endsonpage = ((segment->offset + segment->length) % PAGE_SIZE) == 0;
 		}
-
-		if (err)
-			break;
-
-		done += docount;
 	}
 
-	return err;
-}
+	if (pair != -1)
+		issuecommand(queue, pair, commandlba, pagecount, request);
 
-static int read(void *private, iovec_iterator_t *iovec_iterator, uintmax_t lba, size_t count) {
-	return rwblocks(private, iovec_iterator, lba, count, false);
-}
+	if (__atomic_sub_fetch(&request->remaining, 1, __ATOMIC_SEQ_CST) == 0)
+		block_complete(request);
 
-static int write(void *private, iovec_iterator_t *iovec_iterator, uintmax_t lba, size_t count) {
-	return rwblocks(private, iovec_iterator, lba, count, true);
+	return 0;
 }
 
 static void initnamespace(nvmecontroller_t *controller, int id) {
@@ -584,8 +778,15 @@ static void initnamespace(nvmecontroller_t *controller, int id) {
 		.lbaoffset = 0,
 		.blockcapacity = namespace->capacity,
 		.blocksize = namespace->blocksize,
-		.read = read,
-		.write = write
+		.maxcount = controller->maxpages * PAGE_SIZE / namespace->blocksize,
+		.maxdiscard = (controller->oncs & CTLRID_ONCS_DATASETMANAGEMENT) ? UINT32_MAX : 0,
+		.maxwritezeroes = (controller->oncs & CTLRID_ONCS_WRITEZEROES) ? 0x10000 : 0,
+		.writecache = controller->writecache,
+		.fua = controller->writecache,
+		.submit = submit,
+		.ioctl = ioctl,
+		.poll = cmdline_get("nvmepoll") ? poll : NULL,
+		.scheduler = BLOCK_SCHED_NOOP
 	};
 
 	block_register(&desc, name);
@@ -595,8 +796,15 @@ static void initnamespace(nvmecontroller_t *controller, int id) {
 
 #define MAX_PAIRS_PER_CONTROLLER 16
 
-static int ctlrid;
-static void initcontroller(pcienum_t *e) {
+// controllers can take a while to get ready after a reset
+#define READY_POLL_US 1000
+
+typedef struct {
+	pcienum_t *e;
+	int id;
+} probejob_t;
+
+static void initcontroller(pcienum_t *e, int id) {
 	pcibar_t bar0p = pci_getbar(e, 0);
 	volatile nvmebar0_t *bar0 = (volatile nvmebar0_t *)bar0p.address;
 	__assert(bar0);
@@ -648,7 +856,8 @@ static void initcontroller(pcienum_t *e) {
 	bar0->cc = cc;
 
 	// wait for controller to reset
-	while (STATUS_READY(bar0->status)) ;
+	while (STATUS_READY(bar0->status))
+		sched_sleep_us(READY_POLL_US);
 
 	// minimal config
 
@@ -677,7 +886,8 @@ static void initcontroller(pcienum_t *e) {
 	CC_ENABLE(cc);
 	bar0->cc = cc;
 
-	while (STATUS_TEST(bar0->status) == 0) ;
+	while (STATUS_TEST(bar0->status) == 0)
+		sched_sleep_us(READY_POLL_US);
 
 	if (STATUS_FATAL(bar0->status)) {
 		printf("nvme: controller returned fatal while initializing\n");
@@ -688,7 +898,7 @@ static void initcontroller(pcienum_t *e) {
 	nvmecontroller_t *controller = alloc(sizeof(nvmecontroller_t));
 	__assert(controller);
 
-	controller->id = ctlrid;
+	controller->id = id;
 	controller->bar0 = bar0;
 	controller->dbstride = CAP_DOORBELLSTRIDE(bar0->cap);
 	controller->maxentries = CAP_MAXENTRIES(bar0->cap);
@@ -703,7 +913,7 @@ static void initcontroller(pcienum_t *e) {
 	controller->adminqueue.completion.phase = 1;
 
 	SPINLOCK_INIT(controller->adminqueue.lock);
-	SEMAPHORE_INIT(&controller->adminqueue.entrysem, QUEUEPAIR_ENTRY_COUNT);
+	SEMAPHORE_INIT(&controller->adminqueue.entrysem, QUEUEPAIR_ENTRY_COUNT - 1);
 
 	isr_t *adminisr = NULL;
 	if (e->msix.exists) {
@@ -727,10 +937,20 @@ static void initcontroller(pcienum_t *e) {
 		return;
 	}
 
-	++ctlrid;
-
 	resetsoftwareprogress(controller);
 
+	// the maximum data transfer size is in units of the minimum page size, with 0 meaning no limit
+	controller->maxpages = MAX_COMMAND_PAGES;
+	if (controllerid->maxdatatransfer) {
+		size_t mdtsbytes = (1ul << controllerid->maxdatatransfer) * (1ul << (CAP_MINPAGESIZE(bar0->cap) + 12));
+		controller->maxpages = max(1, min(MAX_COMMAND_PAGES, mdtsbytes / PAGE_SIZE));
+	}
+
+	printf("nvme%lu: up to %lu pages per command\n", controller->id, controller->maxpages);
+
+	controller->oncs = controllerid->oncs;
+	controller->writecache = controllerid->vwc & CTLRID_VWC_PRESENT;
+
 	// validate SQ entry size and CQ entry size and set it on CC
 	int minsqlog2 = CTLRID_QSIZE_MIN(controllerid->sqentrysize);
 	int maxsqlog2 = CTLRID_QSIZE_MAX(controllerid->sqentrysize);
@@ -751,26 +971,53 @@ static void initcontroller(pcienum_t *e) {
 	__assert(namespacelist);
 	__assert(IDENTIFY_NAMESPACELIST(controller, namespacelist) == 0);
 
-	// determine how many pairs to use
-	size_t iomin = min(intcount, MAX_PAIRS_PER_CONTROLLER);
+	// get the cpus ordered by topology so that a queue shared by several of them is shared by neighbours
+	size_t cpucount = arch_smp_cpusawake;
+	cpu_t **cpus = alloc(sizeof(cpu_t *) * cpucount);
+	__assert(cpus);
+	cpucount = topology_cpus(cpus, cpucount);
+	__assert(cpucount);
+
+	// determine how many pairs to use, one per cpu if possible. the admin queue takes the first vector
+	size_t iomin = min(min(intcount > 1 ? intcount - 1 : 1, MAX_PAIRS_PER_CONTROLLER), cpucount);
 	size_t iocount;
 	__assert(allocateioqueues(controller, iomin, &iocount) == 0);
 	iocount = min(iomin, iocount);
-	printf("nvme%lu: using %lu I/O queues\n", controller->id, iocount);
+	printf("nvme%lu: using %lu I/O queues for %lu cpus\n", controller->id, iocount, cpucount);
 	controller->paircount = iocount;
 
+	controller->cpuqueuecount = 0;
+	for (int i = 0; i < cpucount; ++i)
+		controller->cpuqueuecount = max(controller->cpuqueuecount, cpus[i]->id + 1);
+
+	controller->cpuqueues = alloc(sizeof(queuepair_t *) * controller->cpuqueuecount);
+	__assert(controller->cpuqueues);
+
 	// create i/o queues
 	controller->ioqueues = alloc(sizeof(queuepair_t) * iocount);
 	__assert(controller->ioqueues);
 
+	cpu_t *oldtarget = current_thread()->cputarget;
 	for (int i = 0; i < iocount; ++i) {
+		// each queue serves a contiguous group of cpus, and its interrupt goes to the first one of them
+		size_t first = i * cpucount / iocount;
+		size_t last = (i + 1) * cpucount / iocount;
+		for (size_t c = first; c < last; ++c)
+			controller->cpuqueues[cpus[c]->id] = &controller->ioqueues[i];
+
 		newioqueuepair(controller, &controller->ioqueues[i], i + 1);
+
+		// isrs are allocated on the current cpu and msi-x messages target it, so move there first
+		sched_reschedule_on_cpu(cpus[first], true);
 		if (e->msix.exists) {
 			isr_t *isr = msixnewisrforqueue(&controller->ioqueues[i]);
 			pci_msixadd(e, i + 1, INTERRUPT_IDTOVECTOR(isr->id), 1, 0);
 		}
 	}
 
+	sched_target_cpu(oldtarget);
+	free(cpus);
+
 	// initialize namespaces
 	for (int i = 0; i < 1024 && namespacelist[i]; ++i)
 		initnamespace(controller, namespacelist[i]);
@@ -779,12 +1026,25 @@ static void initcontroller(pcienum_t *e) {
 	free(controllerid);
 }
 
+static void probe(void *arg) {
+	probejob_t *job = arg;
+	initcontroller(job->e, job->id);
+	free(job);
+}
+
+// every controller is brought up on its own thread. the ids follow the pci order so the names don't depend on
+// which one gets ready first
 void nvme_init() {
 	int i = 0;
 	for (;;) {
-		pcienum_t *e = pci_getenum(PCI_CLASS_STORAGE, PCI_SUBCLASS_STORAGE_NVM, -1, -1, -1, -1, i++);
+		pcienum_t *e = pci_getenum(PCI_CLASS_STORAGE, PCI_SUBCLASS_STORAGE_NVM, -1, -1, -1, -1, i);
 		if (e == NULL)
 			break;
-		initcontroller(e);
+
+		probejob_t *job = alloc(sizeof(probejob_t));
+		__assert(job);
+		job->e = e;
+		job->id = i++;
+		block_async(probe, job);
 	}
 }
@@ -4,27 +4,49 @@
 #include <hashtable.h>
 #include <kernel/slab.h>
 #include <semaphore.h>
+#include <mutex.h>
 #include <kernel/block.h>
 #include <kernel/pmm.h>
+#include <kernel/topology.h>
+#include <arch/smp.h>
 #include <string.h>
 
-#define QUEUE_MAX_SIZE 144
+#define QUEUE_MAX_SIZE 256
+#define MAX_QUEUES 16
+
+#define VIOBLK_FEATURE_SEGMAX (1l << 2)
+#define VIOBLK_FEATURE_FLUSH (1l << 9)
+#define VIOBLK_FEATURE_MQ (1l << 12)
+#define VIOBLK_FEATURE_DISCARD (1l << 13)
+#define VIOBLK_FEATURE_WRITEZEROES (1l << 14)
+
+#define WANTED_FEATURES (VIO_FEATURE_VERSION_1 | VIO_FEATURE_INDIRECT_DESC | VIOBLK_FEATURE_SEGMAX | VIOBLK_FEATURE_MQ | \
+	VIOBLK_FEATURE_DISCARD | VIOBLK_FEATURE_WRITEZEROES | VIOBLK_FEATURE_FLUSH)
 
 typedef struct {
 	uint64_t capacity;
+	uint32_t sizemax;
+	uint32_t segmax;
+	uint16_t cylinders;
+	uint8_t heads;
+	uint8_t sectors;
+	uint32_t blocksize;
+	uint8_t physicalblockexp;
+	uint8_t alignmentoffset;
+	uint16_t miniosize;
+	uint32_t optiosize;
+	uint8_t writeback;
+	uint8_t unused0;
+	uint16_t numqueues;
+	uint32_t maxdiscardsectors;
+	uint32_t maxdiscardsegments;
+	uint32_t discardsectoralignment;
+	uint32_t maxwritezeroessectors;
+	uint32_t maxwritezeroessegments;
+	uint8_t writezeroesmayunmap;
+	uint8_t unused1[3];
 } __attribute__((packed)) blkdevconfig_t;
 
-typedef struct {
-	viodevice_t *viodevice;
-	size_t capacity;
-	int id;
-	vioqueue_t queue;
-	dpc_t queuedpc;
-	spinlock_t queuelock;
-	semaphore_t queuesem;
-	thread_t *queuewaiting[QUEUE_MAX_SIZE / 3];
-} vioblkdev_t;
-
 typedef struct {
 	uint32_t type;
 	uint32_t reserved;
@@ -33,133 +55,343 @@ typedef struct {
 
 #define HEADER_TYPE_READ 0
 #define HEADER_TYPE_WRITE 1
+#define HEADER_TYPE_FLUSH 4
+#define HEADER_TYPE_DISCARD 11
+#define HEADER_TYPE_WRITEZEROES 13
+
+// the data of discard and write zeroes requests
+typedef struct {
+	uint64_t sector;
+	uint32_t count;
+	uint32_t flags;
+} __attribute__((packed)) discardrange_t;
+
+// every descriptor that can head a chain has a cell with the header, status and discard range of its request
+#define CELL_SIZE 64
+#define CELL_HEADER(queue, head) ((requestheader_t *)((uintptr_t)(queue)->cellsphys + (head) * CELL_SIZE))
+#define CELL_STATUS(queue, head) ((uint8_t *)((uintptr_t)(queue)->cellsphys + (head) * CELL_SIZE + sizeof(requestheader_t)))
+#define CELL_RANGE(queue, head) ((discardrange_t *)((uintptr_t)(queue)->cellsphys + (head) * CELL_SIZE + 32))
+
+// an indirect table fits in a page, with the header and status taking two entries
+#define INDIRECT_MAX_SEGMENTS (PAGE_SIZE / sizeof(viobuffer_t) - 2)
+
+typedef struct {
+	blockrequest_t *request;
+	viobuffer_t *indirectphys; // allocated the first time the descriptor heads an indirect chain
+	size_t desccount;
+} vioblkslot_t;
+
+typedef struct {
+	struct vioblkdev_t *blkdev;
+	int index;
+	vioqueue_t queue;
+	dpc_t dpc;
+	spinlock_t lock;
+	mutex_t allocmutex;
+	semaphore_t descsem;
+	uint16_t freehead;
+	void *cellsphys;
+	vioblkslot_t *slots; // one per descriptor, allocated apart to keep the queues small
+} vioblkqueue_t;
+
+typedef struct vioblkdev_t {
+	viodevice_t *viodevice;
+	size_t capacity;
+	int id;
+	bool indirect;
+	size_t segmax;
+	size_t queuecount;
+	vioblkqueue_t *queues;
+	vioblkqueue_t **cpuqueues; // indexed by cpu id
+	size_t cpuqueuecount;
+	uintmax_t queueindex;
+} vioblkdev_t;
 
 static void vioblk_dpc(context_t *context, dpcarg_t arg) {
-	vioblkdev_t *blkdev = arg;
-	volatile viobuffer_t *buffers = VIO_QUEUE_BUFFERS(&blkdev->queue);
-	spinlock_acquire(&blkdev->queuelock);
-	while (blkdev->queue.lastusedindex != VIO_QUEUE_DEV_IDX(&blkdev->queue)) {
-		int idx = blkdev->queue.lastusedindex++ % blkdev->queue.size;
-		int buffidx = VIO_QUEUE_DEV_RING(&blkdev->queue)[idx].index;
-		__assert(blkdev->queuewaiting[buffidx / 3]);
-		sched_wakeup(blkdev->queuewaiting[buffidx / 3], SCHED_WAKEUP_REASON_NORMAL);
-		blkdev->queuewaiting[buffidx / 3] = NULL;
-		buffers[buffidx].address = 0;
-		buffers[buffidx + 1].address = 0;
-		buffers[buffidx + 2].address = 0;
-		semaphore_signal(&blkdev->queuesem);
+	vioblkqueue_t *queue = arg;
+	volatile viobuffer_t *buffers = VIO_QUEUE_BUFFERS(&queue->queue);
+	spinlock_acquire(&queue->lock);
+	while (queue->queue.lastusedindex != VIO_QUEUE_DEV_IDX(&queue->queue)) {
+		int idx = queue->queue.lastusedindex++ % queue->queue.size;
+		uint16_t head = VIO_QUEUE_DEV_RING(&queue->queue)[idx].index;
+		vioblkslot_t *slot = &queue->slots[head];
+		blockrequest_t *request = slot->request;
+		__assert(request);
+		slot->request = NULL;
+
+		if (*(uint8_t *)MAKE_HHDM(CELL_STATUS(queue, head)))
+			request->error = EIO;
+
+		// give the chain back to the free list, it is still linked through the next fields
+		uint16_t tail = head;
+		for (int i = 1; i < slot->desccount; ++i)
+			tail = buffers[tail].next;
+
+		buffers[tail].next = queue->freehead;
+		queue->freehead = head;
+
+		for (int i = 0; i < slot->desccount; ++i)
+			semaphore_signal(&queue->descsem);
+
+		// the request is done once the last of its chains is used
+		if (__atomic_sub_fetch(&request->remaining, 1, __ATOMIC_SEQ_CST) == 0)
+			block_complete(request);
 	}
-	spinlock_release(&blkdev->queuelock);
+	spinlock_release(&queue->lock);
 }
 
 static void vioblk_irq(isr_t *isr, context_t *context) {
-	vioblkdev_t *blkdev = isr->priv;
-	dpc_enqueue(&blkdev->queuedpc, vioblk_dpc, blkdev);
+	vioblkqueue_t *queue = isr->priv;
+	dpc_enqueue(&queue->dpc, vioblk_dpc, queue);
 }
 
-// driver and device are physical addresses
-static void vioblk_enqueue(vioblkdev_t *blkdev, requestheader_t *headerphys, void *bufferphys, size_t bufferlen, uint8_t *statusphys, bool write) {
+// takes a linked chain of count descriptors off the free list, waiting for completions to give them back if needed.
+// the waiting is serialized so that two big chains can't each hold part of what the other needs
+static uint16_t getdescriptors(vioblkqueue_t *queue, size_t count) {
+	MUTEX_ACQUIRE(&queue->allocmutex, false);
+	for (int i = 0; i < count; ++i)
+		semaphore_wait(&queue->descsem, false);
+	MUTEX_RELEASE(&queue->allocmutex);
+
+	volatile viobuffer_t *buffers = VIO_QUEUE_BUFFERS(&queue->queue);
 	bool intstatus = interrupt_set(false);
-	semaphore_wait(&blkdev->queuesem, false);
+	spinlock_acquire(&queue->lock);
 
-	spinlock_acquire(&blkdev->queuelock);
-	int idx = 0;
-	volatile viobuffer_t *buffers = VIO_QUEUE_BUFFERS(&blkdev->queue);
-	while (buffers[idx].address && idx < blkdev->queue.size)
-		idx += 3;
+	uint16_t head = queue->freehead;
+	uint16_t tail = head;
+	for (int i = 1; i < count; ++i)
+		tail = buffers[tail].next;
 
-	__assert(idx < blkdev->queue.size);
+	queue->freehead = buffers[tail].next;
 
-	buffers[idx].address = (uint64_t)headerphys;
-	buffers[idx].length = sizeof(requestheader_t);
-	buffers[idx].flags = VIO_QUEUE_BUFFER_NEXT;
-	buffers[idx].next = idx + 1;
+	spinlock_release(&queue->lock);
+	interrupt_set(intstatus);
+	return head;
+}
 
-	buffers[idx + 1].address = (uint64_t)bufferphys;
-	buffers[idx + 1].length = bufferlen;
-	buffers[idx + 1].flags = (write ? 0 : VIO_QUEUE_BUFFER_DEVICE) | VIO_QUEUE_BUFFER_NEXT;
-	buffers[idx + 1].next = idx + 2;
+static void putdescriptor(vioblkqueue_t *queue, uint16_t desc) {
+	volatile viobuffer_t *buffers = VIO_QUEUE_BUFFERS(&queue->queue);
+	bool intstatus = interrupt_set(false);
+	spinlock_acquire(&queue->lock);
+	buffers[desc].next = queue->freehead;
+	queue->freehead = desc;
+	spinlock_release(&queue->lock);
+	interrupt_set(intstatus);
 
-	buffers[idx + 2].address = (uint64_t)statusphys;
-	buffers[idx + 2].length = 1;
-	buffers[idx + 2].flags = VIO_QUEUE_BUFFER_DEVICE;
+	semaphore_signal(&queue->descsem);
+}
 
-	size_t driveridx = VIO_QUEUE_DRV_IDX(&blkdev->queue);
-	VIO_QUEUE_DRV_RING(&blkdev->queue)[driveridx % blkdev->queue.size] = idx;
+static void ring(vioblkqueue_t *queue, uint16_t head, blockrequest_t *request, size_t desccount) {
+	bool intstatus = interrupt_set(false);
+	spinlock_acquire(&queue->lock);
 
-	sched_prepare_sleep(false);
-	blkdev->queuewaiting[idx / 3] = current_thread();
+	queue->slots[head].request = request;
+	queue->slots[head].desccount = desccount;
 
-	++VIO_QUEUE_DRV_IDX(&blkdev->queue);
-	*blkdev->queue.notify = 0;
-	spinlock_release(&blkdev->queuelock);
+	size_t driveridx = VIO_QUEUE_DRV_IDX(&queue->queue);
+	VIO_QUEUE_DRV_RING(&queue->queue)[driveridx % queue->queue.size] = head;
 
-	sched_yield();
+	++VIO_QUEUE_DRV_IDX(&queue->queue);
+	*queue->queue.notify = queue->index;
 
+	spinlock_release(&queue->lock);
 	interrupt_set(intstatus);
 }
 
-static int vioblk_rw(vioblkdev_t *blkdev, iovec_iterator_t *iovec_iterator, uintmax_t lba, size_t count, bool write) {
-	void *physpage = pmm_allocpage(PMM_SECTION_DEFAULT);
-	if (physpage == NULL)
-		return ENOMEM;
+typedef struct {
+	bio_t *bio;
+	size_t index;
+} cursor_t;
+
+static biosegment_t *nextsegment(cursor_t *cursor) {
+	while (cursor->bio && cursor->index == cursor->bio->segmentcount) {
+		cursor->bio = cursor->bio->next;
+		cursor->index = 0;
+	}
+
+	return cursor->bio ? &cursor->bio->segments[cursor->index++] : NULL;
+}
+
+static void fillbuffer(volatile viobuffer_t *buffer, uint64_t address, size_t length, uint16_t flags) {
+	buffer->address = address;
+	buffer->length = length;
+	buffer->flags = flags;
+}
 
-	int err = 0;
-	requestheader_t *header = physpage;
-	requestheader_t *headerhhdm = MAKE_HHDM(physpage);
-	uint8_t *status = (uint8_t *)(header + 1);
-	uint8_t *statushhdm = MAKE_HHDM(status);
+// submits count segments of the request as a single chain, indirect if the device allows it
+static void submitchain(vioblkqueue_t *queue, blockrequest_t *request, cursor_t *cursor, size_t count, uint64_t sector) {
+	bool write = request->op == BIO_OP_WRITE;
+	uint16_t dataflags = write ? 0 : VIO_QUEUE_BUFFER_DEVICE;
+	volatile viobuffer_t *buffers = VIO_QUEUE_BUFFERS(&queue->queue);
+
+	if (queue->blkdev->indirect) {
+		uint16_t head = getdescriptors(queue, 1);
+		vioblkslot_t *slot = &queue->slots[head];
+		if (slot->indirectphys == NULL)
+			slot->indirectphys = pmm_allocpage(PMM_SECTION_DEFAULT);
+
+		if (slot->indirectphys) {
+			requestheader_t *header = MAKE_HHDM(CELL_HEADER(queue, head));
+			header->type = write ? HEADER_TYPE_WRITE : HEADER_TYPE_READ;
+			header->sector = sector;
+
+			volatile viobuffer_t *table = MAKE_HHDM(slot->indirectphys);
+			fillbuffer(&table[0], (uint64_t)CELL_HEADER(queue, head), sizeof(requestheader_t), VIO_QUEUE_BUFFER_NEXT);
+			table[0].next = 1;
+			for (int i = 1; i <= count; ++i) {
+				biosegment_t *segment = nextsegment(cursor);
+				fillbuffer(&table[i], (uint64_t)segment->page + segment->offset, segment->length, dataflags | VIO_QUEUE_BUFFER_NEXT);
+				table[i].next = i + 1;
+			}
+			fillbuffer(&table[count + 1], (uint64_t)CELL_STATUS(queue, head), 1, VIO_QUEUE_BUFFER_DEVICE);
+
+			fillbuffer(&buffers[head], (uint64_t)slot->indirectphys, (count + 2) * sizeof(viobuffer_t), VIO_QUEUE_BUFFER_INDIRECT);
+			ring(queue, head, request, 1);
+			return;
+		}
 
-	headerhhdm->type = write ? HEADER_TYPE_WRITE : HEADER_TYPE_READ;
+		// no memory for the table, do it directly
+		putdescriptor(queue, head);
+	}
 
-	int done = 0;
-	while (done < count) {
-		void *page;
-		size_t page_offset, page_remaining;
-		err = iovec_iterator_next_page(iovec_iterator, &page_offset, &page_remaining, &page);
-		if (err)
-			break;
+	uint16_t head = getdescriptors(queue, count + 2);
+	requestheader_t *header = MAKE_HHDM(CELL_HEADER(queue, head));
+	header->type = write ? HEADER_TYPE_WRITE : HEADER_TYPE_READ;
+	header->sector = sector;
+
+	fillbuffer(&buffers[head], (uint64_t)CELL_HEADER(queue, head), sizeof(requestheader_t), VIO_QUEUE_BUFFER_NEXT);
+	uint16_t desc = buffers[head].next;
+	for (int i = 0; i < count; ++i) {
+		biosegment_t *segment = nextsegment(cursor);
+		fillbuffer(&buffers[desc], (uint64_t)segment->page + segment->offset, segment->length, dataflags | VIO_QUEUE_BUFFER_NEXT);
+		desc = buffers[desc].next;
+	}
+	fillbuffer(&buffers[desc], (uint64_t)CELL_STATUS(queue, head), 1, VIO_QUEUE_BUFFER_DEVICE);
 
-		// check that there is enough space to complete the write of this page
-		__assert(page);
-		__assert(page_remaining >= min((count - done) * 512, PAGE_SIZE));
+	ring(queue, head, request, count + 2);
+}
 
-		// and that the space is aligned to the block size
-		__assert((page_remaining % 512) == 0);
+// the block layer merges discards and write zeroes up to the limits given to it, so they fit in a single range.
+// flushes have no range, only the header and the status
+static void submitnodata(vioblkqueue_t *queue, blockrequest_t *request) {
+	volatile viobuffer_t *buffers = VIO_QUEUE_BUFFERS(&queue->queue);
+	bool flush = request->op == BIO_OP_FLUSH;
+	uint16_t head = getdescriptors(queue, flush ? 2 : 3);
+
+	requestheader_t *header = MAKE_HHDM(CELL_HEADER(queue, head));
+	if (flush)
+		header->type = HEADER_TYPE_FLUSH;
+	else
+		header->type = request->op == BIO_OP_DISCARD ? HEADER_TYPE_DISCARD : HEADER_TYPE_WRITEZEROES;
+
+	header->reserved = 0;
+	header->sector = 0;
+
+	if (flush) {
+		fillbuffer(&buffers[head], (uint64_t)CELL_HEADER(queue, head), sizeof(requestheader_t), VIO_QUEUE_BUFFER_NEXT);
+		fillbuffer(&buffers[buffers[head].next], (uint64_t)CELL_STATUS(queue, head), 1, VIO_QUEUE_BUFFER_DEVICE);
+		ring(queue, head, request, 2);
+		return;
+	}
 
-		headerhhdm->sector = lba + done;
-		size_t docount = page_remaining / 512;
-		docount = min(docount, count - done);
+	discardrange_t *range = MAKE_HHDM(CELL_RANGE(queue, head));
+	range->sector = request->lba;
+	range->count = request->count;
+	range->flags = 0;
 
-		vioblk_enqueue(blkdev, header, (void *)((uintptr_t)page + page_offset), PAGE_SIZE, status, write);
+	fillbuffer(&buffers[head], (uint64_t)CELL_HEADER(queue, head), sizeof(requestheader_t), VIO_QUEUE_BUFFER_NEXT);
+	uint16_t desc = buffers[head].next;
+	fillbuffer(&buffers[desc], (uint64_t)CELL_RANGE(queue, head), sizeof(discardrange_t), VIO_QUEUE_BUFFER_NEXT);
+	desc = buffers[desc].next;
+	fillbuffer(&buffers[desc], (uint64_t)CELL_STATUS(queue, head), 1, VIO_QUEUE_BUFFER_DEVICE);
 
-		pmm_release(page);
+	ring(queue, head, request, 3);
+}
 
-		// if we didnt use the whole space in the page, set the iterator back a bit
-		size_t diff_between_available_and_used = page_remaining - docount * 512;
-		if (diff_between_available_and_used) {
-			size_t iterator_offset = iovec_iterator_total_offset(iovec_iterator);
-			iovec_iterator_set(iovec_iterator, iterator_offset - diff_between_available_and_used);
-		}
+static vioblkqueue_t *pickqueue(vioblkdev_t *blkdev) {
+	long id = current_cpu_id();
+	if (id < blkdev->cpuqueuecount && blkdev->cpuqueues[id])
+		return blkdev->cpuqueues[id];
 
-		if (*statushhdm) {
-			err = EIO;
-			break;
-		}
+	uintmax_t index = __atomic_fetch_add(&blkdev->queueindex, 1, __ATOMIC_SEQ_CST);
+	return &blkdev->queues[index % blkdev->queuecount];
+}
+
+// the whole request goes in as few chains as the segment limit allows, all submitted before any is waited on
+static int vioblk_submit(void *private, blockrequest_t *request) {
+	vioblkdev_t *blkdev = private;
+	vioblkqueue_t *queue = pickqueue(blkdev);
+	uint64_t sector = request->lba;
 
-		done += docount;
+	cursor_t cursor = {
+		.bio = request->bios,
+		.index = 0
+	};
+
+	if (request->op != BIO_OP_READ && request->op != BIO_OP_WRITE) {
+		request->remaining = 1;
+		submitnodata(queue, request);
+		return 0;
 	}
 
-	pmm_release(physpage);
-	return err;
-}
+	// keep an extra count so the request can't complete while its chains are still being submitted
+	request->remaining = 1;
 
-static int vioblk_write(void *private, iovec_iterator_t *iovec_iterator, uintmax_t lba, size_t count) {
-	return vioblk_rw(private, iovec_iterator, lba, count, true);
+	size_t left = request->segmentcount;
+	while (left) {
+		size_t count = min(left, blkdev->segmax);
+
+		// the sector of the next chain is known only after walking the segments of this one
+		cursor_t start = cursor;
+		size_t bytes = 0;
+		for (int i = 0; i < count; ++i)
+			bytes += nextsegment(&cursor)->length;
+
+		__atomic_add_fetch(&request->remaining, 1, __ATOMIC_SEQ_CST);
+		submitchain(queue, request, &start, count, sector);
+
+		sector += bytes / 512;
+		left -= count;
+	}
+
+	if (__atomic_sub_fetch(&request->remaining, 1, __ATOMIC_SEQ_CST) == 0)
+		block_complete(request);
+
+	return 0;
 }
 
-static int vioblk_read(void *private, iovec_iterator_t *iovec_iterator, uintmax_t lba, size_t count) {
-	return vioblk_rw(private, iovec_iterator, lba, count, false);
+static void initqueue(vioblkdev_t *blkdev, vioblkqueue_t *queue, int index) {
+	viodevice_t *viodevice = blkdev->viodevice;
+	queue->blkdev = blkdev;
+	queue->index = index;
+
+	size_t size = min(QUEUE_MAX_SIZE, virtio_queuesize(viodevice, index));
+	virtio_createqueue(viodevice, &queue->queue, index, size, index);
+	blkdev->segmax = min(blkdev->segmax, size - 2);
+
+	queue->slots = alloc(sizeof(vioblkslot_t) * size);
+	__assert(queue->slots);
+
+	// every descriptor starts in the free list
+	volatile viobuffer_t *buffers = VIO_QUEUE_BUFFERS(&queue->queue);
+	for (int i = 0; i < size; ++i)
+		buffers[i].next = i + 1;
+	queue->freehead = 0;
+
+	size_t cellpages = ROUND_UP(size * CELL_SIZE, PAGE_SIZE) / PAGE_SIZE;
+	queue->cellsphys = pmm_alloc(cellpages, PMM_SECTION_DEFAULT);
+	__assert(queue->cellsphys);
+
+	SPINLOCK_INIT(queue->lock);
+	MUTEX_INIT(&queue->allocmutex);
+	SEMAPHORE_INIT(&queue->descsem, size);
+
+	isr_t *isr = interrupt_allocate(vioblk_irq, ARCH_EOI, IPL_DISK);
+	__assert(isr);
+	isr->priv = queue;
+	pci_msixadd(viodevice->e, index, INTERRUPT_IDTOVECTOR(isr->id), 0, 0);
+
+	virtio_enablequeue(viodevice, index);
 }
 
 int vioblk_newdevice(viodevice_t *viodevice) {
@@ -168,10 +400,10 @@ int vioblk_newdevice(viodevice_t *viodevice) {
 		return 1;
 	}
 
-	pci_initmsix(viodevice->e);
+	size_t intcount = pci_initmsix(viodevice->e);
 
-	// TODO support several queues
-	__assert(virtio_negotiatefeatures(viodevice, VIO_FEATURE_VERSION_1) == VIO_FEATURE_VERSION_1);
+	uint64_t features = virtio_negotiatefeatures(viodevice, WANTED_FEATURES);
+	__assert(features & VIO_FEATURE_VERSION_1);
 
 	// initialize device object
 	vioblkdev_t *blkdev = alloc(sizeof(vioblkdev_t));
@@ -183,31 +415,71 @@ int vioblk_newdevice(viodevice_t *viodevice) {
 	blkdev->viodevice = viodevice;
 	blkdev->capacity = blkconfig->capacity;
 	blkdev->id = id++;
+	blkdev->indirect = features & VIO_FEATURE_INDIRECT_DESC;
+
+	// biggest number of data segments in a single chain.
+	// also bounded by the queue size so an indirect chain can still fall back to a direct one
+	size_t queuesize = min(QUEUE_MAX_SIZE, virtio_queuesize(viodevice, 0));
+	blkdev->segmax = queuesize - 2;
+	if (blkdev->indirect)
+		blkdev->segmax = min(blkdev->segmax, INDIRECT_MAX_SEGMENTS);
+	if ((features & VIOBLK_FEATURE_SEGMAX) && blkconfig->segmax)
+		blkdev->segmax = min(blkdev->segmax, blkconfig->segmax);
+
+	// one queue per cpu if possible, each with its own msi-x vector
+	size_t cpucount = arch_smp_cpusawake;
+	cpu_t **cpus = alloc(sizeof(cpu_t *) * cpucount);
+	__assert(cpus);
+	cpucount = topology_cpus(cpus, cpucount);
+	__assert(cpucount);
+
+	size_t devicequeues = (features & VIOBLK_FEATURE_MQ) ? max(blkconfig->numqueues, 1) : 1;
+	blkdev->queuecount = min(min(devicequeues, intcount), min(cpucount, MAX_QUEUES));
+
+	printf("vioblk%d: capacity of %lu blocks, %lu queue%s, %lu segments per %s chain\n", blkdev->id, blkdev->capacity, blkdev->queuecount,
+		blkdev->queuecount > 1 ? "s" : "", blkdev->segmax, blkdev->indirect ? "indirect" : "direct");
+
+	blkdev->queues = alloc(sizeof(vioblkqueue_t) * blkdev->queuecount);
+	__assert(blkdev->queues);
+
+	for (int i = 0; i < cpucount; ++i)
+		blkdev->cpuqueuecount = max(blkdev->cpuqueuecount, cpus[i]->id + 1);
+
+	blkdev->cpuqueues = alloc(sizeof(vioblkqueue_t *) * blkdev->cpuqueuecount);
+	__assert(blkdev->cpuqueues);
+
+	cpu_t *oldtarget = current_thread()->cputarget;
+	for (int i = 0; i < blkdev->queuecount; ++i) {
+		// each queue serves a contiguous group of cpus, and its interrupt goes to the first one of them
+		size_t first = i * cpucount / blkdev->queuecount;
+		size_t last = (i + 1) * cpucount / blkdev->queuecount;
+		for (size_t c = first; c < last; ++c)
+			blkdev->cpuqueues[cpus[c]->id] = &blkdev->queues[i];
+
+		// isrs are allocated on the current cpu and msi-x messages target it, so move there first
+		sched_reschedule_on_cpu(cpus[first], true);
+		initqueue(blkdev, &blkdev->queues[i], i);
+	}
 
-	printf("vioblk%d: capacity of %lu blocks\n", blkdev->id, blkdev->capacity);
+	sched_target_cpu(oldtarget);
+	free(cpus);
 
-	isr_t *isr = interrupt_allocate(vioblk_irq, ARCH_EOI, IPL_DISK);
-	__assert(isr);
-	isr->priv = blkdev;
-	pci_msixadd(viodevice->e, 0, INTERRUPT_IDTOVECTOR(isr->id), 0, 0);
 	pci_msixsetmask(viodevice->e, 0);
-
-	// initialize queue
-	size_t size = min(QUEUE_MAX_SIZE, virtio_queuesize(viodevice, 0));
-	size = size - (size % 3);
-	virtio_createqueue(viodevice, &blkdev->queue, 0, size, 0);
-	SEMAPHORE_INIT(&blkdev->queuesem, blkdev->queue.size / 3);
-	SPINLOCK_INIT(blkdev->queuelock);
-
-	virtio_enablequeue(viodevice, 0);
 	virtio_enabledevice(viodevice);
 
 	blockdesc_t blkdesc = {
 		.private = blkdev,
 		.blockcapacity = blkdev->capacity,
 		.blocksize = 512,
-		.write = vioblk_write,
-		.read = vioblk_read
+		.maxsegments = blkdev->segmax,
+		.maxdiscard = (features & VIOBLK_FEATURE_DISCARD) ? blkconfig->maxdiscardsectors : 0,
+		.maxwritezeroes = (features & VIOBLK_FEATURE_WRITEZEROES) ? blkconfig->maxwritezeroessectors : 0,
+		// without the flush feature the device has to write everything through
+		.writecache = features & VIOBLK_FEATURE_FLUSH,
+		.submit = vioblk_submit,
+		.scheduler = BLOCK_SCHED_DEADLINE,
+		// enough to keep the device busy while leaving the scheduler something to sort
+		.queuedepth = 32
 	};
 
 	char name[20];
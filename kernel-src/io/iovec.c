@@ -60,7 +60,7 @@ size_t iovec_iterator_skip(iovec_iterator_t *iovec_iterator, size_t skip_count)
 }
 
 size_t iovec_iterator_set(iovec_iterator_t *iovec_iterator, size_t offset) {
-	iovec_iterator->current = iovec_iterator->current;
+	iovec_iterator->current = iovec_iterator->iovec;
 	iovec_iterator->current_offset = 0;
 	iovec_iterator->total_offset = 0;
 
@@ -243,8 +243,34 @@ int iovec_iterator_next_page(iovec_iterator_t *iovec_iterator, size_t *page_offs
 		return EFAULT;
 
 	*page_offset = offset_in_page;
-	*page_remaining = min(PAGE_SIZE, remaining);
+	*page_remaining = min(PAGE_SIZE - offset_in_page, remaining);
 	*page = phys;
 	iovec_iterator_skip(iovec_iterator, *page_remaining);
 	return 0;
 }
+
+bool iovec_iterator_aligned(iovec_iterator_t *iovec_iterator, size_t alignment, bool user) {
+	for (iovec_t *iovec = iovec_iterator->current; iovec < iovec_iterator->iovec + iovec_iterator->count; ++iovec) {
+		uintptr_t addr = (uintptr_t)iovec->addr;
+		size_t len = iovec->len;
+		if (iovec == iovec_iterator->current) {
+			addr += iovec_iterator->current_offset;
+			len -= iovec_iterator->current_offset;
+		}
+
+		if ((user && IS_USER_ADDRESS(addr) == false) || (addr % alignment) || (len % alignment))
+			return false;
+	}
+
+	return true;
+}
+
+void *iovec_iterator_current_address(iovec_iterator_t *iovec_iterator, size_t *contiguous) {
+	if (iovec_iterator_finished(iovec_iterator)) {
+		*contiguous = 0;
+		return NULL;
+	}
+
+	*contiguous = iovec_iterator->current->len - iovec_iterator->current_offset;
+	return (void *)((uintptr_t)iovec_iterator->current->addr + iovec_iterator->current_offset);
+}
@@ -3,6 +3,10 @@
 #include <string.h>
 #include <logging.h>
 #include <kernel/timekeeper.h>
+#include <kernel/vmmcache.h>
+#include <kernel/pmm.h>
+#include <util.h>
+#include <kernel/dcache.h>
 
 static int null_write(int minor, iovec_iterator_t *iovec_iterator, size_t count, uintmax_t offset, int flags, size_t *wcount) {
 	*wcount = count;
@@ -47,6 +51,28 @@ static int urandom_read(int minor, iovec_iterator_t *iovec_iterator, size_t coun
 	return 0;
 }
 
+// one counter per line, generated again for every read like /dev/blockstats
+static int cachestats_read(int minor, iovec_iterator_t *iovec_iterator, size_t count, uintmax_t offset, int flags, size_t *rcount) {
+	char buffer[512];
+	size_t length = snprintf(buffer, sizeof(buffer),
+		"cachedpages %lu\nhits %lu\nmisses %lu\nrefaults %lu\nactivated %lu\ndeactivated %lu\nreclaimed %lu\n"
+		"dentries %lu\ndentryhits %lu\ndentrynegativehits %lu\ndentrymisses %lu\n",
+		vmmcache_cachedpages, vmmcache_hits, vmmcache_misses, vmmcache_refaults,
+		pmm_activatedpages, pmm_deactivatedpages, pmm_reclaimedpages,
+		dcache_entries, dcache_hits, dcache_negativehits, dcache_misses);
+
+	*rcount = 0;
+	if (offset >= length)
+		return 0;
+
+	size_t copy = min(count, length - offset);
+	int error = iovec_iterator_copy_from_buffer(iovec_iterator, buffer + offset, copy);
+	if (error == 0)
+		*rcount = copy;
+
+	return error;
+}
+
 static devops_t nullops = {
 	.read = null_read,
 	.write = null_write,
@@ -71,9 +97,14 @@ static devops_t urandomops = {
 	.maxseek = maxseek
 };
 
+static devops_t cachestatsops = {
+	.read = cachestats_read
+};
+
 void pseudodevices_init() {
 	__assert(devfs_register(&nullops, "null", V_TYPE_CHDEV, DEV_MAJOR_NULL, 0, 0666, NULL) == 0);
 	__assert(devfs_register(&fullops, "full", V_TYPE_CHDEV, DEV_MAJOR_FULL, 0, 0666, NULL) == 0);
 	__assert(devfs_register(&zeroops, "zero", V_TYPE_CHDEV, DEV_MAJOR_ZERO, 0, 0666, NULL) == 0);
 	__assert(devfs_register(&urandomops, "urandom", V_TYPE_CHDEV, DEV_MAJOR_URANDOM, 0, 0666, NULL) == 0);
+	__assert(devfs_register(&cachestatsops, "cachestats", V_TYPE_CHDEV, DEV_MAJOR_CACHESTATS, 0, 0644, NULL) == 0);
 }
@@ -6,6 +6,8 @@
 #include <mutex.h>
 #include <util.h>
 #include <kernel/vmmcache.h>
+#include <kernel/vmm.h>
+#include <kernel/scheduler.h>
 
 uintptr_t hhdmbase;
 static size_t memorysize;
@@ -15,8 +17,28 @@ size_t freepagecount;
 static mutex_t freelistmutex;
 static page_t *freelists[PMM_SECTION_COUNT];
 static page_t *freetails[PMM_SECTION_COUNT];
+// cache pages with no references are kept in two lists, the inactive (standby) list and the active list.
+// pages enter the inactive list when released and only get promoted to the active list if they were
+// referenced again while cached. reclaim takes from the tail of the inactive list first and the active list
+// is aged into the inactive one to keep it from growing past it.
 static page_t *standbylists[PMM_SECTION_COUNT];
 static page_t *standbytails[PMM_SECTION_COUNT];
+static page_t *activelists[PMM_SECTION_COUNT];
+static page_t *activetails[PMM_SECTION_COUNT];
+
+static size_t anonfreecount;
+static size_t inactivecount;
+static size_t activecount;
+
+size_t pmm_reclaimedpages;
+size_t pmm_activatedpages;
+size_t pmm_deactivatedpages;
+
+static thread_t *reclaimthread;
+static semaphore_t reclaimsem;
+static pmmshrinker_t *shrinkers;
+static size_t lowwatermark;
+static size_t highwatermark;
 
 typedef struct {
 	uintmax_t baseid;
@@ -49,26 +71,37 @@ static page_t* pages;
 #define PAGE_BOUNDARYCHECK(pageid) \
 	__assert((pageid) * PAGE_SIZE < (uintptr_t)pages || (pageid) * PAGE_SIZE >= (uintptr_t)&pages[pagecount])
 
-static void insertinfreelist(page_t *page) {
-	uintmax_t pageid = PAGE_GETID(page);
-	PAGE_BOUNDARYCHECK(pageid);
-	struct page_t **list;
-	struct page_t **tail;
-
-	int section;
-
+static int getsection(uintmax_t pageid) {
 	if (pageid < TOP_1MB)
-		section = PMM_SECTION_1MB;
+		return PMM_SECTION_1MB;
 	else if (pageid < TOP_4GB)
-		section = PMM_SECTION_4GB;
+		return PMM_SECTION_4GB;
 	else
-		section = PMM_SECTION_DEFAULT;
+		return PMM_SECTION_DEFAULT;
+}
 
-	list = page->backing ? &standbylists[section] : &freelists[section];
-	tail = page->backing ? &standbytails[section] : &freetails[section];
+static void getlist(page_t *page, int section, page_t ***list, page_t ***tail, size_t **count) {
+	if (page->backing == NULL) {
+		*list = &freelists[section];
+		*tail = &freetails[section];
+		*count = &anonfreecount;
+	} else if (page->flags & PAGE_FLAGS_ACTIVE) {
+		*list = &activelists[section];
+		*tail = &activetails[section];
+		*count = &activecount;
+	} else {
+		*list = &standbylists[section];
+		*tail = &standbytails[section];
+		*count = &inactivecount;
+	}
+}
 
-	if (sections[section].searchstart > pageid)
-		sections[section].searchstart = pageid;
+static void listinsert(page_t *page, int section) {
+	struct page_t **list;
+	struct page_t **tail;
+	size_t *count;
+
+	getlist(page, section, &list, &tail, &count);
 
 	page->freenext = *list;
 	page->freeprev = NULL;
@@ -78,26 +111,15 @@ static void insertinfreelist(page_t *page) {
 	else
 		*tail = page;
 
-	++freepagecount;
+	++*count;
 }
 
-static void removefromfreelist(page_t *page) {
-	uintmax_t pageid = PAGE_GETID(page);
-	PAGE_BOUNDARYCHECK(pageid);
+static void listremove(page_t *page, int section) {
 	struct page_t **list;
 	struct page_t **tail;
+	size_t *count;
 
-	int section;
-
-	if (pageid < TOP_1MB)
-		section = PMM_SECTION_1MB;
-	else if (pageid < TOP_4GB)
-		section = PMM_SECTION_4GB;
-	else
-		section = PMM_SECTION_DEFAULT;
-
-	list = page->backing ? &standbylists[section] : &freelists[section];
-	tail = page->backing ? &standbytails[section] : &freetails[section];
+	getlist(page, section, &list, &tail, &count);
 
 	if (page->freeprev)
 		page->freeprev->freenext = page->freenext;
@@ -109,6 +131,55 @@ static void removefromfreelist(page_t *page) {
 	else
 		*tail = page->freeprev;
 
+	--*count;
+}
+
+// moves the least recently used active page of a section to the head of the inactive list
+// expects freelistmutex to be held
+static void deactivate(int section) {
+	page_t *page = activetails[section];
+	if (page == NULL)
+		return;
+
+	listremove(page, section);
+	page->flags &= ~(PAGE_FLAGS_ACTIVE | PAGE_FLAGS_REFERENCED);
+	listinsert(page, section);
+	++pmm_deactivatedpages;
+}
+
+static void insertinfreelist(page_t *page) {
+	uintmax_t pageid = PAGE_GETID(page);
+	PAGE_BOUNDARYCHECK(pageid);
+
+	int section = getsection(pageid);
+
+	if (sections[section].searchstart > pageid)
+		sections[section].searchstart = pageid;
+
+	// a cache page that was referenced again since it was last released gets promoted
+	if (page->backing && (page->flags & (PAGE_FLAGS_ACTIVE | PAGE_FLAGS_REFERENCED)) == PAGE_FLAGS_REFERENCED)
+		++pmm_activatedpages;
+
+	if (page->backing && (page->flags & PAGE_FLAGS_REFERENCED)) {
+		page->flags |= PAGE_FLAGS_ACTIVE;
+		page->flags &= ~PAGE_FLAGS_REFERENCED;
+	}
+
+	listinsert(page, section);
+
+	// age the active list so it never outgrows the inactive one
+	if (page->flags & PAGE_FLAGS_ACTIVE && activecount > inactivecount)
+		deactivate(section);
+
+	++freepagecount;
+}
+
+static void removefromfreelist(page_t *page) {
+	uintmax_t pageid = PAGE_GETID(page);
+	PAGE_BOUNDARYCHECK(pageid);
+
+	listremove(page, getsection(pageid));
+
 	--freepagecount;
 }
 
@@ -144,6 +215,8 @@ void pmm_release(void *addr) {
 	uintmax_t newrefcount = __atomic_sub_fetch(&page->refcount, 1, __ATOMIC_SEQ_CST);
 	if (newrefcount == 0) {
 		__assert((page->flags & PAGE_FLAGS_DIRTY) == 0);
+		// nothing can be borrowing the page anymore
+		page->flags &= ~PAGE_FLAGS_LOANED;
 		MUTEX_ACQUIRE(&freelistmutex, false);
 		insertinfreelist(page);
 		if (page->backing == NULL)
@@ -158,6 +231,26 @@ static void doalloc(page_t *page) {
 	page->refcount = 1;
 }
 
+// holds the least recently used unreferenced cache page of a section or below
+// expects freelistmutex to be held
+static page_t *pickstandby(int section) {
+	for (int i = section; i >= 0; --i) {
+		// the active list is only touched when there are no inactive pages left
+		page_t *page = standbytails[i] ? standbytails[i] : activetails[i];
+		if (page) {
+			internalhold(page);
+			return page;
+		}
+	}
+
+	return NULL;
+}
+
+static void wakereclaim() {
+	if (reclaimthread && anonfreecount < lowwatermark && (inactivecount + activecount || shrinkers))
+		semaphore_signal_limit(&reclaimsem, 1);
+}
+
 void *pmm_allocpage(int section) {
 	retry:
 	MUTEX_ACQUIRE(&freelistmutex, false);
@@ -175,18 +268,13 @@ void *pmm_allocpage(int section) {
 
 	bool cachepage = false;
 
-	// if that wasn't possible, try to take from the cache standby list
+	// if that wasn't possible, try to take from the cache standby lists
 	if (page == NULL) {
-		for (int i = section; i >= 0; --i) {
-			page = standbytails[i];
-			if (page) {
-				cachepage = true;
-				internalhold(page);
-				break;
-			}
-		}
+		page = pickstandby(section);
+		cachepage = page != NULL;
 	}
 
+	wakereclaim();
 	MUTEX_RELEASE(&freelistmutex);
 
 	if (cachepage && vmmcache_takepage(page) == EAGAIN) {
@@ -210,6 +298,66 @@ void *pmm_allocpage(int section) {
 	return address;
 }
 
+// turns unreferenced cache pages into free anonymous pages in the background until the high watermark
+// is reached, so allocations don't have to go through the page cache themselves
+static void reclaim() {
+	for (;;) {
+		semaphore_wait(&reclaimsem, false);
+
+		// pages mapped since the last pass will be promoted once released if they were used
+		vmm_harvestaccessed();
+
+		for (;;) {
+			MUTEX_ACQUIRE(&freelistmutex, false);
+			page_t *page = anonfreecount < highwatermark ? pickstandby(PMM_SECTION_DEFAULT) : NULL;
+			MUTEX_RELEASE(&freelistmutex);
+
+			if (page == NULL)
+				break;
+
+			void *address = pmm_getpageaddress(page);
+
+			// someone got the page from the cache between us holding it and taking it
+			if (vmmcache_takepage(page) == EAGAIN) {
+				pmm_release(address);
+				continue;
+			}
+
+			// we hold the only reference to the page and its no longer in the cache, release it as anonymous memory
+			page->backing = NULL;
+			page->offset = 0;
+			page->flags = 0;
+			pmm_release(address);
+			++pmm_reclaimedpages;
+		}
+
+		// the page cache has nothing left to give
+		if (anonfreecount < highwatermark) {
+			for (pmmshrinker_t *shrinker = shrinkers; shrinker; shrinker = shrinker->next)
+				shrinker->shrink();
+		}
+	}
+}
+
+void pmm_registershrinker(pmmshrinker_t *shrinker) {
+	MUTEX_ACQUIRE(&freelistmutex, false);
+	shrinker->next = shrinkers;
+	shrinkers = shrinker;
+	MUTEX_RELEASE(&freelistmutex);
+}
+
+void pmm_reclaiminit() {
+	size_t usablepages = memorysize / PAGE_SIZE;
+	lowwatermark = max(usablepages / 256, 64);
+	highwatermark = lowwatermark * 4;
+
+	SEMAPHORE_INIT(&reclaimsem, 0);
+	reclaimthread = sched_newthread(reclaim, PAGE_SIZE * 4, 1, NULL, NULL);
+	__assert(reclaimthread);
+	sched_queue(reclaimthread);
+	printf("pmm: reclaim watermarks: %lu low %lu high\n", lowwatermark, highwatermark);
+}
+
 void pmm_makefree(void *address, size_t count) {
 	memorysize += PAGE_SIZE * count;
 	__assert(((uintptr_t)address % PAGE_SIZE) == 0);
@@ -222,6 +370,16 @@ void pmm_makefree(void *address, size_t count) {
 	}
 }
 
+// takes a single page that was never handed to the allocator (like one from a bootloader module)
+// and gives it to the caller as if it was just allocated, without copying anything out of it
+void pmm_adoptpage(void *address) {
+	__assert(((uintptr_t)address % PAGE_SIZE) == 0);
+	uintmax_t pageid = (uintptr_t)address / PAGE_SIZE;
+	PAGE_BOUNDARYCHECK(pageid);
+	memorysize += PAGE_SIZE;
+	doalloc(&pages[pageid]);
+}
+
 void pmm_init() {
 	__assert(hhdmreq.response);
 	hhdmbase = hhdmreq.response->offset;
@@ -214,6 +214,14 @@ static void insertrange(vmmspace_t *space, vmmrange_t *newrange) {
 	}
 }
 
+// whether the pages mapped in the range can be page cache pages. device mappings might not even be in memory
+static inline bool hascachepages(vmmrange_t *range) {
+	if (range->flags & VMM_FLAGS_PHYSICAL)
+		return false;
+
+	return (range->flags & VMM_FLAGS_FILE) == 0 || vfs_iscacheable(range->vnode);
+}
+
 static void destroyrange(vmmrange_t *range, uintmax_t _offset, size_t size, int flags) {
 	uintmax_t top = _offset + size;
 
@@ -227,6 +235,13 @@ static void destroyrange(vmmrange_t *range, uintmax_t _offset, size_t size, int
 		proc_t *proc = thread ? thread->proc : NULL;
 		cred_t *cred = proc ? &proc->cred : NULL;
 
+		// let the page replacement know the cache page was used while mapped, which includes pages lent to anonymous mappings
+		if (hascachepages(range) && arch_mmu_isaccessed(current_vmm_context()->pagetable, vaddr)) {
+			page_t *page = pmm_getpage(physical);
+			if (page->backing)
+				__atomic_or_fetch(&page->flags, PAGE_FLAGS_REFERENCED, __ATOMIC_SEQ_CST);
+		}
+
 		if ((range->flags & VMM_FLAGS_FILE) && ((range->flags & VMM_FLAGS_SHARED) || vfs_iscacheable(range->vnode) == false)) {
 			// shared file mapping or non cacheable mapping
 			if (vfs_iscacheable(range->vnode) == false) {
@@ -581,7 +596,10 @@ bool vmm_pagefault(void *addr, bool user, int actions) {
 			} else {
 				// cacheable vnode
 				page_t *res = NULL;
-				int error = vmmcache_getpage(range->vnode, range->offset + mapoffset, &res);
+				// shared mappings see writes to the file, so they can't use a page lent out by a zero copy read
+				int error = (range->flags & VMM_FLAGS_SHARED) ?
+					vmmcache_getwritablepage(range->vnode, range->offset + mapoffset, &res) :
+					vmmcache_getpage(range->vnode, range->offset + mapoffset, &res);
 
 				if (error == ENXIO || error == ENOMEM)  {
 					if (error == ENOMEM)
@@ -619,8 +637,8 @@ bool vmm_pagefault(void *addr, bool user, int actions) {
 		page_t *oldpage = pmm_getpage(oldphys);
 
 		if (    ((range->flags & VMM_FLAGS_FILE) && (range->flags & VMM_FLAGS_SHARED)) ||
-			((range->flags & VMM_FLAGS_FILE) == 0 && oldpage->refcount == 1)) {
-			// shared file or anon with refcount == 1, remap it as writable
+			((range->flags & VMM_FLAGS_FILE) == 0 && oldpage->refcount == 1 && oldpage->backing == NULL)) {
+			// shared file or anon with refcount == 1 that isn't a cache page from a zero copy read, remap it as writable
 
 			arch_mmu_remap(current_vmm_context()->pagetable, oldphys, addr, range->mmuflags);
 			if ((range->flags & VMM_FLAGS_FILE) && vfs_iscacheable(range->vnode)) {
@@ -658,6 +676,54 @@ bool vmm_pagefault(void *addr, bool user, int actions) {
 	return status;
 }
 
+// makes sure a user range is mapped in with the permissions a device needs to access it directly,
+// breaking copy on write beforehand if the device is going to write to it
+int vmm_faultin(void *addr, size_t size, bool write) {
+	uintptr_t top = (uintptr_t)addr + size;
+	for (uintptr_t page = ROUND_DOWN((uintptr_t)addr, PAGE_SIZE); page < top; page += PAGE_SIZE) {
+		if (arch_mmu_ispresent(current_vmm_context()->pagetable, (void *)page) && (write == false || arch_mmu_iswritable(current_vmm_context()->pagetable, (void *)page)))
+			continue;
+
+		if (vmm_pagefault((void *)page, true, write ? VMM_ACTION_WRITE : VMM_ACTION_READ) == false)
+			return EFAULT;
+	}
+
+	return 0;
+}
+
+// replaces the page at addr in a private anonymous mapping with a copy on write reference to physical
+int vmm_cowmap(void *addr, void *physical) {
+	__assert(((uintptr_t)addr % PAGE_SIZE) == 0);
+	vmmspace_t *space = getspace(addr);
+	if (space == NULL || space == &kernelspace)
+		return EINVAL;
+
+	MUTEX_ACQUIRE(&space->lock, false);
+	vmmrange_t *range = getrange(space, addr);
+	int error = 0;
+
+	if (range == NULL || (range->flags & (VMM_FLAGS_FILE | VMM_FLAGS_SHARED | VMM_FLAGS_PHYSICAL)) || (range->mmuflags & ARCH_MMU_FLAGS_WRITE) == 0) {
+		error = EINVAL;
+		goto cleanup;
+	}
+
+	void *oldphysical = arch_mmu_getphysical(current_vmm_context()->pagetable, addr);
+	if (oldphysical) {
+		arch_mmu_remap(current_vmm_context()->pagetable, physical, addr, range->mmuflags & ~ARCH_MMU_FLAGS_WRITE);
+		arch_mmu_invalidate_range(addr, PAGE_SIZE);
+		pmm_release(oldphysical);
+	} else if (arch_mmu_map(current_vmm_context()->pagetable, physical, addr, range->mmuflags & ~ARCH_MMU_FLAGS_WRITE) == false) {
+		error = ENOMEM;
+		goto cleanup;
+	}
+
+	pmm_hold(physical);
+
+	cleanup:
+	MUTEX_RELEASE(&space->lock);
+	return error;
+}
+
 void *vmm_getphysical(void *addr, bool hold) {
 	addr = (void *)ROUND_DOWN((uintptr_t)addr, PAGE_SIZE);
 
@@ -816,6 +882,9 @@ void vmm_unmap(void *addr, size_t size, int flags) {
 }
 
 static scache_t *ctxcache;
+// every user context, for the accessed bits to be harvested
+static mutex_t contextlistmutex;
+static vmmcontext_t *contextlist;
 
 static void ctxctor(scache_t *cache, void *obj) {
 	vmmcontext_t *ctx = obj;
@@ -841,10 +910,28 @@ vmmcontext_t *vmm_newcontext() {
 		return NULL;
 	}
 
+	MUTEX_ACQUIRE(&contextlistmutex, false);
+	ctx->prev = NULL;
+	ctx->next = contextlist;
+	if (contextlist)
+		contextlist->prev = ctx;
+	contextlist = ctx;
+	MUTEX_RELEASE(&contextlistmutex);
+
 	return ctx;
 }
 
 void vmm_destroycontext(vmmcontext_t *context) {
+	MUTEX_ACQUIRE(&contextlistmutex, false);
+	if (context->prev)
+		context->prev->next = context->next;
+	else
+		contextlist = context->next;
+
+	if (context->next)
+		context->next->prev = context->prev;
+	MUTEX_RELEASE(&contextlistmutex);
+
 	vmmcontext_t *oldctx = current_thread()->vmmctx;
 	vmm_switchcontext(context);
 	vmm_unmap(context->space.start, context->space.end - context->space.start, 0);
@@ -903,6 +990,33 @@ vmmcontext_t *vmm_fork(vmmcontext_t *oldcontext) {
 	return NULL;
 }
 
+// called by the reclaim thread so that cache pages which stay mapped for a long time are still seen as used.
+// the accessed bits are cleared, so each pass only sees the accesses since the last one
+static void markreferenced(void *physical) {
+	page_t *page = pmm_getpage(physical);
+	if (page->backing)
+		__atomic_or_fetch(&page->flags, PAGE_FLAGS_REFERENCED, __ATOMIC_SEQ_CST);
+}
+
+void vmm_harvestaccessed() {
+	MUTEX_ACQUIRE(&contextlistmutex, false);
+	for (vmmcontext_t *ctx = contextlist; ctx; ctx = ctx->next) {
+		// don't wait behind a page fault that might be waiting for I/O
+		if (MUTEX_TRY(&ctx->space.lock) == false)
+			continue;
+
+		for (vmmrange_t *range = ctx->space.ranges; range; range = range->next) {
+			if (hascachepages(range) == false)
+				continue;
+
+			arch_mmu_harvestaccessed(ctx->pagetable, range->start, range->size, markreferenced);
+		}
+
+		MUTEX_RELEASE(&ctx->space.lock);
+	}
+	MUTEX_RELEASE(&contextlistmutex);
+}
+
 void vmm_switchcontext(vmmcontext_t *ctx) {
 	if (current_thread())
 		current_thread()->vmmctx = ctx;
@@ -923,6 +1037,7 @@ void vmm_init() {
 	// set up initial state
 	__assert(sizeof(vmmcache_t) <= PAGE_SIZE);
 	MUTEX_INIT(&kernelspace.lock);
+	MUTEX_INIT(&contextlistmutex);
 
 	cachelist = newcache();
 	vmm_kernelctx.pagetable = arch_mmu_newtable();
@@ -3,9 +3,11 @@
 #include <util.h>
 #include <logging.h>
 #include <kernel/timekeeper.h>
+#include <kernel/block.h>
 #include <kernel/event.h>
 
 #define TABLE_SIZE 4096
+#define SHADOW_SIZE 4096
 #define WRITER_TICK_SECONDS 15
 
 static mutex_t mutex;
@@ -17,6 +19,18 @@ static eventheader_t syncevent;
 static eventheader_t pagereadyevent;
 size_t vmmcache_cachedpages;
 
+// remembers recently reclaimed pages so a refault can be told apart from a first access
+typedef struct {
+	uint64_t key;
+	uintmax_t evictiontime;
+} shadowentry_t;
+
+static shadowentry_t *shadowtable;
+static uintmax_t evictions;
+size_t vmmcache_hits;
+size_t vmmcache_misses;
+size_t vmmcache_refaults;
+
 #define HOLD_LOCK() \
 	MUTEX_ACQUIRE(&mutex, false);
 
@@ -24,7 +38,7 @@ size_t vmmcache_cachedpages;
 	MUTEX_RELEASE(&mutex);
 
 static inline uint64_t fnv1ahash(void *buffer, size_t size);
-static uintmax_t getentry(vnode_t *vnode, uintmax_t offset) {
+static uint64_t getkey(vnode_t *vnode, uintmax_t offset) {
 	struct {
 		vnode_t *vnode;
 		uintmax_t offset;
@@ -33,7 +47,27 @@ static uintmax_t getentry(vnode_t *vnode, uintmax_t offset) {
 	tmp.vnode = vnode;
 	tmp.offset = offset;
 
-	return fnv1ahash(&tmp, sizeof(tmp)) % TABLE_SIZE;
+	return fnv1ahash(&tmp, sizeof(tmp));
+}
+
+static uintmax_t getentry(vnode_t *vnode, uintmax_t offset) {
+	return getkey(vnode, offset) % TABLE_SIZE;
+}
+
+// assumes lock is held
+static void checkrefault(page_t *page) {
+	uint64_t key = getkey(page->backing, page->offset);
+	shadowentry_t *shadow = &shadowtable[key % SHADOW_SIZE];
+	if (shadow->key != key)
+		return;
+
+	++vmmcache_refaults;
+	// the page would still be in memory if the cache was twice its current size, treat the refault as a second
+	// reference so it gets activated once released instead of being thrown out with the streaming pages
+	if (evictions - shadow->evictiontime <= vmmcache_cachedpages)
+		page->flags |= PAGE_FLAGS_REFERENCED;
+
+	shadow->key = 0;
 }
 
 // assumes lock is held
@@ -114,6 +148,8 @@ int vmmcache_getpage(vnode_t *vnode, uintmax_t offset, page_t **res) {
 	if (page) {
 		// page is present in the page cache
 		pmm_hold(pmm_getpageaddress((page_t *)page));
+		__atomic_or_fetch(&page->flags, PAGE_FLAGS_REFERENCED, __ATOMIC_SEQ_CST);
+		++vmmcache_hits;
 		RELEASE_LOCK();
 
 		// in the case of a retry, release the allocated page here
@@ -160,6 +196,8 @@ int vmmcache_getpage(vnode_t *vnode, uintmax_t offset, page_t **res) {
 
 		// add it to the page cache
 		putpage(newpage);
+		checkrefault(newpage);
+		++vmmcache_misses;
 
 		RELEASE_LOCK();
 
@@ -193,6 +231,69 @@ int vmmcache_getpage(vnode_t *vnode, uintmax_t offset, page_t **res) {
 	return 0;
 }
 
+// like vmmcache_getpage, but makes sure the page returned is not lent out to anonymous memory
+// by a zero copy read, so that it can be written to or shared with a mapping
+int vmmcache_getwritablepage(vnode_t *vnode, uintmax_t offset, page_t **res) {
+	for (;;) {
+		page_t *page;
+		int error = vmmcache_getpage(vnode, offset, &page);
+		if (error)
+			return error;
+
+		if ((page->flags & PAGE_FLAGS_LOANED) == 0) {
+			*res = page;
+			return 0;
+		}
+
+		// give the cache its own copy of the page and leave the old one to the borrowers
+		void *address = pmm_allocpage(PMM_SECTION_DEFAULT);
+		if (address == NULL) {
+			pmm_release(pmm_getpageaddress(page));
+			return ENOMEM;
+		}
+
+		page_t *newpage = pmm_getpage(address);
+		memcpy(MAKE_HHDM(address), MAKE_HHDM(pmm_getpageaddress(page)), PAGE_SIZE);
+
+		HOLD_LOCK();
+		// someone else could have done it while the lock wasn't held
+		if ((page->flags & PAGE_FLAGS_LOANED) && (page->flags & PAGE_FLAGS_TRUNCATED) == 0) {
+			__assert((page->flags & PAGE_FLAGS_DIRTY) == 0);
+			removepage(page);
+			page->backing = NULL;
+			page->offset = 0;
+			page->flags = 0;
+
+			newpage->backing = vnode;
+			newpage->offset = offset;
+			newpage->flags |= PAGE_FLAGS_READY | PAGE_FLAGS_REFERENCED;
+			putpage(newpage);
+		}
+		RELEASE_LOCK();
+
+		// if the copy went into the cache, this puts it in the standby list. if not, it gets freed
+		pmm_release(address);
+
+		// the borrowers own the old page now, drop our reference and look the page up again
+		pmm_release(pmm_getpageaddress(page));
+	}
+}
+
+// lends a clean page held only by the caller to anonymous memory. any attempt to write to it
+// through the cache will first replace it in the cache with a copy
+int vmmcache_lendpage(page_t *page) {
+	int error = 0;
+	HOLD_LOCK();
+
+	if (page->refcount != 1 || page->backing == NULL || (page->flags & (PAGE_FLAGS_DIRTY | PAGE_FLAGS_PINNED | PAGE_FLAGS_TRUNCATED)))
+		error = EBUSY;
+	else
+		page->flags |= PAGE_FLAGS_LOANED;
+
+	RELEASE_LOCK();
+	return error;
+}
+
 // adds a page to the cache in a specific offset if its not already there
 int vmmcache_pushpage(vnode_t *vnode, uintmax_t offset, page_t *page) {
 	__assert((offset % PAGE_SIZE) == 0);
@@ -252,6 +353,11 @@ int vmmcache_takepage(page_t *page) {
 
 	// XXX maybe just not allow truncated pages to take up space like this?
 	if ((page->flags & PAGE_FLAGS_TRUNCATED) == 0) {
+		// remember the eviction for refault detection
+		uint64_t key = getkey(page->backing, page->offset);
+		shadowtable[key % SHADOW_SIZE].key = key;
+		shadowtable[key % SHADOW_SIZE].evictiontime = ++evictions;
+
 		// the page needs to be removed from the cache to continue
 		removepage(page);
 	}
@@ -292,6 +398,72 @@ int vmmcache_truncate(vnode_t *vnode, uintmax_t offset) {
 	return 0;
 }
 
+// for when the data backing a range was changed without going through the cache. unreferenced pages are dropped,
+// pages lent out by zero copy reads are left to their borrowers and pages that are still mapped or held are read
+// again, so nobody keeps seeing the old data. dirty pages are left alone. the vnode is expected to be unlocked
+int vmmcache_invalidate(vnode_t *vnode, uintmax_t offset, size_t size) {
+	offset = ROUND_DOWN(offset, PAGE_SIZE);
+	uintmax_t top = offset + size < offset ? UINTMAX_MAX : offset + size;
+	uintmax_t refreshstart = UINTMAX_MAX;
+	uintmax_t refreshend = 0;
+	HOLD_LOCK();
+
+	page_t *page = vnode->pages;
+	while (page) {
+		page_t *oldpage = page;
+		page = page->vnodenext;
+
+		if (oldpage->offset < offset || oldpage->offset >= top || (oldpage->flags & (PAGE_FLAGS_DIRTY | PAGE_FLAGS_PINNED)))
+			continue;
+
+		if (oldpage->flags & PAGE_FLAGS_LOANED) {
+			// the borrowers got the data as it was when they read it, the page is theirs now
+			removepage(oldpage);
+			oldpage->backing = NULL;
+			oldpage->offset = 0;
+			oldpage->flags = 0;
+		} else if (oldpage->refcount) {
+			if (oldpage->offset < refreshstart)
+				refreshstart = oldpage->offset;
+
+			if (oldpage->offset + PAGE_SIZE > refreshend)
+				refreshend = oldpage->offset + PAGE_SIZE;
+		} else {
+			// the page stays in the standby list and will be reused as a truncated page
+			oldpage->flags |= PAGE_FLAGS_TRUNCATED;
+			removepage(oldpage);
+		}
+	}
+
+	RELEASE_LOCK();
+
+	int error = 0;
+	for (uintmax_t pageoffset = refreshstart; pageoffset < refreshend; pageoffset += PAGE_SIZE) {
+		HOLD_LOCK();
+		page = findpage(vnode, pageoffset);
+		if (page && (page->flags & (PAGE_FLAGS_DIRTY | PAGE_FLAGS_PINNED | PAGE_FLAGS_LOANED)) == 0)
+			pmm_hold(pmm_getpageaddress(page));
+		else
+			page = NULL;
+		RELEASE_LOCK();
+
+		if (page == NULL)
+			continue;
+
+		// a getpage still in progress for it holds the vnode lock, so this one reads after it
+		VOP_LOCK(vnode);
+		int e = VOP_GETPAGE(vnode, pageoffset, page);
+		VOP_UNLOCK(vnode);
+		pmm_release(pmm_getpageaddress(page));
+
+		// ENXIO if the file was truncated in the meantime
+		if (e && e != ENXIO && error == 0)
+			error = e;
+	}
+
+	return error;
+}
+
 // called with lock held
 // returns with lock released
 // expects backing lock to be held
@@ -335,22 +507,21 @@ int vmmcache_syncvnode(vnode_t *vnode, uintmax_t offset, size_t size) {
 	page_t *page = vnode->pages;
 	page_t *vnodedirtylist = NULL;
 	for (; page; page = page->vnodenext) {
-		if (page->offset < offset || page->offset >= top || (page->offset & PAGE_FLAGS_DIRTY) == 0)
+		if (page->offset < offset || page->offset >= top || (page->flags & PAGE_FLAGS_DIRTY) == 0)
 			continue;
 
 		// remove from write list and add to an internal list using the write pointers
 		// in a singly linked list way
 		if (page->writenext)
 			page->writenext->writeprev = page->writeprev;
+		else
+			dirtylistend = page->writeprev;
 
 		if (page->writeprev)
 			page->writeprev->writenext = page->writenext;
 		else
 			dirtylist = page->writenext;
 
-		if (dirtylist == NULL)
-			dirtylistend = NULL;
-
 		page->writenext = vnodedirtylist;
 		page->writeprev = NULL;
 		vnodedirtylist = page;
@@ -435,6 +606,8 @@ static void tick(context_t *, dpcarg_t arg) {
 
 static void writer() {
 	timerentry_t timerentry;
+	// writeback shouldn't get in the way of the reads processes are waiting on
+	current_thread()->ioweight = BLOCK_WEIGHT_BACKGROUND;
 	// this will be inserted on some random cpu's timer, but it will always work after that
 	interrupt_set(false);
 	timer_insert(current_cpu()->timer, &timerentry, tick, NULL, (uintmax_t)WRITER_TICK_SECONDS * 1000000, true);
@@ -467,6 +640,10 @@ void vmmcache_init() {
 	__assert(table);
 	memset(table, 0, TABLE_SIZE * sizeof(page_t *));
 
+	shadowtable = vmm_map(NULL, SHADOW_SIZE * sizeof(shadowentry_t), VMM_FLAGS_ALLOCATE, ARCH_MMU_FLAGS_READ | ARCH_MMU_FLAGS_WRITE | ARCH_MMU_FLAGS_NOEXEC, NULL);
+	__assert(shadowtable);
+	memset(shadowtable, 0, SHADOW_SIZE * sizeof(shadowentry_t));
+
 	SEMAPHORE_INIT(&sync, 0);
 	writerthread = sched_newthread(writer, PAGE_SIZE * 16, 1, NULL, NULL);
 	__assert(writerthread);
@@ -9,6 +9,7 @@
 #include <kernel/elf.h>
 #include <kernel/devfs.h>
 #include <kernel/cmdline.h>
+#include <kernel/block.h>
 
 static hashtable_t pid_table;
 static scache_t *processcache;
@@ -87,6 +88,7 @@ proc_t *proc_create() {
 	proc->fdcount = 3;
 	proc->refcount = 1;
 	proc->fdfirst = 3;
+	proc->ioweight = BLOCK_WEIGHT_DEFAULT;
 	MUTEX_INIT(&proc->fdmutex);
 	SEMAPHORE_INIT(&proc->waitsem, 0);
 	SPINLOCK_INIT(proc->jobctllock);
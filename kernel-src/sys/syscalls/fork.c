@@ -44,6 +44,7 @@ syscallret_t syscall_fork(context_t *ctx) {
 	MUTEX_RELEASE(&proc->mutex);
 
 	nproc->umask = current_thread()->proc->umask;
+	nproc->ioweight = current_thread()->proc->ioweight;
 	nproc->cred = current_thread()->proc->cred;
 	nproc->root = proc_get_root();
 	nproc->cwd = proc_get_cwd();
@@ -42,7 +42,8 @@ syscallret_t syscall_getdents(context_t *, int dirfd, void *ubuffer, size_t read
 	if (ret.errno)
 		goto cleanup;
 
-	fd->offset = offset + ret.ret;
+	// the d_off of the last entry is where the next call should continue from
+	fd->offset = ret.ret ? buffer[ret.ret - 1].d_off : offset;
 	ret.ret *= sizeof(dent_t);
 
 	ret.errno = usercopy_touser(ubuffer, buffer, ret.ret);
@@ -0,0 +1,194 @@
+#include <kernel/syscalls.h>
+#include <kernel/vfs.h>
+#include <kernel/file.h>
+#include <kernel/usercopy.h>
+#include <arch/cpu.h>
+#include <errno.h>
+#include <logging.h>
+
+static bool isstream(vnode_t *vnode) {
+	size_t tmp;
+	return vnode->type == V_TYPE_SOCKET || vnode->type == V_TYPE_FIFO || (vnode->type == V_TYPE_CHDEV && VOP_MAXSEEK(vnode, &tmp));
+}
+
+// common part of sendfile, copy_file_range and splice.
+// the offset pointers are optional, if they're NULL the file offset is used and updated instead
+static int transfer(file_t *in, off_t *inoffp, file_t *out, off_t *outoffp, size_t count, size_t *done) {
+	*done = 0;
+
+	if ((in->flags & FILE_READ) == 0 || (out->flags & FILE_WRITE) == 0)
+		return EBADF;
+
+	if (out->flags & O_APPEND)
+		return EINVAL;
+
+	if ((inoffp && isstream(in->vnode)) || (outoffp && isstream(out->vnode)))
+		return ESPIPE;
+
+	if (count == 0)
+		return 0;
+
+	off_t inoffset = in->offset;
+	off_t outoffset = out->offset;
+
+	if (inoffp) {
+		int error = USERCOPY_POSSIBLY_FROM_USER(&inoffset, inoffp, sizeof(off_t));
+		if (error)
+			return error;
+	}
+
+	if (outoffp) {
+		int error = USERCOPY_POSSIBLY_FROM_USER(&outoffset, outoffp, sizeof(off_t));
+		if (error)
+			return error;
+	}
+
+	if (inoffset < 0 || outoffset < 0)
+		return EINVAL;
+
+	int error = vfs_splice(in->vnode, inoffset, fileflagstovnodeflags(in->flags), out->vnode, outoffset, fileflagstovnodeflags(out->flags), count, done);
+	if (error)
+		return error;
+
+	inoffset += *done;
+	outoffset += *done;
+
+	if (inoffp)
+		error = USERCOPY_POSSIBLY_TO_USER(inoffp, &inoffset, sizeof(off_t));
+	else
+		in->offset = inoffset;
+
+	if (error)
+		return error;
+
+	if (outoffp)
+		error = USERCOPY_POSSIBLY_TO_USER(outoffp, &outoffset, sizeof(off_t));
+	else
+		out->offset = outoffset;
+
+	return error;
+}
+
+syscallret_t syscall_sendfile(context_t *context, int outfd, int infd, off_t *offset, size_t count) {
+	syscallret_t ret = {
+		.ret = -1
+	};
+
+	file_t *in = fd_get(infd);
+	file_t *out = fd_get(outfd);
+
+	if (in == NULL || out == NULL) {
+		ret.errno = EBADF;
+		goto cleanup;
+	}
+
+	// the source has to be something that can be read at an offset
+	if (isstream(in->vnode)) {
+		ret.errno = EINVAL;
+		goto cleanup;
+	}
+
+	size_t done;
+	ret.errno = transfer(in, offset, out, NULL, count, &done);
+	ret.ret = ret.errno ? -1 : done;
+cleanup:
+	if (in)
+		fd_release(in);
+	if (out)
+		fd_release(out);
+
+	return ret;
+}
+
+syscallret_t syscall_copyfilerange(context_t *context, int infd, off_t *inoffset, int outfd, off_t *outoffset, size_t count, unsigned int flags) {
+	syscallret_t ret = {
+		.ret = -1
+	};
+
+	file_t *in = fd_get(infd);
+	file_t *out = fd_get(outfd);
+
+	if (in == NULL || out == NULL) {
+		ret.errno = EBADF;
+		goto cleanup;
+	}
+
+	if (flags) {
+		ret.errno = EINVAL;
+		goto cleanup;
+	}
+
+	if (in->vnode->type == V_TYPE_DIR || out->vnode->type == V_TYPE_DIR) {
+		ret.errno = EISDIR;
+		goto cleanup;
+	}
+
+	if (in->vnode->type != V_TYPE_REGULAR || out->vnode->type != V_TYPE_REGULAR) {
+		ret.errno = EINVAL;
+		goto cleanup;
+	}
+
+	// overlapping ranges within the same file are not allowed
+	if (in->vnode == out->vnode) {
+		off_t inoff = in->offset;
+		off_t outoff = out->offset;
+		if (inoffset)
+			ret.errno = USERCOPY_POSSIBLY_FROM_USER(&inoff, inoffset, sizeof(off_t));
+		if (ret.errno == 0 && outoffset)
+			ret.errno = USERCOPY_POSSIBLY_FROM_USER(&outoff, outoffset, sizeof(off_t));
+		if (ret.errno)
+			goto cleanup;
+
+		if (inoff < outoff + (off_t)count && outoff < inoff + (off_t)count) {
+			ret.errno = EINVAL;
+			goto cleanup;
+		}
+	}
+
+	size_t done;
+	ret.errno = transfer(in, inoffset, out, outoffset, count, &done);
+	ret.ret = ret.errno ? -1 : done;
+cleanup:
+	if (in)
+		fd_release(in);
+	if (out)
+		fd_release(out);
+
+	return ret;
+}
+
+syscallret_t syscall_splice(context_t *context, int infd, off_t *inoffset, int outfd, off_t *outoffset, size_t count, unsigned int flags) {
+	syscallret_t ret = {
+		.ret = -1
+	};
+
+	file_t *in = fd_get(infd);
+	file_t *out = fd_get(outfd);
+
+	if (in == NULL || out == NULL) {
+		ret.errno = EBADF;
+		goto cleanup;
+	}
+
+	// one of the ends has to be a pipe
+	if (in->vnode->type != V_TYPE_FIFO && out->vnode->type != V_TYPE_FIFO) {
+		ret.errno = EINVAL;
+		goto cleanup;
+	}
+
+	if (in->vnode == out->vnode) {
+		ret.errno = EINVAL;
+		goto cleanup;
+	}
+
+	size_t done;
+	ret.errno = transfer(in, inoffset, out, outoffset, count, &done);
+	ret.ret = ret.errno ? -1 : done;
+cleanup:
+	if (in)
+		fd_release(in);
+	if (out)
+		fd_release(out);
+
+	return ret;
+}
@@ -7,7 +7,7 @@ syscallret_t syscall_sync(context_t *) {
 	return ret;
 }
 
-syscallret_t syscall_fsync(context_t *context, int fd) {
+static syscallret_t syncfd(int fd, int flags) {
 	syscallret_t ret = {
 		.ret = -1
 	};
@@ -19,10 +19,18 @@ syscallret_t syscall_fsync(context_t *context, int fd) {
 	}
 
 	VOP_LOCK(file->vnode);
-	ret.errno = VOP_SYNC(file->vnode);
+	ret.errno = VOP_SYNC(file->vnode, flags);
 	VOP_UNLOCK(file->vnode);
 
 	fd_release(file);
 	ret.ret = ret.errno ? -1 : 0;
 	return ret;
 }
+
+syscallret_t syscall_fsync(context_t *context, int fd) {
+	return syncfd(fd, 0);
+}
+
+syscallret_t syscall_fdatasync(context_t *context, int fd) {
+	return syncfd(fd, V_SYNC_DATA);
+}
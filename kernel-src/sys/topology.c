@@ -34,3 +34,40 @@ void topology_insert(topology_node_t *node, topology_node_t *parent, int id, cpu
 
 	spinlock_releaseloweripl(&tree_lock, old_ipl);
 }
+
+// every cpu inserts its own chain of nodes from the package down, so sorting the chains by their ids
+// puts the cpus that share a package and a core next to each other
+static int comparechains(topology_node_t *a, topology_node_t *b) {
+	while (a && b) {
+		if (a->id != b->id)
+			return a->id < b->id ? -1 : 1;
+
+		a = a->children;
+		b = b->children;
+	}
+
+	return 0;
+}
+
+size_t topology_cpus(cpu_t **cpus, size_t max) {
+	topology_node_t *chains[max];
+	size_t count = 0;
+
+	long old_ipl = spinlock_acquireraiseipl(&tree_lock, IPL_MAX);
+	for (topology_node_t *node = topology_root.children; node && count < max; node = node->sibling) {
+		// insertion sort, there aren't many cpus
+		size_t i = count++;
+		while (i > 0 && comparechains(chains[i - 1], node) > 0) {
+			chains[i] = chains[i - 1];
+			--i;
+		}
+
+		chains[i] = node;
+	}
+	spinlock_releaseloweripl(&tree_lock, old_ipl);
+
+	for (size_t i = 0; i < count; ++i)
+		cpus[i] = chains[i]->cpu;
+
+	return count;
+}